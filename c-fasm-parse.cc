@@ -22,15 +22,19 @@ enum FasmParseResult FasmParse(StringPiece content, FILE *errstream,
                                FasmParseCallback parse_cb, void *parse_userdata,
                                FasmAnnotationCallback annotation_cb,
                                void *annotation_userdata) {
+  // Using the template version of fasm::parse(), so the calls to the
+  // C-function pointers are directly inlined into the parse loop.
+  auto parse_callback = [parse_cb, parse_userdata](
+                            uint32_t line, std::string_view feature,
+                            int start_bit, int width, uint64_t bits) {
+    return parse_cb(parse_userdata, line, {feature.data(), feature.size()},
+                    start_bit, width, bits);
+  };
+  const std::string_view fasm_content(content.data, content.size);
+
   if (annotation_cb) {
     return (FasmParseResult)fasm::parse(
-        std::string_view(content.data, content.size), errstream,
-        [parse_cb, parse_userdata](uint32_t line, std::string_view feature,
-                                   int start_bit, int width, uint64_t bits) {
-          return parse_cb(parse_userdata, line,
-                          {feature.data(), feature.size()}, start_bit, width,
-                          bits);
-        },
+        fasm_content, errstream, parse_callback,
         [annotation_cb, annotation_userdata](
             uint32_t line, std::string_view feature,  //
             std::string_view name, std::string_view value) {
@@ -38,21 +42,8 @@ enum FasmParseResult FasmParse(StringPiece content, FILE *errstream,
               annotation_userdata, line, {feature.data(), feature.size()},
               {name.data(), name.size()}, {value.data(), value.size()});
         });
-
   } else {
-    return (FasmParseResult)fasm::parse(
-        std::string_view(content.data, content.size), errstream,
-        [parse_cb, parse_userdata](uint32_t line, std::string_view feature,
-                                   int start_bit, int width, uint64_t bits) {
-          return parse_cb(parse_userdata, line,
-                          {feature.data(), feature.size()}, start_bit, width,
-                          bits);
-        });
+    return (FasmParseResult)fasm::parse(fasm_content, errstream,
+                                        parse_callback);
   }
 }
-
-// We're compiling with -fno-exceptions. To avoid linking with c++ libraries,
-// implement this boilerplate here.
-namespace std {
-  void __throw_bad_function_call() { abort(); }
-}
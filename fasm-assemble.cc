@@ -0,0 +1,112 @@
+// Copyright 2022 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Assemble a fasm file into frames using a segbits database and benchmark.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <string_view>
+#include <thread>
+
+#include "fasm-assembler.h"
+
+int64_t getTimeInMicros() {
+  struct timeval t;
+  gettimeofday(&t, NULL);
+  return (int64_t)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+// Memory map file; returns empty string_view on failure.
+std::string_view MapFile(const char *filename) {
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror(filename);
+    return {};
+  }
+  struct stat s;
+  fstat(fd, &s);
+  if (s.st_size == 0) {
+    close(fd);
+    return {};
+  }
+  void *const buffer = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (buffer == MAP_FAILED) {
+    perror("Couldn't map file");
+    return {};
+  }
+  return {(const char *)buffer, (size_t)s.st_size};
+}
+
+// Useful upper bound.
+static const int kMaxThreads = 2 * std::thread::hardware_concurrency();
+int GetThreadNumberToUse() {
+  const char *const parallel_env = getenv("PARALLEL_FASM");
+  return std::clamp(parallel_env ? atoi(parallel_env) : 1, 1, kMaxThreads);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3 || argc > 4) {
+    printf("usage: %s <segbits-file> <fasm-file> [<frame-bits>]\n"
+           "\tDefault frame bits: 3232. Writes frames to stdout if it is "
+           "not a terminal.\n"
+           "\tReads PARALLEL_FASM environment variable for #threads to use "
+           "[1..%d].\n",
+           argv[0], kMaxThreads);
+    return 1;
+  }
+  const uint32_t frame_bits = (argc == 4) ? atoi(argv[3]) : 101 * 32;
+
+  int64_t start_us = getTimeInMicros();
+  const std::string_view segbits = MapFile(argv[1]);
+  if (segbits.empty()) return 1;
+  fasm::BitDatabase db(frame_bits);
+  fasm::ParseResult result = db.load_segbits(segbits, stderr);
+  db.compile();
+  fprintf(stderr, "Database: %u features, %u frames. %.3fs\n",
+          db.feature_count(), db.frame_count(),
+          (getTimeInMicros() - start_us) / 1e6);
+
+  const std::string_view content = MapFile(argv[2]);
+  if (content.empty()) return 1;
+  const int thread_count = GetThreadNumberToUse();
+  fasm::FrameBitmap frames(db.frame_count(), db.frame_bits());
+  start_us = getTimeInMicros();
+  result = std::max(result, fasm::assemble_parallel(content, thread_count, db,
+                                                    stderr, &frames));
+  const int64_t duration_us = getTimeInMicros() - start_us;
+
+  uint64_t set_bits = 0;
+  for (const uint64_t word : frames.words()) {
+    set_bits += __builtin_popcountll(word);
+  }
+  constexpr float MiBFactor = 1e6 / (1 << 20);
+  fprintf(stderr,
+          "%" PRIu64 " bits set. %d thread%s. %.3fs wall time. %.1f MiB/s\n",
+          set_bits, thread_count, thread_count > 1 ? "s" : "",
+          duration_us / 1e6, 1.0f * content.size() / duration_us * MiBFactor);
+
+  if (!isatty(STDOUT_FILENO)) {
+    fwrite(frames.words().data(), sizeof(uint64_t), frames.words().size(),
+           stdout);
+  }
+  return result <= fasm::ParseResult::kNonCritical ? 0 : 1;
+}
@@ -0,0 +1,373 @@
+// Copyright 2022 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Assembly of FASM into configuration frames using a database that maps
+// each feature bit to bits in the frames.
+
+#ifndef SIMPLE_FASM_ASSEMBLER_H
+#define SIMPLE_FASM_ASSEMBLER_H
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "fasm-feature-table.h"
+#include "fasm-parse.h"
+
+namespace fasm {
+// Configuration frames as one bitmap: bit "b" of frame "f" is at position
+// f * frame_bits + b.
+class FrameBitmap {
+ public:
+  FrameBitmap(uint32_t frame_count, uint32_t frame_bits)
+      : frame_count_(frame_count), frame_bits_(frame_bits),
+        words_((uint64_t(frame_count) * frame_bits + 63) / 64) {}
+
+  uint32_t frame_count() const { return frame_count_; }
+  uint32_t frame_bits() const { return frame_bits_; }
+
+  void set(uint32_t position) {
+    words_[position >> 6] |= uint64_t(1) << (position & 63);
+  }
+  bool get(uint32_t frame, uint32_t bit) const {
+    const uint64_t position = uint64_t(frame) * frame_bits_ + bit;
+    return (words_[position >> 6] >> (position & 63)) & 1;
+  }
+
+  // Raw bitmap words, least significant bit first.
+  const std::vector<uint64_t> &words() const { return words_; }
+  std::vector<uint64_t> &words() { return words_; }
+
+ private:
+  uint32_t frame_count_;
+  uint32_t frame_bits_;
+  std::vector<uint64_t> words_;
+};
+
+// Database mapping feature bits to frame bits. Mappings are added first,
+// e.g. with load_segbits(), then compile() arranges them in flat arrays
+// for fast lookup. After that, the database is read-only and can be used
+// from multiple threads.
+class BitDatabase {
+ public:
+  explicit BitDatabase(uint32_t frame_bits) : frame_bits_(frame_bits) {}
+
+  // Bit "feature_bit" of "feature" sets "frame_bit" in "frame". A feature
+  // bit can set multiple frame bits. Returns false and ignores the bit if
+  // "frame_bit" is not within the frame or the total number of frame bits
+  // would exceed what a FrameBitmap can address.
+  bool add(std::string_view feature, uint32_t feature_bit, uint32_t frame,
+           uint32_t frame_bit);
+
+  // Load database in the simple text format used by prjxray segbits files:
+  //   <feature>[<feature-bit>] <frame>_<frame-bit> [<frame>_<frame-bit>...]
+  // A missing [<feature-bit>] means bit 0. Frame bits prefixed with '!' need
+  // to be cleared, which is the default, so they are ignored. Empty lines
+  // and lines starting with '#' are skipped.
+  // Issues are reported to "errstream"; the most severe is returned.
+  ParseResult load_segbits(std::string_view content, FILE *errstream);
+
+  // Prepare for lookups. Must be called after the last add().
+  void compile();
+
+  uint32_t frame_bits() const { return frame_bits_; }
+  uint32_t frame_count() const { return frame_count_; }
+  uint32_t feature_count() const { return features_.size(); }
+
+  // Set the frame bits for the bits set in "bits" of "feature" in "frames".
+  // Returns number of set bits without frame bits in the database or -1 if
+  // the feature is not known at all.
+  int assemble(std::string_view feature, int start_bit, uint64_t bits,
+               FrameBitmap *frames) const;
+
+ private:
+  struct PendingBit {
+    uint32_t feature;
+    uint32_t feature_bit;
+    uint32_t position;
+  };
+
+  const uint32_t frame_bits_;
+  uint32_t frame_count_ = 0;
+  FeatureTable features_;
+  std::vector<PendingBit> pending_;
+
+  // Compiled database. Bits of feature f are feature_start_[f] ...
+  // feature_start_[f + 1] - 1 in bit_start_, which in turn has the range of
+  // frame bit positions for each of them.
+  std::vector<uint32_t> feature_start_;
+  std::vector<uint32_t> bit_start_;
+  std::vector<uint32_t> positions_;
+};
+
+// Parse "content" and set the bits of all features in "frames", which needs
+// to be sized for "db". Unknown features are reported and skipped.
+inline ParseResult assemble(const ContentChunk &chunk, const BitDatabase &db,
+                            FILE *errstream, FrameBitmap *frames);
+
+inline ParseResult assemble(std::string_view content, const BitDatabase &db,
+                            FILE *errstream, FrameBitmap *frames) {
+  return assemble(ContentChunk{content, 1}, db, errstream, frames);
+}
+
+// Like assemble(), but parse chunks in parallel with "thread_count"
+// threads, each into its own bitmap. These are merged with OR into "frames"
+// at the end.
+inline ParseResult assemble_parallel(std::string_view content,
+                                     int thread_count, const BitDatabase &db,
+                                     FILE *errstream, FrameBitmap *frames,
+                                     const Executor &executor = {});
+
+// -- End of API interface; rest is implementation details
+
+inline bool BitDatabase::add(std::string_view feature, uint32_t feature_bit,
+                             uint32_t frame, uint32_t frame_bit) {
+  // All positions up to the end of the frame need to fit in 32 bits.
+  constexpr uint64_t kMaxBits = uint64_t(1) << 32;
+  if (frame_bit >= frame_bits_ ||
+      (uint64_t(frame) + 1) * frame_bits_ > kMaxBits) {
+    return false;
+  }
+  const uint64_t position = uint64_t(frame) * frame_bits_ + frame_bit;
+  pending_.push_back(
+      {features_.intern(feature), feature_bit, uint32_t(position)});
+  frame_count_ = std::max(frame_count_, frame + 1);
+  return true;
+}
+
+inline ParseResult BitDatabase::load_segbits(std::string_view content,
+                                             FILE *errstream) {
+  // Parse decimal number; returns false if there is none or it does not
+  // fit in 32 bits.
+  const auto parse_number = [](std::string_view *s, uint32_t *value) {
+    size_t i = 0;
+    uint64_t result = 0;
+    while (i < s->size() && (*s)[i] >= '0' && (*s)[i] <= '9') {
+      result = result * 10 + ((*s)[i] - '0');
+      if (result > UINT32_MAX) return false;
+      ++i;
+    }
+    s->remove_prefix(i);
+    *value = uint32_t(result);
+    return i > 0;
+  };
+  const auto next_token = [](std::string_view *s) {
+    const size_t start = std::min(s->find_first_not_of(" \t\r"), s->size());
+    s->remove_prefix(start);
+    const size_t end = std::min(s->find_first_of(" \t\r"), s->size());
+    const std::string_view token = s->substr(0, end);
+    s->remove_prefix(end);
+    return token;
+  };
+
+  ParseResult result = ParseResult::kSuccess;
+  uint32_t line_number = 0;
+  while (!content.empty()) {
+    ++line_number;
+    const size_t eol = std::min(content.find('\n'), content.size());
+    std::string_view line = content.substr(0, eol);
+    content.remove_prefix(std::min(eol + 1, content.size()));
+
+    std::string_view feature = next_token(&line);
+    if (feature.empty() || feature[0] == '#') continue;
+    uint32_t feature_bit = 0;
+    if (feature.back() == ']') {
+      const size_t open = feature.rfind('[');
+      std::string_view index = feature.substr(open + 1);
+      if (open == std::string_view::npos ||
+          !parse_number(&index, &feature_bit) || index != "]") {
+        fprintf(errstream, "%u: ERR invalid feature bit '%.*s'\n",
+                line_number, (int)feature.size(), feature.data());
+        result = ParseResult::kError;
+        continue;
+      }
+      feature = feature.substr(0, open);
+    }
+
+    for (std::string_view bit; !(bit = next_token(&line)).empty(); /**/) {
+      if (bit[0] == '!') continue;  // Cleared bit.
+      const size_t underscore = std::min(bit.find('_'), bit.size());
+      std::string_view frame_str = bit.substr(0, underscore);
+      std::string_view frame_bit_str =
+          bit.substr(std::min(underscore + 1, bit.size()));
+      uint32_t frame, frame_bit;
+      if (underscore == bit.size() || !parse_number(&frame_str, &frame) ||
+          !frame_str.empty() || !parse_number(&frame_bit_str, &frame_bit) ||
+          !frame_bit_str.empty()) {
+        fprintf(errstream, "%u: ERR expected <frame>_<bit>, got '%.*s'\n",
+                line_number, (int)bit.size(), bit.data());
+        result = ParseResult::kError;
+        continue;
+      }
+      if (frame_bit >= frame_bits_) {
+        fprintf(errstream, "%u: SKIP frame bit %u out of range\n",
+                line_number, frame_bit);
+        result = std::max(result, ParseResult::kSkipped);
+        continue;
+      }
+      if (!add(feature, feature_bit, frame, frame_bit)) {
+        fprintf(errstream, "%u: ERR frame %u exceeds addressable bits\n",
+                line_number, frame);
+        result = ParseResult::kError;
+      }
+    }
+  }
+  return result;
+}
+
+inline void BitDatabase::compile() {
+  const uint32_t feature_count = features_.size();
+  // Number of bits per feature determined by the highest bit used.
+  std::vector<uint32_t> bit_count(feature_count, 0);
+  for (const PendingBit &p : pending_) {
+    bit_count[p.feature] = std::max(bit_count[p.feature], p.feature_bit + 1);
+  }
+  feature_start_.assign(feature_count + 1, 0);
+  for (uint32_t f = 0; f < feature_count; ++f) {
+    feature_start_[f + 1] = feature_start_[f] + bit_count[f];
+  }
+
+  // Counting sort of the positions by their feature bit.
+  const uint32_t total_bits = feature_start_[feature_count];
+  bit_start_.assign(total_bits + 1, 0);
+  for (const PendingBit &p : pending_) {
+    ++bit_start_[feature_start_[p.feature] + p.feature_bit + 1];
+  }
+  for (uint32_t i = 0; i < total_bits; ++i) {
+    bit_start_[i + 1] += bit_start_[i];
+  }
+  std::vector<uint32_t> fill(bit_start_.begin(), bit_start_.end() - 1);
+  positions_.resize(pending_.size());
+  for (const PendingBit &p : pending_) {
+    positions_[fill[feature_start_[p.feature] + p.feature_bit]++] =
+        p.position;
+  }
+  pending_.clear();
+  pending_.shrink_to_fit();
+}
+
+inline int BitDatabase::assemble(std::string_view feature, int start_bit,
+                                 uint64_t bits, FrameBitmap *frames) const {
+  const uint32_t id = features_.find(feature);
+  if (id == FeatureTable::kNotFound || id + 1 >= feature_start_.size()) {
+    return -1;
+  }
+  const uint32_t first = feature_start_[id];
+  const uint32_t bit_count = feature_start_[id + 1] - first;
+  int missing = 0;
+  // Only visit the set bits.
+  for (/**/; bits; bits &= bits - 1) {
+    const uint32_t bit = start_bit + __builtin_ctzll(bits);
+    if (bit >= bit_count) {
+      ++missing;
+      continue;
+    }
+    const uint32_t begin = bit_start_[first + bit];
+    const uint32_t end = bit_start_[first + bit + 1];
+    if (begin == end) ++missing;
+    for (uint32_t i = begin; i < end; ++i) {
+      frames->set(positions_[i]);
+    }
+  }
+  return missing;
+}
+
+inline ParseResult assemble(const ContentChunk &chunk, const BitDatabase &db,
+                            FILE *errstream, FrameBitmap *frames) {
+  ParseResult db_result = ParseResult::kSuccess;
+  const ParseResult result = parse(
+      chunk, errstream,
+      [&](uint32_t line, std::string_view feature, int start_bit, int,
+          uint64_t bits) {
+        const int missing = db.assemble(feature, start_bit, bits, frames);
+        if (missing < 0) {
+          fprintf(errstream, "%u: SKIP unknown feature %.*s\n", line,
+                  (int)feature.size(), feature.data());
+          db_result = std::max(db_result, ParseResult::kSkipped);
+        } else if (missing > 0) {
+          fprintf(errstream, "%u: WARN %.*s: %d set bits not in database\n",
+                  line, (int)feature.size(), feature.data(), missing);
+          db_result = std::max(db_result, ParseResult::kNonCritical);
+        }
+        return true;
+      });
+  return std::max(result, db_result);
+}
+
+inline ParseResult assemble_parallel(std::string_view content,
+                                     int thread_count, const BitDatabase &db,
+                                     FILE *errstream, FrameBitmap *frames,
+                                     const Executor &executor) {
+  const auto run = [&executor](int count,
+                               const std::function<void(int)> &task) {
+    if (executor) {
+      executor(count, task);
+    } else {
+      run_threads(count, task);
+    }
+  };
+  const std::vector<ContentChunk> chunks =
+      split_lines(content, balanced_chunk_count(content.size(), thread_count),
+                  thread_count, executor);
+  if (chunks.size() <= 1) {
+    return assemble(content, db, errstream, frames);
+  }
+
+  // First worker assembles directly into the result, others into their own
+  // bitmap, created when they start.
+  thread_count = std::min<int>(thread_count, chunks.size());
+  std::vector<std::unique_ptr<FrameBitmap>> bitmaps(thread_count);
+  std::vector<ParseResult> results(chunks.size());
+  run_balanced(
+      chunks.size(), thread_count,
+      [&](int worker, int i) {
+        FrameBitmap *target = frames;
+        if (worker > 0) {
+          if (!bitmaps[worker]) {
+            bitmaps[worker].reset(
+                new FrameBitmap(frames->frame_count(), frames->frame_bits()));
+          }
+          target = bitmaps[worker].get();
+        }
+        results[i] = assemble(chunks[i], db, errstream, target);
+      },
+      executor);
+
+  // Merge: each thread takes care of a range of words of all bitmaps.
+  std::vector<uint64_t> &words = frames->words();
+  const size_t range = (words.size() + thread_count - 1) / thread_count;
+  run(thread_count, [&](int r) {
+    const size_t begin = std::min(words.size(), r * range);
+    const size_t end = std::min(words.size(), begin + range);
+    for (size_t b = 1; b < bitmaps.size(); ++b) {
+      if (!bitmaps[b]) continue;  // Worker did not get any chunk.
+      const uint64_t *const other = bitmaps[b]->words().data();
+      for (size_t i = begin; i < end; ++i) {
+        words[i] |= other[i];
+      }
+    }
+  });
+
+  ParseResult result = ParseResult::kSuccess;
+  for (const ParseResult r : results) {
+    result = std::max(result, r);
+  }
+  return result;
+}
+}  // namespace fasm
+#endif  // SIMPLE_FASM_ASSEMBLER_H
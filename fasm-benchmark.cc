@@ -0,0 +1,563 @@
+// Copyright 2022 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmark the parse paths on a set of generated workloads with different
+// characteristics, write results as JSON and compare them with a baseline.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "c-fasm-parse.h"
+#include "fasm-diagnostics.h"
+#include "fasm-parse.h"
+
+namespace {
+// Deterministic pseudo-random numbers, so that workloads are the same in
+// each run and results comparable with a baseline.
+class Random {
+ public:
+  uint64_t next() {
+    state_ ^= state_ << 13;
+    state_ ^= state_ >> 7;
+    state_ ^= state_ << 17;
+    return state_;
+  }
+  uint32_t below(uint32_t n) { return next() % n; }
+
+ private:
+  uint64_t state_ = 0x2545f4914f6cdd1d;
+};
+
+void AppendName(Random *rnd, int segments, int max_segment_len,
+                std::string *out) {
+  static constexpr char kChars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ_0123456789";
+  for (int s = 0; s < segments; ++s) {
+    if (s) out->push_back('.');
+    out->push_back(kChars[rnd->below(26)]);  // Start with a letter.
+    const int len = rnd->below(max_segment_len);
+    for (int i = 0; i < len; ++i) {
+      out->push_back(kChars[rnd->below(sizeof(kChars) - 1)]);
+    }
+  }
+}
+
+void AppendNumber(uint64_t value, int base, std::string *out) {
+  char digits[64];
+  int pos = sizeof(digits);
+  do {
+    digits[--pos] = "0123456789abcdef"[value % base];
+    value /= base;
+  } while (value);
+  out->append(digits + pos, sizeof(digits) - pos);
+}
+
+// FEATURE[max:min] = <width>'<base><value>
+void AppendRangedLine(Random *rnd, std::string_view name, char base,
+                      std::string *out) {
+  const int width = rnd->below(63) + 1;
+  const int bit = rnd->below(256);
+  const uint64_t value = rnd->next() & (~uint64_t(0) >> (64 - width));
+  out->append(name);
+  out->push_back('[');
+  AppendNumber(bit + width - 1, 10, out);
+  out->push_back(':');
+  AppendNumber(bit, 10, out);
+  out->append("] = ");
+  AppendNumber(width, 10, out);
+  out->push_back('\'');
+  out->push_back(base);
+  switch (base) {
+  case 'h': AppendNumber(value, 16, out); break;
+  case 'b': AppendNumber(value, 2, out); break;
+  case 'o': AppendNumber(value, 8, out); break;
+  default: AppendNumber(value, 10, out); break;
+  }
+}
+
+struct Workload {
+  const char *name;
+  const char *description;
+  void (*append_line)(Random *rnd, uint32_t line, std::string *out);
+};
+
+std::string ShortName(Random *rnd) {
+  std::string name;
+  AppendName(rnd, 1, 14, &name);
+  return name;
+}
+
+const Workload kWorkloads[] = {
+  {"ranged-hex", "NAME[a:b] = N'hX as fasm-generate-testfile",
+   [](Random *rnd, uint32_t, std::string *out) {
+     AppendRangedLine(rnd, ShortName(rnd), 'h', out);
+     out->push_back('\n');
+   }},
+  {"single-bit", "TILE.SITE.FEATURE and FEATURE[n], no assignment",
+   [](Random *rnd, uint32_t, std::string *out) {
+     AppendName(rnd, 3, 12, out);
+     if (rnd->below(2)) {
+       out->push_back('[');
+       AppendNumber(rnd->below(64), 10, out);
+       out->push_back(']');
+     }
+     out->push_back('\n');
+   }},
+  {"long-names", "deep hierarchical names of 8 to 16 segments",
+   [](Random *rnd, uint32_t, std::string *out) {
+     std::string name;
+     AppendName(rnd, 8 + rnd->below(9), 16, &name);
+     AppendRangedLine(rnd, name, 'h', out);
+     out->push_back('\n');
+   }},
+  {"annotations", "every feature with two annotations",
+   [](Random *rnd, uint32_t line, std::string *out) {
+     AppendName(rnd, 3, 10, out);
+     out->append(" { .src = \"design.v:");
+     AppendNumber(line, 10, out);
+     out->append("\", .attr = \"");
+     AppendName(rnd, 2, 10, out);
+     out->append("\" }\n");
+   }},
+  {"comments", "two of three lines comments, others trailing comment",
+   [](Random *rnd, uint32_t line, std::string *out) {
+     if (line % 3 != 0) {
+       out->append("# This is a comment describing ");
+       AppendName(rnd, 2, 20, out);
+     } else {
+       AppendRangedLine(rnd, ShortName(rnd), 'h', out);
+       out->append("  # and a trailing one");
+     }
+     out->push_back('\n');
+   }},
+  {"binary-decimal", "binary, decimal, octal and plain number values",
+   [](Random *rnd, uint32_t line, std::string *out) {
+     static constexpr char kBases[] = {'b', 'd', 'o'};
+     if (line % 4 == 0) {
+       out->append(ShortName(rnd));
+       out->append("[7:0] = ");
+       AppendNumber(rnd->below(256), 10, out);
+     } else {
+       AppendRangedLine(rnd, ShortName(rnd), kBases[line % 4 - 1], out);
+     }
+     out->push_back('\n');
+   }},
+  {"crlf", "ranged-hex with DOS line endings",
+   [](Random *rnd, uint32_t, std::string *out) {
+     AppendRangedLine(rnd, ShortName(rnd), 'h', out);
+     out->append("\r\n");
+   }},
+  {"errors", "one in four lines has an issue",
+   [](Random *rnd, uint32_t line, std::string *out) {
+     const std::string name = ShortName(rnd);
+     switch (line % 16) {
+     case 0: out->append(name + "[0:7] = 8'hff"); break;   // Inverted
+     case 4: out->append(name + "[7:0 = 8'hff"); break;    // No ']'
+     case 8: out->append(name + "[7:0] = 8'x12"); break;   // Base
+     case 12: out->append(name + "[3:0] = 8'hff"); break;  // Too wide
+     default: AppendRangedLine(rnd, name, 'h', out);
+     }
+     out->push_back('\n');
+   }},
+};
+
+std::string Generate(const Workload &workload, uint32_t lines) {
+  std::string content;
+  Random rnd;
+  for (uint32_t line = 1; line <= lines; ++line) {
+    workload.append_line(&rnd, line, &content);
+  }
+  return content;
+}
+
+// Values are XORed into a per-thread variable, so that the compiler can't
+// drop the work and threads don't share a cache line.
+thread_local uint64_t sink_value;
+
+const auto kParseCallback = [](uint32_t, std::string_view, int, int,
+                               uint64_t bits) {
+  sink_value ^= bits;
+  return true;
+};
+const auto kAnnotationCallback = [](uint32_t, std::string_view,
+                                    std::string_view, std::string_view value) {
+  sink_value ^= value.size();
+};
+
+bool CParseCallback(void *, uint32_t, StringPiece, int, int, uint64_t bits) {
+  sink_value ^= bits;
+  return true;
+}
+void CAnnotationCallback(void *, uint32_t, StringPiece, StringPiece,
+                         StringPiece value) {
+  sink_value ^= value.size;
+}
+
+// A way to parse content, run with "threads" if it supports them.
+struct Method {
+  const char *name;
+  bool parallel;
+  void (*run)(std::string_view content, int threads, FILE *errstream);
+};
+
+const Method kMethods[] = {
+  {"parse", false,
+   [](std::string_view content, int, FILE *errstream) {
+     fasm::parse(content, errstream, kParseCallback, kAnnotationCallback);
+   }},
+  {"c-api", false,
+   [](std::string_view content, int, FILE *errstream) {
+     FasmParse({content.data(), content.size()}, errstream, CParseCallback,
+               nullptr, CAnnotationCallback, nullptr);
+   }},
+  {"stdio", false,
+   // As fasm-validation-parse with USE_STDIO_PARSE, but from memory so
+   // that the disk is not measured.
+   [](std::string_view content, int, FILE *errstream) {
+     fasm::StreamParser parser(errstream, kParseCallback,
+                               kAnnotationCallback);
+     // Not all libcs open empty buffers; nothing to read then anyway.
+     if (!content.empty()) {
+       FILE *const in =
+           fmemopen((void *)content.data(), content.size(), "r");
+       if (!in) {
+         perror("fmemopen");
+         return;
+       }
+       static char buffer[1 << 20];
+       size_t got;
+       while ((got = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+         parser.feed(std::string_view(buffer, got));
+       }
+       fclose(in);
+     }
+     parser.finish();
+   }},
+  {"parallel", true,
+   [](std::string_view content, int threads, FILE *errstream) {
+     fasm::DiagnosticCollector diagnostics;
+     fasm::parse_parallel(content, threads, &diagnostics, kParseCallback,
+                          kAnnotationCallback);
+     diagnostics.print(errstream);
+   }},
+};
+
+struct Result {
+  std::string workload;
+  std::string method;
+  int threads = 1;
+  uint64_t bytes = 0;
+  uint64_t lines = 0;
+  double seconds = 0;
+
+  double mib_per_s() const { return bytes / seconds / (1 << 20); }
+  double mlines_per_s() const { return lines / seconds / 1e6; }
+  double ns_per_line() const { return lines ? seconds * 1e9 / lines : 0; }
+};
+
+// Quote "s" as JSON string. Workload names come from file names, so can
+// contain anything.
+std::string JsonQuote(std::string_view s) {
+  std::string result = "\"";
+  for (const char c : s) {
+    if (c == '"' || c == '\\') {
+      result.push_back('\\');
+      result.push_back(c);
+    } else if ((unsigned char)c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      result.append(escaped);
+    } else {
+      result.push_back(c);
+    }
+  }
+  return result.append("\"");
+}
+
+// Parse JSON string at the beginning of "s" and advance "s" past it.
+// Returns false if there is no string as written by JsonQuote().
+bool ParseJsonString(std::string_view *s, std::string *out) {
+  if (s->empty() || s->front() != '"') return false;
+  out->clear();
+  for (size_t i = 1; i < s->size(); ++i) {
+    const char c = (*s)[i];
+    if (c == '"') {
+      s->remove_prefix(i + 1);
+      return true;
+    }
+    if (c != '\\') {
+      out->push_back(c);
+      continue;
+    }
+    if (++i >= s->size()) return false;
+    switch ((*s)[i]) {
+    case '"': case '\\': case '/': out->push_back((*s)[i]); break;
+    case 'b': out->push_back('\b'); break;
+    case 'f': out->push_back('\f'); break;
+    case 'n': out->push_back('\n'); break;
+    case 'r': out->push_back('\r'); break;
+    case 't': out->push_back('\t'); break;
+    case 'u': {
+      // Only ASCII is escaped by JsonQuote(); UTF-8 is passed as-is.
+      if (i + 4 >= s->size()) return false;
+      const std::string hex(s->substr(i + 1, 4));
+      char *end;
+      const long value = strtol(hex.c_str(), &end, 16);
+      if (*end != '\0' || value >= 0x80) return false;
+      out->push_back(char(value));
+      i += 4;
+      break;
+    }
+    default: return false;
+    }
+  }
+  return false;
+}
+
+void WriteJson(const std::vector<Result> &results, uint32_t lines,
+               FILE *out) {
+  // One result per line, so that the file is easy to diff and to read back
+  // as baseline.
+  fprintf(out, "{\"lines_per_workload\": %u,\n \"results\": [\n", lines);
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result &r = results[i];
+    fprintf(out,
+            "  {\"workload\": %s, \"method\": %s, \"threads\": %d, "
+            "\"bytes\": %" PRIu64 ", \"lines\": %" PRIu64
+            ", \"seconds\": %.6f, \"mib_per_s\": %.1f, "
+            "\"mlines_per_s\": %.2f, \"ns_per_line\": %.2f}%s\n",
+            JsonQuote(r.workload).c_str(), JsonQuote(r.method).c_str(),
+            r.threads, r.bytes, r.lines,
+            r.seconds, r.mib_per_s(), r.mlines_per_s(), r.ns_per_line(),
+            i + 1 < results.size() ? "," : "");
+  }
+  fprintf(out, "]}\n");
+}
+
+// Read results of a previous run written by WriteJson().
+bool ReadBaseline(const char *filename, std::vector<Result> *results) {
+  FILE *in = fopen(filename, "r");
+  if (!in) {
+    perror(filename);
+    return false;
+  }
+  // Consume "prefix" from the beginning of "s" if it is there.
+  const auto consume = [](std::string_view *s, std::string_view prefix) {
+    if (s->substr(0, prefix.size()) != prefix) return false;
+    s->remove_prefix(prefix.size());
+    return true;
+  };
+  char *line = nullptr;
+  size_t capacity = 0;
+  while (getline(&line, &capacity, in) > 0) {
+    std::string_view rest = line;
+    rest.remove_prefix(std::min(rest.find_first_not_of(" \t"), rest.size()));
+    Result r;
+    // "rest" stays NUL-terminated, as it ends where "line" does.
+    if (!consume(&rest, "{\"workload\": ") ||
+        !ParseJsonString(&rest, &r.workload) ||
+        !consume(&rest, ", \"method\": ") ||
+        !ParseJsonString(&rest, &r.method) ||
+        sscanf(rest.data(),
+               ", \"threads\": %d, \"bytes\": %" SCNu64
+               ", \"lines\": %" SCNu64 ", \"seconds\": %lf",
+               &r.threads, &r.bytes, &r.lines, &r.seconds) != 4) {
+      continue;
+    }
+    results->push_back(r);
+  }
+  free(line);
+  fclose(in);
+  return true;
+}
+
+// Print how results compare to the baseline. Returns number of results
+// slower by more than "tolerance_percent".
+int CompareWithBaseline(const std::vector<Result> &results,
+                        const std::vector<Result> &baseline,
+                        double tolerance_percent) {
+  int regressions = 0;
+  fprintf(stderr, "\n%-15s %-9s %3s %10s %10s %8s\n", "workload", "method",
+          "thr", "base ns/l", "now ns/l", "change");
+  for (const Result &r : results) {
+    const auto found = std::find_if(
+        baseline.begin(), baseline.end(), [&](const Result &b) {
+          return b.workload == r.workload && b.method == r.method &&
+                 b.threads == r.threads;
+        });
+    if (found == baseline.end() || found->lines == 0) continue;
+    // Compare per line, so that a different size still can be compared.
+    const double change =
+        100.0 * (r.ns_per_line() - found->ns_per_line()) /
+        found->ns_per_line();
+    const bool regression = change > tolerance_percent;
+    regressions += regression;
+    fprintf(stderr, "%-15s %-9s %3d %10.2f %10.2f %+7.1f%%%s\n",
+            r.workload.c_str(), r.method.c_str(), r.threads,
+            found->ns_per_line(), r.ns_per_line(), change,
+            regression ? "  REGRESSION" : "");
+  }
+  return regressions;
+}
+
+// Parse comma-separated list of thread counts, e.g. "2,4,8".
+std::vector<int> ParseThreadList(const char *list) {
+  std::vector<int> result;
+  for (const char *it = list; *it; /**/) {
+    const int threads = atoi(it);
+    if (threads > 0) result.push_back(threads);
+    it = strchr(it, ',');
+    if (!it) break;
+    ++it;
+  }
+  return result;
+}
+
+int usage(const char *progname) {
+  fprintf(stderr,
+          "usage: %s [options] [<fasm-file>...]\n"
+          "Benchmark parsing of generated workloads and the given files.\n"
+          "Options:\n"
+          "\t-l <lines>     : Lines per generated workload. Default 1000000\n"
+          "\t-t <n,n,..>    : Thread counts for the parallel parse.\n"
+          "\t                 Default 2,4 and the number of cores.\n"
+          "\t-r <repeat>    : Best of this many runs. Default 3\n"
+          "\t-w <workload>  : Only run workloads with this name; repeatable.\n"
+          "\t-o <json-file> : Write results here instead of stdout.\n"
+          "\t-b <json-file> : Compare with baseline written previously with\n"
+          "\t                 -o; exit code 1 if any got slower than the\n"
+          "\t                 tolerance given with -T.\n"
+          "\t-T <percent>   : Slowdown per line tolerated in the baseline\n"
+          "\t                 comparison. Default 10\n"
+          "Workloads:\n",
+          progname);
+  for (const Workload &w : kWorkloads) {
+    fprintf(stderr, "\t%-15s: %s\n", w.name, w.description);
+  }
+  return 1;
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  uint32_t lines = 1000000;
+  int repeat = 3;
+  double tolerance_percent = 10;
+  const char *json_file = nullptr;
+  const char *baseline_file = nullptr;
+  std::vector<std::string> only_workloads;
+  const int cores = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<int> thread_counts = {2, 4, cores};
+  int opt;
+  while ((opt = getopt(argc, argv, "l:t:r:w:o:b:T:h")) != -1) {
+    switch (opt) {
+    case 'l': lines = atoi(optarg); break;
+    case 't': thread_counts = ParseThreadList(optarg); break;
+    case 'r': repeat = std::max(1, atoi(optarg)); break;
+    case 'w': only_workloads.push_back(optarg); break;
+    case 'o': json_file = optarg; break;
+    case 'b': baseline_file = optarg; break;
+    case 'T': tolerance_percent = atof(optarg); break;
+    default: return usage(argv[0]);
+    }
+  }
+  if (lines == 0) return usage(argv[0]);
+  std::sort(thread_counts.begin(), thread_counts.end());
+  thread_counts.erase(std::unique(thread_counts.begin(), thread_counts.end()),
+                      thread_counts.end());
+
+  std::vector<Result> baseline;
+  if (baseline_file && !ReadBaseline(baseline_file, &baseline)) return 1;
+
+  // Workloads with name and content: generated ones and given files.
+  std::vector<std::pair<std::string, std::string>> contents;
+  for (const Workload &w : kWorkloads) {
+    if (!only_workloads.empty() &&
+        std::find(only_workloads.begin(), only_workloads.end(), w.name) ==
+            only_workloads.end()) {
+      continue;
+    }
+    contents.emplace_back(w.name, Generate(w, lines));
+  }
+  for (int i = optind; i < argc; ++i) {
+    FILE *in = fopen(argv[i], "rb");
+    if (!in) {
+      perror(argv[i]);
+      return 1;
+    }
+    std::string content;
+    char buffer[1 << 16];
+    size_t got;
+    while ((got = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+      content.append(buffer, got);
+    }
+    fclose(in);
+    contents.emplace_back(argv[i], std::move(content));
+  }
+
+  // Issues in the error workload are formatted, but not to the terminal.
+  FILE *const devnull = fopen("/dev/null", "w");
+  std::vector<Result> results;
+  fprintf(stderr, "%-15s %-9s %3s %9s %9s %8s\n", "workload", "method", "thr",
+          "MiB/s", "MLines/s", "ns/line");
+  for (const auto &[name, content] : contents) {
+    const uint64_t line_count =
+        std::count(content.begin(), content.end(), '\n');
+    for (const Method &method : kMethods) {
+      std::vector<int> threads = {1};
+      if (method.parallel) threads = thread_counts;
+      for (const int t : threads) {
+        Result r{name, method.name, t, content.size(), line_count, 1e30};
+        for (int i = 0; i < repeat; ++i) {
+          const auto start = std::chrono::steady_clock::now();
+          method.run(content, t, devnull);
+          const std::chrono::duration<double> duration =
+              std::chrono::steady_clock::now() - start;
+          r.seconds = std::min(r.seconds, duration.count());
+        }
+        fprintf(stderr, "%-15s %-9s %3d %9.1f %9.2f %8.2f\n", name.c_str(),
+                method.name, t, r.mib_per_s(), r.mlines_per_s(),
+                r.ns_per_line());
+        results.push_back(r);
+      }
+    }
+  }
+  fclose(devnull);
+
+  FILE *const out = json_file ? fopen(json_file, "w") : stdout;
+  if (!out) {
+    perror(json_file);
+    return 1;
+  }
+  WriteJson(results, lines, out);
+  if (json_file) fclose(out);
+
+  if (baseline_file) {
+    const int regressions =
+        CompareWithBaseline(results, baseline, tolerance_percent);
+    fprintf(stderr, "%d regression%s beyond %.0f%%\n", regressions,
+            regressions == 1 ? "" : "s", tolerance_percent);
+    return regressions > 0 ? 1 : 0;
+  }
+  return 0;
+}
@@ -0,0 +1,477 @@
+// Copyright 2022 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compact binary representation of parsed FASM (.fasmb), that can be
+// memory mapped and replayed into the parse callbacks without parsing.
+//
+// File layout; all values in native byte order, sections 8-byte aligned:
+//   BinaryHeader
+//   BinaryRecord[record_count]          Feature values in file order.
+//   BinaryAnnotation[annotation_count]  Annotations in file order.
+//   BinaryString[string_count]          Index into the string data.
+//   char[string_data_size]              Deduplicated names and values.
+
+#ifndef SIMPLE_FASM_BINARY_H
+#define SIMPLE_FASM_BINARY_H
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "fasm-feature-table.h"
+#include "fasm-parse.h"
+
+namespace fasm {
+// Identifies the source a binary file was created from, to decide if it
+// can be used instead of parsing the source.
+struct SourceFingerprint {
+  uint64_t size;
+  int64_t mtime_ns;      // Modification time of the source file.
+  uint64_t sample_hash;  // Hash of the first and last few KiB of content.
+
+  bool operator==(const SourceFingerprint &other) const {
+    return size == other.size && mtime_ns == other.mtime_ns &&
+           sample_hash == other.sample_hash;
+  }
+};
+
+// Fingerprint of "content" with given modification time.
+inline SourceFingerprint fingerprint(std::string_view content,
+                                     int64_t mtime_ns);
+
+struct BinaryHeader {
+  static constexpr char kMagic[8] = {'F', 'A', 'S', 'M', 'B', '\n', 0, 1};
+  static constexpr uint32_t kByteOrderMark = 0x01020304;
+
+  char magic[8];
+  uint32_t byte_order;  // kByteOrderMark in native order of writer.
+  uint32_t parse_result;  // ParseResult of parsing the source.
+  SourceFingerprint source;
+  uint64_t record_count;
+  uint64_t annotation_count;
+  uint64_t string_count;
+  uint64_t string_data_size;
+  uint64_t records_offset;
+  uint64_t annotations_offset;
+  uint64_t strings_offset;
+  uint64_t string_data_offset;
+};
+
+// Value of a feature as passed to the ParseCallback.
+struct BinaryRecord {
+  uint64_t bits;
+  uint32_t line;
+  uint32_t feature;  // String ID.
+  uint16_t start_bit;
+  uint16_t width;
+  uint32_t reserved;
+};
+
+struct BinaryAnnotation {
+  uint32_t line;
+  uint32_t feature;  // String IDs. Feature is empty for lines without one.
+  uint32_t name;
+  uint32_t value;
+};
+
+struct BinaryString {
+  uint64_t offset;  // Relative to the string data.
+  uint64_t size;
+};
+
+// Collects values from the parse callbacks and writes them in the binary
+// format. Values wider than 64 bits are stored in slices like the
+// ParseCallback receives them if there is no WideParseCallback.
+// Callbacks need to be called in file order, so not usable with
+// parse_parallel().
+class BinaryWriter {
+ public:
+  // Records are streamed to "out", which needs to be seekable to write
+  // the header at the end.
+  explicit BinaryWriter(FILE *out);
+
+  // Same signature as ParseCallback and AnnotationCallback.
+  bool add_record(uint32_t line, std::string_view feature, int start_bit,
+                  int width, uint64_t bits);
+  void add_annotation(uint32_t line, std::string_view feature,
+                      std::string_view name, std::string_view value);
+
+  // Callbacks for parse() and friends.
+  auto parse_callback() {
+    return [this](uint32_t line, std::string_view feature, int start_bit,
+                  int width, uint64_t bits) {
+      return add_record(line, feature, start_bit, width, bits);
+    };
+  }
+  auto annotation_callback() {
+    return [this](uint32_t line, std::string_view feature,
+                  std::string_view name, std::string_view value) {
+      add_annotation(line, feature, name, value);
+    };
+  }
+
+  // Write remaining sections and header. "result" is the result of the
+  // parse and will be reported by the reader. Returns false on write error.
+  bool finish(ParseResult result, const SourceFingerprint &source);
+
+ private:
+  FILE *const out_;
+  FeatureTable strings_;
+  std::vector<BinaryAnnotation> annotations_;
+  uint64_t record_count_ = 0;
+  bool write_ok_;
+};
+
+// Reads binary files by memory mapping them.
+class BinaryReader {
+ public:
+  BinaryReader() = default;
+  ~BinaryReader();
+  BinaryReader(const BinaryReader &) = delete;
+  BinaryReader &operator=(const BinaryReader &) = delete;
+
+  // Map and check file. Returns false if it can't be read or is not a valid
+  // binary fasm file; issues are reported to "errstream".
+  bool open(const char *filename, FILE *errstream);
+
+  // Same, using binary content already in memory, which needs to stay
+  // valid and be 8-byte aligned.
+  bool open_buffer(std::string_view content, FILE *errstream);
+
+  const BinaryHeader &header() const { return *header_; }
+
+  // Result of parsing the original source.
+  ParseResult parse_result() const {
+    return ParseResult(header_->parse_result);
+  }
+
+  uint64_t record_count() const { return header_->record_count; }
+  const BinaryRecord &record(uint64_t i) const { return records_[i]; }
+
+  std::string_view string(uint32_t id) const {
+    return {string_data_ + strings_[id].offset, strings_[id].size};
+  }
+
+  // Replay records "begin" up to excluding "end" to the callbacks with the
+  // same signatures as in parse(). Annotations are passed after the records
+  // of their line. Annotations on lines between the last record of the
+  // previous range and the first record of this range belong to this range
+  // and are passed before its first record. The last range also gets the
+  // annotations after the last record; empty ranges get none.
+  // Returns 'false' if the callback requested to abort.
+  template <typename ParseCallbackT,
+            typename AnnotationCallbackT = std::nullptr_t>
+  bool replay(uint64_t begin, uint64_t end, ParseCallbackT &&parse_callback,
+              AnnotationCallbackT &&annotation_callback = nullptr) const;
+
+  // Replay everything in "thread_count" ranges of records in parallel. The
+  // string_views passed to the callbacks are valid as long as the reader.
+  // Returns the result of the original parse or kUserAbort.
+  template <typename ParseCallbackT,
+            typename AnnotationCallbackT = std::nullptr_t>
+  ParseResult replay_parallel(int thread_count,
+                              ParseCallbackT &&parse_callback,
+                              AnnotationCallbackT &&annotation_callback =
+                                  nullptr,
+                              const Executor &executor = {}) const;
+
+ private:
+  void *mapped_ = nullptr;
+  size_t mapped_size_ = 0;
+  const BinaryHeader *header_ = nullptr;
+  const BinaryRecord *records_ = nullptr;
+  const BinaryAnnotation *annotations_ = nullptr;
+  const BinaryString *strings_ = nullptr;
+  const char *string_data_ = nullptr;
+};
+
+// -- End of API interface; rest is implementation details
+
+inline SourceFingerprint fingerprint(std::string_view content,
+                                     int64_t mtime_ns) {
+  constexpr size_t kSampleSize = 4096;
+  const uint64_t head = FeatureTable::hash(content.substr(0, kSampleSize));
+  const uint64_t tail = FeatureTable::hash(
+      content.substr(content.size() - std::min(content.size(), kSampleSize)));
+  return {content.size(), mtime_ns, head ^ (tail * 0x9E3779B97F4A7C15)};
+}
+
+inline BinaryWriter::BinaryWriter(FILE *out) : out_(out) {
+  // Header written at the end once all the sizes are known.
+  const BinaryHeader placeholder{};
+  write_ok_ = fwrite(&placeholder, sizeof(placeholder), 1, out_) == 1;
+}
+
+inline bool BinaryWriter::add_record(uint32_t line, std::string_view feature,
+                                     int start_bit, int width,
+                                     uint64_t bits) {
+  const BinaryRecord record{bits,
+                            line,
+                            strings_.intern(feature),
+                            uint16_t(start_bit),
+                            uint16_t(width),
+                            0};
+  write_ok_ &= fwrite(&record, sizeof(record), 1, out_) == 1;
+  ++record_count_;
+  return write_ok_;
+}
+
+inline void BinaryWriter::add_annotation(uint32_t line,
+                                         std::string_view feature,
+                                         std::string_view name,
+                                         std::string_view value) {
+  annotations_.push_back({line, strings_.intern(feature), strings_.intern(name),
+                          strings_.intern(value)});
+}
+
+inline bool BinaryWriter::finish(ParseResult result,
+                                 const SourceFingerprint &source) {
+  BinaryHeader header{};
+  memcpy(header.magic, BinaryHeader::kMagic, sizeof(header.magic));
+  header.byte_order = BinaryHeader::kByteOrderMark;
+  header.parse_result = uint32_t(result);
+  header.source = source;
+  header.record_count = record_count_;
+  header.annotation_count = annotations_.size();
+  header.string_count = strings_.size();
+  header.records_offset = sizeof(BinaryHeader);
+  header.annotations_offset =
+      header.records_offset + record_count_ * sizeof(BinaryRecord);
+  header.strings_offset = header.annotations_offset +
+                          annotations_.size() * sizeof(BinaryAnnotation);
+  header.string_data_offset =
+      header.strings_offset + header.string_count * sizeof(BinaryString);
+
+  write_ok_ &= fwrite(annotations_.data(), sizeof(BinaryAnnotation),
+                      annotations_.size(), out_) == annotations_.size();
+  std::vector<BinaryString> index(header.string_count);
+  uint64_t offset = 0;
+  for (uint32_t i = 0; i < header.string_count; ++i) {
+    index[i] = {offset, strings_.name(i).size()};
+    offset += index[i].size;
+  }
+  header.string_data_size = offset;
+  write_ok_ &= fwrite(index.data(), sizeof(BinaryString), index.size(),
+                      out_) == index.size();
+  for (uint32_t i = 0; i < header.string_count; ++i) {
+    const std::string_view s = strings_.name(i);
+    write_ok_ &= fwrite(s.data(), 1, s.size(), out_) == s.size();
+  }
+
+  write_ok_ &= fseek(out_, 0, SEEK_SET) == 0;
+  write_ok_ &= fwrite(&header, sizeof(header), 1, out_) == 1;
+  write_ok_ &= fflush(out_) == 0;
+  return write_ok_;
+}
+
+inline BinaryReader::~BinaryReader() {
+  if (mapped_) munmap(mapped_, mapped_size_);
+}
+
+inline bool BinaryReader::open(const char *filename, FILE *errstream) {
+  const int fd = ::open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(errstream, "%s: can't open\n", filename);
+    return false;
+  }
+  struct stat s;
+  fstat(fd, &s);
+  void *const buffer =
+      s.st_size ? mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0)
+                : MAP_FAILED;
+  close(fd);
+  if (buffer == MAP_FAILED) {
+    fprintf(errstream, "%s: can't map\n", filename);
+    return false;
+  }
+  if (mapped_) munmap(mapped_, mapped_size_);
+  mapped_ = buffer;
+  mapped_size_ = s.st_size;
+  return open_buffer({(const char *)buffer, mapped_size_}, errstream);
+}
+
+inline bool BinaryReader::open_buffer(std::string_view content,
+                                      FILE *errstream) {
+  header_ = nullptr;
+  if (content.size() < sizeof(BinaryHeader)) {
+    fprintf(errstream, "binary fasm: file too short\n");
+    return false;
+  }
+  const auto *header = (const BinaryHeader *)content.data();
+  if (memcmp(header->magic, BinaryHeader::kMagic, sizeof(header->magic)) !=
+          0 ||
+      header->byte_order != BinaryHeader::kByteOrderMark) {
+    fprintf(errstream, "binary fasm: not a binary fasm file of this "
+            "version or byte order\n");
+    return false;
+  }
+  // Sections follow each other. Counts are checked against the remaining
+  // size before multiplying, so that corrupt counts can't wrap around.
+  const uint64_t size = content.size();
+  const auto section_fits = [size](uint64_t offset, uint64_t count,
+                                   uint64_t element_size) {
+    return offset <= size && count <= (size - offset) / element_size;
+  };
+  if (header->records_offset < sizeof(BinaryHeader) ||
+      !section_fits(header->records_offset, header->record_count,
+                    sizeof(BinaryRecord)) ||
+      header->annotations_offset !=
+          header->records_offset +
+              header->record_count * sizeof(BinaryRecord) ||
+      !section_fits(header->annotations_offset, header->annotation_count,
+                    sizeof(BinaryAnnotation)) ||
+      header->strings_offset !=
+          header->annotations_offset +
+              header->annotation_count * sizeof(BinaryAnnotation) ||
+      !section_fits(header->strings_offset, header->string_count,
+                    sizeof(BinaryString)) ||
+      header->string_data_offset !=
+          header->strings_offset +
+              header->string_count * sizeof(BinaryString) ||
+      header->string_data_size != size - header->string_data_offset) {
+    fprintf(errstream, "binary fasm: inconsistent section sizes\n");
+    return false;
+  }
+  // Check all string references once, so that accessors don't need to.
+  const auto *strings =
+      (const BinaryString *)(content.data() + header->strings_offset);
+  for (uint64_t i = 0; i < header->string_count; ++i) {
+    if (strings[i].size > header->string_data_size ||
+        strings[i].offset > header->string_data_size - strings[i].size) {
+      fprintf(errstream, "binary fasm: string %" PRIu64 " out of range\n", i);
+      return false;
+    }
+  }
+  const uint64_t string_count = header->string_count;
+  const auto *records =
+      (const BinaryRecord *)(content.data() + header->records_offset);
+  for (uint64_t i = 0; i < header->record_count; ++i) {
+    if (records[i].feature >= string_count) {
+      fprintf(errstream, "binary fasm: record %" PRIu64 " has invalid "
+              "feature\n", i);
+      return false;
+    }
+  }
+  const auto *annotations =
+      (const BinaryAnnotation *)(content.data() + header->annotations_offset);
+  for (uint64_t i = 0; i < header->annotation_count; ++i) {
+    if (annotations[i].feature >= string_count ||
+        annotations[i].name >= string_count ||
+        annotations[i].value >= string_count) {
+      fprintf(errstream, "binary fasm: annotation %" PRIu64 " has invalid "
+              "string\n", i);
+      return false;
+    }
+  }
+  header_ = header;
+  records_ = (const BinaryRecord *)(content.data() + header->records_offset);
+  annotations_ = (const BinaryAnnotation *)(content.data() +
+                                            header->annotations_offset);
+  strings_ = (const BinaryString *)(content.data() + header->strings_offset);
+  string_data_ = content.data() + header->string_data_offset;
+  return true;
+}
+
+template <typename ParseCallbackT, typename AnnotationCallbackT>
+bool BinaryReader::replay(uint64_t begin, uint64_t end,
+                          ParseCallbackT &&parse_callback,
+                          AnnotationCallbackT &&annotation_callback) const {
+  if constexpr (internal::kMaybeEmptyCallback<AnnotationCallbackT>) {
+    if (!annotation_callback) {
+      return replay(begin, end, parse_callback, nullptr);
+    }
+  }
+  constexpr bool kWantsAnnotations =
+      !std::is_same_v<std::decay_t<AnnotationCallbackT>, std::nullptr_t>;
+  if (begin >= end && header_->record_count > 0) {
+    return true;  // Empty ranges don't get any annotations.
+  }
+  // Annotations after the records of the previous range up to the last
+  // line of this range.
+  const BinaryAnnotation *annotation = annotations_;
+  const BinaryAnnotation *annotation_end =
+      annotations_ + header_->annotation_count;
+  if constexpr (kWantsAnnotations) {
+    const auto by_line = [](uint32_t line, const BinaryAnnotation &a) {
+      return line < a.line;
+    };
+    if (begin > 0) {
+      annotation = std::upper_bound(annotation, annotation_end,
+                                    records_[begin - 1].line, by_line);
+    }
+    if (end < header_->record_count) {
+      annotation_end = std::upper_bound(annotation, annotation_end,
+                                        records_[end - 1].line, by_line);
+    }
+  }
+  for (uint64_t i = begin; i < end; ++i) {
+    const BinaryRecord &r = records_[i];
+    if constexpr (kWantsAnnotations) {
+      for (/**/; annotation < annotation_end && annotation->line < r.line;
+           ++annotation) {
+        annotation_callback(annotation->line, string(annotation->feature),
+                            string(annotation->name),
+                            string(annotation->value));
+      }
+    }
+    if (!parse_callback(r.line, string(r.feature), r.start_bit, r.width,
+                        r.bits)) {
+      return false;
+    }
+  }
+  if constexpr (kWantsAnnotations) {
+    for (/**/; annotation < annotation_end; ++annotation) {
+      annotation_callback(annotation->line, string(annotation->feature),
+                          string(annotation->name), string(annotation->value));
+    }
+  }
+  return true;
+}
+
+template <typename ParseCallbackT, typename AnnotationCallbackT>
+ParseResult BinaryReader::replay_parallel(
+    int thread_count, ParseCallbackT &&parse_callback,
+    AnnotationCallbackT &&annotation_callback,
+    const Executor &executor) const {
+  const uint64_t count = header_->record_count;
+  // Only the last range ends at the last record, as it also gets the
+  // annotations following it.
+  thread_count = std::clamp<uint64_t>(count, 1, std::max(1, thread_count));
+  std::vector<char> completed(thread_count);
+  const auto replay_range = [&](int i) {
+    completed[i] = replay(count * i / thread_count,
+                          count * (i + 1) / thread_count, parse_callback,
+                          annotation_callback);
+  };
+  if (executor) {
+    executor(thread_count, replay_range);
+  } else {
+    run_threads(thread_count, replay_range);
+  }
+  for (const char c : completed) {
+    if (!c) return ParseResult::kUserAbort;
+  }
+  return parse_result();
+}
+}  // namespace fasm
+#endif  // SIMPLE_FASM_BINARY_H
@@ -0,0 +1,560 @@
+// Copyright 2022 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Canonical form of FASM as defined in the specification: every bit that is
+// set on a line of its own, sorted by feature and bit, no annotations.
+
+#ifndef SIMPLE_FASM_CANONICAL_H
+#define SIMPLE_FASM_CANONICAL_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <numeric>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "fasm-feature-table.h"
+#include "fasm-parse.h"
+#include "fasm-writer.h"
+
+namespace fasm {
+struct CanonicalizeOptions {
+  int thread_count = 1;
+
+  // Approximate memory used to sort the bits. Content with more bits is
+  // processed in parts, each sorted and written to a temporary file as a
+  // run; the runs are then merged.
+  size_t memory_budget = size_t(1) << 30;
+
+  Executor executor;  // Runs the worker threads, if set.
+};
+
+// Write the canonical form of "content" to "out": each bit set as
+// "FEATURE[bit]" on its own line, or just "FEATURE" for bit 0, sorted by
+// feature name and bit. As with diff(), a bit assigned on several lines has
+// the value of its last assignment; bits that end up 0 are not written.
+// Parse issues are reported to "errstream"; the most severe is returned, or
+// kError if writing or the temporary file failed.
+inline ParseResult canonicalize(std::string_view content, FILE *errstream,
+                                FILE *out,
+                                const CanonicalizeOptions &options = {});
+
+// -- End of API interface; rest is implementation details
+
+namespace internal {
+// Each bit assignment is a 64-bit key: feature << 17 | bit << 1 | value, the
+// feature being an ID local to a chunk while parsing, and the rank of the
+// name in its partition afterwards. Sorting by key >> 1 with a stable sort
+// keeps assignments of the same bit in line order, so the last one counts.
+constexpr int kCanonicalFeatureShift = 17;
+
+// Content bytes per byte of memory_budget. Values expand to one key per bit,
+// i.e. up to 4 keys per hex digit, which are copied once for partitioning
+// and once more while sorting.
+constexpr size_t kCanonicalMemoryPerByte = 32;
+
+// Assigns IDs to the feature names of one chunk.
+class ChunkFeatureNames {
+ public:
+  uint32_t intern(std::string_view name) {
+    // Wide values and ranges split over lines repeat the previous name.
+    if (last_ < names_.size() && names_[last_] == name) return last_;
+    if (2 * (names_.size() + 1) > slots_.size()) grow();
+    const uint64_t hash = FeatureTable::hash(name);
+    const size_t mask = slots_.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      const uint32_t slot = slots_[i];
+      if (slot == 0) {
+        names_.push_back(name);
+        hashes_.push_back(hash);
+        slots_[i] = names_.size();
+        return last_ = names_.size() - 1;
+      }
+      if (hashes_[slot - 1] == hash && names_[slot - 1] == name) {
+        return last_ = slot - 1;
+      }
+    }
+  }
+
+  const std::vector<std::string_view> &names() const { return names_; }
+
+ private:
+  void grow() {
+    slots_.assign(std::max<size_t>(1024, 2 * slots_.size()), 0);
+    const size_t mask = slots_.size() - 1;
+    for (uint32_t id = 0; id < names_.size(); ++id) {
+      size_t i = hashes_[id] & mask;
+      while (slots_[i]) i = (i + 1) & mask;
+      slots_[i] = id + 1;
+    }
+  }
+
+  std::vector<uint32_t> slots_;  // ID + 1; 0 for empty.
+  std::vector<std::string_view> names_;
+  std::vector<uint64_t> hashes_;
+  uint32_t last_ = 0;
+};
+
+struct CanonicalChunk {
+  ChunkFeatureNames names;
+  std::vector<uint64_t> keys;
+  std::vector<uint32_t> sorted;    // IDs sorted by name.
+  std::vector<uint64_t> location;  // By ID: partition << 32 | rank.
+};
+
+struct CanonicalPartition {
+  std::vector<std::string_view> names;  // By rank.
+  std::vector<uint64_t> keys;
+};
+
+// Header of a feature in a run; followed by "value_count" values, each
+// bit << 1 | value, sorted by bit.
+struct CanonicalRunFeature {
+  uint64_t name_offset;  // In the content.
+  uint32_t name_size;
+  uint32_t value_count;
+};
+
+// Stable sort of "keys" by key >> 1, with "buffer" of the same size.
+inline void radix_sort_keys(std::vector<uint64_t> *keys,
+                            std::vector<uint64_t> *buffer) {
+  if (keys->size() < 256) {
+    std::stable_sort(keys->begin(), keys->end(),
+                     [](uint64_t a, uint64_t b) { return a >> 1 < b >> 1; });
+    return;
+  }
+  uint64_t used_bits = 0;
+  for (const uint64_t key : *keys) used_bits |= key;
+  constexpr int kDigitBits = 11;
+  constexpr uint64_t kDigitMask = (1 << kDigitBits) - 1;
+  buffer->resize(keys->size());
+  for (int shift = 1; shift < 64 && (used_bits >> shift) != 0;
+       shift += kDigitBits) {
+    size_t position[1 << kDigitBits] = {};
+    for (const uint64_t key : *keys) ++position[(key >> shift) & kDigitMask];
+    size_t start = 0;
+    for (size_t &p : position) {
+      const size_t count = p;
+      p = start;
+      start += count;
+    }
+    for (const uint64_t key : *keys) {
+      (*buffer)[position[(key >> shift) & kDigitMask]++] = key;
+    }
+    keys->swap(*buffer);
+  }
+}
+
+// Parse "chunks" and distribute their bits to partitions of name ranges.
+// The keys of each partition are sorted, keeping only the last assignment
+// of each bit, and passed to "format" to fill a buffer. Groups of
+// partitions are formatted in parallel; "write" then gets the buffers in
+// partition order.
+inline ParseResult canonicalize_chunks(
+    const std::vector<ContentChunk> &chunks, FILE *errstream,
+    const CanonicalizeOptions &options,
+    const std::function<void(const CanonicalPartition &partition,
+                             const std::vector<uint64_t> &keys,
+                             std::string *buffer)> &format,
+    const std::function<bool(const std::string &buffer)> &write) {
+  const int thread_count = std::max(options.thread_count, 1);
+  std::vector<CanonicalChunk> parsed(chunks.size());
+  std::vector<ParseResult> results(chunks.size(), ParseResult::kSuccess);
+  run_balanced(
+      chunks.size(), thread_count,
+      [&](int, int c) {
+        CanonicalChunk &chunk = parsed[c];
+        chunk.keys.reserve(chunks[c].content.size() / 2);
+        results[c] = parse(
+            chunks[c], errstream,
+            [&](uint32_t, std::string_view feature, int start_bit, int width,
+                uint64_t bits) {
+              const uint64_t base =
+                  uint64_t(chunk.names.intern(feature))
+                      << kCanonicalFeatureShift |
+                  uint64_t(start_bit) << 1;
+              for (int i = 0; i < width; ++i) {
+                chunk.keys.push_back((base + (uint64_t(i) << 1)) |
+                                     ((bits >> i) & 1));
+              }
+              return true;
+            });
+        const std::vector<std::string_view> &names = chunk.names.names();
+        chunk.sorted.resize(names.size());
+        std::iota(chunk.sorted.begin(), chunk.sorted.end(), 0);
+        std::sort(chunk.sorted.begin(), chunk.sorted.end(),
+                  [&](uint32_t a, uint32_t b) { return names[a] < names[b]; });
+        chunk.location.resize(names.size());
+      },
+      options.executor);
+
+  // Split the name space at names sampled evenly from each chunk, so that
+  // partitions have about the same number of names.
+  const size_t max_partitions = 16 * thread_count;
+  std::vector<std::string_view> samples;
+  for (const CanonicalChunk &chunk : parsed) {
+    const size_t count = chunk.sorted.size();
+    for (size_t i = 0; i < max_partitions && i < count; ++i) {
+      samples.push_back(
+          chunk.names.names()[chunk.sorted[i * count / max_partitions]]);
+    }
+  }
+  std::sort(samples.begin(), samples.end());
+  std::vector<std::string_view> splitters;
+  for (size_t p = 1; p < max_partitions && !samples.empty(); ++p) {
+    const std::string_view s = samples[p * samples.size() / max_partitions];
+    if (splitters.empty() || splitters.back() < s) splitters.push_back(s);
+  }
+  if (!splitters.empty() && splitters.front() == samples.front()) {
+    splitters.erase(splitters.begin());  // Would give an empty partition.
+  }
+  const int partition_count = splitters.size() + 1;
+
+  // Rank the names within each partition.
+  std::vector<CanonicalPartition> partitions(partition_count);
+  run_balanced(
+      partition_count, thread_count,
+      [&](int, int p) {
+        struct Entry {
+          std::string_view name;
+          uint32_t chunk;
+          uint32_t id;
+        };
+        std::vector<Entry> entries;
+        for (uint32_t c = 0; c < parsed.size(); ++c) {
+          const CanonicalChunk &chunk = parsed[c];
+          const auto by_name = [&](uint32_t id, std::string_view s) {
+            return chunk.names.names()[id] < s;
+          };
+          const auto begin =
+              p == 0 ? chunk.sorted.begin()
+                     : std::lower_bound(chunk.sorted.begin(),
+                                        chunk.sorted.end(), splitters[p - 1],
+                                        by_name);
+          const auto end = p == partition_count - 1
+                               ? chunk.sorted.end()
+                               : std::lower_bound(begin, chunk.sorted.end(),
+                                                  splitters[p], by_name);
+          for (auto it = begin; it != end; ++it) {
+            entries.push_back({chunk.names.names()[*it], c, *it});
+          }
+        }
+        std::sort(entries.begin(), entries.end(),
+                  [](const Entry &a, const Entry &b) {
+                    return a.name < b.name;
+                  });
+        std::vector<std::string_view> &names = partitions[p].names;
+        for (const Entry &e : entries) {
+          if (names.empty() || names.back() != e.name) {
+            names.push_back(e.name);
+          }
+          parsed[e.chunk].location[e.id] =
+              uint64_t(p) << 32 | (names.size() - 1);
+        }
+      },
+      options.executor);
+
+  // Move keys to their partitions, chunks in order so that assignments of
+  // the same bit stay in line order.
+  std::vector<std::vector<size_t>> offsets(
+      parsed.size(), std::vector<size_t>(partition_count));
+  run_balanced(
+      parsed.size(), thread_count,
+      [&](int, int c) {
+        for (const uint64_t key : parsed[c].keys) {
+          ++offsets[c][parsed[c].location[key >> kCanonicalFeatureShift] >>
+                       32];
+        }
+      },
+      options.executor);
+  for (int p = 0; p < partition_count; ++p) {
+    size_t size = 0;
+    for (std::vector<size_t> &chunk_offsets : offsets) {
+      const size_t count = chunk_offsets[p];
+      chunk_offsets[p] = size;
+      size += count;
+    }
+    partitions[p].keys.resize(size);
+  }
+  run_balanced(
+      parsed.size(), thread_count,
+      [&](int, int c) {
+        CanonicalChunk &chunk = parsed[c];
+        constexpr uint64_t kBitMask =
+            (uint64_t(1) << kCanonicalFeatureShift) - 1;
+        for (const uint64_t key : chunk.keys) {
+          const uint64_t location =
+              chunk.location[key >> kCanonicalFeatureShift];
+          const uint32_t rank = location;
+          partitions[location >> 32].keys[offsets[c][location >> 32]++] =
+              uint64_t(rank) << kCanonicalFeatureShift | (key & kBitMask);
+        }
+        std::vector<uint64_t>().swap(chunk.keys);
+      },
+      options.executor);
+
+  // Sort and format a group of partitions at a time, so that only part of
+  // the output is in memory.
+  std::vector<std::string> buffers(2 * thread_count);
+  std::vector<std::vector<uint64_t>> sort_buffers(thread_count);
+  for (int first = 0; first < partition_count; first += buffers.size()) {
+    const int group_size =
+        std::min<int>(buffers.size(), partition_count - first);
+    run_balanced(
+        group_size, thread_count,
+        [&](int worker, int i) {
+          CanonicalPartition &partition = partitions[first + i];
+          std::vector<uint64_t> &keys = partition.keys;
+          radix_sort_keys(&keys, &sort_buffers[worker]);
+          size_t kept = 0;
+          for (size_t k = 0; k < keys.size(); ++k) {
+            if (k + 1 < keys.size() && keys[k] >> 1 == keys[k + 1] >> 1) {
+              continue;  // Not the last assignment.
+            }
+            keys[kept++] = keys[k];
+          }
+          keys.resize(kept);
+          buffers[i].clear();
+          format(partition, keys, &buffers[i]);
+          std::vector<uint64_t>().swap(keys);
+        },
+        options.executor);
+    for (int i = 0; i < group_size; ++i) {
+      if (!write(buffers[i])) return ParseResult::kError;
+    }
+  }
+  return *std::max_element(results.begin(), results.end());
+}
+
+// Reads the features of one run from the temporary file.
+class CanonicalRunReader {
+ public:
+  CanonicalRunReader(int fd, uint64_t begin, uint64_t end,
+                     size_t buffer_size)
+      : fd_(fd), pos_(begin), end_(end), buffer_(buffer_size) {}
+
+  // Read next feature. Returns false at the end of the run or on error.
+  bool next(std::string_view content) {
+    CanonicalRunFeature feature;
+    if (!read(&feature, sizeof(feature))) return false;
+    name = content.substr(feature.name_offset, feature.name_size);
+    values.resize(feature.value_count);
+    return read(values.data(), values.size() * sizeof(uint32_t));
+  }
+
+  std::string_view name;
+  std::vector<uint32_t> values;
+
+ private:
+  bool read(void *data, size_t size) {
+    char *out = (char *)data;
+    while (size > 0) {
+      if (buffer_pos_ == buffer_end_) {
+        const size_t wanted = std::min<uint64_t>(buffer_.size(), end_ - pos_);
+        if (wanted == 0) return false;
+        const ssize_t r = pread(fd_, buffer_.data(), wanted, pos_);
+        if (r <= 0) return false;
+        pos_ += r;
+        buffer_pos_ = 0;
+        buffer_end_ = r;
+      }
+      const size_t n = std::min(size, buffer_end_ - buffer_pos_);
+      memcpy(out, buffer_.data() + buffer_pos_, n);
+      buffer_pos_ += n;
+      out += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  const int fd_;
+  uint64_t pos_;
+  const uint64_t end_;
+  std::vector<char> buffer_;
+  size_t buffer_pos_ = 0;
+  size_t buffer_end_ = 0;
+};
+
+// Merge the sorted runs, each from runs[i] to runs[i + 1] in "file". Of
+// the same feature, values of later runs come later, so override.
+inline bool merge_canonical_runs(std::string_view content, FILE *file,
+                                 const std::vector<uint64_t> &runs,
+                                 size_t memory_budget, FILE *out) {
+  const int run_count = runs.size() - 1;
+  const size_t buffer_size = std::clamp<size_t>(
+      memory_budget / 2 / run_count, 64 << 10, 4 << 20);
+  std::vector<CanonicalRunReader> readers;
+  readers.reserve(run_count);
+  for (int r = 0; r < run_count; ++r) {
+    readers.emplace_back(fileno(file), runs[r], runs[r + 1], buffer_size);
+  }
+  const auto later = [&](int a, int b) {
+    if (readers[a].name != readers[b].name) {
+      return readers[a].name > readers[b].name;
+    }
+    return a > b;
+  };
+  std::priority_queue<int, std::vector<int>, decltype(later)> queue(later);
+  for (int r = 0; r < run_count; ++r) {
+    if (readers[r].next(content)) queue.push(r);
+  }
+  Writer writer(out, WriteStyle::kCanonical);
+  std::vector<uint32_t> values;
+  while (!queue.empty()) {
+    const int first = queue.top();
+    const std::string_view name = readers[first].name;
+    values.clear();
+    while (!queue.empty() && readers[queue.top()].name == name) {
+      const int r = queue.top();
+      queue.pop();
+      values.insert(values.end(), readers[r].values.begin(),
+                    readers[r].values.end());
+      if (readers[r].next(content)) queue.push(r);
+    }
+    std::stable_sort(values.begin(), values.end(),
+                     [](uint32_t a, uint32_t b) { return a >> 1 < b >> 1; });
+    for (size_t i = 0; i < values.size(); ++i) {
+      const bool last = i + 1 == values.size() ||
+                        values[i] >> 1 != values[i + 1] >> 1;
+      if (last && (values[i] & 1)) {
+        writer.add_feature(name, values[i] >> 1, 1, 1);
+      }
+    }
+  }
+  return writer.flush();
+}
+}  // namespace internal
+
+inline ParseResult canonicalize(std::string_view content, FILE *errstream,
+                                FILE *out,
+                                const CanonicalizeOptions &options) {
+  using internal::CanonicalPartition;
+  const int thread_count = std::max(options.thread_count, 1);
+  const size_t segment_size = std::max<size_t>(
+      options.memory_budget / internal::kCanonicalMemoryPerByte, 1 << 20);
+  const bool use_runs = content.size() > segment_size;
+  FILE *const run_file = use_runs ? tmpfile() : nullptr;
+  if (use_runs && !run_file) {
+    fprintf(errstream, "Can't create temporary file: %s\n", strerror(errno));
+    return ParseResult::kError;
+  }
+  std::vector<uint64_t> runs = {0};
+
+  ParseResult result = ParseResult::kSuccess;
+  bool write_failed = false;
+  uint32_t first_line = 1;
+  for (size_t begin = 0; begin < content.size();) {
+    size_t end = content.size();
+    if (content.size() - begin > segment_size) {
+      const void *const newline =
+          memchr(content.data() + begin + segment_size, '\n',
+                 content.size() - begin - segment_size);
+      if (newline) end = (const char *)newline - content.data() + 1;
+    }
+    const std::string_view segment = content.substr(begin, end - begin);
+    std::vector<ContentChunk> chunks;
+    if (segment.back() == '\n') {
+      chunks = split_lines(
+          segment, balanced_chunk_count(segment.size(), thread_count),
+          thread_count, options.executor);
+      for (ContentChunk &chunk : chunks) {
+        chunk.first_line += first_line - 1;
+        chunk.offset += begin;
+      }
+    } else {
+      chunks.push_back({segment, first_line, begin});  // Last line unended.
+    }
+    const bool first_run = runs.size() == 1;
+    const ParseResult r = internal::canonicalize_chunks(
+        chunks, errstream, options,
+        [&](const CanonicalPartition &partition,
+            const std::vector<uint64_t> &keys, std::string *buffer) {
+          if (!use_runs) {
+            Writer writer(buffer, WriteStyle::kCanonical);
+            for (const uint64_t key : keys) {
+              if ((key & 1) == 0) continue;
+              writer.add_feature(
+                  partition.names[key >> internal::kCanonicalFeatureShift],
+                  (key >> 1) & 0xffff, 1, 1);
+            }
+            return;
+          }
+          // Cleared bits are kept to override earlier runs.
+          for (size_t k = 0; k < keys.size(); /**/) {
+            const uint64_t rank = keys[k] >> internal::kCanonicalFeatureShift;
+            const size_t header = buffer->size();
+            buffer->resize(header + sizeof(internal::CanonicalRunFeature));
+            uint32_t count = 0;
+            for (/**/; k < keys.size() &&
+                       keys[k] >> internal::kCanonicalFeatureShift == rank;
+                 ++k) {
+              if (first_run && (keys[k] & 1) == 0) continue;
+              const uint32_t value =
+                  keys[k] & ((1 << internal::kCanonicalFeatureShift) - 1);
+              buffer->append((const char *)&value, sizeof(value));
+              ++count;
+            }
+            if (count == 0) {
+              buffer->resize(header);
+              continue;
+            }
+            const std::string_view name = partition.names[rank];
+            const internal::CanonicalRunFeature feature = {
+                uint64_t(name.data() - content.data()),
+                uint32_t(name.size()), count};
+            memcpy(&(*buffer)[header], &feature, sizeof(feature));
+          }
+        },
+        [&](const std::string &buffer) {
+          FILE *const f = use_runs ? run_file : out;
+          if (fwrite(buffer.data(), 1, buffer.size(), f) == buffer.size()) {
+            return true;
+          }
+          fprintf(errstream, "Writing failed: %s\n", strerror(errno));
+          write_failed = true;
+          return false;
+        });
+    result = std::max(result, r);
+    if (write_failed) break;
+    if (use_runs) {
+      runs.push_back(ftell(run_file));
+      first_line = chunks.back().first_line +
+                   internal::count_newlines(chunks.back().content.data(),
+                                            chunks.back().content.data() +
+                                                chunks.back().content.size());
+    }
+    begin = end;
+  }
+
+  if (use_runs && !write_failed) {
+    if (fflush(run_file) != 0 ||
+        !internal::merge_canonical_runs(content, run_file, runs,
+                                        options.memory_budget, out)) {
+      fprintf(errstream, "Merging runs failed: %s\n", strerror(errno));
+      result = ParseResult::kError;
+    }
+  }
+  if (run_file) fclose(run_file);
+  return result;
+}
+}  // namespace fasm
+#endif  // SIMPLE_FASM_CANONICAL_H
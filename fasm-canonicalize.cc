@@ -0,0 +1,92 @@
+// Copyright 2022 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Write the canonical form of a fasm file: one set bit per line, sorted.
+
+#include <stdio.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <string_view>
+#include <thread>
+
+#include "fasm-canonical.h"
+#include "fasm-io.h"
+
+int64_t getTimeInMicros() {
+  struct timeval t;
+  gettimeofday(&t, NULL);
+  return (int64_t)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+static int usage(const char *progname) {
+  fprintf(stderr,
+          "usage: %s [options] <fasm-file>\n"
+          "Writes each bit set on its own line, sorted by feature and bit, "
+          "without\nannotations. If a bit is assigned more than once, the "
+          "last assignment counts.\n"
+          "Options:\n"
+          "\t-j <threads> : Threads to use. Default: all cores\n"
+          "\t-m <MiB>     : Approximate memory to sort in; larger files are "
+          "sorted\n"
+          "\t               in runs in a temporary file. Default: 1024\n"
+          "\t-o <file>    : Output file. Default: stdout\n",
+          progname);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  fasm::CanonicalizeOptions options;
+  options.thread_count = std::max(1u, std::thread::hardware_concurrency());
+  const char *out_file = nullptr;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:m:o:h")) != -1) {
+    switch (opt) {
+    case 'j': options.thread_count = std::max(1, atoi(optarg)); break;
+    case 'm': options.memory_budget = size_t(std::max(1, atoi(optarg))) << 20;
+      break;
+    case 'o': out_file = optarg; break;
+    default: return usage(argv[0]);
+    }
+  }
+  if (argc - optind != 1) {
+    return usage(argv[0]);
+  }
+
+  fasm::MappedFile file;
+  if (!file.map(argv[optind], fasm::ReadOptions(), stderr)) return 1;
+  const std::string_view content = file.content();
+  FILE *const out = out_file ? fopen(out_file, "wb") : stdout;
+  if (!out) {
+    perror(out_file);
+    return 1;
+  }
+
+  const int64_t start_us = getTimeInMicros();
+  const fasm::ParseResult result =
+      fasm::canonicalize(content, stderr, out, options);
+  if (fflush(out) != 0 || (out_file && fclose(out) != 0)) {
+    perror("Writing output failed");
+    return 1;
+  }
+  const int64_t duration_us = getTimeInMicros() - start_us;
+
+  constexpr float MiBFactor = 1e6 / (1 << 20);
+  fprintf(stderr, "%d thread%s. %.3fs wall time. %.1f MiB/s\n",
+          options.thread_count, options.thread_count > 1 ? "s" : "",
+          duration_us / 1e6, 1.0f * content.size() / duration_us * MiBFactor);
+  return result > fasm::ParseResult::kNonCritical ? 1 : 0;
+}
@@ -0,0 +1,505 @@
+// Copyright 2022 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Parse compressed FPGA assembly files, decompressing in a separate thread
+// while parse workers process the content already available.
+//
+// gzip is handled with zlib (link with -lz). zstd is supported if
+// FASM_HAVE_ZSTD is defined (link with -lzstd).
+
+#ifndef SIMPLE_FASM_DECOMPRESS_H
+#define SIMPLE_FASM_DECOMPRESS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#ifdef FASM_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "fasm-parse.h"
+
+namespace fasm {
+enum class Compression { kNone, kGzip, kZstd };
+
+// Determine compression from the magic bytes at the start of a file.
+inline Compression detect_compression(std::string_view start);
+
+// Returns if reading content with the given compression is supported.
+inline bool compression_supported(Compression compression);
+
+struct PipelineOptions {
+  // Number of threads parsing blocks; decompression runs in an additional
+  // thread.
+  int parse_threads = 1;
+
+  // Decompressed bytes per block handed to a parse worker. Blocks end at a
+  // newline, so are a bit shorter, or longer if a line does not fit.
+  size_t block_size = 4 << 20;
+
+  // Decompressed blocks waiting to be parsed before the decompression
+  // pauses; 0 means 2 * parse_threads. Memory use is about
+  // (queue_depth + parse_threads + 1) * block_size.
+  int queue_depth = 0;
+};
+
+// Time spent in the stages of the pipeline, to see which is the bottleneck.
+// If the decompression is waiting for free blocks, parsing is too slow; if
+// the parse workers are waiting for content, decompression is too slow.
+struct PipelineStats {
+  uint64_t compressed_bytes = 0;  // Bytes read from the file.
+  uint64_t content_bytes = 0;     // Decompressed bytes.
+  uint32_t lines = 0;
+  uint32_t blocks = 0;
+
+  int64_t wall_us = 0;
+  int64_t decompress_us = 0;        // Decompressing and splitting blocks.
+  int64_t decompress_wait_us = 0;   // Decompression waiting for free block.
+  int64_t parse_us = 0;             // Parsing, summed over all workers.
+  int64_t parse_wait_us = 0;        // Workers waiting for blocks, summed.
+};
+
+// Parses one line-aligned "chunk" of decompressed content in parse worker
+// number "worker" (0 <= worker < parse_threads), so that per-thread state
+// can be kept without locking.
+using ChunkParser =
+    std::function<ParseResult(int worker, const ContentChunk &chunk)>;
+
+// Decompress "filename" in its own thread and hand newline-aligned blocks
+// of the content through a bounded queue to "options.parse_threads" workers
+// calling "parse_chunk". Chunks are parsed in parallel, so possibly out of
+// order, but the first_line of each is relative to the whole content.
+// Uncompressed files are read as they are. If the content does not end
+// with a newline, one is added.
+//
+// If "stats" is given, it is filled with throughput data of each stage.
+// Returns the most severe result of any chunk; kError if the file can not
+// be read or decompressed, reported to "errstream". If a chunk returns
+// kUserAbort, no further chunks are started.
+inline ParseResult parse_compressed_chunks(const char *filename,
+                                           FILE *errstream,
+                                           const ChunkParser &parse_chunk,
+                                           const PipelineOptions &options = {},
+                                           PipelineStats *stats = nullptr);
+
+// Like parse_compressed_chunks(), calling fasm::parse() for each chunk. The
+// callbacks are called concurrently from multiple threads, so need to be
+// thread-safe, as with parse_parallel(). The string_views passed to the
+// callbacks are only valid during the callback.
+template <typename ParseCallbackT,
+          typename AnnotationCallbackT = std::nullptr_t>
+inline ParseResult parse_compressed_file(
+    const char *filename, FILE *errstream, ParseCallbackT &&parse_callback,
+    AnnotationCallbackT &&annotation_callback = nullptr,
+    const PipelineOptions &options = {}, PipelineStats *stats = nullptr);
+
+// -- End of API interface; rest is implementation details
+
+inline Compression detect_compression(std::string_view start) {
+  if (start.size() >= 2 && start[0] == '\x1f' && start[1] == '\x8b') {
+    return Compression::kGzip;
+  }
+  if (start.size() >= 4 && start.substr(0, 4) == "\x28\xb5\x2f\xfd") {
+    return Compression::kZstd;
+  }
+  return Compression::kNone;
+}
+
+inline bool compression_supported(Compression compression) {
+#ifdef FASM_HAVE_ZSTD
+  constexpr bool kZstdSupported = true;
+#else
+  constexpr bool kZstdSupported = false;
+#endif
+  return compression != Compression::kZstd || kZstdSupported;
+}
+
+namespace internal {
+// Reads a file, decompressing it according to its magic bytes.
+class DecompressingReader {
+ public:
+  DecompressingReader() = default;
+  ~DecompressingReader();
+  DecompressingReader(const DecompressingReader &) = delete;
+  DecompressingReader &operator=(const DecompressingReader &) = delete;
+
+  bool open(const char *filename, FILE *errstream);
+
+  // Read up to "size" decompressed bytes into "buffer". Returns number of
+  // bytes read, 0 at the end of the content or -1 on error.
+  int64_t read(char *buffer, size_t size);
+
+  // Number of bytes read from the file so far.
+  uint64_t compressed_bytes() const;
+
+ private:
+  const char *filename_ = nullptr;
+  FILE *errstream_ = nullptr;
+  gzFile gz_ = nullptr;  // Also used for uncompressed files.
+#ifdef FASM_HAVE_ZSTD
+  FILE *file_ = nullptr;
+  ZSTD_DCtx *zstd_ = nullptr;
+  std::vector<char> input_;
+  ZSTD_inBuffer in_ = {nullptr, 0, 0};
+  size_t frame_remaining_ = 0;  // Non-zero in the middle of a frame.
+  uint64_t zstd_bytes_read_ = 0;
+#endif
+};
+
+inline DecompressingReader::~DecompressingReader() {
+  if (gz_) gzclose(gz_);
+#ifdef FASM_HAVE_ZSTD
+  if (zstd_) ZSTD_freeDCtx(zstd_);
+  if (file_) fclose(file_);
+#endif
+}
+
+inline bool DecompressingReader::open(const char *filename, FILE *errstream) {
+  filename_ = filename;
+  errstream_ = errstream;
+  FILE *const file = fopen(filename, "rb");
+  if (!file) {
+    fprintf(errstream, "%s: can't open: %s\n", filename, strerror(errno));
+    return false;
+  }
+  char magic[4];
+  const size_t magic_len = fread(magic, 1, sizeof(magic), file);
+  const Compression compression =
+      detect_compression(std::string_view(magic, magic_len));
+  if (!compression_supported(compression)) {
+    fprintf(errstream, "%s: zstd compressed, but zstd support not compiled "
+            "in\n", filename);
+    fclose(file);
+    return false;
+  }
+#ifdef FASM_HAVE_ZSTD
+  if (compression == Compression::kZstd) {
+    rewind(file);
+    file_ = file;
+    zstd_ = ZSTD_createDCtx();
+    input_.resize(ZSTD_DStreamInSize());
+    return zstd_ != nullptr;
+  }
+#endif
+  fclose(file);
+  // zlib reads uncompressed files transparently.
+  gz_ = gzopen(filename, "rb");
+  if (!gz_) {
+    fprintf(errstream, "%s: can't open\n", filename);
+    return false;
+  }
+  gzbuffer(gz_, 1 << 18);
+  return true;
+}
+
+inline int64_t DecompressingReader::read(char *buffer, size_t size) {
+  size = std::min(size, (size_t)INT_MAX);
+  if (gz_) {
+    const int got = gzread(gz_, buffer, size);
+    int error = Z_OK;
+    const char *const message = gzerror(gz_, &error);
+    // Z_BUF_ERROR: truncated file, reported once all content is read.
+    if (got < 0 || (error != Z_OK && (error != Z_BUF_ERROR || got == 0))) {
+      fprintf(errstream_, "%s\n", message);  // Message includes filename.
+      return -1;
+    }
+    return got;
+  }
+#ifdef FASM_HAVE_ZSTD
+  ZSTD_outBuffer out = {buffer, size, 0};
+  while (out.pos < out.size) {
+    if (in_.pos == in_.size) {
+      const size_t got = fread(input_.data(), 1, input_.size(), file_);
+      if (got == 0) {
+        if (ferror(file_) || frame_remaining_ != 0) {
+          fprintf(errstream_, "%s: %s\n", filename_,
+                  ferror(file_) ? strerror(errno) : "truncated zstd frame");
+          return -1;
+        }
+        break;
+      }
+      zstd_bytes_read_ += got;
+      in_ = {input_.data(), got, 0};
+    }
+    frame_remaining_ = ZSTD_decompressStream(zstd_, &out, &in_);
+    if (ZSTD_isError(frame_remaining_)) {
+      fprintf(errstream_, "%s: %s\n", filename_,
+              ZSTD_getErrorName(frame_remaining_));
+      return -1;
+    }
+  }
+  return out.pos;
+#else
+  return -1;
+#endif
+}
+
+inline uint64_t DecompressingReader::compressed_bytes() const {
+  if (gz_) return gzoffset(gz_);
+#ifdef FASM_HAVE_ZSTD
+  return zstd_bytes_read_;
+#else
+  return 0;
+#endif
+}
+
+// Queue with a maximum number of elements. Producers block while it is
+// full, consumers while it is empty.
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity) : capacity_(capacity) {}
+
+  // Returns 'false' if the queue is cancelled.
+  bool push(T value) {
+    std::unique_lock<std::mutex> l(mutex_);
+    not_full_.wait(l, [this] {
+      return cancelled_ || queue_.size() < capacity_;
+    });
+    if (cancelled_) return false;
+    queue_.push_back(std::move(value));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  // Returns 'false' if the queue is cancelled, or closed and empty.
+  bool pop(T *value) {
+    std::unique_lock<std::mutex> l(mutex_);
+    not_empty_.wait(l, [this] {
+      return cancelled_ || closed_ || !queue_.empty();
+    });
+    if (cancelled_ || queue_.empty()) return false;
+    *value = std::move(queue_.front());
+    queue_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  // No more elements will be pushed; pop() returns the remaining ones.
+  void close() {
+    std::unique_lock<std::mutex> l(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+  }
+
+  // Wake up everyone waiting; push() and pop() return 'false' from now on.
+  void cancel() {
+    std::unique_lock<std::mutex> l(mutex_);
+    cancelled_ = true;
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+ private:
+  const size_t capacity_;
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::deque<T> queue_;
+  bool closed_ = false;
+  bool cancelled_ = false;
+};
+
+struct ContentBlock {
+  std::vector<char> buffer;  // Allocated size; reused between blocks.
+  size_t size = 0;           // Used bytes, ending in a newline.
+  uint32_t first_line = 0;
+  uint64_t offset = 0;       // Offset in the decompressed content.
+};
+
+inline int64_t MicrosSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// The pipeline behind parse_compressed_chunks(), reading content with
+// "reader", which has the read() and compressed_bytes() methods of the
+// DecompressingReader.
+template <typename ReaderT>
+inline ParseResult parse_pipelined(ReaderT *reader,
+                                   const ChunkParser &parse_chunk,
+                                   const PipelineOptions &options,
+                                   PipelineStats *stats) {
+  using Clock = std::chrono::steady_clock;
+  const auto start_time = Clock::now();
+
+  const int parse_threads = std::max(options.parse_threads, 1);
+  const int queue_depth = options.queue_depth > 0 ? options.queue_depth
+                                                  : 2 * parse_threads;
+  const size_t block_size = std::max(options.block_size, (size_t)1);
+
+  // Blocks circulate between the queue of empty blocks to be filled by
+  // the decompression and the queue of filled blocks to be parsed.
+  using BlockPtr = std::unique_ptr<ContentBlock>;
+  const int block_count = queue_depth + parse_threads + 1;
+  internal::BoundedQueue<BlockPtr> free_blocks(block_count);
+  internal::BoundedQueue<BlockPtr> filled_blocks(queue_depth);
+  for (int i = 0; i < block_count; ++i) {
+    free_blocks.push(std::make_unique<ContentBlock>());
+  }
+
+  PipelineStats decompress_stats;
+  std::atomic<bool> read_error(false);
+  std::thread decompress_thread([&]() {
+    PipelineStats &s = decompress_stats;
+    uint32_t next_line = 1;
+    BlockPtr block;
+    BlockPtr next;
+    auto wait_start = Clock::now();
+    if (!free_blocks.pop(&block)) return;
+    s.decompress_wait_us += MicrosSince(wait_start);
+    auto busy_start = Clock::now();
+    size_t fill = 0;
+    for (;;) {
+      if (fill == block->buffer.size()) {  // New block or very long line.
+        block->buffer.resize(std::max(block_size, 2 * fill));
+      }
+      const int64_t got = reader->read(block->buffer.data() + fill,
+                                       block->buffer.size() - fill);
+      if (got < 0) {
+        read_error = true;
+        break;
+      }
+      fill += got;
+      const bool at_end = (got == 0);
+      if (!at_end && fill < block->buffer.size()) continue;
+
+      // Hand over all complete lines; remaining partial line goes to the
+      // next block.
+      const char *const start = block->buffer.data();
+      const char *eol = (const char *)memrchr(start, '\n', fill);
+      if (at_end && fill > 0 && start[fill - 1] != '\n') {
+        if (fill == block->buffer.size()) block->buffer.resize(fill + 1);
+        block->buffer[fill++] = '\n';
+        eol = block->buffer.data() + fill - 1;
+      }
+      if (!eol) {
+        if (at_end) break;  // Empty.
+        continue;
+      }
+      block->size = eol - block->buffer.data() + 1;
+      block->first_line = next_line;
+      block->offset = s.content_bytes;
+      next_line += internal::count_newlines(block->buffer.data(),
+                                            block->buffer.data() + block->size);
+      s.content_bytes += block->size;
+      ++s.blocks;
+      if (!at_end) {
+        s.decompress_us += MicrosSince(busy_start);
+        wait_start = Clock::now();
+        if (!free_blocks.pop(&next)) break;
+        s.decompress_wait_us += MicrosSince(wait_start);
+        busy_start = Clock::now();
+        fill -= block->size;
+        if (next->buffer.size() < fill) next->buffer.resize(fill);
+        memcpy(next->buffer.data(), block->buffer.data() + block->size, fill);
+      }
+      s.decompress_us += MicrosSince(busy_start);
+      wait_start = Clock::now();
+      if (!filled_blocks.push(std::move(block))) break;
+      s.decompress_wait_us += MicrosSince(wait_start);
+      busy_start = Clock::now();
+      if (at_end) break;
+      block = std::move(next);
+    }
+    s.lines = next_line - 1;
+    s.compressed_bytes = reader->compressed_bytes();
+    filled_blocks.close();
+  });
+
+  std::vector<ParseResult> results(parse_threads, ParseResult::kSuccess);
+  std::vector<PipelineStats> worker_stats(parse_threads);
+  run_threads(parse_threads, [&](int worker) {
+    PipelineStats &s = worker_stats[worker];
+    BlockPtr block;
+    for (;;) {
+      const auto wait_start = Clock::now();
+      if (!filled_blocks.pop(&block)) break;
+      s.parse_wait_us += MicrosSince(wait_start);
+      const auto parse_start = Clock::now();
+      const ParseResult result = parse_chunk(
+          worker,
+          ContentChunk{std::string_view(block->buffer.data(), block->size),
+                       block->first_line, block->offset});
+      s.parse_us += MicrosSince(parse_start);
+      results[worker] = std::max(results[worker], result);
+      if (result == ParseResult::kUserAbort) {
+        filled_blocks.cancel();
+        free_blocks.cancel();
+        break;
+      }
+      free_blocks.push(std::move(block));
+    }
+  });
+  decompress_thread.join();
+
+  ParseResult result = ParseResult::kSuccess;
+  for (const ParseResult r : results) {
+    result = std::max(result, r);
+  }
+  if (read_error) result = ParseResult::kError;
+
+  if (stats) {
+    *stats = decompress_stats;
+    for (const PipelineStats &s : worker_stats) {
+      stats->parse_us += s.parse_us;
+      stats->parse_wait_us += s.parse_wait_us;
+    }
+    stats->wall_us = MicrosSince(start_time);
+  }
+  return result;
+}
+}  // namespace internal
+
+inline ParseResult parse_compressed_chunks(const char *filename,
+                                           FILE *errstream,
+                                           const ChunkParser &parse_chunk,
+                                           const PipelineOptions &options,
+                                           PipelineStats *stats) {
+  internal::DecompressingReader reader;
+  if (!reader.open(filename, errstream)) return ParseResult::kError;
+  return internal::parse_pipelined(&reader, parse_chunk, options, stats);
+}
+
+template <typename ParseCallbackT, typename AnnotationCallbackT>
+inline ParseResult parse_compressed_file(
+    const char *filename, FILE *errstream, ParseCallbackT &&parse_callback,
+    AnnotationCallbackT &&annotation_callback, const PipelineOptions &options,
+    PipelineStats *stats) {
+  return parse_compressed_chunks(
+      filename, errstream,
+      [&](int, const ContentChunk &chunk) {
+        return parse(chunk, errstream, parse_callback, annotation_callback);
+      },
+      options, stats);
+}
+}  // namespace fasm
+#endif  // SIMPLE_FASM_DECOMPRESS_H
@@ -0,0 +1,191 @@
+// Copyright 2022 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Collect parse diagnostics per thread without locking, and report them
+// sorted by line once parsing is done.
+
+#ifndef SIMPLE_FASM_DIAGNOSTICS_H
+#define SIMPLE_FASM_DIAGNOSTICS_H
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "fasm-parse.h"
+
+namespace fasm {
+struct DiagnosticLimits {
+  // Keep only the first diagnostics of each DiagnosticCode; the others are
+  // only counted. Large broken files have many of the same issue.
+  uint32_t max_per_code = 100;
+
+  // Keep at most this many diagnostics in total.
+  uint32_t max_total = 10000;
+};
+
+// Buffers diagnostics reported to its sinks, one per thread, so that
+// parallel parsing does not contend on a shared stream. Limits are applied
+// while collecting in each sink and again when merging.
+class DiagnosticCollector {
+ public:
+  explicit DiagnosticCollector(const DiagnosticLimits &limits = {})
+      : limits_(limits) {}
+  DiagnosticCollector(const DiagnosticCollector &) = delete;
+  DiagnosticCollector &operator=(const DiagnosticCollector &) = delete;
+
+  // Sink to be used by one thread, e.g. the index of the chunk or worker.
+  // Sinks with different indices can be used concurrently.
+  DiagnosticSink *sink(int index);
+
+  // All kept diagnostics, sorted by line and offset, with the limits
+  // applied over all sinks. The string_views point into the collector.
+  // Call once all parsing is finished.
+  std::vector<Diagnostic> merge() const;
+
+  // Number of diagnostics reported with "code", including those not kept.
+  uint64_t count(DiagnosticCode code) const;
+
+  // Print merged diagnostics to "out", followed by the number of
+  // diagnostics not shown for each code.
+  void print(FILE *out) const;
+
+ private:
+  class ThreadSink;
+
+  const DiagnosticLimits limits_;
+  mutable std::mutex mutex_;  // Only protecting creation of sinks.
+  std::vector<std::unique_ptr<ThreadSink>> sinks_;
+};
+
+// Like parse_parallel() in fasm-parse.h, with each chunk reporting to its
+// own sink of "diagnostics".
+template <typename ParseCallbackT,
+          typename AnnotationCallbackT = std::nullptr_t>
+inline ParseResult parse_parallel(std::string_view content, int thread_count,
+                                  DiagnosticCollector *diagnostics,
+                                  ParseCallbackT &&parse_callback,
+                                  AnnotationCallbackT &&annotation_callback =
+                                      nullptr,
+                                  const Executor &executor = {});
+
+// -- End of API interface; rest is implementation details
+
+class DiagnosticCollector::ThreadSink final : public DiagnosticSink {
+ public:
+  explicit ThreadSink(const DiagnosticLimits &limits) : limits_(limits) {}
+
+  void report(const Diagnostic &diagnostic) final {
+    const int code = static_cast<int>(diagnostic.code);
+    if (counts_[code]++ >= limits_.max_per_code ||
+        kept_.size() >= limits_.max_total) {
+      return;
+    }
+    // Content might be gone once we merge; keep copies of the strings.
+    kept_.push_back({diagnostic, std::string(diagnostic.feature),
+                     std::string(diagnostic.name)});
+  }
+
+  struct Kept {
+    Diagnostic diagnostic;
+    std::string feature;
+    std::string name;
+  };
+
+  const DiagnosticLimits &limits_;
+  std::vector<Kept> kept_;
+  uint64_t counts_[kDiagnosticCodeCount] = {};
+};
+
+inline DiagnosticSink *DiagnosticCollector::sink(int index) {
+  const std::lock_guard<std::mutex> l(mutex_);
+  if (index >= (int)sinks_.size()) sinks_.resize(index + 1);
+  if (!sinks_[index]) sinks_[index] = std::make_unique<ThreadSink>(limits_);
+  return sinks_[index].get();
+}
+
+inline std::vector<Diagnostic> DiagnosticCollector::merge() const {
+  const std::lock_guard<std::mutex> l(mutex_);
+  std::vector<Diagnostic> all;
+  for (const auto &sink : sinks_) {
+    if (!sink) continue;
+    for (const ThreadSink::Kept &kept : sink->kept_) {
+      Diagnostic d = kept.diagnostic;
+      d.feature = kept.feature;
+      d.name = kept.name;
+      all.push_back(d);
+    }
+  }
+  std::stable_sort(all.begin(), all.end(),
+                   [](const Diagnostic &a, const Diagnostic &b) {
+                     if (a.line != b.line) return a.line < b.line;
+                     return a.offset < b.offset;
+                   });
+
+  // Each sink kept its first max_per_code, now the first of all of them.
+  uint32_t per_code[kDiagnosticCodeCount] = {};
+  std::vector<Diagnostic> result;
+  for (const Diagnostic &d : all) {
+    if (result.size() >= limits_.max_total) break;
+    if (per_code[static_cast<int>(d.code)]++ >= limits_.max_per_code) {
+      continue;
+    }
+    result.push_back(d);
+  }
+  return result;
+}
+
+inline uint64_t DiagnosticCollector::count(DiagnosticCode code) const {
+  const std::lock_guard<std::mutex> l(mutex_);
+  uint64_t result = 0;
+  for (const auto &sink : sinks_) {
+    if (sink) result += sink->counts_[static_cast<int>(code)];
+  }
+  return result;
+}
+
+inline void DiagnosticCollector::print(FILE *out) const {
+  const std::vector<Diagnostic> diagnostics = merge();
+  uint64_t shown[kDiagnosticCodeCount] = {};
+  for (const Diagnostic &d : diagnostics) {
+    print_diagnostic(out, d);
+    ++shown[static_cast<int>(d.code)];
+  }
+  for (int i = 0; i < kDiagnosticCodeCount; ++i) {
+    const DiagnosticCode code = static_cast<DiagnosticCode>(i);
+    const uint64_t not_shown = count(code) - shown[i];
+    if (not_shown > 0) {
+      fprintf(out, "... and %" PRIu64 " more %s\n", not_shown,
+              diagnostic_code_name(code));
+    }
+  }
+}
+
+template <typename ParseCallbackT, typename AnnotationCallbackT>
+inline ParseResult parse_parallel(std::string_view content, int thread_count,
+                                  DiagnosticCollector *diagnostics,
+                                  ParseCallbackT &&parse_callback,
+                                  AnnotationCallbackT &&annotation_callback,
+                                  const Executor &executor) {
+  return internal::parse_parallel(
+      content, thread_count, [&](int i) { return diagnostics->sink(i); },
+      parse_callback, annotation_callback, executor);
+}
+}  // namespace fasm
+#endif  // SIMPLE_FASM_DIAGNOSTICS_H
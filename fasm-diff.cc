@@ -0,0 +1,175 @@
+// Copyright 2022 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compare which feature bits are set in two fasm files.
+
+#include <stdio.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "fasm-diff.h"
+#include "fasm-io.h"
+#include "fasm-writer.h"
+
+int64_t getTimeInMicros() {
+  struct timeval t;
+  gettimeofday(&t, NULL);
+  return (int64_t)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+static int usage(const char *progname) {
+  fprintf(stderr,
+          "usage: %s [options] <old-fasm-file> <new-fasm-file>\n"
+          "Compares which bits of which features are set, independent of "
+          "line order,\nformatting, number base and how ranges are split.\n"
+          "Prints bits that are only set in the old file with '-', only in "
+          "the new file\nwith '+'; neighboring bits changed the same way as "
+          "one range.\n"
+          "Options:\n"
+          "\t-j <threads> : Threads to use. Default: all cores\n"
+          "\t-p <file>    : Write patch: new values of all changed "
+          "features,\n"
+          "\t               including zeros, to be applied after the old "
+          "file.\n"
+          "\t-q           : Only print the summary.\n"
+          "Exit code 0 if the same, 1 if different, 2 on error.\n",
+          progname);
+  return 2;
+}
+
+int main(int argc, char *argv[]) {
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  const char *patch_file = nullptr;
+  bool quiet = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:p:qh")) != -1) {
+    switch (opt) {
+    case 'j': threads = std::max(1, atoi(optarg)); break;
+    case 'p': patch_file = optarg; break;
+    case 'q': quiet = true; break;
+    default: return usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2) {
+    return usage(argv[0]);
+  }
+
+  const fasm::ReadOptions read_options;
+  fasm::MappedFile old_file, new_file;
+  if (!old_file.map(argv[optind], read_options, stderr) ||
+      !new_file.map(argv[optind + 1], read_options, stderr)) {
+    return 2;
+  }
+  const std::string_view old_content = old_file.content();
+  const std::string_view new_content = new_file.content();
+
+  const int64_t start_us = getTimeInMicros();
+  std::vector<fasm::FeatureDiff> diffs;
+  const fasm::ParseResult result =
+      fasm::diff(old_content, new_content, threads, stderr, &diffs);
+  const int64_t duration_us = getTimeInMicros() - start_us;
+
+  uint64_t added = 0, removed = 0, changed = 0;
+  uint64_t added_bits = 0, removed_bits = 0;
+  std::string out;
+  fasm::Writer writer(&out);
+  // Bits that differ, each run of neighboring bits changed the same way on
+  // one line: '-' if they were set in the old file, '+' if in the new.
+  std::vector<uint64_t> ones;
+  const auto write_changes = [&](const fasm::FeatureDiff &d) {
+    const auto bit = [](const std::vector<uint64_t> &words, int i) {
+      return (words[i >> 6] >> (i & 63)) & 1;
+    };
+    for (int i = 0; i < d.width; /**/) {
+      if (i % 64 == 0 && d.old_bits[i >> 6] == d.new_bits[i >> 6]) {
+        i += 64;  // Sparse features have long stretches without changes.
+        continue;
+      }
+      const bool was_set = bit(d.old_bits, i);
+      if (was_set == bit(d.new_bits, i)) {
+        ++i;
+        continue;
+      }
+      int end = i + 1;
+      while (end < d.width && bit(d.old_bits, end) == was_set &&
+             bit(d.new_bits, end) != was_set) {
+        ++end;
+      }
+      const int width = end - i;
+      ones.assign((width + 63) / 64, ~uint64_t(0));
+      if (width % 64) ones.back() = (uint64_t(1) << (width % 64)) - 1;
+      writer.end_line();
+      out.push_back(was_set ? '-' : '+');
+      writer.add_wide_feature(d.feature, d.min_bit + i, width, ones.data());
+      i = end;
+    }
+  };
+  for (const fasm::FeatureDiff &d : diffs) {
+    const bool had_bits = std::any_of(d.old_bits.begin(), d.old_bits.end(),
+                                      [](uint64_t w) { return w != 0; });
+    const bool has_bits = std::any_of(d.new_bits.begin(), d.new_bits.end(),
+                                      [](uint64_t w) { return w != 0; });
+    added += !had_bits;
+    removed += !has_bits;
+    changed += had_bits && has_bits;
+    added_bits += d.added_bits();
+    removed_bits += d.removed_bits();
+    if (quiet) continue;
+    write_changes(d);
+    if (out.size() > (1 << 20)) {
+      writer.end_line();
+      fwrite(out.data(), 1, out.size(), stdout);
+      out.clear();
+    }
+  }
+  writer.end_line();
+  fwrite(out.data(), 1, out.size(), stdout);
+
+  if (patch_file) {
+    FILE *const patch = fopen(patch_file, "wb");
+    if (!patch) {
+      perror(patch_file);
+      return 2;
+    }
+    fasm::Writer patch_writer(patch, fasm::WriteStyle::kCanonical);
+    for (const fasm::FeatureDiff &d : diffs) {
+      patch_writer.add_wide_feature(d.feature, d.min_bit, d.width,
+                                    d.new_bits.data());
+    }
+    if (!patch_writer.flush() || fclose(patch) != 0) {
+      perror("Writing patch failed");
+      return 2;
+    }
+  }
+
+  constexpr float MiBFactor = 1e6 / (1 << 20);
+  fprintf(stderr,
+          "%" PRIu64 " features added, %" PRIu64 " removed, %" PRIu64
+          " changed; %" PRIu64 " bits added, %" PRIu64 " removed.\n"
+          "%d thread%s. %.3fs wall time. %.1f MiB/s\n",
+          added, removed, changed, added_bits, removed_bits, threads,
+          threads > 1 ? "s" : "", duration_us / 1e6,
+          1.0f * (old_content.size() + new_content.size()) / duration_us *
+              MiBFactor);
+  if (result > fasm::ParseResult::kNonCritical) return 2;
+  return diffs.empty() ? 0 : 1;
+}
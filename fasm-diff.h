@@ -0,0 +1,292 @@
+// Copyright 2022 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Semantic difference of two FASM files: which bits of which features are
+// set, independent of line order, formatting, number base and how ranges
+// are split into lines.
+
+#ifndef SIMPLE_FASM_DIFF_H
+#define SIMPLE_FASM_DIFF_H
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <string_view>
+#include <vector>
+
+#include "fasm-feature-table.h"
+#include "fasm-parse.h"
+
+namespace fasm {
+// A feature with different bits set in the two files. Bits are relative to
+// "min_bit", which together with "width" covers the bits set in either.
+struct FeatureDiff {
+  std::string_view feature;  // Points into one of the contents.
+  int min_bit;
+  int width;
+  std::vector<uint64_t> old_bits;  // (width + 63) / 64 words, LSB first.
+  std::vector<uint64_t> new_bits;
+
+  // Bits set in the new file but not in the old and vice versa.
+  uint64_t added_bits() const;
+  uint64_t removed_bits() const;
+};
+
+// Compare bits set in "old_content" and "new_content", both parsed in
+// parallel with "thread_count" threads. Bits assigned 0 are the same as not
+// mentioned; if a bit is assigned on several lines, the last one counts.
+// So appending the new values of all differences to the old content gives
+// the same as the new content. Features are hashed into partitions, which
+// are then compared in parallel. Differences are added to "result" sorted
+// by feature name.
+// Parse issues are reported to "errstream"; the most severe is returned.
+inline ParseResult diff(std::string_view old_content,
+                        std::string_view new_content, int thread_count,
+                        FILE *errstream, std::vector<FeatureDiff> *result,
+                        const Executor &executor = {});
+
+// -- End of API interface; rest is implementation details
+
+inline uint64_t FeatureDiff::added_bits() const {
+  uint64_t count = 0;
+  for (size_t i = 0; i < new_bits.size(); ++i) {
+    count += __builtin_popcountll(new_bits[i] & ~old_bits[i]);
+  }
+  return count;
+}
+
+inline uint64_t FeatureDiff::removed_bits() const {
+  uint64_t count = 0;
+  for (size_t i = 0; i < old_bits.size(); ++i) {
+    count += __builtin_popcountll(old_bits[i] & ~new_bits[i]);
+  }
+  return count;
+}
+
+namespace internal {
+// Value of one feature line, or slice of it if wider than 64 bits.
+struct DiffRecord {
+  uint64_t hash;
+  const char *name;
+  uint64_t bits;
+  uint32_t name_size;
+  uint32_t start_bit;
+  uint32_t line;
+  uint32_t width;
+
+  std::string_view feature() const { return {name, name_size}; }
+};
+
+// Records of one file, one bucket per worker and partition.
+using DiffBuckets = std::vector<std::vector<std::vector<DiffRecord>>>;
+
+// Sorted indices of bits set by the records of one feature, applied in
+// line order.
+inline void collect_set_bits(DiffRecord *begin, DiffRecord *end,
+                             std::vector<uint32_t> *out) {
+  out->clear();
+  if (end - begin == 1) {  // Most common: feature on one line.
+    for (uint64_t bits = begin->bits; bits; bits &= bits - 1) {
+      out->push_back(begin->start_bit + __builtin_ctzll(bits));
+    }
+    return;
+  }
+  std::sort(begin, end, [](const DiffRecord &a, const DiffRecord &b) {
+    return a.line != b.line ? a.line < b.line : a.start_bit < b.start_bit;
+  });
+  uint32_t low = ~0u, high = 0;
+  for (const DiffRecord *r = begin; r < end; ++r) {
+    low = std::min(low, r->start_bit);
+    high = std::max(high, r->start_bit + r->width - 1);
+  }
+
+  // Bit indices are at most 16 bits, so a bitmap of the span is small.
+  // One more word, so that values crossing a word boundary always fit.
+  std::vector<uint64_t> words((high - low) / 64 + 2);
+  for (const DiffRecord *r = begin; r < end; ++r) {
+    const uint64_t mask = uint64_t(-1) >> (64 - r->width);
+    const uint32_t pos = r->start_bit - low;
+    const uint32_t shift = pos % 64;
+    uint64_t *const word = &words[pos / 64];
+    word[0] = (word[0] & ~(mask << shift)) | (r->bits << shift);
+    if (shift != 0 && shift + r->width > 64) {
+      word[1] =
+          (word[1] & ~(mask >> (64 - shift))) | (r->bits >> (64 - shift));
+    }
+  }
+  for (size_t i = 0; i < words.size(); ++i) {
+    for (uint64_t bits = words[i]; bits; bits &= bits - 1) {
+      out->push_back(low + 64 * i + __builtin_ctzll(bits));
+    }
+  }
+}
+
+// Compare the records of one partition of both files.
+inline void diff_partition(std::vector<DiffRecord> *old_records,
+                           std::vector<DiffRecord> *new_records,
+                           std::vector<FeatureDiff> *result) {
+  const auto by_feature = [](const DiffRecord &a, const DiffRecord &b) {
+    if (a.hash != b.hash) return a.hash < b.hash;
+    return a.feature() < b.feature();
+  };
+  // Sorting by hash first is much faster, as the same feature on many lines
+  // would otherwise compare names. Only hash collisions need names sorted.
+  for (std::vector<DiffRecord> *records : {old_records, new_records}) {
+    std::sort(records->begin(), records->end(),
+              [](const DiffRecord &a, const DiffRecord &b) {
+                return a.hash < b.hash;
+              });
+    for (auto run = records->begin(); run != records->end(); /**/) {
+      auto run_end = run + 1;
+      bool same_name = true;
+      for (/**/; run_end != records->end() && run_end->hash == run->hash;
+           ++run_end) {
+        same_name &= run_end->feature() == run->feature();
+      }
+      if (!same_name) std::sort(run, run_end, by_feature);
+      run = run_end;
+    }
+  }
+
+  const auto group_end = [&](DiffRecord *begin, DiffRecord *end) {
+    DiffRecord *it = begin;
+    while (it < end && !by_feature(*begin, *it)) ++it;
+    return it;
+  };
+  DiffRecord *old_it = old_records->data();
+  DiffRecord *const old_end = old_it + old_records->size();
+  DiffRecord *new_it = new_records->data();
+  DiffRecord *const new_end = new_it + new_records->size();
+  std::vector<uint32_t> old_set, new_set;
+  while (old_it < old_end || new_it < new_end) {
+    // Next feature in sort order from either side.
+    const bool take_old = old_it < old_end &&
+                          (new_it == new_end || !by_feature(*new_it, *old_it));
+    const bool take_new = new_it < new_end &&
+                          (old_it == old_end || !by_feature(*old_it, *new_it));
+    DiffRecord *const old_group = take_old ? group_end(old_it, old_end)
+                                           : old_it;
+    DiffRecord *const new_group = take_new ? group_end(new_it, new_end)
+                                           : new_it;
+    collect_set_bits(old_it, old_group, &old_set);
+    collect_set_bits(new_it, new_group, &new_set);
+    if (old_set != new_set) {
+      FeatureDiff d;
+      d.feature = take_old ? old_it->feature() : new_it->feature();
+      const uint32_t min_bit =
+          std::min(old_set.empty() ? ~0u : old_set.front(),
+                   new_set.empty() ? ~0u : new_set.front());
+      const uint32_t max_bit = std::max(old_set.empty() ? 0 : old_set.back(),
+                                        new_set.empty() ? 0 : new_set.back());
+      d.min_bit = min_bit;
+      d.width = max_bit - min_bit + 1;
+      d.old_bits.resize((d.width + 63) / 64);
+      d.new_bits.resize((d.width + 63) / 64);
+      for (const uint32_t bit : old_set) {
+        const uint32_t pos = bit - min_bit;
+        d.old_bits[pos / 64] |= uint64_t(1) << (pos % 64);
+      }
+      for (const uint32_t bit : new_set) {
+        const uint32_t pos = bit - min_bit;
+        d.new_bits[pos / 64] |= uint64_t(1) << (pos % 64);
+      }
+      result->push_back(std::move(d));
+    }
+    old_it = old_group;
+    new_it = new_group;
+  }
+}
+}  // namespace internal
+
+inline ParseResult diff(std::string_view old_content,
+                        std::string_view new_content, int thread_count,
+                        FILE *errstream, std::vector<FeatureDiff> *result,
+                        const Executor &executor) {
+  thread_count = std::max(thread_count, 1);
+  // Partitions small enough to be sorted in cache.
+  const int partitions = 16 * thread_count;
+
+  // Chunks of both files, parsed by whichever worker is free.
+  std::vector<ContentChunk> chunks[2];
+  const std::string_view contents[2] = {old_content, new_content};
+  for (int f = 0; f < 2; ++f) {
+    const std::string_view content = contents[f];
+    if (content.empty()) continue;
+    if (content.back() != '\n') {
+      chunks[f].push_back({content, 1});  // parse() deals with the last line
+    } else {
+      chunks[f] = split_lines(
+          content, balanced_chunk_count(content.size(), thread_count),
+          thread_count, executor);
+    }
+  }
+  const int old_chunk_count = chunks[0].size();
+  internal::DiffBuckets buckets[2];
+  for (auto &b : buckets) {
+    b.resize(thread_count, std::vector<std::vector<internal::DiffRecord>>(
+                               partitions));
+  }
+  std::vector<ParseResult> worker_results(thread_count, ParseResult::kSuccess);
+  run_balanced(
+      chunks[0].size() + chunks[1].size(), thread_count,
+      [&](int worker, int task) {
+        const int f = task < old_chunk_count ? 0 : 1;
+        const ContentChunk &chunk =
+            chunks[f][f == 0 ? task : task - old_chunk_count];
+        auto &partition = buckets[f][worker];
+        const ParseResult r = parse(
+            chunk, errstream,
+            [&](uint32_t line, std::string_view feature, int start_bit,
+                int width, uint64_t bits) {
+              const uint64_t hash = FeatureTable::hash(feature);
+              partition[hash % partitions].push_back(
+                  {hash, feature.data(), bits, uint32_t(feature.size()),
+                   uint32_t(start_bit), line, uint32_t(width)});
+              return true;
+            });
+        worker_results[worker] = std::max(worker_results[worker], r);
+      },
+      executor);
+
+  // Each partition compared by one worker.
+  std::vector<std::vector<FeatureDiff>> partition_diffs(partitions);
+  run_balanced(
+      partitions, thread_count,
+      [&](int, int p) {
+        std::vector<internal::DiffRecord> records[2];
+        for (int f = 0; f < 2; ++f) {
+          for (auto &worker_buckets : buckets[f]) {
+            std::vector<internal::DiffRecord> &bucket = worker_buckets[p];
+            records[f].insert(records[f].end(), bucket.begin(), bucket.end());
+            std::vector<internal::DiffRecord>().swap(bucket);
+          }
+        }
+        internal::diff_partition(&records[0], &records[1], &partition_diffs[p]);
+      },
+      executor);
+
+  const size_t first_new = result->size();
+  for (auto &diffs : partition_diffs) {
+    std::move(diffs.begin(), diffs.end(), std::back_inserter(*result));
+  }
+  std::sort(result->begin() + first_new, result->end(),
+            [](const FeatureDiff &a, const FeatureDiff &b) {
+              return a.feature < b.feature;
+            });
+  return *std::max_element(worker_results.begin(), worker_results.end());
+}
+}  // namespace fasm
+#endif  // SIMPLE_FASM_DIFF_H
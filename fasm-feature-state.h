@@ -0,0 +1,346 @@
+// Copyright 2022 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Merged state of all features of a file, collected while parsing in
+// parallel, noticing bits that are assigned more than once.
+
+#ifndef SIMPLE_FASM_FEATURE_STATE_H
+#define SIMPLE_FASM_FEATURE_STATE_H
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+#include "fasm-feature-table.h"
+#include "fasm-parse.h"
+
+namespace fasm {
+// The same bits of a feature assigned on two lines. If the values differ,
+// it is a conflict, otherwise a duplicate.
+struct FeatureConflict {
+  std::string_view feature;
+  int start_bit;  // Bits assigned on both lines.
+  int width;
+  uint32_t first_line;  // Earlier line and its value of these bits.
+  uint64_t first_bits;
+  uint32_t second_line;
+  uint64_t second_bits;
+
+  bool conflicting() const { return first_bits != second_bits; }
+};
+
+// Print conflict as warning, duplicate as info, in the style of the
+// parser's messages.
+inline void print_conflict(FILE *out, const FeatureConflict &conflict);
+
+// Value and assigned bits of each feature, merged from all lines that
+// assign them, e.g. "FOO[3:0]" and "FOO[7:4]". If bits are assigned more
+// than once, the last line counts and the overlap is recorded as
+// FeatureConflict.
+//
+// All functions are thread-safe, so the parse_callback() can be used with
+// parse_parallel() or from multiple workers of run_balanced(). Features are
+// distributed by hash over independently locked shards, so threads rarely
+// wait for each other. The result does not depend on the order lines are
+// added in.
+//
+// Feature names are not copied; the parsed content needs to outlive the
+// store.
+class FeatureStateStore {
+ public:
+  FeatureStateStore() = default;
+  FeatureStateStore(const FeatureStateStore &) = delete;
+  FeatureStateStore &operator=(const FeatureStateStore &) = delete;
+
+  // Record the assignment of "width" (up to 64) bits starting at
+  // "start_bit", as received by the ParseCallback. Always returns true.
+  bool add(uint32_t line, std::string_view feature, int start_bit, int width,
+           uint64_t bits);
+
+  // Parse callback adding each feature.
+  auto parse_callback() {
+    return [this](uint32_t line, std::string_view feature, int start_bit,
+                  int width, uint64_t bits) {
+      return add(line, feature, start_bit, width, bits);
+    };
+  }
+
+  // Parse callback adding the feature before passing it on to
+  // "parse_callback".
+  template <typename ParseCallbackT>
+  auto wrap(ParseCallbackT &&parse_callback) {
+    return [this, parse_callback](uint32_t line, std::string_view feature,
+                                  int start_bit, int width,
+                                  uint64_t bits) mutable {
+      add(line, feature, start_bit, width, bits);
+      return parse_callback(line, feature, start_bit, width, bits);
+    };
+  }
+
+  // Get merged value of "width" (up to 64) bits of "feature" starting at
+  // "start_bit", and if "assigned" is given, which of them were assigned
+  // on any line. Returns false if the feature was never assigned.
+  bool value(std::string_view feature, int start_bit, int width,
+             uint64_t *bits, uint64_t *assigned = nullptr) const;
+
+  // Number of distinct features.
+  size_t size() const;
+
+  // All conflicts and duplicates found, sorted by line.
+  std::vector<FeatureConflict> conflicts() const;
+
+ private:
+  static constexpr uint32_t kNone = ~uint32_t(0);
+
+  struct Assignment {
+    uint64_t bits;
+    uint32_t line;
+    uint32_t next;  // Previous assignment of the same feature, or kNone.
+    uint16_t start_bit;
+    uint8_t width;
+  };
+
+  struct Entry {
+    std::string_view name;
+    uint64_t hash;
+    uint64_t words[2] = {};  // Value and assigned mask of bits 0..63.
+    uint32_t wide = kNone;   // Index in Shard::wide for bits above.
+    uint32_t last_assignment = kNone;
+  };
+
+  struct alignas(64) Shard {
+    mutable std::mutex mutex;
+    std::vector<uint32_t> slots;  // Entry index + 1; 0 for empty.
+    std::vector<Entry> entries;
+    std::vector<Assignment> assignments;
+    // Value and assigned mask of each word from bit 64 on.
+    std::vector<std::vector<uint64_t>> wide;
+    std::vector<FeatureConflict> conflicts;
+
+    uint32_t find(std::string_view name, uint64_t hash) const;
+    uint32_t insert(std::string_view name, uint64_t hash);
+    uint64_t *words(Entry *entry, int word);
+    const uint64_t *words(const Entry &entry, int word) const;
+    uint64_t record_overlaps(const Entry &entry, uint32_t line, int start_bit,
+                             int width, uint64_t bits);
+  };
+
+  static constexpr int kShardBits = 6;
+
+  Shard &shard(uint64_t hash) { return shards_[hash >> (64 - kShardBits)]; }
+  const Shard &shard(uint64_t hash) const {
+    return shards_[hash >> (64 - kShardBits)];
+  }
+
+  Shard shards_[1 << kShardBits];
+};
+
+// -- End of API interface; rest is implementation details
+
+inline void print_conflict(FILE *out, const FeatureConflict &c) {
+  char range[16];
+  if (c.width == 1) {
+    snprintf(range, sizeof(range), "[%d]", c.start_bit);
+  } else {
+    snprintf(range, sizeof(range), "[%d:%d]", c.start_bit + c.width - 1,
+             c.start_bit);
+  }
+  const int feature_len = c.feature.size();
+  const char *const feature = c.feature.data();
+  if (c.conflicting()) {
+    fprintf(out,
+            "%u: WARN %.*s%s = %d'h%" PRIx64 " conflicts with line %u: "
+            "%d'h%" PRIx64 "\n",
+            c.second_line, feature_len, feature, range, c.width,
+            c.second_bits, c.first_line, c.width, c.first_bits);
+  } else {
+    fprintf(out, "%u: INFO %.*s%s already assigned in line %u\n",
+            c.second_line, feature_len, feature, range, c.first_line);
+  }
+}
+
+inline uint32_t FeatureStateStore::Shard::find(std::string_view name,
+                                               uint64_t hash) const {
+  if (slots.empty()) return kNone;
+  const size_t mask = slots.size() - 1;
+  for (size_t i = hash & mask; slots[i] != 0; i = (i + 1) & mask) {
+    const Entry &entry = entries[slots[i] - 1];
+    if (entry.hash == hash && entry.name == name) return slots[i] - 1;
+  }
+  return kNone;
+}
+
+inline uint32_t FeatureStateStore::Shard::insert(std::string_view name,
+                                                 uint64_t hash) {
+  if (2 * (entries.size() + 1) > slots.size()) {
+    slots.assign(std::max<size_t>(256, 2 * slots.size()), 0);
+    const size_t mask = slots.size() - 1;
+    for (uint32_t e = 0; e < entries.size(); ++e) {
+      size_t i = entries[e].hash & mask;
+      while (slots[i]) i = (i + 1) & mask;
+      slots[i] = e + 1;
+    }
+  }
+  const size_t mask = slots.size() - 1;
+  size_t i = hash & mask;
+  while (slots[i]) i = (i + 1) & mask;
+  entries.push_back({name, hash});
+  slots[i] = entries.size();
+  return entries.size() - 1;
+}
+
+inline uint64_t *FeatureStateStore::Shard::words(Entry *entry, int word) {
+  if (word == 0) return entry->words;
+  if (entry->wide == kNone) {
+    entry->wide = wide.size();
+    wide.emplace_back();
+  }
+  std::vector<uint64_t> &words = wide[entry->wide];
+  if (words.size() < 2 * size_t(word)) words.resize(2 * word);
+  return &words[2 * (word - 1)];
+}
+
+inline const uint64_t *FeatureStateStore::Shard::words(const Entry &entry,
+                                                       int word) const {
+  if (word == 0) return entry.words;
+  if (entry.wide == kNone || wide[entry.wide].size() < 2 * size_t(word)) {
+    return nullptr;
+  }
+  return &wide[entry.wide][2 * (word - 1)];
+}
+
+// Record overlaps of the new assignment with all earlier added ones, and
+// return the mask of its bits not overridden by a later line.
+inline uint64_t FeatureStateStore::Shard::record_overlaps(
+    const Entry &entry, uint32_t line, int start_bit, int width,
+    uint64_t bits) {
+  uint64_t apply = uint64_t(-1) >> (64 - width);
+  for (uint32_t a = entry.last_assignment; a != kNone;
+       a = assignments[a].next) {
+    const Assignment &other = assignments[a];
+    const int low = std::max<int>(start_bit, other.start_bit);
+    const int high =
+        std::min<int>(start_bit + width, other.start_bit + other.width);
+    if (low >= high) continue;
+    const uint64_t mask = uint64_t(-1) >> (64 - (high - low));
+    const uint64_t mine = (bits >> (low - start_bit)) & mask;
+    const uint64_t theirs = (other.bits >> (low - other.start_bit)) & mask;
+    if (other.line <= line) {
+      conflicts.push_back({entry.name, low, high - low, other.line, theirs,
+                           line, mine});
+    } else {
+      conflicts.push_back({entry.name, low, high - low, line, mine,
+                           other.line, theirs});
+      apply &= ~(mask << (low - start_bit));
+    }
+  }
+  return apply;
+}
+
+inline bool FeatureStateStore::add(uint32_t line, std::string_view feature,
+                                   int start_bit, int width, uint64_t bits) {
+  const uint64_t full = uint64_t(-1) >> (64 - width);
+  bits &= full;
+  const uint64_t hash = FeatureTable::hash(feature);
+  Shard &s = shard(hash);
+  const std::lock_guard<std::mutex> lock(s.mutex);
+  uint32_t e = s.find(feature, hash);
+  if (e == kNone) e = s.insert(feature, hash);
+  Entry &entry = s.entries[e];
+
+  // The assignment covers one word, or two if it crosses a word boundary.
+  const int word = start_bit / 64;
+  const int shift = start_bit % 64;
+  const bool crossing = shift != 0 && shift + width > 64;
+  uint64_t *const low = s.words(&entry, word);
+  bool overlap = (low[1] & (full << shift)) != 0;
+  if (crossing) {
+    overlap |= (s.words(&entry, word + 1)[1] & (full >> (64 - shift))) != 0;
+  }
+  const uint64_t apply =
+      overlap ? s.record_overlaps(entry, line, start_bit, width, bits) : full;
+  for (int i = 0; i < (crossing ? 2 : 1); ++i) {
+    // Pointer from words() might have been invalidated by the second call.
+    uint64_t *const w = s.words(&entry, word + i);
+    const uint64_t mask = i == 0 ? full << shift : full >> (64 - shift);
+    const uint64_t value = i == 0 ? bits << shift : bits >> (64 - shift);
+    const uint64_t take = i == 0 ? apply << shift : apply >> (64 - shift);
+    w[0] = (w[0] & ~take) | (value & take);
+    w[1] |= mask;
+  }
+  s.assignments.push_back({bits, line, entry.last_assignment,
+                           uint16_t(start_bit), uint8_t(width)});
+  entry.last_assignment = s.assignments.size() - 1;
+  return true;
+}
+
+inline bool FeatureStateStore::value(std::string_view feature, int start_bit,
+                                     int width, uint64_t *bits,
+                                     uint64_t *assigned) const {
+  const uint64_t hash = FeatureTable::hash(feature);
+  const Shard &s = shard(hash);
+  const std::lock_guard<std::mutex> lock(s.mutex);
+  const uint32_t e = s.find(feature, hash);
+  if (e == kNone) return false;
+  const int word = start_bit / 64;
+  const int shift = start_bit % 64;
+  const uint64_t *const low = s.words(s.entries[e], word);
+  const uint64_t *const high = shift != 0 && shift + width > 64
+                                   ? s.words(s.entries[e], word + 1)
+                                   : nullptr;
+  uint64_t result[2];
+  for (int i = 0; i < 2; ++i) {
+    result[i] = low ? low[i] >> shift : 0;
+    if (high) result[i] |= high[i] << (64 - shift);
+    result[i] &= uint64_t(-1) >> (64 - width);
+  }
+  *bits = result[0];
+  if (assigned) *assigned = result[1];
+  return true;
+}
+
+inline size_t FeatureStateStore::size() const {
+  size_t result = 0;
+  for (const Shard &s : shards_) {
+    const std::lock_guard<std::mutex> lock(s.mutex);
+    result += s.entries.size();
+  }
+  return result;
+}
+
+inline std::vector<FeatureConflict> FeatureStateStore::conflicts() const {
+  std::vector<FeatureConflict> result;
+  for (const Shard &s : shards_) {
+    const std::lock_guard<std::mutex> lock(s.mutex);
+    result.insert(result.end(), s.conflicts.begin(), s.conflicts.end());
+  }
+  std::sort(result.begin(), result.end(),
+            [](const FeatureConflict &a, const FeatureConflict &b) {
+              if (a.second_line != b.second_line) {
+                return a.second_line < b.second_line;
+              }
+              if (a.first_line != b.first_line) {
+                return a.first_line < b.first_line;
+              }
+              return a.start_bit < b.start_bit;
+            });
+  return result;
+}
+}  // namespace fasm
+#endif  // SIMPLE_FASM_FEATURE_STATE_H
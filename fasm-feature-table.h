@@ -0,0 +1,479 @@
+// Copyright 2022 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Interning of feature names and their hierarchy prefixes into dense integer
+// IDs while parsing.
+
+#ifndef SIMPLE_FASM_FEATURE_TABLE_H
+#define SIMPLE_FASM_FEATURE_TABLE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "fasm-parse.h"
+
+namespace fasm {
+// Thread-safe table assigning dense IDs 0, 1, 2, ... to feature names. The
+// same name always gets the same ID, no matter which thread asks first, so
+// it can be shared between threads in parse_parallel().
+//
+// Names are copied into the table, so it can outlive the parsed content.
+// Looking up the name of an ID does not need any locking.
+class FeatureTable {
+ public:
+  static constexpr uint32_t kNotFound = ~uint32_t(0);
+
+  FeatureTable();
+  ~FeatureTable();
+  FeatureTable(const FeatureTable &) = delete;
+  FeatureTable &operator=(const FeatureTable &) = delete;
+
+  // Hash function used by the table. Can be precomputed by callers to
+  // be used in intern() or find() or their own hash tables.
+  static uint64_t hash(std::string_view name);
+
+  // Return ID of "name", assigning the next free ID if not seen yet.
+  // Names already in the table are found without locking.
+  uint32_t intern(std::string_view name) { return intern(name, hash(name)); }
+  uint32_t intern(std::string_view name, uint64_t hash);
+
+  // Return ID of "name" or kNotFound if not known. Does not lock.
+  uint32_t find(std::string_view name) const { return find(name, hash(name)); }
+  uint32_t find(std::string_view name, uint64_t hash) const;
+
+  // Reverse lookup: name of given ID, which must have been returned by
+  // intern() before.
+  std::string_view name(uint32_t id) const {
+    return blocks_[id >> kBlockBits].load(std::memory_order_acquire)
+        [id & (kBlockSize - 1)];
+  }
+
+  // Number of IDs assigned. If other threads are interning concurrently, the
+  // names of the most recent IDs might not be available yet.
+  uint32_t size() const { return next_id_.load(std::memory_order_acquire); }
+
+ private:
+  // Reverse lookup table: blocks of names, allocated as needed.
+  static constexpr int kBlockBits = 16;
+  static constexpr uint32_t kBlockSize = 1 << kBlockBits;
+  static constexpr int kMaxBlocks = 1 << 12;  // Up to 268M features.
+
+  // The name to ID map is split in shards, selected by upper hash bits, to
+  // reduce lock contention between inserting threads. Each is an open
+  // addressing hash table storing the hash alongside, so that it never needs
+  // to be recomputed, and name comparisons only happen if the hash matches.
+  //
+  // Readers probe without lock: a slot is published by storing its id last,
+  // and a grown slot array replaces the old one, which is kept alive until
+  // the table is destroyed. A reader still looking at an old array might
+  // miss a recent insert; intern() then retries under the lock.
+  static constexpr int kShardBits = 6;
+  // The name is stored in the slot as well to not need an indirection
+  // through the reverse lookup table when comparing.
+  struct Slot {
+    std::atomic<uint64_t> hash{0};
+    std::atomic<const char *> name{nullptr};
+    std::atomic<uint32_t> name_len{0};
+    std::atomic<uint32_t> id{kNotFound};  // kNotFound: empty slot.
+  };
+  struct SlotArray {
+    explicit SlotArray(size_t size) : mask(size - 1), slots(new Slot[size]) {}
+    const size_t mask;
+    const std::unique_ptr<Slot[]> slots;
+  };
+  struct Shard {
+    std::atomic<SlotArray *> slots{nullptr};
+    std::mutex lock;  // Everything below is guarded by it.
+    std::vector<std::unique_ptr<SlotArray>> all_slot_arrays;
+    size_t used = 0;
+    // Storage for the copied names.
+    std::vector<std::unique_ptr<char[]>> name_storage;
+    char *storage_pos = nullptr;
+    size_t storage_left = 0;
+  };
+
+  // Slot with "name" or the empty slot to insert it.
+  Slot &find_slot(const SlotArray &array, std::string_view name,
+                  uint64_t hash) const;
+  std::string_view copy_name(Shard *shard, std::string_view name);
+  static void grow(Shard *shard);
+
+  std::atomic<uint32_t> next_id_{0};
+  std::unique_ptr<std::atomic<std::string_view *>[]> blocks_;
+  std::mutex block_allocation_lock_;
+  Shard shards_[1 << kShardBits];
+};
+
+// Feature as passed to callbacks wrapped with with_interning().
+struct InternedFeature {
+  std::string_view name;
+  uint32_t id;    // Dense ID in the FeatureTable.
+  uint64_t hash;  // FeatureTable::hash(name)
+};
+
+// Wrap a callback with the signature
+//   bool(uint32_t line, const InternedFeature &feature, int start_bit,
+//        int width, uint64_t bits)
+// so that it can be used as ParseCallback, with every feature interned in
+// "table". The returned callback can be used with parse(), parse_parallel()
+// or StreamParser.
+template <typename InternedCallbackT>
+inline auto with_interning(FeatureTable *table, InternedCallbackT &&callback);
+
+// Trie of feature name hierarchies, e.g. "TILE_X1Y2.SLICEL_X0.ALUT.INIT"
+// is the node "INIT" below "ALUT" below "SLICEL_X0" below "TILE_X1Y2" below
+// the root. Node IDs are dense, so consumers can keep per-node data, such as
+// the state of a tile, in arrays. Thread-safe like FeatureTable.
+class FeatureTrie {
+ public:
+  static constexpr uint32_t kRoot = 0;
+  static constexpr uint32_t kNotFound = FeatureTable::kNotFound;
+
+  FeatureTrie();
+
+  // Return node of "segment" below "parent", creating it if needed.
+  uint32_t child(uint32_t parent, std::string_view segment) {
+    return nodes_.intern(NodeKey(parent, segment).key());
+  }
+
+  // Return node of "segment" below "parent" or kNotFound.
+  uint32_t find_child(uint32_t parent, std::string_view segment) const {
+    return nodes_.find(NodeKey(parent, segment).key());
+  }
+
+  // Parent of "node"; kNotFound for the root.
+  uint32_t parent(uint32_t node) const;
+
+  // Name segment of "node"; empty for the root.
+  std::string_view segment(uint32_t node) const {
+    return nodes_.name(node).substr(sizeof(uint32_t));
+  }
+
+  // Full dot-separated name of "node".
+  std::string path(uint32_t node) const;
+
+  // Number of nodes including the root.
+  uint32_t size() const { return nodes_.size(); }
+
+ private:
+  // Nodes are interned with the parent ID prepended to the segment.
+  class NodeKey {
+   public:
+    NodeKey(uint32_t parent, std::string_view segment);
+    std::string_view key() const { return key_; }
+
+   private:
+    char buffer_[256];
+    std::string long_key_;  // Only used if segment does not fit in buffer.
+    std::string_view key_;
+  };
+
+  FeatureTable nodes_;
+};
+
+// Resolves segmented feature names as reported by parse_segmented() to nodes
+// in a FeatureTrie. Remembers the nodes of the previous feature, so that
+// consecutive features in the same tile or site only look up the segments
+// that differ; the shared prefix is found by comparing it to the previous
+// name. Recently looked up children are kept in a small cache as well.
+// Not thread-safe: use one per thread, e.g. per chunk in parallel parsing,
+// all sharing the same trie.
+class PrefixCache {
+ public:
+  explicit PrefixCache(FeatureTrie *trie) : trie_(trie) {}
+
+  // Return node of the full feature name. Afterwards, node(i) returns the
+  // node of feature.prefix(i).
+  uint32_t resolve(const FeatureSegments &feature);
+
+  uint32_t node(int i) const { return nodes_[i]; }
+
+ private:
+  uint32_t child(uint32_t parent, std::string_view segment);
+
+  FeatureTrie *const trie_;
+
+  // Direct-mapped cache of (parent, segment) -> child.
+  static constexpr int kChildCacheBits = 10;
+  struct ChildCacheEntry {
+    uint64_t hash;
+    uint32_t parent;
+    uint32_t node = FeatureTrie::kNotFound;
+  };
+  std::unique_ptr<ChildCacheEntry[]> child_cache_{
+      new ChildCacheEntry[1 << kChildCacheBits]};
+
+  std::string previous_name_;
+  int previous_count_ = 0;
+  uint32_t previous_end_[FeatureSegments::kMaxSegments];
+  uint32_t nodes_[FeatureSegments::kMaxSegments];
+};
+
+// -- End of API interface; rest is implementation details
+
+inline FeatureTable::FeatureTable()
+    : blocks_(new std::atomic<std::string_view *>[kMaxBlocks]) {
+  for (int i = 0; i < kMaxBlocks; ++i) {
+    blocks_[i].store(nullptr, std::memory_order_relaxed);
+  }
+  for (Shard &shard : shards_) {
+    shard.all_slot_arrays.emplace_back(new SlotArray(64));
+    shard.slots.store(shard.all_slot_arrays.back().get(),
+                      std::memory_order_release);
+  }
+}
+
+inline FeatureTable::~FeatureTable() {
+  for (int i = 0; i < kMaxBlocks; ++i) {
+    delete[] blocks_[i].load(std::memory_order_relaxed);
+  }
+}
+
+inline uint64_t FeatureTable::hash(std::string_view name) {
+  // Simple multiply-xorshift over 8 bytes at a time; good enough for
+  // feature names and much faster than byte-wise hashing.
+  constexpr uint64_t kMul = 0x9E3779B97F4A7C15;
+  uint64_t h = name.size() * kMul;
+  const char *it = name.data();
+  const char *const end = it + name.size();
+  for (/**/; end - it >= 8; it += 8) {
+    uint64_t word;
+    memcpy(&word, it, sizeof(word));
+    h = (h ^ word) * kMul;
+    h ^= h >> 29;
+  }
+  if (it < end) {
+    // Remaining bytes: fixed-size loads instead of a variable size memcpy().
+    // Names of at least 8 bytes re-read overlapping bytes of the last word.
+    uint64_t word = 0;
+    if (name.size() >= 8) {
+      memcpy(&word, end - 8, sizeof(word));
+    } else {
+      for (/**/; it < end; ++it) {
+        word = (word << 8) | uint8_t(*it);
+      }
+    }
+    h = (h ^ word) * kMul;
+    h ^= h >> 29;
+  }
+  h *= kMul;
+  return h ^ (h >> 32);
+}
+
+inline FeatureTable::Slot &FeatureTable::find_slot(const SlotArray &array,
+                                                  std::string_view name,
+                                                  uint64_t hash) const {
+  for (size_t pos = hash & array.mask; /**/; pos = (pos + 1) & array.mask) {
+    Slot &slot = array.slots[pos];
+    const uint32_t id = slot.id.load(std::memory_order_acquire);
+    if (id == kNotFound) {
+      return slot;
+    }
+    if (slot.hash.load(std::memory_order_relaxed) == hash &&
+        slot.name_len.load(std::memory_order_relaxed) == name.size() &&
+        memcmp(slot.name.load(std::memory_order_relaxed), name.data(),
+               name.size()) == 0) {
+      return slot;
+    }
+  }
+}
+
+inline uint32_t FeatureTable::find(std::string_view name,
+                                   uint64_t hash) const {
+  const Shard &shard = shards_[hash >> (64 - kShardBits)];
+  const SlotArray &array = *shard.slots.load(std::memory_order_acquire);
+  return find_slot(array, name, hash).id.load(std::memory_order_acquire);
+}
+
+inline uint32_t FeatureTable::intern(std::string_view name, uint64_t hash) {
+  const uint32_t found = find(name, hash);
+  if (found != kNotFound) {
+    return found;
+  }
+
+  Shard &shard = shards_[hash >> (64 - kShardBits)];
+  const std::lock_guard<std::mutex> l(shard.lock);
+  Slot &slot =
+      find_slot(*shard.slots.load(std::memory_order_relaxed), name, hash);
+  const uint32_t existing = slot.id.load(std::memory_order_relaxed);
+  if (existing != kNotFound) {
+    return existing;  // Inserted by other thread meanwhile.
+  }
+
+  const uint32_t id = next_id_.fetch_add(1, std::memory_order_acq_rel);
+  const uint32_t block = id >> kBlockBits;
+  if (block >= kMaxBlocks) {
+    fprintf(stderr, "FeatureTable: too many features\n");
+    abort();
+  }
+  std::string_view *names = blocks_[block].load(std::memory_order_acquire);
+  if (!names) {
+    const std::lock_guard<std::mutex> block_lock(block_allocation_lock_);
+    names = blocks_[block].load(std::memory_order_acquire);
+    if (!names) {
+      names = new std::string_view[kBlockSize];
+      blocks_[block].store(names, std::memory_order_release);
+    }
+  }
+  const std::string_view copy = copy_name(&shard, name);
+  names[id & (kBlockSize - 1)] = copy;
+
+  // Publish: id last, so that readers seeing it also see hash and name.
+  slot.hash.store(hash, std::memory_order_relaxed);
+  slot.name.store(copy.data(), std::memory_order_relaxed);
+  slot.name_len.store(copy.size(), std::memory_order_relaxed);
+  slot.id.store(id, std::memory_order_release);
+  if (++shard.used * 2 > shard.all_slot_arrays.back()->mask + 1) {
+    grow(&shard);
+  }
+  return id;
+}
+
+inline std::string_view FeatureTable::copy_name(Shard *shard,
+                                                std::string_view name) {
+  constexpr size_t kStorageBlockSize = 1 << 16;
+  if (name.size() > shard->storage_left) {
+    const size_t size = std::max(kStorageBlockSize, name.size());
+    shard->name_storage.emplace_back(new char[size]);
+    shard->storage_pos = shard->name_storage.back().get();
+    shard->storage_left = size;
+  }
+  char *const copy = shard->storage_pos;
+  memcpy(copy, name.data(), name.size());
+  shard->storage_pos += name.size();
+  shard->storage_left -= name.size();
+  return {copy, name.size()};
+}
+
+inline void FeatureTable::grow(Shard *shard) {
+  const SlotArray &old_array = *shard->all_slot_arrays.back();
+  auto *array = new SlotArray(2 * (old_array.mask + 1));
+  for (size_t i = 0; i <= old_array.mask; ++i) {
+    const Slot &slot = old_array.slots[i];
+    const uint32_t id = slot.id.load(std::memory_order_relaxed);
+    if (id == kNotFound) continue;
+    const uint64_t hash = slot.hash.load(std::memory_order_relaxed);
+    size_t pos = hash & array->mask;
+    while (array->slots[pos].id.load(std::memory_order_relaxed) != kNotFound) {
+      pos = (pos + 1) & array->mask;
+    }
+    Slot &target = array->slots[pos];
+    target.hash.store(hash, std::memory_order_relaxed);
+    target.name.store(slot.name.load(std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+    target.name_len.store(slot.name_len.load(std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+    target.id.store(id, std::memory_order_relaxed);
+  }
+  // Old array stays alive: concurrent readers might still be probing it.
+  shard->all_slot_arrays.emplace_back(array);
+  shard->slots.store(array, std::memory_order_release);
+}
+
+inline FeatureTrie::FeatureTrie() {
+  nodes_.intern(NodeKey(kNotFound, "").key());
+}
+
+inline FeatureTrie::NodeKey::NodeKey(uint32_t parent,
+                                     std::string_view segment) {
+  char *key = buffer_;
+  const size_t key_size = sizeof(parent) + segment.size();
+  if (key_size > sizeof(buffer_)) {
+    long_key_.resize(key_size);
+    key = &long_key_[0];
+  }
+  memcpy(key, &parent, sizeof(parent));
+  memcpy(key + sizeof(parent), segment.data(), segment.size());
+  key_ = {key, key_size};
+}
+
+inline uint32_t FeatureTrie::parent(uint32_t node) const {
+  uint32_t result;
+  memcpy(&result, nodes_.name(node).data(), sizeof(result));
+  return result;
+}
+
+inline std::string FeatureTrie::path(uint32_t node) const {
+  std::string result;
+  for (/**/; node != kRoot; node = parent(node)) {
+    const std::string_view s = segment(node);
+    result.insert(0, s.data(), s.size());
+    if (parent(node) != kRoot) result.insert(0, 1, '.');
+  }
+  return result;
+}
+
+inline uint32_t PrefixCache::child(uint32_t parent,
+                                   std::string_view segment) {
+  const uint64_t hash = FeatureTable::hash(segment);
+  ChildCacheEntry &entry =
+      child_cache_[(hash ^ parent) & ((1 << kChildCacheBits) - 1)];
+  if (entry.hash != hash || entry.parent != parent ||
+      entry.node == FeatureTrie::kNotFound ||
+      trie_->segment(entry.node) != segment) {
+    entry.hash = hash;
+    entry.parent = parent;
+    entry.node = trie_->child(parent, segment);
+  }
+  return entry.node;
+}
+
+inline uint32_t PrefixCache::resolve(const FeatureSegments &feature) {
+  // Leading segments identical to the previous feature keep their nodes.
+  int same = 0;
+  uint32_t start = 0;
+  const int common_count = std::min(feature.count, previous_count_);
+  while (same < common_count && feature.end[same] == previous_end_[same] &&
+         memcmp(feature.name.data() + start, previous_name_.data() + start,
+                feature.end[same] - start) == 0) {
+    start = feature.end[same] + 1;
+    ++same;
+  }
+
+  uint32_t node = (same == 0) ? FeatureTrie::kRoot : nodes_[same - 1];
+  for (int i = same; i < feature.count; ++i) {
+    node = nodes_[i] = child(node, feature.segment(i));
+    previous_end_[i] = feature.end[i];
+  }
+  if (same < feature.count) {
+    previous_name_.assign(feature.name);
+  }
+  previous_count_ = feature.count;
+  return node;
+}
+
+template <typename InternedCallbackT>
+inline auto with_interning(FeatureTable *table, InternedCallbackT &&callback) {
+  return [table, callback = std::forward<InternedCallbackT>(callback)](
+             uint32_t line, std::string_view feature, int start_bit,
+             int width, uint64_t bits) mutable {
+    const uint64_t hash = FeatureTable::hash(feature);
+    const uint32_t id = table->intern(feature, hash);
+    return callback(line, InternedFeature{feature, id, hash}, start_bit, width,
+                    bits);
+  };
+}
+}  // namespace fasm
+#endif  // SIMPLE_FASM_FEATURE_TABLE_H
@@ -0,0 +1,113 @@
+// Copyright 2022 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Generate a synthetic segbits database for a grid of tiles and a fasm file
+// using its features, to test and benchmark the assembler.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cinttypes>
+#include <cstdint>
+
+constexpr int kDefaultColumns = 200;
+constexpr int kRows = 50;            // Tiles per column.
+constexpr int kFramesPerColumn = 36;
+constexpr int kTileBits = 64;        // Bits of each tile in a frame.
+constexpr int kFrameBits = 101 * 32; // Some spare bits at the end.
+constexpr int kSlices = 2;
+constexpr int kLuts = 4;
+
+int usage(const char *progname) {
+  fprintf(stderr,
+          "usage: %s <segbits-out> <fasm-out> [<columns>]\n"
+          "Grid of <columns> x %d tiles; default %d columns.\n"
+          "Frames have %d bits.\n",
+          progname, kRows, kDefaultColumns, kFrameBits);
+  return 1;
+}
+
+// Frame and bit in frame of bit number "n" of tile x, y; "prefix" is '!'
+// for bits to be cleared.
+void PrintFrameBit(FILE *out, const char *prefix, int x, int y, int n) {
+  fprintf(out, " %s%d_%d", prefix, x * kFramesPerColumn + n / kTileBits,
+          y * kTileBits + n % kTileBits);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3 || argc > 4) {
+    return usage(argv[0]);
+  }
+  const int columns = (argc == 4) ? atoi(argv[3]) : kDefaultColumns;
+  if (columns <= 0) {
+    return usage(argv[0]);
+  }
+  FILE *segbits = fopen(argv[1], "w");
+  FILE *fasm = fopen(argv[2], "w");
+  if (!segbits || !fasm) {
+    perror("Can't open output");
+    return 1;
+  }
+
+  srand(42); // Make 'random' numbers repeatable.
+
+  // Per tile: LUT INIT bits, one flip-flop init bit and a two-bit output mux
+  // per LUT, using multiple frame bits and cleared bits like real databases.
+  constexpr int kLutInitBits = kSlices * kLuts * 64;
+  for (int x = 0; x < columns; ++x) {
+    for (int y = 0; y < kRows; ++y) {
+      for (int s = 0; s < kSlices; ++s) {
+        for (int l = 0; l < kLuts; ++l) {
+          const int lut = s * kLuts + l;
+          const char lut_name = 'A' + l;
+          for (int b = 0; b < 64; ++b) {
+            fprintf(segbits, "TILE_X%dY%d.SLICE_X%d.%cLUT.INIT[%02d]", x, y,
+                    s, lut_name, b);
+            PrintFrameBit(segbits, "", x, y, lut * 64 + b);
+            fprintf(segbits, "\n");
+          }
+          fprintf(segbits, "TILE_X%dY%d.SLICE_X%d.%cFF.ZINI", x, y, s,
+                  lut_name);
+          PrintFrameBit(segbits, "", x, y, kLutInitBits + lut);
+          fprintf(segbits, "\n");
+          for (int m = 0; m < 2; ++m) {
+            const int mux_bit = kLutInitBits + 16 + 2 * lut;
+            fprintf(segbits, "TILE_X%dY%d.SLICE_X%d.%cOUTMUX.%s", x, y, s,
+                    lut_name, m ? "O6" : "O5");
+            PrintFrameBit(segbits, "", x, y, mux_bit);
+            PrintFrameBit(segbits, m ? "" : "!", x, y, mux_bit + 1);
+            fprintf(segbits, "\n");
+          }
+
+          // Features in fasm, in the tile order tools usually emit them.
+          if (rand() % 10 < 7) {
+            const uint64_t init = (uint64_t)rand() << 32 | (uint64_t)rand();
+            fprintf(fasm, "TILE_X%dY%d.SLICE_X%d.%cLUT.INIT[63:0] = "
+                    "64'h%016" PRIx64 "\n", x, y, s, lut_name, init);
+          }
+          if (rand() % 2) {
+            fprintf(fasm, "TILE_X%dY%d.SLICE_X%d.%cFF.ZINI\n", x, y, s,
+                    lut_name);
+          }
+          if (rand() % 10 < 3) {
+            fprintf(fasm, "TILE_X%dY%d.SLICE_X%d.%cOUTMUX.%s\n", x, y, s,
+                    lut_name, rand() % 2 ? "O6" : "O5");
+          }
+        }
+      }
+    }
+  }
+  fclose(segbits);
+  fclose(fasm);
+}
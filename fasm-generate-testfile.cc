@@ -13,48 +13,286 @@
 // limitations under the License.
 
 // Generate some fasm file for testing.
+//
+// Lines are generated in fixed-size blocks, each with its own random
+// generator seeded from the block index, so blocks can be generated in
+// parallel and the output is the same regardless of the number of threads.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <cinttypes>
 #include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include "fasm-writer.h"
 
 constexpr int64_t kDefaultCount = 100'000'000;  // Results in ~3.5GiB file.
+constexpr int kLinesPerBlock = 1 << 16;
+
+// Mix bits of "value" into a well-distributed seed (splitmix64 finalizer).
+static uint64_t Mix(uint64_t value) {
+  value += 0x9e3779b97f4a7c15;
+  value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9;
+  value = (value ^ (value >> 27)) * 0x94d049bb133111eb;
+  return value ^ (value >> 31);
+}
+
+class Random {
+ public:
+  explicit Random(uint64_t seed) : state_(Mix(seed) | 1) {}
+  uint64_t next() {  // xorshift64
+    state_ ^= state_ << 13;
+    state_ ^= state_ >> 7;
+    state_ ^= state_ << 17;
+    return state_;
+  }
+  uint32_t below(uint32_t n) { return (next() >> 32) * n >> 32; }
+
+ private:
+  uint64_t state_;
+};
+
+static void AppendDecimal(uint32_t value, std::string *out) {
+  char digits[10];
+  char *const end = digits + sizeof(digits);
+  char *pos = end;
+  do {
+    *--pos = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  out->append(pos, end - pos);
+}
+
+// Pseudo-random identifier as feature name, as generated originally.
+static void AppendRandomName(Random *rnd, std::string *out) {
+  constexpr int kEncodePool = 27;
+  constexpr char encode_chars[kEncodePool + 1] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ_";
+  for (uint64_t id = rnd->next(); id; id /= kEncodePool) {
+    out->push_back(encode_chars[id % kEncodePool]);
+  }
+}
+
+// Tile name such as "CLBLL_L_X12Y104" like in an actual 7-series design.
+// Consecutive lines mostly stay in the same tile as in real output.
+static void AppendTile(uint64_t seed, int64_t line, std::string *out) {
+  static constexpr const char *kTileTypes[] = {
+    "CLBLL_L", "CLBLL_R", "CLBLM_L", "CLBLM_R", "INT_L", "INT_R",
+    "BRAM_L",  "DSP_R",   "LIOB33",  "HCLK_L",
+  };
+  constexpr int kTileTypeCount = sizeof(kTileTypes) / sizeof(kTileTypes[0]);
+  const uint64_t tile = Mix(seed ^ (line / 24));
+  out->append(kTileTypes[tile % kTileTypeCount]);
+  out->append("_X");
+  AppendDecimal((tile >> 8) % 180, out);
+  out->push_back('Y');
+  AppendDecimal((tile >> 20) % 350, out);
+}
+
+static void AppendSiteFeature(Random *rnd, std::string *out) {
+  static constexpr const char *kSites[] = {
+    "SLICEL_X0", "SLICEL_X1", "SLICEM_X0", "RAMB18_Y0", "IOB_Y1",
+  };
+  static constexpr const char *kFeatures[] = {
+    "AFF.ZINI", "AFF.ZRST", "CEUSEDMUX", "SRUSEDMUX", "CARRY4.ACY0",
+    "A5FFMUX.IN_A", "BOUTMUX.B5Q", "CLKINV", "PULLTYPE.PULLUP", "IN_TERM.NONE",
+  };
+  out->append(kSites[rnd->below(sizeof(kSites) / sizeof(kSites[0]))]);
+  out->push_back('.');
+  out->append(kFeatures[rnd->below(sizeof(kFeatures) / sizeof(kFeatures[0]))]);
+}
+
+// Programmable interconnect point, e.g. "EE2BEG0.LOGIC_OUTS_L12".
+static void AppendPip(Random *rnd, std::string *out) {
+  static constexpr const char *kWires[] = {
+    "EE2BEG", "NN6BEG", "SW2A", "WL1BEG",
+    "IMUX_L", "BYP_ALT", "GFAN", "FAN_ALT",
+  };
+  constexpr int kWireCount = sizeof(kWires) / sizeof(kWires[0]);
+  out->append(kWires[rnd->below(kWireCount)]);
+  AppendDecimal(rnd->below(48), out);
+  out->append(".LOGIC_OUTS_L");
+  AppendDecimal(rnd->below(24), out);
+}
+
+struct LineContext {
+  uint64_t seed;
+  int64_t line;  // Counting from 0.
+  Random *rnd;
+  std::string *name;  // Buffer to assemble feature name in.
+  fasm::Writer *writer;
+};
+
+struct Profile {
+  const char *name;
+  const char *description;
+  void (*generate_line)(const LineContext &c);
+};
+
+static void GenerateRangedHex(const LineContext &c) {
+  AppendRandomName(c.rnd, c.name);
+  const int bit = c.rnd->below(256);
+  const int width = c.rnd->below(63) + 1;
+  c.writer->add_feature(*c.name, bit, width, c.rnd->next());
+}
 
-int usage(const char *progname) {
-  fprintf(stderr, "usage: %s <optional-count>\nDefault: %" PRId64 "\n",
+static void GenerateTileFeature(const LineContext &c) {
+  AppendTile(c.seed, c.line, c.name);
+  c.name->push_back('.');
+  const uint32_t kind = c.rnd->below(100);
+  if (kind < 70) {
+    AppendPip(c.rnd, c.name);
+    c.writer->add_feature(*c.name, 0, 1, 1);
+  } else if (kind < 95) {
+    AppendSiteFeature(c.rnd, c.name);
+    c.writer->add_feature(*c.name, 0, 1, 1);
+  } else {
+    c.name->append("SLICEL_X0.ALUT.INIT");
+    c.writer->add_feature(*c.name, 0, 64, c.rnd->next());
+  }
+}
+
+static void GenerateSingleBit(const LineContext &c) {
+  AppendTile(c.seed, c.line, c.name);
+  c.name->push_back('.');
+  AppendPip(c.rnd, c.name);
+  if (c.rnd->below(4) == 0) {
+    c.writer->add_feature(*c.name, c.rnd->below(32), 1, 1);
+  } else {
+    c.writer->add_feature(*c.name, 0, 1, 1);
+  }
+}
+
+static void GenerateWideInit(const LineContext &c) {
+  // 64 INIT_xx lines per block RAM tile, 256 bits each.
+  AppendTile(c.seed, c.line / 64 * 24, c.name);
+  c.name->append(".RAMB18_Y0.INIT_");
+  static constexpr char kHex[] = "0123456789ABCDEF";
+  c.name->push_back(kHex[(c.line / 16) % 4]);
+  c.name->push_back(kHex[c.line % 16]);
+  uint64_t bits[4];
+  for (uint64_t &word : bits) word = c.rnd->next();
+  c.writer->add_wide_feature(*c.name, 0, 256, bits);
+}
+
+static void GenerateAnnotated(const LineContext &c) {
+  GenerateTileFeature(c);
+  if (c.rnd->below(4) != 0) return;
+  std::string &value = *c.name;  // Reuse buffer, feature is written already.
+  value.assign("top.v:");
+  AppendDecimal(c.rnd->below(10000) + 1, &value);
+  c.writer->add_annotation(".src", value);
+  value.assign("cell_");
+  AppendDecimal(c.rnd->below(1 << 20), &value);
+  c.writer->add_annotation(".cell", value);
+}
+
+static constexpr Profile kProfiles[] = {
+  {"ranged-hex", "random names with bit range and hex value (default)",
+   GenerateRangedHex},
+  {"tiles", "tile/site hierarchy; mostly pips, some site features and INIT",
+   GenerateTileFeature},
+  {"single-bit", "only single-bit pip features", GenerateSingleBit},
+  {"wide-init", "256 bit wide BRAM INIT values", GenerateWideInit},
+  {"annotated", "tiles with .src and .cell annotations on a quarter",
+   GenerateAnnotated},
+};
+
+static void GenerateBlock(const Profile &profile, uint64_t seed, int64_t block,
+                          int64_t line_count, fasm::Writer *writer) {
+  Random rnd(seed ^ Mix(block));
+  std::string name;
+  const int64_t first = block * kLinesPerBlock;
+  const int64_t last = std::min(first + kLinesPerBlock, line_count);
+  for (int64_t line = first; line < last; ++line) {
+    name.clear();
+    profile.generate_line({seed, line, &rnd, &name, writer});
+  }
+}
+
+static int usage(const char *progname) {
+  fprintf(stderr,
+          "usage: %s [options] [<line-count>]\nDefault: %" PRId64 " lines\n"
+          "Options:\n"
+          "\t-p <profile> : Kind of content. Default ranged-hex\n"
+          "\t-j <threads> : Threads to generate with. Default: all cores\n"
+          "\t-s <seed>    : Different seed for different content. Default 42\n"
+          "\t-o <file>    : Write to file instead of stdout.\n"
+          "The output only depends on the profile, seed and line count.\n"
+          "Profiles:\n",
           progname, kDefaultCount);
+  for (const Profile &p : kProfiles) {
+    fprintf(stderr, "\t%-11s: %s\n", p.name, p.description);
+  }
   return 1;
 }
 
 int main(int argc, char *argv[]) {
-  if (argc > 2) {
+  const Profile *profile = &kProfiles[0];
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  uint64_t seed = 42;
+  const char *output = nullptr;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:j:s:o:h")) != -1) {
+    switch (opt) {
+    case 'p':
+      profile = nullptr;
+      for (const Profile &p : kProfiles) {
+        if (strcmp(p.name, optarg) == 0) profile = &p;
+      }
+      if (!profile) return usage(argv[0]);
+      break;
+    case 'j': threads = std::max(1, atoi(optarg)); break;
+    case 's': seed = strtoull(optarg, nullptr, 10); break;
+    case 'o': output = optarg; break;
+    default: return usage(argv[0]);
+    }
+  }
+  if (argc - optind > 1) {
     return usage(argv[0]);
   }
-  const int64_t count = (argc == 2) ? atol(argv[1]) : kDefaultCount;
-  if (count == 0) {
+  const int64_t count = (optind < argc) ? atol(argv[optind]) : kDefaultCount;
+  if (count <= 0) {
     return usage(argv[0]);
   }
 
-  srand(42); // Make 'random' numbers repeatable.
-
-  constexpr int kEncodePool = 27;
-  constexpr char encode_chars[kEncodePool + 1] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ_";
-  char feature_name[128];
-  for (int64_t i = 0; i < count; ++i) {
-    // Create some pseudo-random string as feature name from a random id.
-    uint64_t feature_id = (uint64_t)rand() << 32 | (uint64_t)rand();
-    int feature_len = 0;
-    for (/**/; feature_id; feature_id /= kEncodePool) {
-      feature_name[feature_len++] = encode_chars[feature_id % kEncodePool];
-    }
-    fwrite(feature_name, feature_len, 1, stdout);
+  FILE *const out = output ? fopen(output, "wb") : stdout;
+  if (!out) {
+    perror(output);
+    return 1;
+  }
 
-    const int bit = rand() % 256;
-    const int width = rand() % 63 + 1;  // min 1 up to max width we can parse.
-    const uint64_t long_rand = (uint64_t)rand() << 32 | (uint64_t)rand();
-    printf("[%d:%d] = %d'h%" PRIx64 "\n", bit + width - 1, bit, // bit range
-           width, long_rand & ((1L << width) - 1));
+  // Generate a few blocks per thread at a time, so that memory use is
+  // bounded with arbitrarily large outputs, and write them in order.
+  const int64_t block_count = (count + kLinesPerBlock - 1) / kLinesPerBlock;
+  const int64_t blocks_per_round = 4 * threads;
+  bool success = true;
+  for (int64_t round_start = 0; success && round_start < block_count;
+       round_start += blocks_per_round) {
+    const int round_blocks =
+        std::min(blocks_per_round, block_count - round_start);
+    success = fasm::write_parallel(
+        round_blocks,
+        [&](int i, fasm::Writer *writer) {
+          GenerateBlock(*profile, seed, round_start + i, count, writer);
+        },
+        out, fasm::WriteStyle::kReadable,
+        [threads](int task_count, const std::function<void(int)> &task) {
+          // Threads pick up the next block, which keeps them busy even if
+          // blocks differ in size.
+          fasm::run_balanced(task_count, threads,
+                             [&](int, int i) { task(i); });
+        });
+  }
+  if (output && fclose(out) != 0) success = false;
+  if (!success) {
+    perror("Writing output failed");
+    return 1;
   }
+  return 0;
 }
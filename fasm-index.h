@@ -0,0 +1,787 @@
+// Copyright 2022 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Indices of a FASM file, built while parsing, to get to a line, tile or
+// feature without scanning from the start.
+//
+// LineIndex sidecar file layout; all values in native byte order:
+//   LineIndexHeader
+//   LineIndex::Entry[entry_count]    Sorted by line.
+//   LineIndexTile[tile_count]        Sorted by prefix.
+//   char[name_data_size]             Tile prefixes.
+//
+// FeatureIndex sidecar file layout, memory mapped when read:
+//   FeatureIndexHeader
+//   FeatureIndex::Entry[entry_count] Sorted by hash, then line.
+
+#ifndef SIMPLE_FASM_INDEX_H
+#define SIMPLE_FASM_INDEX_H
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "fasm-binary.h"
+#include "fasm-parse.h"
+
+namespace fasm {
+class LineIndex {
+ public:
+  // Start of a line that has a feature; one every "stride" lines where
+  // there is one.
+  struct Entry {
+    uint64_t offset;
+    uint32_t line;
+    uint32_t reserved;
+  };
+
+  // Range of lines with features whose name starts with "prefix" followed
+  // by a dot, e.g. the tile "CLBLL_L_X12Y104". Lines in between might
+  // belong to other tiles.
+  struct TileRange {
+    std::string prefix;
+    uint32_t first_line;
+    uint32_t last_line;
+    uint64_t begin;  // Start of first line.
+    uint64_t end;    // Just after the newline of the last line.
+  };
+
+  // Read index from "filename". Returns false if it can't be read or was
+  // not built from "source", i.e. the file changed; issues are reported to
+  // "errstream".
+  bool read(const char *filename, const SourceFingerprint &source,
+            FILE *errstream);
+
+  // Write index to "filename" via a temporary file that replaces it when
+  // complete. Returns false on write error.
+  bool write(const char *filename) const;
+
+  const SourceFingerprint &source() const { return source_; }
+  uint32_t stride() const { return stride_; }
+  uint32_t line_count() const { return line_count_; }
+  const std::vector<Entry> &entries() const { return entries_; }
+  const std::vector<TileRange> &tiles() const { return tiles_; }
+
+  // Tile range with given prefix or nullptr if there is none.
+  const TileRange *find_tile(std::string_view prefix) const;
+
+  // Byte offset of the start of "line" in "content", the file this index
+  // was built from. Scans forward from the closest entry before. Lines
+  // past the end are at content.size().
+  size_t line_offset(std::string_view content, uint32_t line) const;
+
+  // Lines "first" up to including "last" of "content" as a chunk to be
+  // passed to parse().
+  ContentChunk lines(std::string_view content, uint32_t first,
+                     uint32_t last) const;
+
+  // Like split_lines(), but chunks have the same number of lines, give or
+  // take one, instead of bytes. No need to count lines first.
+  std::vector<ContentChunk> split(std::string_view content, int count) const;
+
+ private:
+  friend class LineIndexBuilder;
+
+  SourceFingerprint source_ = {};
+  uint32_t stride_ = 0;
+  uint32_t line_count_ = 0;
+  std::vector<Entry> entries_;
+  std::vector<TileRange> tiles_;
+};
+
+// Collects the index from the parse callback. Not thread-safe; with
+// parse_parallel() or parse_chunk(), use one per thread and merge() them.
+// Lines can be added in any order.
+class LineIndexBuilder {
+ public:
+  static constexpr uint32_t kDefaultStride = 1024;
+
+  // "content" is the whole file passed to parse() or split into chunks.
+  explicit LineIndexBuilder(std::string_view content,
+                            uint32_t stride = kDefaultStride)
+      : content_(content), stride_(std::max(stride, 1u)) {}
+
+  // Record "feature", a string_view into the content, as passed to the
+  // ParseCallback on "line".
+  void add(uint32_t line, std::string_view feature);
+
+  // Parse callback recording the feature before passing it on to
+  // "parse_callback".
+  template <typename ParseCallbackT>
+  auto wrap(ParseCallbackT &&parse_callback) {
+    return [this, parse_callback](uint32_t line, std::string_view feature,
+                                  int start_bit, int width,
+                                  uint64_t bits) mutable {
+      add(line, feature);
+      return parse_callback(line, feature, start_bit, width, bits);
+    };
+  }
+
+  // Add everything "other" collected from the same content.
+  void merge(const LineIndexBuilder &other);
+
+  // Index of the content recorded so far.
+  LineIndex finish(const SourceFingerprint &source) const;
+
+ private:
+  struct Range {
+    uint32_t first_line;
+    uint32_t last_line;
+    uint64_t begin;
+    uint64_t end;  // End of the last feature name; extended by finish().
+  };
+
+  uint64_t line_start(std::string_view feature) const;
+
+  const std::string_view content_;
+  const uint32_t stride_;
+  uint32_t last_line_ = 0;
+  std::vector<LineIndex::Entry> entries_;
+  std::unordered_map<std::string_view, Range> tiles_;
+  std::string_view current_prefix_;  // Features often share the tile.
+  Range *current_tile_ = nullptr;
+};
+
+// Index of the lines each feature name is on, to look up the values of a
+// few features without parsing the whole file. Only a hash of the name is
+// stored, so the index is small; lookup() parses the candidate lines to
+// find the actual matches.
+class FeatureIndex {
+ public:
+  struct Entry {
+    uint32_t hash;  // Lower bits of FeatureTable::hash() of the name.
+    uint32_t line;
+    uint64_t offset;  // Start of the line.
+  };
+
+  FeatureIndex() = default;
+  FeatureIndex(FeatureIndex &&other);
+  FeatureIndex &operator=(FeatureIndex &&other);
+  ~FeatureIndex();
+
+  // Memory map index from "filename". Returns false if it can't be read or
+  // was not built from "source"; issues are reported to "errstream".
+  bool read(const char *filename, const SourceFingerprint &source,
+            FILE *errstream);
+
+  // Write index to "filename" via a temporary file that replaces it when
+  // complete. Returns false on write error.
+  bool write(const char *filename) const;
+
+  const SourceFingerprint &source() const { return source_; }
+
+  // Number of lines with features.
+  size_t size() const { return end_ - begin_; }
+
+  // Lines that might have "feature" in file order. Other features with the
+  // same hash are included.
+  std::pair<const Entry *, const Entry *> candidates(
+      std::string_view feature) const;
+
+ private:
+  friend class FeatureIndexBuilder;
+
+  SourceFingerprint source_ = {};
+  std::vector<Entry> built_;
+  void *mapped_ = nullptr;
+  size_t mapped_size_ = 0;
+  const Entry *begin_ = nullptr;  // Into built_ or mapped_.
+  const Entry *end_ = nullptr;
+};
+
+// Collects the FeatureIndex from the parse callback, like the
+// LineIndexBuilder; use one per thread and merge() them.
+class FeatureIndexBuilder {
+ public:
+  // "content" is the whole file passed to parse() or split into chunks.
+  explicit FeatureIndexBuilder(std::string_view content)
+      : content_(content) {}
+
+  // Record "feature", a string_view into the content, as passed to the
+  // ParseCallback on "line".
+  void add(uint32_t line, std::string_view feature);
+
+  // Parse callback recording the feature before passing it on to
+  // "parse_callback".
+  template <typename ParseCallbackT>
+  auto wrap(ParseCallbackT &&parse_callback) {
+    return [this, parse_callback](uint32_t line, std::string_view feature,
+                                  int start_bit, int width,
+                                  uint64_t bits) mutable {
+      add(line, feature);
+      return parse_callback(line, feature, start_bit, width, bits);
+    };
+  }
+
+  // Add everything "other" collected from the same content.
+  void merge(const FeatureIndexBuilder &other);
+
+  // Index of the features recorded. Entries are moved into the index, so
+  // the builder is empty afterwards.
+  FeatureIndex finish(const SourceFingerprint &source);
+
+ private:
+  const std::string_view content_;
+  std::vector<FeatureIndex::Entry> entries_;
+};
+
+// Parse only the lines of "content", the file "index" was built from, that
+// have any of the "features", calling the callbacks as parse() would for
+// these lines. Callbacks for each feature are in file order, features in
+// the order given. Issues in these lines are reported to "errstream".
+template <typename ParseCallbackT,
+          typename AnnotationCallbackT = std::nullptr_t,
+          typename WideParseCallbackT = std::nullptr_t>
+inline ParseResult lookup(const FeatureIndex &index, std::string_view content,
+                          const std::vector<std::string_view> &features,
+                          FILE *errstream, ParseCallbackT &&parse_callback,
+                          AnnotationCallbackT &&annotation_callback = nullptr,
+                          WideParseCallbackT &&wide_callback = nullptr);
+
+// -- End of API interface; rest is implementation details
+
+struct LineIndexHeader {
+  static constexpr char kMagic[8] = {'F', 'A', 'S', 'M', 'I', 'D', 'X', 1};
+  static constexpr uint32_t kByteOrderMark = 0x01020304;
+
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t stride;
+  SourceFingerprint source;
+  uint64_t line_count;
+  uint64_t entry_count;
+  uint64_t tile_count;
+  uint64_t name_data_size;
+};
+
+struct LineIndexTile {
+  uint64_t begin;
+  uint64_t end;
+  uint64_t name_offset;  // Relative to the name data.
+  uint32_t name_size;
+  uint32_t first_line;
+  uint32_t last_line;
+  uint32_t reserved;
+};
+
+namespace internal {
+// Offset of the start of the line containing "feature" in "content".
+inline uint64_t line_start(std::string_view content,
+                           std::string_view feature) {
+  const char *const begin = content.data();
+  const char *pos = feature.data();
+  while (pos > begin && pos[-1] != '\n') --pos;
+  return pos - begin;
+}
+
+// Write "filename" with "write_content(FILE *)" to a temporary file first,
+// renamed when complete, so that readers never see a partial file.
+template <typename WriteContentT>
+inline bool write_replacing(const char *filename,
+                            WriteContentT &&write_content) {
+  const std::string tmp_name = std::string(filename) + ".tmp";
+  FILE *const out = fopen(tmp_name.c_str(), "wb");
+  if (!out) return false;
+  bool success = write_content(out);
+  success &= fclose(out) == 0;
+  if (!success || rename(tmp_name.c_str(), filename) != 0) {
+    unlink(tmp_name.c_str());
+    return false;
+  }
+  return true;
+}
+}  // namespace internal
+
+inline uint64_t LineIndexBuilder::line_start(std::string_view feature) const {
+  return internal::line_start(content_, feature);
+}
+
+inline void LineIndexBuilder::add(uint32_t line, std::string_view feature) {
+  if (line / stride_ != last_line_ / stride_ || line < last_line_ ||
+      entries_.empty()) {
+    // First feature line in this stride; merged ones are sorted out later.
+    entries_.push_back({line_start(feature), line, 0});
+  }
+  last_line_ = line;
+
+  const uint64_t feature_end = feature.data() + feature.size() -
+                               content_.data();
+  const size_t prefix_len = current_prefix_.size();
+  if (!current_tile_ || feature.size() <= prefix_len ||
+      feature[prefix_len] != '.' ||
+      feature.compare(0, prefix_len, current_prefix_) != 0) {
+    const size_t dot = feature.find('.');
+    if (dot == std::string_view::npos) {
+      current_tile_ = nullptr;
+      return;
+    }
+    current_prefix_ = feature.substr(0, dot);
+    auto inserted = tiles_.emplace(current_prefix_, Range{line, line, 0, 0});
+    current_tile_ = &inserted.first->second;
+    if (inserted.second) current_tile_->begin = line_start(feature);
+  }
+  Range &tile = *current_tile_;
+  if (line < tile.first_line) {
+    tile.first_line = line;
+    tile.begin = line_start(feature);
+  }
+  if (line >= tile.last_line) {
+    tile.last_line = line;
+    tile.end = std::max(tile.end, feature_end);
+  }
+}
+
+inline void LineIndexBuilder::merge(const LineIndexBuilder &other) {
+  entries_.insert(entries_.end(), other.entries_.begin(),
+                  other.entries_.end());
+  for (const auto &[prefix, range] : other.tiles_) {
+    auto inserted = tiles_.emplace(prefix, range);
+    if (inserted.second) continue;
+    Range &tile = inserted.first->second;
+    if (range.first_line < tile.first_line) {
+      tile.first_line = range.first_line;
+      tile.begin = range.begin;
+    }
+    if (range.last_line >= tile.last_line) {
+      tile.last_line = range.last_line;
+      tile.end = std::max(tile.end, range.end);
+    }
+  }
+  current_tile_ = nullptr;  // Might have moved.
+}
+
+inline LineIndex LineIndexBuilder::finish(
+    const SourceFingerprint &source) const {
+  LineIndex index;
+  index.source_ = source;
+  index.stride_ = stride_;
+
+  // Keep the first line of each stride.
+  index.entries_ = entries_;
+  std::sort(index.entries_.begin(), index.entries_.end(),
+            [](const LineIndex::Entry &a, const LineIndex::Entry &b) {
+              return a.line < b.line;
+            });
+  uint32_t kept = 0;
+  for (const LineIndex::Entry &e : index.entries_) {
+    if (kept == 0 || e.line / stride_ != index.entries_[kept - 1].line /
+                                             stride_) {
+      index.entries_[kept++] = e;
+    }
+  }
+  index.entries_.resize(kept);
+
+  // Lines after the last feature only need to be counted once.
+  const char *const end = content_.data() + content_.size();
+  const LineIndex::Entry last =
+      index.entries_.empty() ? LineIndex::Entry{0, 1, 0}
+                             : index.entries_.back();
+  index.line_count_ = last.line - 1 +
+                      internal::count_newlines(content_.data() + last.offset,
+                                               end);
+  if (!content_.empty() && content_.back() != '\n') ++index.line_count_;
+
+  for (const auto &[prefix, range] : tiles_) {
+    const char *const newline =
+        (const char *)memchr(content_.data() + range.end, '\n',
+                             content_.size() - range.end);
+    index.tiles_.push_back({std::string(prefix), range.first_line,
+                            range.last_line, range.begin,
+                            newline ? newline + 1 - content_.data()
+                                    : content_.size()});
+  }
+  std::sort(index.tiles_.begin(), index.tiles_.end(),
+            [](const LineIndex::TileRange &a, const LineIndex::TileRange &b) {
+              return a.prefix < b.prefix;
+            });
+  return index;
+}
+
+inline const LineIndex::TileRange *LineIndex::find_tile(
+    std::string_view prefix) const {
+  auto found = std::lower_bound(
+      tiles_.begin(), tiles_.end(), prefix,
+      [](const TileRange &t, std::string_view p) { return t.prefix < p; });
+  if (found == tiles_.end() || found->prefix != prefix) return nullptr;
+  return &*found;
+}
+
+inline size_t LineIndex::line_offset(std::string_view content,
+                                     uint32_t line) const {
+  auto found = std::upper_bound(
+      entries_.begin(), entries_.end(), line,
+      [](uint32_t l, const Entry &e) { return l < e.line; });
+  size_t offset = 0;
+  uint32_t at_line = 1;
+  if (found != entries_.begin()) {
+    --found;
+    offset = found->offset;
+    at_line = found->line;
+  }
+  for (/**/; at_line < line && offset < content.size(); ++at_line) {
+    const char *const newline = (const char *)memchr(
+        content.data() + offset, '\n', content.size() - offset);
+    if (!newline) return content.size();
+    offset = newline + 1 - content.data();
+  }
+  return std::min(offset, content.size());
+}
+
+inline ContentChunk LineIndex::lines(std::string_view content,
+                                     uint32_t first, uint32_t last) const {
+  first = std::max(first, 1u);
+  const size_t begin = line_offset(content, first);
+  const size_t end = last < first ? begin : line_offset(content, last + 1);
+  return {content.substr(begin, end - begin), first, begin};
+}
+
+inline std::vector<ContentChunk> LineIndex::split(std::string_view content,
+                                                  int count) const {
+  std::vector<ContentChunk> chunks;
+  if (content.empty() || content.back() != '\n') return chunks;
+  count = std::clamp<int64_t>(count, 1, std::max(line_count_, 1u));
+  for (int i = 0; i < count; ++i) {
+    const uint32_t first = 1 + uint64_t(line_count_) * i / count;
+    const uint32_t last = uint64_t(line_count_) * (i + 1) / count;
+    chunks.push_back(lines(content, first, last));
+  }
+  return chunks;
+}
+
+inline bool LineIndex::write(const char *filename) const {
+  LineIndexHeader header{};
+  memcpy(header.magic, LineIndexHeader::kMagic, sizeof(header.magic));
+  header.byte_order = LineIndexHeader::kByteOrderMark;
+  header.stride = stride_;
+  header.source = source_;
+  header.line_count = line_count_;
+  header.entry_count = entries_.size();
+  header.tile_count = tiles_.size();
+  std::vector<LineIndexTile> tiles;
+  for (const TileRange &t : tiles_) {
+    tiles.push_back({t.begin, t.end, header.name_data_size,
+                     uint32_t(t.prefix.size()), t.first_line, t.last_line,
+                     0});
+    header.name_data_size += t.prefix.size();
+  }
+  return internal::write_replacing(filename, [&](FILE *out) {
+    bool success = fwrite(&header, sizeof(header), 1, out) == 1;
+    success &= fwrite(entries_.data(), sizeof(Entry), entries_.size(),
+                      out) == entries_.size();
+    success &= fwrite(tiles.data(), sizeof(LineIndexTile), tiles.size(),
+                      out) == tiles.size();
+    for (const TileRange &t : tiles_) {
+      success &= fwrite(t.prefix.data(), 1, t.prefix.size(), out) ==
+                 t.prefix.size();
+    }
+    return success;
+  });
+}
+
+inline bool LineIndex::read(const char *filename,
+                            const SourceFingerprint &source,
+                            FILE *errstream) {
+  FILE *const in = fopen(filename, "rb");
+  if (!in) {
+    fprintf(errstream, "%s: can't open\n", filename);
+    return false;
+  }
+  LineIndexHeader header;
+  bool success = fread(&header, sizeof(header), 1, in) == 1;
+  if (!success ||
+      memcmp(header.magic, LineIndexHeader::kMagic, sizeof(header.magic)) !=
+          0 ||
+      header.byte_order != LineIndexHeader::kByteOrderMark) {
+    fprintf(errstream, "%s: not a line index of this version or byte "
+            "order\n", filename);
+    fclose(in);
+    return false;
+  }
+  if (!(header.source == source)) {
+    fprintf(errstream, "%s: outdated, file changed\n", filename);
+    fclose(in);
+    return false;
+  }
+  // Check the counts against the file size before allocating for them.
+  struct stat s;
+  if (fstat(fileno(in), &s) != 0) {
+    fprintf(errstream, "%s: can't stat\n", filename);
+    fclose(in);
+    return false;
+  }
+  const uint64_t file_size = s.st_size;
+  uint64_t expected_size = sizeof(header);
+  const auto add_section = [&](uint64_t count, uint64_t element_size) {
+    if (expected_size > file_size ||
+        count > (file_size - expected_size) / element_size) {
+      return false;
+    }
+    expected_size += count * element_size;
+    return true;
+  };
+  if (!add_section(header.entry_count, sizeof(Entry)) ||
+      !add_section(header.tile_count, sizeof(LineIndexTile)) ||
+      !add_section(header.name_data_size, 1) || expected_size != file_size) {
+    fprintf(errstream, "%s: inconsistent size\n", filename);
+    fclose(in);
+    return false;
+  }
+  std::vector<Entry> entries(header.entry_count);
+  std::vector<LineIndexTile> tiles(header.tile_count);
+  std::string names(header.name_data_size, '\0');
+  success &= fread(entries.data(), sizeof(Entry), entries.size(), in) ==
+             entries.size();
+  success &= fread(tiles.data(), sizeof(LineIndexTile), tiles.size(), in) ==
+             tiles.size();
+  success &= fread(names.data(), 1, names.size(), in) == names.size();
+  fclose(in);
+  if (!success) {
+    fprintf(errstream, "%s: truncated line index\n", filename);
+    return false;
+  }
+  // Offsets are used on the source without further checks.
+  for (const Entry &e : entries) {
+    success &= e.offset <= header.source.size;
+  }
+  for (const LineIndexTile &t : tiles) {
+    success &= t.name_offset <= names.size() &&
+               t.name_size <= names.size() - t.name_offset &&
+               t.begin <= t.end && t.end <= header.source.size;
+  }
+  if (!success) {
+    fprintf(errstream, "%s: offsets outside of file\n", filename);
+    return false;
+  }
+  source_ = header.source;
+  stride_ = header.stride;
+  line_count_ = header.line_count;
+  entries_ = std::move(entries);
+  tiles_.clear();
+  for (const LineIndexTile &t : tiles) {
+    tiles_.push_back({names.substr(t.name_offset, t.name_size),
+                      t.first_line, t.last_line, t.begin, t.end});
+  }
+  return true;
+}
+struct FeatureIndexHeader {
+  static constexpr char kMagic[8] = {'F', 'A', 'S', 'M', 'F', 'I', 'X', 1};
+  static constexpr uint32_t kByteOrderMark = 0x01020304;
+
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t reserved;
+  SourceFingerprint source;
+  uint64_t entry_count;
+};
+
+inline void FeatureIndexBuilder::add(uint32_t line,
+                                     std::string_view feature) {
+  // Values wider than 64 bits arrive in several callbacks of the same line.
+  if (!entries_.empty() && entries_.back().line == line) return;
+  entries_.push_back({uint32_t(FeatureTable::hash(feature)), line,
+                      internal::line_start(content_, feature)});
+}
+
+inline void FeatureIndexBuilder::merge(const FeatureIndexBuilder &other) {
+  entries_.insert(entries_.end(), other.entries_.begin(),
+                  other.entries_.end());
+}
+
+inline FeatureIndex FeatureIndexBuilder::finish(
+    const SourceFingerprint &source) {
+  FeatureIndex index;
+  index.source_ = source;
+  index.built_ = std::move(entries_);
+  entries_.clear();
+  std::sort(index.built_.begin(), index.built_.end(),
+            [](const FeatureIndex::Entry &a, const FeatureIndex::Entry &b) {
+              return a.hash != b.hash ? a.hash < b.hash : a.line < b.line;
+            });
+  index.begin_ = index.built_.data();
+  index.end_ = index.begin_ + index.built_.size();
+  return index;
+}
+
+inline FeatureIndex::FeatureIndex(FeatureIndex &&other) {
+  *this = std::move(other);
+}
+
+inline FeatureIndex &FeatureIndex::operator=(FeatureIndex &&other) {
+  if (this == &other) return *this;
+  if (mapped_) munmap(mapped_, mapped_size_);
+  source_ = other.source_;
+  built_ = std::move(other.built_);  // Keeps the buffer begin_ points to.
+  mapped_ = std::exchange(other.mapped_, nullptr);
+  mapped_size_ = std::exchange(other.mapped_size_, 0);
+  begin_ = std::exchange(other.begin_, nullptr);
+  end_ = std::exchange(other.end_, nullptr);
+  return *this;
+}
+
+inline FeatureIndex::~FeatureIndex() {
+  if (mapped_) munmap(mapped_, mapped_size_);
+}
+
+inline std::pair<const FeatureIndex::Entry *, const FeatureIndex::Entry *>
+FeatureIndex::candidates(std::string_view feature) const {
+  const uint32_t hash = FeatureTable::hash(feature);
+  const Entry *const first =
+      std::lower_bound(begin_, end_, hash,
+                       [](const Entry &e, uint32_t h) { return e.hash < h; });
+  const Entry *last = first;
+  while (last < end_ && last->hash == hash) ++last;
+  return {first, last};
+}
+
+inline bool FeatureIndex::write(const char *filename) const {
+  FeatureIndexHeader header{};
+  memcpy(header.magic, FeatureIndexHeader::kMagic, sizeof(header.magic));
+  header.byte_order = FeatureIndexHeader::kByteOrderMark;
+  header.source = source_;
+  header.entry_count = size();
+  return internal::write_replacing(filename, [&](FILE *out) {
+    return fwrite(&header, sizeof(header), 1, out) == 1 &&
+           fwrite(begin_, sizeof(Entry), size(), out) == size();
+  });
+}
+
+inline bool FeatureIndex::read(const char *filename,
+                               const SourceFingerprint &source,
+                               FILE *errstream) {
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(errstream, "%s: can't open\n", filename);
+    return false;
+  }
+  struct stat s;
+  if (fstat(fd, &s) != 0) {
+    fprintf(errstream, "%s: can't stat\n", filename);
+    close(fd);
+    return false;
+  }
+  void *const buffer =
+      size_t(s.st_size) >= sizeof(FeatureIndexHeader)
+          ? mmap(nullptr, s.st_size, PROT_READ, MAP_SHARED, fd, 0)
+          : MAP_FAILED;
+  close(fd);
+  if (buffer == MAP_FAILED) {
+    fprintf(errstream, "%s: can't map\n", filename);
+    return false;
+  }
+  const auto *header = (const FeatureIndexHeader *)buffer;
+  // Compared by division, as a corrupt count could overflow a product.
+  const uint64_t entry_bytes = s.st_size - sizeof(FeatureIndexHeader);
+  const char *error = nullptr;
+  if (memcmp(header->magic, FeatureIndexHeader::kMagic,
+             sizeof(header->magic)) != 0 ||
+      header->byte_order != FeatureIndexHeader::kByteOrderMark) {
+    error = "not a feature index of this version or byte order";
+  } else if (!(header->source == source)) {
+    error = "outdated, file changed";
+  } else if (header->entry_count != entry_bytes / sizeof(Entry) ||
+             entry_bytes % sizeof(Entry) != 0) {
+    error = "inconsistent size";
+  }
+  if (error) {
+    fprintf(errstream, "%s: %s\n", filename, error);
+    munmap(buffer, s.st_size);
+    return false;
+  }
+  *this = FeatureIndex();
+  source_ = header->source;
+  mapped_ = buffer;
+  mapped_size_ = s.st_size;
+  begin_ = (const Entry *)(header + 1);
+  end_ = begin_ + header->entry_count;
+  return true;
+}
+
+template <typename ParseCallbackT, typename AnnotationCallbackT,
+          typename WideParseCallbackT>
+inline ParseResult lookup(const FeatureIndex &index, std::string_view content,
+                          const std::vector<std::string_view> &features,
+                          FILE *errstream, ParseCallbackT &&parse_callback,
+                          AnnotationCallbackT &&annotation_callback,
+                          WideParseCallbackT &&wide_callback) {
+  if constexpr (internal::kMaybeEmptyCallback<AnnotationCallbackT>) {
+    if (!annotation_callback) {
+      return lookup(index, content, features, errstream, parse_callback,
+                    nullptr, wide_callback);
+    }
+  }
+  if constexpr (internal::kMaybeEmptyCallback<WideParseCallbackT>) {
+    if (!wide_callback) {
+      return lookup(index, content, features, errstream, parse_callback,
+                    annotation_callback, nullptr);
+    }
+  }
+  constexpr bool kWantsAnnotations =
+      !std::is_same_v<std::decay_t<AnnotationCallbackT>, std::nullptr_t>;
+  constexpr bool kWantsWide =
+      !std::is_same_v<std::decay_t<WideParseCallbackT>, std::nullptr_t>;
+  ParseResult result = ParseResult::kSuccess;
+  for (const std::string_view feature : features) {
+    const auto [first, last] = index.candidates(feature);
+    for (const FeatureIndex::Entry *e = first; e < last; ++e) {
+      if (e->offset >= content.size()) continue;
+      const char *const newline = (const char *)memchr(
+          content.data() + e->offset, '\n', content.size() - e->offset);
+      const size_t end = newline ? newline + 1 - content.data()
+                                 : content.size();
+      // Candidates with the same hash but another name are parsed, but
+      // not passed on.
+      const auto filter = [&](uint32_t line, std::string_view f, int start_bit,
+                              int width, uint64_t bits) {
+        return f != feature || parse_callback(line, f, start_bit, width, bits);
+      };
+      const auto filter_annotation = [&](uint32_t line, std::string_view f,
+                                         std::string_view name,
+                                         std::string_view value) {
+        if constexpr (kWantsAnnotations) {
+          if (f == feature) annotation_callback(line, f, name, value);
+        }
+      };
+      const ContentChunk chunk{
+          content.substr(e->offset, end - e->offset), e->line, e->offset};
+      ParseResult line_result;
+      if constexpr (kWantsWide) {
+        line_result = parse(
+            chunk, errstream, filter, filter_annotation,
+            [&](uint32_t line, std::string_view f, int start_bit, int width,
+                const uint64_t *bits) {
+              return f != feature ||
+                     wide_callback(line, f, start_bit, width, bits);
+            });
+      } else {
+        line_result = parse(chunk, errstream, filter, filter_annotation);
+      }
+      result = std::max(result, line_result);
+      if (result == ParseResult::kUserAbort) return result;
+    }
+  }
+  return result;
+}
+}  // namespace fasm
+#endif  // SIMPLE_FASM_INDEX_H
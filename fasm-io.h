@@ -0,0 +1,579 @@
+// Copyright 2022 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Ways to read FASM files for parsing. Memory mapping is fastest if the
+// file is in the page cache already; on a cold cache, reading blocks ahead
+// while parse workers are busy with the previous ones keeps the disk busy.
+//
+// Linux only. io_uring is used through the system calls directly, so no
+// liburing is needed; if the kernel does not allow it, pread() is used.
+
+#ifndef SIMPLE_FASM_IO_H
+#define SIMPLE_FASM_IO_H
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define FASM_HAVE_IO_URING 1
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "fasm-decompress.h"
+#include "fasm-parse.h"
+
+namespace fasm {
+enum class ReadBackend {
+  kMmap,     // Map the whole file; parse chunks in place.
+  kPread,    // Read blocks with pread() in a separate thread.
+  kDirect,   // Same with O_DIRECT, bypassing the page cache.
+  kIoUring,  // Keep several block reads queued with io_uring.
+};
+
+// Name of the backend as used in parse_read_backend(), e.g. "io_uring".
+inline const char *read_backend_name(ReadBackend backend);
+
+// Backend from its name; returns 'false' if there is no such backend.
+inline bool parse_read_backend(std::string_view name, ReadBackend *backend);
+
+struct ReadOptions {
+  ReadBackend backend = ReadBackend::kMmap;
+
+  // kMmap: madvise() hints. Sequential doubles the kernel read-ahead,
+  // willneed starts reading the whole file right away.
+  bool advise_sequential = true;
+  bool advise_willneed = false;
+  bool populate = false;     // MAP_POPULATE: read everything before parsing.
+  bool huge_pages = false;   // MADV_HUGEPAGE, if supported for the file.
+
+  // Block backends: bytes per read request (rounded up to 4KiB for
+  // O_DIRECT) and io_uring requests in flight.
+  size_t read_size = 1 << 20;
+  int read_ahead = 8;
+};
+
+// Memory mapped file according to the kMmap options.
+class MappedFile {
+ public:
+  MappedFile() = default;
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  // Map "filename"; issues are reported to "errstream". An empty file
+  // can be mapped, but has empty content.
+  bool map(const char *filename, const ReadOptions &options,
+           FILE *errstream);
+
+  std::string_view content() const { return content_; }
+  const struct stat &file_stat() const { return stat_; }
+
+ private:
+  std::string_view content_;
+  struct stat stat_ = {};
+};
+
+// Drop pages of "filename" from the page cache, as far as they are not
+// dirty, to measure reading from disk. Returns 'false' on error.
+inline bool evict_from_page_cache(const char *filename);
+
+// Parse "filename" read with "read_options.backend" in
+// "options.parse_threads" workers calling "parse_chunk", as
+// parse_compressed_chunks() does. With kMmap, the file is split in chunks
+// handed to the workers with run_balanced(), otherwise blocks of
+// "options.block_size" are read in a separate thread while the workers
+// parse the previous ones. The file is not decompressed.
+//
+// If a backend is not supported, e.g. O_DIRECT on some file systems, a
+// note is written to "errstream" and kPread is used instead.
+inline ParseResult parse_file_chunks(const char *filename,
+                                     const ReadOptions &read_options,
+                                     FILE *errstream,
+                                     const ChunkParser &parse_chunk,
+                                     const PipelineOptions &options = {},
+                                     PipelineStats *stats = nullptr);
+
+// -- End of API interface; rest is implementation details
+
+inline const char *read_backend_name(ReadBackend backend) {
+  switch (backend) {
+  case ReadBackend::kMmap: return "mmap";
+  case ReadBackend::kPread: return "pread";
+  case ReadBackend::kDirect: return "direct";
+  case ReadBackend::kIoUring: return "io_uring";
+  }
+  return "";
+}
+
+inline bool parse_read_backend(std::string_view name, ReadBackend *backend) {
+  for (ReadBackend b : {ReadBackend::kMmap, ReadBackend::kPread,
+                        ReadBackend::kDirect, ReadBackend::kIoUring}) {
+    if (name == read_backend_name(b)) {
+      *backend = b;
+      return true;
+    }
+  }
+  return false;
+}
+
+inline MappedFile::~MappedFile() {
+  if (!content_.empty()) {
+    munmap(const_cast<char *>(content_.data()), content_.size());
+  }
+}
+
+inline bool MappedFile::map(const char *filename, const ReadOptions &options,
+                            FILE *errstream) {
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(errstream, "%s: can't open: %s\n", filename, strerror(errno));
+    return false;
+  }
+  if (fstat(fd, &stat_) != 0) {
+    fprintf(errstream, "%s: can't stat: %s\n", filename, strerror(errno));
+    close(fd);
+    return false;
+  }
+  if (stat_.st_size == 0) {
+    close(fd);
+    return true;
+  }
+  const int flags = MAP_SHARED | (options.populate ? MAP_POPULATE : 0);
+  void *const buffer = mmap(nullptr, stat_.st_size, PROT_READ, flags, fd, 0);
+  close(fd);
+  if (buffer == MAP_FAILED) {
+    fprintf(errstream, "%s: can't map: %s\n", filename, strerror(errno));
+    return false;
+  }
+  // Hints only; not all of them are supported everywhere.
+  if (options.advise_sequential) {
+    madvise(buffer, stat_.st_size, MADV_SEQUENTIAL);
+  }
+  if (options.advise_willneed) madvise(buffer, stat_.st_size, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+  if (options.huge_pages) madvise(buffer, stat_.st_size, MADV_HUGEPAGE);
+#endif
+  content_ = std::string_view((const char *)buffer, stat_.st_size);
+  return true;
+}
+
+inline bool evict_from_page_cache(const char *filename) {
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) return false;
+  const bool success = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+  close(fd);
+  return success;
+}
+
+namespace internal {
+// Reads a file sequentially in the way chosen, for parse_pipelined().
+class BlockFileReader {
+ public:
+  BlockFileReader() = default;
+  ~BlockFileReader();
+  BlockFileReader(const BlockFileReader &) = delete;
+  BlockFileReader &operator=(const BlockFileReader &) = delete;
+
+  // Open with kPread, kDirect or kIoUring; falls back to kPread if not
+  // supported.
+  bool open(const char *filename, const ReadOptions &options,
+            FILE *errstream);
+
+  // Backend actually used.
+  ReadBackend backend() const { return backend_; }
+
+  // Read up to "size" bytes. Returns number of bytes read, 0 at the end
+  // of the file or -1 on error.
+  int64_t read(char *buffer, size_t size);
+
+  // Number of bytes read from the file so far.
+  uint64_t compressed_bytes() const { return file_offset_; }
+
+ private:
+  static constexpr size_t kDirectAlignment = 4096;
+
+  // Fill staging buffer from the file with the current backend.
+  bool fill_staging();
+  bool fill_staging_direct();
+#ifdef FASM_HAVE_IO_URING
+  bool setup_uring(int depth);
+  void submit_uring_read(int slot);
+  bool fill_staging_uring();
+#endif
+
+  const char *filename_ = nullptr;
+  FILE *errstream_ = nullptr;
+  ReadBackend backend_ = ReadBackend::kPread;
+  int fd_ = -1;
+  uint64_t file_size_ = 0;
+  uint64_t file_offset_ = 0;  // Handed out to read() so far.
+  size_t read_size_ = 0;
+
+  // kDirect and kIoUring read into aligned buffers first; read() copies
+  // from the current one.
+  char *staging_ = nullptr;
+  size_t staging_pos_ = 0;
+  size_t staging_size_ = 0;
+
+#ifdef FASM_HAVE_IO_URING
+  // Ring buffers shared with the kernel.
+  struct Slot {
+    char *buffer = nullptr;
+    uint64_t offset = 0;
+    int result = 0;
+    bool done = false;
+  };
+  int ring_fd_ = -1;
+  void *sq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  void *cq_ring_ = nullptr;  // Same as sq_ring_ with IORING_FEAT_SINGLE_MMAP
+  size_t cq_ring_size_ = 0;
+  io_uring_sqe *sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  std::atomic<uint32_t> *sq_tail_ = nullptr;
+  uint32_t sq_mask_ = 0;
+  uint32_t *sq_array_ = nullptr;
+  std::atomic<uint32_t> *cq_head_ = nullptr;
+  std::atomic<uint32_t> *cq_tail_ = nullptr;
+  uint32_t cq_mask_ = 0;
+  io_uring_cqe *cqes_ = nullptr;
+  std::vector<Slot> slots_;
+  int next_slot_ = 0;             // Slot with the next content in order.
+  uint64_t next_read_offset_ = 0;  // Where the next submitted read starts.
+#endif
+};
+
+inline BlockFileReader::~BlockFileReader() {
+#ifdef FASM_HAVE_IO_URING
+  if (ring_fd_ >= 0) {
+    // Wait for reads still in flight before their buffers go away.
+    for (Slot &slot : slots_) {
+      while (slot.buffer && !slot.done && slot.offset < file_size_) {
+        const uint32_t head = cq_head_->load(std::memory_order_relaxed);
+        if (head == cq_tail_->load(std::memory_order_acquire)) {
+          syscall(__NR_io_uring_enter, ring_fd_, 0, 1,
+                  IORING_ENTER_GETEVENTS, nullptr, 0);
+          continue;
+        }
+        slots_[cqes_[head & cq_mask_].user_data].done = true;
+        cq_head_->store(head + 1, std::memory_order_release);
+      }
+    }
+    for (Slot &slot : slots_) free(slot.buffer);
+    if (sqes_) munmap(sqes_, sqes_size_);
+    if (cq_ring_ && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_) munmap(sq_ring_, sq_ring_size_);
+    close(ring_fd_);
+    staging_ = nullptr;  // Was one of the slot buffers.
+  }
+#endif
+  free(staging_);
+  if (fd_ >= 0) close(fd_);
+}
+
+inline bool BlockFileReader::open(const char *filename,
+                                  const ReadOptions &options,
+                                  FILE *errstream) {
+  filename_ = filename;
+  errstream_ = errstream;
+  backend_ = options.backend;
+  read_size_ = std::max(options.read_size, (size_t)1);
+  if (backend_ == ReadBackend::kDirect) {
+    fd_ = ::open(filename, O_RDONLY | O_DIRECT);
+    if (fd_ < 0 && errno == EINVAL) {
+      fprintf(errstream, "%s: O_DIRECT not supported; using pread\n",
+              filename);
+      backend_ = ReadBackend::kPread;
+    }
+  }
+  if (fd_ < 0) fd_ = ::open(filename, O_RDONLY);
+  if (fd_ < 0) {
+    fprintf(errstream, "%s: can't open: %s\n", filename, strerror(errno));
+    return false;
+  }
+  struct stat s;
+  fstat(fd_, &s);
+  file_size_ = s.st_size;
+
+  if (backend_ == ReadBackend::kDirect) {
+    read_size_ = (read_size_ + kDirectAlignment - 1) & ~(kDirectAlignment - 1);
+    if (posix_memalign((void **)&staging_, kDirectAlignment, read_size_)) {
+      return false;
+    }
+  }
+  if (backend_ == ReadBackend::kIoUring) {
+#ifdef FASM_HAVE_IO_URING
+    if (!setup_uring(std::max(options.read_ahead, 1)))
+#endif
+    {
+      fprintf(errstream, "%s: io_uring not available; using pread\n",
+              filename);
+      backend_ = ReadBackend::kPread;
+    }
+  }
+  if (backend_ == ReadBackend::kPread) {
+    posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  return true;
+}
+
+inline int64_t BlockFileReader::read(char *buffer, size_t size) {
+  if (backend_ == ReadBackend::kPread) {
+    size_t total = 0;
+    while (total < size) {  // Large reads can come back short.
+      const ssize_t got =
+          pread(fd_, buffer + total, size - total, file_offset_);
+      if (got < 0 && errno == EINTR) continue;
+      if (got < 0) {
+        fprintf(errstream_, "%s: %s\n", filename_, strerror(errno));
+        return -1;
+      }
+      if (got == 0) break;
+      total += got;
+      file_offset_ += got;
+    }
+    return total;
+  }
+  size_t total = 0;
+  while (total < size) {
+    if (staging_pos_ == staging_size_) {
+      if (file_offset_ >= file_size_) break;
+      if (!fill_staging()) return -1;
+      if (staging_size_ == 0) break;
+    }
+    const size_t n = std::min(size - total, staging_size_ - staging_pos_);
+    memcpy(buffer + total, staging_ + staging_pos_, n);
+    staging_pos_ += n;
+    total += n;
+    file_offset_ += n;
+  }
+  return total;
+}
+
+inline bool BlockFileReader::fill_staging() {
+#ifdef FASM_HAVE_IO_URING
+  if (backend_ == ReadBackend::kIoUring) return fill_staging_uring();
+#endif
+  return fill_staging_direct();
+}
+
+inline bool BlockFileReader::fill_staging_direct() {
+  // file_offset_ is aligned: staging is always consumed completely, and
+  // only the last read is shorter than read_size_.
+  ssize_t got;
+  do {
+    got = pread(fd_, staging_, read_size_, file_offset_);
+  } while (got < 0 && errno == EINTR);
+  if (got < 0) {
+    fprintf(errstream_, "%s: %s\n", filename_, strerror(errno));
+    return false;
+  }
+  staging_pos_ = 0;
+  staging_size_ = got;
+  return true;
+}
+
+#ifdef FASM_HAVE_IO_URING
+inline bool BlockFileReader::setup_uring(int depth) {
+  io_uring_params params = {};
+  ring_fd_ = syscall(__NR_io_uring_setup, depth, &params);
+  if (ring_fd_ < 0) return false;
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  }
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    sq_ring_ = nullptr;
+    return false;
+  }
+  cq_ring_ = sq_ring_;
+  if (!single_mmap) {
+    cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      cq_ring_ = nullptr;
+      return false;
+    }
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void *const sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring_fd_,
+                          IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) return false;
+  sqes_ = (io_uring_sqe *)sqes;
+
+  char *const sq = (char *)sq_ring_;
+  char *const cq = (char *)cq_ring_;
+  sq_tail_ = (std::atomic<uint32_t> *)(sq + params.sq_off.tail);
+  sq_mask_ = *(uint32_t *)(sq + params.sq_off.ring_mask);
+  sq_array_ = (uint32_t *)(sq + params.sq_off.array);
+  cq_head_ = (std::atomic<uint32_t> *)(cq + params.cq_off.head);
+  cq_tail_ = (std::atomic<uint32_t> *)(cq + params.cq_off.tail);
+  cq_mask_ = *(uint32_t *)(cq + params.cq_off.ring_mask);
+  cqes_ = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  // Start reading ahead right away.
+  slots_.resize(depth);
+  for (int i = 0; i < depth; ++i) {
+    if (posix_memalign((void **)&slots_[i].buffer, kDirectAlignment,
+                       read_size_)) {
+      return false;
+    }
+    submit_uring_read(i);
+  }
+  return true;
+}
+
+inline void BlockFileReader::submit_uring_read(int slot) {
+  Slot &s = slots_[slot];
+  s.offset = next_read_offset_;
+  s.done = false;
+  if (s.offset >= file_size_) return;  // Nothing left to read.
+  next_read_offset_ += read_size_;
+  const uint32_t tail = sq_tail_->load(std::memory_order_relaxed);
+  const uint32_t index = tail & sq_mask_;
+  io_uring_sqe *const sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd_;
+  sqe->addr = (uint64_t)s.buffer;
+  sqe->len = std::min<uint64_t>(read_size_, file_size_ - s.offset);
+  sqe->off = s.offset;
+  sqe->user_data = slot;
+  sq_array_[index] = index;
+  sq_tail_->store(tail + 1, std::memory_order_release);
+  syscall(__NR_io_uring_enter, ring_fd_, 1, 0, 0, nullptr, 0);
+}
+
+inline bool BlockFileReader::fill_staging_uring() {
+  // The slot consumed last can be used to read ahead again.
+  if (staging_) {
+    const int consumed = (next_slot_ + slots_.size() - 1) % slots_.size();
+    submit_uring_read(consumed);
+  }
+  Slot &slot = slots_[next_slot_];
+  while (!slot.done) {  // Completions can arrive in any order.
+    const uint32_t head = cq_head_->load(std::memory_order_relaxed);
+    if (head == cq_tail_->load(std::memory_order_acquire)) {
+      const int ret = syscall(__NR_io_uring_enter, ring_fd_, 0, 1,
+                              IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (ret < 0 && errno != EINTR) {
+        fprintf(errstream_, "%s: io_uring: %s\n", filename_, strerror(errno));
+        return false;
+      }
+      continue;
+    }
+    const io_uring_cqe &cqe = cqes_[head & cq_mask_];
+    slots_[cqe.user_data].result = cqe.res;
+    slots_[cqe.user_data].done = true;
+    cq_head_->store(head + 1, std::memory_order_release);
+  }
+  if (slot.result < 0) {
+    fprintf(errstream_, "%s: %s\n", filename_, strerror(-slot.result));
+    return false;
+  }
+  const size_t expected = std::min<uint64_t>(read_size_,
+                                             file_size_ - slot.offset);
+  size_t got = slot.result;
+  while (got < expected) {  // Short read; get the rest synchronously.
+    const ssize_t more = pread(fd_, slot.buffer + got, expected - got,
+                               slot.offset + got);
+    if (more <= 0) {
+      fprintf(errstream_, "%s: short read\n", filename_);
+      return false;
+    }
+    got += more;
+  }
+  staging_ = slot.buffer;
+  staging_pos_ = 0;
+  staging_size_ = got;
+  next_slot_ = (next_slot_ + 1) % slots_.size();
+  return true;
+}
+#endif  // FASM_HAVE_IO_URING
+}  // namespace internal
+
+inline ParseResult parse_file_chunks(const char *filename,
+                                     const ReadOptions &read_options,
+                                     FILE *errstream,
+                                     const ChunkParser &parse_chunk,
+                                     const PipelineOptions &options,
+                                     PipelineStats *stats) {
+  if (read_options.backend != ReadBackend::kMmap) {
+    internal::BlockFileReader reader;
+    if (!reader.open(filename, read_options, errstream)) {
+      return ParseResult::kError;
+    }
+    return internal::parse_pipelined(&reader, parse_chunk, options, stats);
+  }
+
+  const auto start_time = std::chrono::steady_clock::now();
+  MappedFile file;
+  if (!file.map(filename, read_options, errstream)) return ParseResult::kError;
+  const std::string_view content = file.content();
+  if (content.empty()) return ParseResult::kSuccess;
+  if (content.back() != '\n') {
+    // Chunks are parsed in place, so can't add the newline.
+    return parse_chunk(0, ContentChunk{content, 1});
+  }
+  const int parse_threads = std::max(options.parse_threads, 1);
+  const std::vector<ContentChunk> chunks = split_lines(
+      content, balanced_chunk_count(content.size(), parse_threads),
+      parse_threads);
+  std::vector<ParseResult> results(chunks.size());
+  std::vector<int64_t> parse_us(chunks.size());
+  run_balanced(chunks.size(), parse_threads, [&](int worker, int i) {
+    const auto parse_start = std::chrono::steady_clock::now();
+    results[i] = parse_chunk(worker, chunks[i]);
+    parse_us[i] = internal::MicrosSince(parse_start);
+  });
+  if (stats) {
+    *stats = {};
+    stats->compressed_bytes = stats->content_bytes = content.size();
+    stats->blocks = chunks.size();
+    stats->lines = chunks.back().first_line - 1 +
+                   internal::count_newlines(
+                       chunks.back().content.data(),
+                       chunks.back().content.data() +
+                           chunks.back().content.size());
+    for (const int64_t us : parse_us) stats->parse_us += us;
+    stats->wall_us = internal::MicrosSince(start_time);
+  }
+  ParseResult result = ParseResult::kSuccess;
+  for (const ParseResult r : results) {
+    result = std::max(result, r);
+  }
+  return result;
+}
+}  // namespace fasm
+#endif  // SIMPLE_FASM_IO_H
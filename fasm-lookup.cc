@@ -0,0 +1,150 @@
+// Copyright 2022 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Print the lines of a few features of a large fasm file, using a feature
+// index next to it ("foo.fasm" -> "foo.fasmf") that is built with a full
+// parse the first time or when the file changed.
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "fasm-index.h"
+#include "fasm-io.h"
+#include "fasm-parse.h"
+#include "fasm-writer.h"
+
+int64_t getTimeInMicros() {
+  struct timeval t;
+  gettimeofday(&t, NULL);
+  return (int64_t)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+// Useful upper bound.
+static const int kMaxThreads = 2 * std::thread::hardware_concurrency();
+int GetThreadNumberToUse() {
+  const char *const parallel_env = getenv("PARALLEL_FASM");
+  return std::clamp(parallel_env ? atoi(parallel_env) : 1, 1, kMaxThreads);
+}
+
+// Parse all of "content" to build the index, each thread with its own
+// builder.
+fasm::FeatureIndex BuildIndex(std::string_view content,
+                              const fasm::SourceFingerprint &source,
+                              int thread_count) {
+  const std::vector<fasm::ContentChunk> chunks = fasm::split_lines(
+      content, fasm::balanced_chunk_count(content.size(), thread_count),
+      thread_count);
+  std::vector<fasm::FeatureIndexBuilder> builders;
+  builders.reserve(thread_count);
+  for (int i = 0; i < thread_count; ++i) builders.emplace_back(content);
+  fasm::run_balanced(chunks.size(), thread_count, [&](int worker, int i) {
+    fasm::parse(chunks[i], stderr,
+                builders[worker].wrap([](uint32_t, std::string_view, int,
+                                         int, uint64_t) { return true; }));
+  });
+  for (int i = 1; i < thread_count; ++i) builders[0].merge(builders[i]);
+  return builders[0].finish(source);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    printf("usage: %s <fasm-file> <feature> [<feature>...]\n"
+           "\tPrints lines with these features, preceded by a comment with "
+           "the line number.\n"
+           "\tThe index <fasm-file>f is built if needed; reads PARALLEL_FASM "
+           "environment variable\n\tfor #threads to use for that [1..%d].\n",
+           argv[0], kMaxThreads);
+    return 1;
+  }
+  const char *const fasm_file = argv[1];
+  // Lookups jump around in the file once it is indexed.
+  fasm::ReadOptions read_options;
+  read_options.advise_sequential = false;
+  fasm::MappedFile file;
+  if (!file.map(fasm_file, read_options, stderr)) return 1;
+  // An empty file is indexed as such, so every feature is reported missing.
+  const std::string_view content = file.content();
+  const struct stat &s = file.file_stat();
+  const fasm::SourceFingerprint source = fasm::fingerprint(
+      content, int64_t(s.st_mtim.tv_sec) * 1000000000 + s.st_mtim.tv_nsec);
+
+  const std::string index_name = std::string(fasm_file) + "f";
+  int64_t start_us = getTimeInMicros();
+  fasm::FeatureIndex index;
+  if (access(index_name.c_str(), R_OK) == 0 &&
+      index.read(index_name.c_str(), source, stderr)) {
+    fprintf(stderr, "Loaded %s with %zu lines. %.6fs\n", index_name.c_str(),
+            index.size(), (getTimeInMicros() - start_us) / 1e6);
+  } else {
+    index = BuildIndex(content, source, GetThreadNumberToUse());
+    if (!index.write(index_name.c_str())) {
+      perror("Writing index failed");
+    }
+    fprintf(stderr, "Indexed %zu lines, wrote %s. %.3fs\n", index.size(),
+            index_name.c_str(), (getTimeInMicros() - start_us) / 1e6);
+  }
+
+  // Collected in a string, so that timing does not include writing.
+  start_us = getTimeInMicros();
+  std::string out;
+  fasm::Writer writer(&out);
+  uint32_t last_line = 0;
+  int missing = 0;
+  fasm::ParseResult result = fasm::ParseResult::kSuccess;
+  for (int i = 2; i < argc; ++i) {
+    int found = 0;
+    const auto print_line_number = [&](uint32_t line) {
+      if (line == last_line) return;
+      writer.end_line();
+      out.append("# line ").append(std::to_string(line)).append("\n");
+      last_line = line;
+      ++found;
+    };
+    auto write_feature = writer.parse_callback();
+    auto write_wide = writer.wide_callback();
+    result = std::max(
+        result,
+        fasm::lookup(
+            index, content, {argv[i]}, stderr,
+            [&](uint32_t line, std::string_view feature, int start_bit,
+                int width, uint64_t bits) {
+              print_line_number(line);
+              return write_feature(line, feature, start_bit, width, bits);
+            },
+            writer.annotation_callback(),
+            [&](uint32_t line, std::string_view feature, int start_bit,
+                int width, const uint64_t *bits) {
+              print_line_number(line);
+              return write_wide(line, feature, start_bit, width, bits);
+            }));
+    if (!found) {
+      fprintf(stderr, "%s: not found\n", argv[i]);
+      ++missing;
+    }
+  }
+  writer.end_line();
+  fprintf(stderr, "Looked up %d feature%s. %.6fs\n", argc - 2,
+          argc > 3 ? "s" : "", (getTimeInMicros() - start_us) / 1e6);
+  fwrite(out.data(), 1, out.size(), stdout);
+  return (missing == 0 && result <= fasm::ParseResult::kNonCritical) ? 0 : 1;
+}
@@ -18,12 +18,23 @@
 #define SIMPLE_FASM_PARSE_H
 
 #include <stdio.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cinttypes>
 #include <cstdint>
 #include <functional>
+#include <string>
 #include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 namespace fasm {
 // Parse callback for FASM lines. The "feature" found in line number "line"
@@ -41,6 +52,14 @@ using AnnotationCallback =
     std::function<void(uint32_t line, std::string_view feature, //
                        std::string_view name, std::string_view value)>;
 
+// Optional callback for features with ranges wider than 64 bits, receiving
+// the value in one call. "bits" points to (width + 63) / 64 words, least
+// significant word first. If not provided, such values are passed to the
+// ParseCallback in slices of up to 64 bits with increasing start_bit.
+using WideParseCallback =
+    std::function<bool(uint32_t line, std::string_view feature, int start_bit,
+                       int width, const uint64_t *bits)>;
+
 // Result values in increasing amount of severity. Start to worry at kSkipped.
 enum class ParseResult {
   kSuccess,     // Successful parse
@@ -51,6 +70,70 @@ enum class ParseResult {
   kError        // Errornous input
 };
 
+// Kind of issue found while parsing.
+enum class DiagnosticCode {
+  kMissingFinalNewline,         // Content does not end with a newline.
+  kExpectedCloseBracket,        // Bit range without closing ']'.
+  kInvertedRange,               // Bit range with max_bit < min_bit.
+  kValueTooWide,                // Value precision exceeds bit range width.
+  kUnknownBase,                 // Not one of b, d, h, o after the tick.
+  kRangeWithoutValue,           // Range of bits but no assignment.
+  kAnnotationExpectedEquals,    // Annotation name not followed by '='.
+  kAnnotationNotQuoted,         // Annotation value not in quotes.
+  kAnnotationUnterminated,      // End of line in annotation value.
+  kAnnotationExpectedSeparator, // Not ',' or '}' after annotation.
+  kExpectedNewline,             // Unexpected character at end of line.
+};
+constexpr int kDiagnosticCodeCount = 11;
+
+// Short name of the code, e.g. "inverted-range".
+inline const char *diagnostic_code_name(DiagnosticCode code);
+
+// An issue found while parsing, not yet formatted as message. The
+// string_views point into the parsed content.
+struct Diagnostic {
+  ParseResult severity;
+  DiagnosticCode code;
+  uint32_t line = 0;              // Line number; 0 if not about a line.
+  uint64_t offset = 0;            // Byte offset in the whole content.
+  std::string_view feature = {};  // Feature; text read for ']' expected.
+  std::string_view name = {};     // Annotation name, if any.
+  int max_bit = 0;                // Range of the feature, if known.
+  int min_bit = 0;
+  uint64_t value = 0;             // Precision given if value is too wide.
+  char found = 0;                 // Unexpected character, if any.
+};
+
+// Receives diagnostics from the parser. Parsing in parallel calls report()
+// from multiple threads, so a sink shared between them needs to be
+// thread-safe. The base class ignores all diagnostics.
+//
+// (Not deleted through base class pointer nor abstract, so that the C
+// API can be linked without the C++ runtime library.)
+class DiagnosticSink {
+ public:
+  virtual void report(const Diagnostic &) {}
+
+ protected:
+  ~DiagnosticSink() = default;
+};
+
+// Print diagnostic as one line message, e.g. "42: SKIP inverted range ..."
+inline void print_diagnostic(FILE *out, const Diagnostic &diagnostic);
+
+// Sink printing each diagnostic right away. Used by all functions that take
+// a "FILE *errstream".
+class FileDiagnosticSink final : public DiagnosticSink {
+ public:
+  explicit FileDiagnosticSink(FILE *out) : out_(out) {}
+  void report(const Diagnostic &diagnostic) final {
+    print_diagnostic(out_, diagnostic);
+  }
+
+ private:
+  FILE *const out_;
+};
+
 // Parse FPGA assembly file, send parsed values to "parse_callback".
 // The "content" is the buffer to parse; last line needs to end with a newline.
 // Errors/Warnings are reported to "errstream".
@@ -71,9 +154,403 @@ inline ParseResult parse(std::string_view content, FILE *errstream,
                          const ParseCallback &parse_callback,
                          const AnnotationCallback &annotation_callback = {});
 
+// Same as above, but accepting any callable with the signature of
+// ParseCallback and AnnotationCallback. As the type of the callbacks is known
+// at compile time, they can be inlined into the parse loop, which avoids the
+// overhead of going through std::function for each line.
+// Pass nullptr as "annotation_callback" if not interested in annotations.
+// The optional "wide_callback" with the signature of WideParseCallback
+// receives values wider than 64 bits in one piece.
+template <typename ParseCallbackT,
+          typename AnnotationCallbackT = std::nullptr_t,
+          typename WideParseCallbackT = std::nullptr_t>
+inline ParseResult parse(std::string_view content, FILE *errstream,
+                         ParseCallbackT &&parse_callback,
+                         AnnotationCallbackT &&annotation_callback = nullptr,
+                         WideParseCallbackT &&wide_callback = nullptr);
+
+// A line-aligned part of a larger content, e.g. to be parsed in parallel.
+struct ContentChunk {
+  std::string_view content;  // Complete lines, ending with a newline.
+  uint32_t first_line;       // Line number of first line in whole content.
+  uint64_t offset = 0;       // Byte offset of content in whole content.
+};
+
+// Like parse() above, but parse a chunk of a larger content; line numbers
+// passed to the callbacks and in error messages are relative to the
+// whole content.
+template <typename ParseCallbackT,
+          typename AnnotationCallbackT = std::nullptr_t,
+          typename WideParseCallbackT = std::nullptr_t>
+inline ParseResult parse(const ContentChunk &chunk, FILE *errstream,
+                         ParseCallbackT &&parse_callback,
+                         AnnotationCallbackT &&annotation_callback = nullptr,
+                         WideParseCallbackT &&wide_callback = nullptr);
+
+// Like the parse() functions above, but issues are reported as Diagnostic
+// to "diagnostics" instead of being printed, e.g. to a DiagnosticCollector
+// (fasm-diagnostics.h) that buffers them per thread.
+template <typename ParseCallbackT,
+          typename AnnotationCallbackT = std::nullptr_t,
+          typename WideParseCallbackT = std::nullptr_t>
+inline ParseResult parse(const ContentChunk &chunk,
+                         DiagnosticSink *diagnostics,
+                         ParseCallbackT &&parse_callback,
+                         AnnotationCallbackT &&annotation_callback = nullptr,
+                         WideParseCallbackT &&wide_callback = nullptr);
+
+template <typename ParseCallbackT,
+          typename AnnotationCallbackT = std::nullptr_t,
+          typename WideParseCallbackT = std::nullptr_t>
+inline ParseResult parse(std::string_view content,
+                         DiagnosticSink *diagnostics,
+                         ParseCallbackT &&parse_callback,
+                         AnnotationCallbackT &&annotation_callback = nullptr,
+                         WideParseCallbackT &&wide_callback = nullptr) {
+  return parse(ContentChunk{content, 1}, diagnostics, parse_callback,
+               annotation_callback, wide_callback);
+}
+
+// An executor runs task(0) ... task(count - 1), possibly in parallel, and
+// returns once all of them are finished. Allows to plug in an existing
+// thread pool; if not set, run_threads() is used.
+using Executor =
+    std::function<void(int count, const std::function<void(int)> &task)>;
+
+// Default executor: run each of the tasks in its own thread.
+inline void run_threads(int count, const std::function<void(int)> &task);
+
+// Run task(worker, i) for i = 0 ... task_count - 1 on "thread_count"
+// workers. Each worker picks the next task not started yet, so workers done
+// early take over remaining work instead of waiting for the slowest.
+// With an "executor", it runs the workers.
+inline void run_balanced(int task_count, int thread_count,
+                         const std::function<void(int worker, int task)> &task,
+                         const Executor &executor = {});
+
+// Number of chunks to split "content_size" bytes into for "thread_count"
+// threads with run_balanced(): multiple per thread, as content is not
+// uniform, but not so small that the overhead per chunk matters.
+inline int balanced_chunk_count(size_t content_size, int thread_count);
+
+// Split "content" at line boundaries into at most "count" chunks of about
+// equal size. Lines are counted in parallel with run_balanced() on
+// "thread_count" workers, run by "executor" if given, to determine the
+// first_line of each chunk.
+// Content needs to end with a newline.
+inline std::vector<ContentChunk> split_lines(std::string_view content,
+                                             int count, int thread_count = 1,
+                                             const Executor &executor = {});
+
+// Parse "content" in parallel with "thread_count" threads. Same as parse(),
+// but the callbacks are called concurrently from multiple threads, so need
+// to be thread-safe. Line numbers are relative to the whole content.
+// The content is split in balanced_chunk_count() chunks handed out with
+// run_balanced().
+// The most severe issue found in any of the chunks is returned.
+template <typename ParseCallbackT,
+          typename AnnotationCallbackT = std::nullptr_t>
+inline ParseResult parse_parallel(std::string_view content, int thread_count,
+                                  FILE *errstream,
+                                  ParseCallbackT &&parse_callback,
+                                  AnnotationCallbackT &&annotation_callback =
+                                      nullptr,
+                                  const Executor &executor = {});
+
+// Block of parsed records in struct-of-arrays layout, for consumers that
+// prefer to process many records at once, e.g. looping over bits[] with SIMD.
+// Record i has the same meaning as the ParseCallback parameters.
+// Fairly large, so better allocate on the heap.
+template <int kCapacity = 4096>
+struct RecordBlock {
+  static constexpr int capacity = kCapacity;
+
+  int size = 0;  // Number of valid records.
+  uint32_t line[kCapacity];
+  const char *feature[kCapacity];
+  uint32_t feature_length[kCapacity];
+  int start_bit[kCapacity];
+  int width[kCapacity];
+  uint64_t bits[kCapacity];
+
+  std::string_view feature_name(int i) const {
+    return {feature[i], feature_length[i]};
+  }
+
+  // Annotations found in the lines of this block.
+  struct Annotation {
+    int record;  // Index of feature record of that line; -1 if none.
+    uint32_t line;
+    std::string_view name;
+    std::string_view value;
+  };
+  std::vector<Annotation> annotations;
+};
+
+// Parse "content" like parse(), but collect records in "block" and call
+// "batch_callback" with it each time it is full, and at the end of the
+// content with the remaining records. The callback gets a
+// "const RecordBlock<kCapacity> &" and returns 'false' to abort parsing.
+// Values wider than 64 bits are stored in slices of up to 64 bits.
+template <int kCapacity, typename BatchCallbackT>
+inline ParseResult parse_batched(const ContentChunk &chunk, FILE *errstream,
+                                 RecordBlock<kCapacity> *block,
+                                 BatchCallbackT &&batch_callback);
+
+template <int kCapacity, typename BatchCallbackT>
+inline ParseResult parse_batched(std::string_view content, FILE *errstream,
+                                 RecordBlock<kCapacity> *block,
+                                 BatchCallbackT &&batch_callback) {
+  return parse_batched(ContentChunk{content, 1}, errstream, block,
+                       batch_callback);
+}
+
+// Feature name split into its dot-separated hierarchy segments, e.g.
+// "TILE_X1Y2.SLICEL_X0.ALUT.INIT" has the four segments "TILE_X1Y2",
+// "SLICEL_X0", "ALUT" and "INIT". Names with more than kMaxSegments segments
+// are not split further: the last segment contains the remaining dots.
+struct FeatureSegments {
+  static constexpr int kMaxSegments = 16;
+
+  std::string_view name;       // The full feature name.
+  int count = 0;               // Number of segments.
+  uint32_t end[kMaxSegments];  // Position after each segment in name.
+
+  std::string_view segment(int i) const {
+    const uint32_t start = (i == 0) ? 0 : end[i - 1] + 1;
+    return name.substr(start, end[i] - start);
+  }
+
+  // Name up to and including segment i, e.g. prefix(0) is the tile.
+  std::string_view prefix(int i) const { return name.substr(0, end[i]); }
+};
+
+// Like parse(), but the segment boundaries of the feature name are recorded
+// while scanning it, so the callback does not need to split it again.
+// The "segment_callback" has the signature
+//   bool(uint32_t line, const FeatureSegments &feature, int start_bit,
+//        int width, uint64_t bits)
+// Values wider than 64 bits are passed in slices of up to 64 bits.
+template <typename SegmentCallbackT,
+          typename AnnotationCallbackT = std::nullptr_t>
+inline ParseResult parse_segmented(const ContentChunk &chunk, FILE *errstream,
+                                   SegmentCallbackT &&segment_callback,
+                                   AnnotationCallbackT &&annotation_callback =
+                                       nullptr);
+
+template <typename SegmentCallbackT,
+          typename AnnotationCallbackT = std::nullptr_t>
+inline ParseResult parse_segmented(std::string_view content, FILE *errstream,
+                                   SegmentCallbackT &&segment_callback,
+                                   AnnotationCallbackT &&annotation_callback =
+                                       nullptr) {
+  return parse_segmented(ContentChunk{content, 1}, errstream,
+                         segment_callback, annotation_callback);
+}
+
+// Counters of what was found while parsing with parse_with_stats(), e.g. to
+// understand why a particular file parses slowly. A line can be counted in
+// multiple classes, e.g. as ranged feature with hex assignment and
+// annotation.
+struct ParseStats {
+  // Kinds of assignment counted in "assignments".
+  enum Assignment {
+    kNoAssignment,  // FEATURE or FEATURE[3:0] without '='.
+    kPlainNumber,   // FEATURE[3:0] = 5, decimal without width.
+    kBinary,        // FEATURE[3:0] = 4'b0101
+    kOctal,
+    kDecimal,
+    kHex,
+    kAssignmentKinds
+  };
+
+  // Histogram bucket i counts values that need i bits, i.e. values 0, 1,
+  // 2..3, 4..7 and so on. The last bucket includes all larger values.
+  static constexpr int kHistogramBuckets = 18;
+  static int histogram_bucket(uint64_t value) {
+    const int bits = value ? 64 - __builtin_clzll(value) : 0;
+    return std::min(bits, kHistogramBuckets - 1);
+  }
+
+  uint64_t bytes = 0;
+  uint64_t lines = 0;
+  uint64_t blank_lines = 0;    // Empty or only whitespace.
+  uint64_t comment_lines = 0;  // Only a comment.
+  uint64_t error_lines = 0;    // Lines with at least one diagnostic.
+  uint64_t plain_features = 0;   // Feature without bit range.
+  uint64_t ranged_features = 0;  // Feature with [max:min] or [bit].
+  uint64_t assignments[kAssignmentKinds] = {};
+  uint64_t annotated_lines = 0;
+  uint64_t annotations = 0;       // Name/value pairs; needs callback.
+  uint64_t annotation_bytes = 0;  // From '{' to end of line.
+  uint64_t width_histogram[kHistogramBuckets] = {};
+  uint64_t name_length_histogram[kHistogramBuckets] = {};
+  int64_t duration_us = 0;  // Wall time spent parsing.
+
+  void add(const ParseStats &other);
+};
+
+// Like parse(), but also count lines by class and other statistics in
+// "stats". The counting is only compiled into this variant of the parse
+// loop, so plain parse() does not pay for it.
+template <typename ParseCallbackT,
+          typename AnnotationCallbackT = std::nullptr_t,
+          typename WideParseCallbackT = std::nullptr_t>
+inline ParseResult parse_with_stats(
+    const ContentChunk &chunk, DiagnosticSink *diagnostics, ParseStats *stats,
+    ParseCallbackT &&parse_callback,
+    AnnotationCallbackT &&annotation_callback = nullptr,
+    WideParseCallbackT &&wide_callback = nullptr);
+
+template <typename ParseCallbackT,
+          typename AnnotationCallbackT = std::nullptr_t,
+          typename WideParseCallbackT = std::nullptr_t>
+inline ParseResult parse_with_stats(
+    std::string_view content, FILE *errstream, ParseStats *stats,
+    ParseCallbackT &&parse_callback,
+    AnnotationCallbackT &&annotation_callback = nullptr,
+    WideParseCallbackT &&wide_callback = nullptr);
+
+// Like parse_parallel(), with statistics of each of the "thread_count"
+// workers in "worker_stats", e.g. to see the imbalance between threads.
+template <typename ParseCallbackT,
+          typename AnnotationCallbackT = std::nullptr_t>
+inline ParseResult parse_parallel_with_stats(
+    std::string_view content, int thread_count, FILE *errstream,
+    std::vector<ParseStats> *worker_stats, ParseCallbackT &&parse_callback,
+    AnnotationCallbackT &&annotation_callback = nullptr,
+    const Executor &executor = {});
+
+// Incremental parser for content arriving in fragments with arbitrary
+// boundaries, e.g. read from a pipe, socket or decompressor. Complete lines
+// are parsed as they become available; partial lines are kept until the rest
+// arrives. Line numbers are counted across all fragments.
+//
+// Callbacks are as in parse(). Note, the string_views passed to the callbacks
+// are only valid during the callback, as the fragments are ephemeral.
+template <typename ParseCallbackT,
+          typename AnnotationCallbackT = std::nullptr_t,
+          typename WideParseCallbackT = std::nullptr_t>
+class StreamParser {
+ public:
+  StreamParser(FILE *errstream, ParseCallbackT parse_callback,
+               AnnotationCallbackT annotation_callback = nullptr,
+               WideParseCallbackT wide_callback = nullptr);
+
+  // Parse the next fragment of the content. Returns 'false' if the callback
+  // requested to abort; any further content is ignored then.
+  bool feed(std::string_view fragment);
+
+  // Finish parsing: the last line does not need to end with a newline.
+  // Returns the most severe issue found.
+  ParseResult finish();
+
+  // Most severe issue found so far.
+  ParseResult result() const { return result_; }
+
+  // Number of complete lines seen so far.
+  uint32_t line_count() const { return line_count_; }
+
+ private:
+  void parse_lines(std::string_view lines);
+
+  FILE *const errstream_;
+  ParseCallbackT parse_callback_;
+  AnnotationCallbackT annotation_callback_;
+  WideParseCallbackT wide_callback_;
+  std::string partial_line_;  // Content after the last newline.
+  uint32_t line_count_ = 0;
+  uint64_t offset_ = 0;  // Bytes parsed so far.
+  ParseResult result_ = ParseResult::kSuccess;
+  bool aborted_ = false;
+};
+
 // -- End of API interface; rest is implementation details
 
+inline const char *diagnostic_code_name(DiagnosticCode code) {
+  switch (code) {
+  case DiagnosticCode::kMissingFinalNewline: return "missing-final-newline";
+  case DiagnosticCode::kExpectedCloseBracket: return "expected-close-bracket";
+  case DiagnosticCode::kInvertedRange: return "inverted-range";
+  case DiagnosticCode::kValueTooWide: return "value-too-wide";
+  case DiagnosticCode::kUnknownBase: return "unknown-base";
+  case DiagnosticCode::kRangeWithoutValue: return "range-without-value";
+  case DiagnosticCode::kAnnotationExpectedEquals:
+    return "annotation-expected-equals";
+  case DiagnosticCode::kAnnotationNotQuoted: return "annotation-not-quoted";
+  case DiagnosticCode::kAnnotationUnterminated:
+    return "annotation-unterminated";
+  case DiagnosticCode::kAnnotationExpectedSeparator:
+    return "annotation-expected-separator";
+  case DiagnosticCode::kExpectedNewline: return "expected-newline";
+  }
+  return "unknown";
+}
+
+inline void print_diagnostic(FILE *out, const Diagnostic &d) {
+  const int feature_len = d.feature.size();
+  const char *const feature = d.feature.data();
+  switch (d.code) {
+  case DiagnosticCode::kMissingFinalNewline:
+    fprintf(out, "content does not end with a newline\n");
+    break;
+  case DiagnosticCode::kExpectedCloseBracket:
+    fprintf(out, "%u: ERR expected ']' : '%.*s'\n", d.line, feature_len,
+            feature);
+    break;
+  case DiagnosticCode::kInvertedRange:
+    fprintf(out, "%u: SKIP inverted range %.*s[%d:%d]\n", d.line,
+            feature_len, feature, d.max_bit, d.min_bit);
+    break;
+  case DiagnosticCode::kValueTooWide:
+    fprintf(out,
+            "%u: WARN Attempt to assign more bits (%" PRIu64 "') for "
+            "%.*s[%d:%d] with supported bit width of %d\n",
+            d.line, d.value, feature_len, feature, d.max_bit, d.min_bit,
+            d.max_bit - d.min_bit + 1);
+    break;
+  case DiagnosticCode::kUnknownBase:
+    fprintf(out, "%u: unknown base signifier '%c'; expected "
+            "one of b, d, h, o\n", d.line, d.found);
+    break;
+  case DiagnosticCode::kRangeWithoutValue:
+    fprintf(out, "%u: INFO Range of bits %.*s[%d:%d], but no assignment\n",
+            d.line, feature_len, feature, d.max_bit, d.min_bit);
+    break;
+  case DiagnosticCode::kAnnotationExpectedEquals:
+    fprintf(out, "%u: annotation %.*s: expected '='\n", d.line,
+            (int)d.name.size(), d.name.data());
+    break;
+  case DiagnosticCode::kAnnotationNotQuoted:
+    fprintf(out, "%u: %.*s : annotation '%.*s': value not quoted\n", d.line,
+            feature_len, feature, (int)d.name.size(), d.name.data());
+    break;
+  case DiagnosticCode::kAnnotationUnterminated:
+    fprintf(out, "%u: annotation not finished before end of line\n", d.line);
+    break;
+  case DiagnosticCode::kAnnotationExpectedSeparator:
+    fprintf(out, "%u: annotations: expected ',' or '}'; got '%c'\n", d.line,
+            d.found);
+    break;
+  case DiagnosticCode::kExpectedNewline:
+    fprintf(out, "%u: expected newline, got '%c'\n", d.line, d.found);
+    break;
+  }
+}
+
 namespace internal {
+template <typename T>
+struct is_std_function : std::false_type {};
+template <typename R, typename... Args>
+struct is_std_function<std::function<R(Args...)>> : std::true_type {};
+
+// Optional callbacks given as std::function or pointer can be empty at
+// runtime, and are then treated like nullptr.
+template <typename CallbackT>
+inline constexpr bool kMaybeEmptyCallback =
+    is_std_function<std::decay_t<CallbackT>>::value ||
+    std::is_pointer_v<std::decay_t<CallbackT>>;
+
 // This look-up table maps ASCII characters to its integer value if it is a
 // digit; anything outside the range of a valid digit stops number parsing.
 //
@@ -107,11 +584,13 @@ inline constexpr int8_t kDigitToInt[256] = {
     99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
 };
 
-// ASCII -> is valid identifier for the feature name.
+// ASCII -> is valid identifier for the feature name. The dot separating
+// hierarchy segments is marked differently, but still evaluates to true.
+inline constexpr char kSegmentSeparator = 2;
 inline constexpr char kValidIdentifier[256] = {
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, // dot
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0, // dot
     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, // digits
     0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // LETTERS
     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, // LETTERS, ... underscore
@@ -128,6 +607,84 @@ inline constexpr char kValidIdentifier[256] = {
 };
 
 typedef uint16_t bit_range_t;  // gcc slightly faster with 16 bit
+
+// Find the first newline at or after "it". There must be a newline
+// before the end of the buffer.
+//
+// Aligned vector loads never cross a page boundary, so the last load (the one
+// that contains the newline) might read a few bytes beyond the end of the
+// buffer, but never touches a page that doesn't contain part of the buffer.
+inline const char *find_newline(const char *it) {
+#if defined(__AVX2__)
+  const __m256i newline = _mm256_set1_epi8('\n');
+  const char *block = (const char *)((uintptr_t)it & ~uintptr_t(31));
+  uint32_t found = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+      _mm256_load_si256((const __m256i *)block), newline));
+  found &= uint32_t(-1) << (it - block);  // Ignore matches before "it"
+  while (!found) {
+    block += 32;
+    found = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+        _mm256_load_si256((const __m256i *)block), newline));
+  }
+  return block + __builtin_ctz(found);
+#elif defined(__SSE2__)
+  const __m128i newline = _mm_set1_epi8('\n');
+  const char *block = (const char *)((uintptr_t)it & ~uintptr_t(15));
+  uint32_t found = _mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_load_si128((const __m128i *)block), newline));
+  found &= uint32_t(-1) << (it - block);  // Ignore matches before "it"
+  while (!found) {
+    block += 16;
+    found = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_load_si128((const __m128i *)block), newline));
+  }
+  return block + __builtin_ctz(found);
+#else
+  while (*it != '\n') ++it;
+  return it;
+#endif
+}
+
+// Count number of newlines in the range [begin, end).
+inline size_t count_newlines(const char *begin, const char *end) {
+  size_t count = 0;
+  // Vector versions: count matches in each byte lane (cmpeq yields -1 per
+  // match) and sum up the lanes before they could overflow after 255 rounds.
+#if defined(__AVX2__)
+  const __m256i newline = _mm256_set1_epi8('\n');
+  while (end - begin >= 32) {
+    __m256i lane_counts = _mm256_setzero_si256();
+    for (int round = 0; round < 255 && end - begin >= 32;
+         ++round, begin += 32) {
+      const __m256i data = _mm256_loadu_si256((const __m256i *)begin);
+      lane_counts = _mm256_sub_epi8(lane_counts,
+                                    _mm256_cmpeq_epi8(data, newline));
+    }
+    uint64_t sums[4];
+    _mm256_storeu_si256((__m256i *)sums,
+                        _mm256_sad_epu8(lane_counts, _mm256_setzero_si256()));
+    count += sums[0] + sums[1] + sums[2] + sums[3];
+  }
+#elif defined(__SSE2__)
+  const __m128i newline = _mm_set1_epi8('\n');
+  while (end - begin >= 16) {
+    __m128i lane_counts = _mm_setzero_si128();
+    for (int round = 0; round < 255 && end - begin >= 16;
+         ++round, begin += 16) {
+      const __m128i data = _mm_loadu_si128((const __m128i *)begin);
+      lane_counts = _mm_sub_epi8(lane_counts, _mm_cmpeq_epi8(data, newline));
+    }
+    uint64_t sums[2];
+    _mm_storeu_si128((__m128i *)sums,
+                     _mm_sad_epu8(lane_counts, _mm_setzero_si128()));
+    count += sums[0] + sums[1];
+  }
+#endif
+  for (/**/; begin < end; ++begin) {
+    count += (*begin == '\n');
+  }
+  return count;
+}
 }  // namespace internal
 
 // [[unlikely]] only available since c++20, so use gcc/clang builtin here.
@@ -137,35 +694,314 @@ typedef uint16_t bit_range_t;  // gcc slightly faster with 16 bit
 #define fasm_skip_blank() while (*it == ' ' || *it == '\t') ++it
 
 // Skip forward until we sit on the '\n' end of current line.
-#define fasm_skip_to_eol() while (*it != '\n') ++it
+#define fasm_skip_to_eol() it = internal::find_newline(it)
 
 // Skip forward beyond the end of current line. To be used before 'continue'.
 #define fasm_skip_to_start_of_next_line() fasm_skip_to_eol(); ++it
 
+namespace internal {
+// Parse digits with given base (any base between 2 and 16 is supported) and
+// accumulate in "v". Digit separators are skipped.
+template <int base, typename T>
+inline void parse_digits_scalar(const char *&it, T &v) {
+  for (int8_t d; (d = kDigitToInt[(uint8_t)*it]) < base; ++it) {
+    if (d != kDigitSeparator) v = v * base + d;
+  }
+}
+
+// SWAR ("SIMD within a register"): look at 8 characters at once.
+inline constexpr uint64_t kSwarOnes = 0x0101010101010101;
+inline constexpr uint64_t kSwarHighBits = 0x8080808080808080;
+
+// High bit set in each byte of "x" that is in the exclusive range (m, n).
+// From Bit Twiddling Hacks hasbetween(); works for 0 <= m < n <= 128.
+constexpr uint64_t swar_between(uint64_t x, uint8_t m, uint8_t n) {
+  return (kSwarOnes * (127 + n) - (x & kSwarOnes * 127)) & ~x &
+         ((x & kSwarOnes * 127) + kSwarOnes * (127 - m)) & kSwarHighBits;
+}
+
+inline constexpr uint64_t kPow10[9] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+
+// Fast path for hex, decimal and binary numbers: convert up to 8 digits at a
+// time, as long as they are not interrupted by a digit separator. Stops
+// at the first non-digit, from where parse_digits_scalar() can take over.
+// Needs at least 8 readable bytes at "it", so stops if closer to "end".
+template <int base, typename T>
+inline void parse_digits_swar(const char *&it, const char *end, T &v) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if constexpr (base == 16 || base == 10 || base == 2) {
+    while (end - it >= 8) {
+      uint64_t chars;
+      memcpy(&chars, it, sizeof(chars));  // First char in lowest byte.
+      uint64_t is_digit;
+      uint64_t digits;  // Value of each digit in its byte.
+      if constexpr (base == 16) {
+        const uint64_t is_alpha =
+            swar_between(chars | kSwarOnes * 0x20, 'a' - 1, 'f' + 1);
+        is_digit = swar_between(chars, '0' - 1, '9' + 1) | is_alpha;
+        digits = (chars & kSwarOnes * 0x0f) + (is_alpha >> 7) * 9;
+      } else if constexpr (base == 10) {
+        is_digit = swar_between(chars, '0' - 1, '9' + 1);
+        digits = chars & kSwarOnes * 0x0f;
+      } else {
+        is_digit = swar_between(chars, '0' - 1, '1' + 1);
+        digits = chars & kSwarOnes;
+      }
+      const uint64_t non_digit = ~is_digit & kSwarHighBits;
+      const int count = non_digit ? __builtin_ctzll(non_digit) / 8 : 8;
+      if (count == 0) return;
+
+      // Move the digits to the most significant bytes, so that the
+      // preceding bytes are leading zeroes, then combine.
+      digits <<= 8 * (8 - count);
+      if constexpr (base == 16) {
+        digits = ((digits << 4) | (digits >> 8)) & 0x00FF00FF00FF00FF;
+        digits = ((digits << 8) | (digits >> 16)) & 0x0000FFFF0000FFFF;
+        digits = ((digits << 16) | (digits >> 32)) & 0x00000000FFFFFFFF;
+        v = T((uint64_t(v) << (4 * count)) | digits);
+      } else if constexpr (base == 10) {
+        digits = (digits * 2561) >> 8;
+        digits = ((digits & 0x00FF00FF00FF00FF) * 6553601) >> 16;
+        digits = ((digits & 0x0000FFFF0000FFFF) * 42949672960001) >> 32;
+        v = T(uint64_t(v) * kPow10[count] + digits);
+      } else {
+        digits = (digits * 0x8040201008040201) >> 56;
+        v = T((uint64_t(v) << count) | digits);
+      }
+      it += count;
+      if (count < 8) return;
+    }
+  }
+#endif
+}
+}  // namespace internal
+
 // Parse number with given base (any base between 2 and 16 is supported)
 #define fasm_parse_number_with_base(v, base)                                   \
   fasm_skip_blank();                                                           \
-  for (int8_t d; (d = internal::kDigitToInt[(uint8_t)*it]) < (base); ++it)     \
-    if (d == internal::kDigitSeparator) {                                      \
-    } else                                                                     \
-      v = v * (base) + d
+  internal::parse_digits_swar<base>(it, end, v);                               \
+  internal::parse_digits_scalar<base>(it, v)
 
-inline ParseResult parse(std::string_view content, FILE *errstream,
-                         const ParseCallback &parse_callback,
-                         const AnnotationCallback &annotation_callback) {
+namespace internal {
+// Values wider than 64 bits are stored in an array of words, least
+// significant first. This is the maximum width of a bit_range_t range.
+inline constexpr int kMaxWideWords = (1 << (8 * sizeof(bit_range_t))) / 64;
+
+// Parse number with given base (between 2 and 16) into "words"; bits
+// beyond what fits into "word_count" words are dropped.
+inline void parse_wide_number(const char *&it, int base, uint64_t *words,
+                              int word_count) {
+  std::fill(words, words + word_count, 0);
+  fasm_skip_blank();
+  if (base == 2 || base == 8 || base == 16) {
+    // Each digit maps to a fixed set of bits, so find the end of the
+    // number and fill the words from the least significant digit.
+    const int bits_per_digit = (base == 16) ? 4 : (base == 8) ? 3 : 1;
+    const char *const start = it;
+    while (kDigitToInt[(uint8_t)*it] < base) {
+      ++it;
+    }
+    const int max_bits = 64 * word_count;
+    int bit_pos = 0;
+    for (const char *digit = it - 1; digit >= start && bit_pos < max_bits;
+         --digit) {
+      const int8_t d = kDigitToInt[(uint8_t)*digit];
+      if (d == kDigitSeparator) continue;
+      const int word = bit_pos / 64;
+      const int shift = bit_pos % 64;
+      words[word] |= uint64_t(d) << shift;
+      if (shift + bits_per_digit > 64 && word + 1 < word_count) {
+        words[word + 1] |= uint64_t(d) >> (64 - shift);  // octal straddling
+      }
+      bit_pos += bits_per_digit;
+    }
+    return;
+  }
+
+  // Other bases: multiply-add over all words, in 32 bit halves.
+  for (int8_t d; (d = kDigitToInt[(uint8_t)*it]) < base; ++it) {
+    if (d == kDigitSeparator) continue;
+    uint64_t carry = d;
+    for (int i = 0; i < word_count; ++i) {
+      const uint64_t lo = (words[i] & 0xffffffff) * base + carry;
+      const uint64_t hi = (words[i] >> 32) * base + (lo >> 32);
+      words[i] = (hi << 32) | (lo & 0xffffffff);
+      carry = hi >> 32;
+    }
+  }
+}
+
+inline ParseStats::Assignment assignment_kind(char format_type) {
+  switch (format_type) {
+  case 'b': return ParseStats::kBinary;
+  case 'o': return ParseStats::kOctal;
+  case 'd': return ParseStats::kDecimal;
+  case 'h': return ParseStats::kHex;
+  default: return ParseStats::kNoAssignment;  // Invalid.
+  }
+}
+
+// Forwards diagnostics, counting the lines they are in.
+class LineCountingSink final : public DiagnosticSink {
+ public:
+  LineCountingSink(DiagnosticSink *forward, uint64_t *count)
+      : forward_(forward), count_(count) {}
+  void report(const Diagnostic &diagnostic) final {
+    if (!seen_any_ || diagnostic.line != last_line_) ++*count_;
+    seen_any_ = true;
+    last_line_ = diagnostic.line;
+    forward_->report(diagnostic);
+  }
+
+ private:
+  DiagnosticSink *const forward_;
+  uint64_t *const count_;
+  bool seen_any_ = false;
+  uint32_t last_line_ = 0;
+};
+
+// Report issue found at "pos" in "chunk". Out of line, as it is rarely
+// needed and should not take up space in the parse loop.
+__attribute__((noinline, cold)) inline void report(
+    DiagnosticSink *diagnostics, const ContentChunk &chunk, const char *pos,
+    Diagnostic diagnostic) {
+  diagnostic.offset = chunk.offset + (pos - chunk.content.data());
+  diagnostics->report(diagnostic);
+}
+
+// Parse the optional assignment of a feature whose range is wider than 64
+// bits and report it to "wide_callback" or, if that is nullptr, to the
+// "parse_callback" in slices of up to 64 bits.
+// Issues are reported to diagnostics and "result" updated accordingly.
+// Returns 'false' if the callback requested to abort.
+template <typename ParseCallbackT, typename WideParseCallbackT>
+__attribute__((noinline)) bool parse_wide_value(
+    const char *&it, const ContentChunk &chunk, uint32_t line_number,
+    std::string_view feature, int max_bit, int min_bit,
+    DiagnosticSink *diagnostics, ParseStats *stats,
+    ParseCallbackT &&parse_callback, WideParseCallbackT &&wide_callback,
+    ParseResult *result) {
+  const uint32_t width = max_bit - min_bit + 1;
+  ParseStats::Assignment assignment = ParseStats::kNoAssignment;
+  const int word_count = (width + 63) / 64;
+  uint64_t words[kMaxWideWords];
+
+  // Same as the assignment parsing for values up to 64 bit in parse().
+  if (*it == '=') {
+    ++it;  // skip '='
+    fasm_skip_blank();
+    std::fill(words, words + word_count, 0);
+    if (kDigitToInt[(uint8_t)*it] <= 9) {
+      parse_wide_number(it, 10, words, word_count);  // width or decimal value
+    }
+    fasm_skip_blank();
+    if (*it == '\'') {
+      ++it;  // skip tick
+      fasm_skip_blank();
+      // Last number was actually precision.
+      if (fasm_unlikely(words[0] > width ||
+                        std::any_of(words + 1, words + word_count,
+                                    [](uint64_t w) { return w != 0; }))) {
+        report(diagnostics, chunk, it,
+               {ParseResult::kNonCritical, DiagnosticCode::kValueTooWide,
+                line_number, 0, feature, {}, max_bit, min_bit, words[0]});
+        *result = std::max(*result, ParseResult::kNonCritical);
+      }
+      const char format_type = *it;
+      ++it;
+      assignment = assignment_kind(format_type);
+      switch (format_type) {
+      case 'h': parse_wide_number(it, 16, words, word_count); break;
+      case 'b': parse_wide_number(it, 2, words, word_count);  break;
+      case 'o': parse_wide_number(it, 8, words, word_count);  break;
+      case 'd': parse_wide_number(it, 10, words, word_count); break;
+      default:
+        report(diagnostics, chunk, it - 1,
+               {ParseResult::kError, DiagnosticCode::kUnknownBase,
+                line_number, 0, feature, {}, max_bit, min_bit, 0,
+                format_type});
+        *result = ParseResult::kError;
+        fasm_skip_to_eol();
+        std::fill(words, words + word_count, 0);
+        words[0] = 0x01;  // In error state now, but report feature as set
+        break;
+      }
+      fasm_skip_blank();
+    } else {
+      assignment = ParseStats::kPlainNumber;
+    }
+  } else {
+    std::fill(words, words + word_count, 0);
+    words[0] = 0x1;  // No assignment: default assumption 1 bit set.
+    report(diagnostics, chunk, feature.data(),
+           {ParseResult::kInfo, DiagnosticCode::kRangeWithoutValue,
+            line_number, 0, feature, {}, max_bit, min_bit});
+    *result = std::max(*result, ParseResult::kInfo);
+  }
+
+  if (stats) ++stats->assignments[assignment];
+
+  if (width % 64 != 0) {  // Clamp bits if value too wide
+    words[word_count - 1] &= uint64_t(-1) >> (64 - width % 64);
+  }
+  if constexpr (!std::is_same_v<std::decay_t<WideParseCallbackT>,
+                                std::nullptr_t>) {
+    return wide_callback(line_number, feature, min_bit, width, words);
+  } else {
+    for (int i = 0; i < word_count; ++i) {
+      const int slice_width = std::min(64, int(width) - 64 * i);
+      if (!parse_callback(line_number, feature, min_bit + 64 * i, slice_width,
+                          words[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+}
+
+// The parse loop. If kWantsSegments, the segment boundaries of each feature
+// name are recorded in "segments" before the callbacks are called. If
+// kWantsStats, line classes etc. are counted in "stats".
+template <bool kWantsSegments, bool kWantsStats, typename ParseCallbackT,
+          typename AnnotationCallbackT, typename WideParseCallbackT>
+inline ParseResult parse_lines(const ContentChunk &chunk,
+                               DiagnosticSink *diagnostics,
+                               FeatureSegments *segments, ParseStats *stats,
+                               ParseCallbackT &&parse_callback,
+                               AnnotationCallbackT &&annotation_callback,
+                               WideParseCallbackT &&wide_callback) {
+  if constexpr (kMaybeEmptyCallback<AnnotationCallbackT>) {
+    if (!annotation_callback) {
+      return parse_lines<kWantsSegments, kWantsStats>(
+          chunk, diagnostics, segments, stats, parse_callback, nullptr,
+          wide_callback);
+    }
+  }
+  if constexpr (kMaybeEmptyCallback<WideParseCallbackT>) {
+    if (!wide_callback) {
+      return parse_lines<kWantsSegments, kWantsStats>(
+          chunk, diagnostics, segments, stats, parse_callback,
+          annotation_callback, nullptr);
+    }
+  }
+  const std::string_view content = chunk.content;
+  constexpr bool kWantsAnnotations =
+      !std::is_same_v<std::decay_t<AnnotationCallbackT>, std::nullptr_t>;
   if (content.empty()) {
     return ParseResult::kSuccess;
   }
   if (content[content.size() - 1] != '\n') {
     // We need '\n' as sentinel, so without it, we'd run past the buffer.
-    fprintf(errstream, "content does not end with a newline\n");
+    report(diagnostics, chunk, content.data() + content.size(),
+           {ParseResult::kError, DiagnosticCode::kMissingFinalNewline});
     return ParseResult::kError;
   }
 
   ParseResult result = ParseResult::kSuccess;
   const char *it = content.data();
   const char *const end = content.data() + content.size();
-  uint32_t line_number = 0;
+  uint32_t line_number = chunk.first_line - 1;
   while (it < end) {
     ++line_number;
     fasm_skip_blank();
@@ -174,11 +1010,34 @@ inline ParseResult parse(std::string_view content, FILE *errstream,
     // (dot, digit, or underscore) which is entirely sufficient for the parsing
     // part. The receiver of the feature name will notice semantic issues.
     const char *const start_feature = it;
-    while (internal::kValidIdentifier[(uint8_t)*it]) {
-      ++it;
+    if constexpr (kWantsSegments) {
+      int count = 0;
+      for (char c; (c = internal::kValidIdentifier[(uint8_t)*it]); ++it) {
+        if (c == internal::kSegmentSeparator &&
+            count < FeatureSegments::kMaxSegments - 1) {
+          segments->end[count++] = it - start_feature;
+        }
+      }
+      segments->end[count++] = it - start_feature;
+      segments->count = count;
+      segments->name = {start_feature, size_t(it - start_feature)};
+    } else {
+      while (internal::kValidIdentifier[(uint8_t)*it]) {
+        ++it;
+      }
     }
     const std::string_view feature{start_feature, size_t(it - start_feature)};
     fasm_skip_blank();
+    if constexpr (kWantsStats) {
+      if (feature.empty()) {
+        stats->blank_lines += (*it == '\n' || *it == '\r');
+        stats->comment_lines += (*it == '#');
+      } else {
+        ++stats->name_length_histogram[ParseStats::histogram_bucket(
+            feature.size())];
+        ++(*it == '[' ? stats->ranged_features : stats->plain_features);
+      }
+    }
 
     if (!feature.empty()) {
       // Read optional feature address and determine width. feature[<max>:<min>]
@@ -196,17 +1055,19 @@ inline ParseResult parse(std::string_view content, FILE *errstream,
           min_bit = max_bit;
         }
         if (fasm_unlikely(*it != ']')) {
-          fprintf(errstream, "%u: ERR expected ']' : '%.*s'\n", line_number,
-                  int(it + 1 - start_feature), start_feature);
+          report(diagnostics, chunk, it,
+                 {ParseResult::kError, DiagnosticCode::kExpectedCloseBracket,
+                  line_number, 0,
+                  std::string_view(start_feature, it + 1 - start_feature)});
           result = ParseResult::kError;
           fasm_skip_to_start_of_next_line();
           continue;
         }
         ++it;  // skip ']'
         if (fasm_unlikely(max_bit < min_bit)) {
-          fprintf(errstream, "%u: SKIP inverted range %.*s[%d:%d]\n",
-                  line_number, (int)feature.size(), feature.data(), max_bit,
-                  min_bit);
+          report(diagnostics, chunk, start_feature,
+                 {ParseResult::kSkipped, DiagnosticCode::kInvertedRange,
+                  line_number, 0, feature, {}, max_bit, min_bit});
           result = std::max(result, ParseResult::kSkipped);
           fasm_skip_to_start_of_next_line();
           continue;
@@ -214,85 +1075,95 @@ inline ParseResult parse(std::string_view content, FILE *errstream,
       }
       fasm_skip_blank();
 
-      uint32_t width = (max_bit - min_bit + 1);
-      if (fasm_unlikely(width > 64)) {
-        // TODO: if this is needed in practice, then parse in multiple
-        // steps and call back multiple times with parts of the number.
-        fprintf(errstream,
-                "%u: ERR: Sorry, can only deal with ranges <= 64 bit currently "
-                "%.*s[%d:%d]; trimming width %u to 64\n",
-                line_number, (int)feature.size(), feature.data(), max_bit,
-                min_bit, width);
-        result = ParseResult::kError;
-        width = 64; // Clamp number of bits we report.
-        // Move foward, doing best effort parsing of lower 64 bits.
+      const uint32_t width = (max_bit - min_bit + 1);
+      if constexpr (kWantsStats) {
+        ++stats->width_histogram[ParseStats::histogram_bucket(width)];
       }
-
-      uint64_t bitset;
-
-      // Assignment.
-      if (*it == '=') {
-        ++it;  // skip '='
-        fasm_skip_blank();
-        bitset = 0;
-        if (internal::kDigitToInt[(uint8_t)*it] <= 9) {
-          fasm_parse_number_with_base(bitset, 10); // width or decimal value
+      if (fasm_unlikely(width > 64)) {
+        // Values not fitting into uint64_t are dealt with out-of-line to
+        // keep the common path fast.
+        if (fasm_unlikely(!internal::parse_wide_value(
+                it, chunk, line_number, feature, max_bit, min_bit,
+                diagnostics, kWantsStats ? stats : nullptr, parse_callback,
+                wide_callback, &result))) {
+          result = std::max(result, ParseResult::kUserAbort);
+          break;
         }
-        fasm_skip_blank();
-        if (*it == '\'') {
-          ++it;  // skip tick
+      } else {
+        uint64_t bitset;
+
+        // Assignment.
+        if (*it == '=') {
+          ++it;  // skip '='
           fasm_skip_blank();
-          // Last number was actually precision. Simple plausibility, but
-          // ignore.
-          if (fasm_unlikely(bitset > width)) {
-            fprintf(errstream,
-                    "%u: WARN Attempt to assign more bits (%" PRIu64 "') for "
-                    "%.*s[%d:%d] with supported bit width of %u\n",
-                    line_number, bitset, (int)feature.size(), feature.data(),
-                    max_bit, min_bit, width);
-            result = std::max(result, ParseResult::kNonCritical);
-          }
           bitset = 0;
-          const char format_type = *it;
-          ++it;
-          switch (format_type) {
-          case 'h': fasm_parse_number_with_base(bitset, 16); break;
-          case 'b': fasm_parse_number_with_base(bitset, 2);  break;
-          case 'o': fasm_parse_number_with_base(bitset, 8);  break;
-          case 'd': fasm_parse_number_with_base(bitset, 10); break;
-          default:
-            fprintf(errstream, "%u: unknown base signifier '%c'; expected "
-                    "one of b, d, h, o\n", line_number, format_type);
-            result = ParseResult::kError;
-            fasm_skip_to_eol();
-            bitset = 0x01; // In error state now, but report this feature as set
-            break;
+          if (internal::kDigitToInt[(uint8_t)*it] <= 9) {
+            fasm_parse_number_with_base(bitset, 10); // width or decimal value
           }
           fasm_skip_blank();
+          if (*it == '\'') {
+            ++it;  // skip tick
+            fasm_skip_blank();
+            // Last number was actually precision. Simple plausibility, but
+            // ignore.
+            if (fasm_unlikely(bitset > width)) {
+              report(diagnostics, chunk, it,
+                     {ParseResult::kNonCritical, DiagnosticCode::kValueTooWide,
+                      line_number, 0, feature, {}, max_bit, min_bit, bitset});
+              result = std::max(result, ParseResult::kNonCritical);
+            }
+            bitset = 0;
+            const char format_type = *it;
+            ++it;
+            if constexpr (kWantsStats) {
+              ++stats->assignments[internal::assignment_kind(format_type)];
+            }
+            switch (format_type) {
+            case 'h': fasm_parse_number_with_base(bitset, 16); break;
+            case 'b': fasm_parse_number_with_base(bitset, 2);  break;
+            case 'o': fasm_parse_number_with_base(bitset, 8);  break;
+            case 'd': fasm_parse_number_with_base(bitset, 10); break;
+            default:
+              report(diagnostics, chunk, it - 1,
+                     {ParseResult::kError, DiagnosticCode::kUnknownBase,
+                      line_number, 0, feature, {}, max_bit, min_bit, 0,
+                      format_type});
+              result = ParseResult::kError;
+              fasm_skip_to_eol();
+              bitset = 0x01; // In error state now, but report feature as set
+              break;
+            }
+            fasm_skip_blank();
+          } else if constexpr (kWantsStats) {
+            ++stats->assignments[ParseStats::kPlainNumber];
+          }
+        } else {
+          if constexpr (kWantsStats) {
+            ++stats->assignments[ParseStats::kNoAssignment];
+          }
+          bitset = 0x1; // No assignment: default assumption 1 bit set.
+          if (fasm_unlikely(min_bit != max_bit)) {
+            report(diagnostics, chunk, start_feature,
+                   {ParseResult::kInfo, DiagnosticCode::kRangeWithoutValue,
+                    line_number, 0, feature, {}, max_bit, min_bit});
+            result = std::max(result, ParseResult::kInfo);
+          }
         }
-      } else {
-        bitset = 0x1; // No assignment: default assumption 1 bit set.
-        if (fasm_unlikely(min_bit != max_bit)) {
-          fprintf(errstream,
-                  "%u: INFO Range of bits %.*s[%d:%d], but no assignment\n",
-                  line_number, (int)feature.size(), feature.data(), max_bit,
-                  min_bit);
-          result = std::max(result, ParseResult::kInfo);
-        }
-      }
 
-      // Ready to report the feature and their bits.
-      bitset &= uint64_t(-1) >> (64 - width); // Clamp bits if value too wide
-      if (fasm_unlikely(
-              !parse_callback(line_number, feature, min_bit, width, bitset))) {
-        result = std::max(result, ParseResult::kUserAbort);
-        break;
+        // Ready to report the feature and their bits.
+        bitset &= uint64_t(-1) >> (64 - width); // Clamp bits if value too wide
+        if (fasm_unlikely(!parse_callback(line_number, feature, min_bit,
+                                          width, bitset))) {
+          result = std::max(result, ParseResult::kUserAbort);
+          break;
+        }
       }
     } // non-empty feature
 
     // Annotations might follow
     if (fasm_unlikely(*it == '{')) {
-      if (annotation_callback) {
+      [[maybe_unused]] const char *const start_annotations = it;
+      if constexpr (kWantsAnnotations) {
         do {
           ++it; // skip '{' or ','
           fasm_skip_blank();
@@ -304,8 +1175,10 @@ inline ParseResult parse(std::string_view content, FILE *errstream,
 
           fasm_skip_blank();
           if (fasm_unlikely(*it != '=')) {
-            fprintf(errstream, "%d: annotation %.*s: expected '='\n",
-                    line_number, (int)aname.size(), aname.data());
+            report(diagnostics, chunk, it,
+                   {ParseResult::kError,
+                    DiagnosticCode::kAnnotationExpectedEquals, line_number, 0,
+                    feature, aname, 0, 0, 0, *it});
             result = ParseResult::kError;
             break;
           }
@@ -313,10 +1186,9 @@ inline ParseResult parse(std::string_view content, FILE *errstream,
 
           fasm_skip_blank();
           if (fasm_unlikely(*it != '"')) {
-            fprintf(errstream,
-                    "%d: %.*s : annotation '%.*s': value not quoted\n",
-                    line_number, (int)feature.size(), feature.data(),
-                    (int)aname.size(), aname.data());
+            report(diagnostics, chunk, it,
+                   {ParseResult::kError, DiagnosticCode::kAnnotationNotQuoted,
+                    line_number, 0, feature, aname, 0, 0, 0, *it});
             result = ParseResult::kError;
             break;
           }
@@ -331,26 +1203,34 @@ inline ParseResult parse(std::string_view content, FILE *errstream,
           const std::string_view avalue{start_value, size_t(it - start_value)};
 
           if (fasm_unlikely(*it == '\n')) {
-            fprintf(errstream,
-                    "%d: annotation not finished before end of line\n",
-                    line_number);
+            report(diagnostics, chunk, it,
+                   {ParseResult::kError,
+                    DiagnosticCode::kAnnotationUnterminated, line_number, 0,
+                    feature, aname});
             result = ParseResult::kError;
             break;
           }
           annotation_callback(line_number, feature, aname, avalue);
+          if constexpr (kWantsStats) ++stats->annotations;
           ++it; // skip '"'
 
           fasm_skip_blank();
         } while (*it == ',');
 
         if (*it != '}') {
-          fprintf(errstream, "%d: annotations: expected ',' or '}'; got '%c'\n",
-                  line_number, *it);
+          report(diagnostics, chunk, it,
+                 {ParseResult::kError,
+                  DiagnosticCode::kAnnotationExpectedSeparator, line_number,
+                  0, feature, {}, 0, 0, 0, *it});
           result = ParseResult::kError;
         }
       }
 
       fasm_skip_to_eol();
+      if constexpr (kWantsStats) {
+        ++stats->annotated_lines;
+        stats->annotation_bytes += it - start_annotations;
+      }
     }
 
     if (*it == '#' || *it == '\r') {
@@ -358,15 +1238,423 @@ inline ParseResult parse(std::string_view content, FILE *errstream,
     }
 
     if (fasm_unlikely(*it != '\n')) {
-      fprintf(errstream, "%d: expected newline, got '%c'\n", line_number, *it);
+      report(diagnostics, chunk, it,
+             {ParseResult::kError, DiagnosticCode::kExpectedNewline,
+              line_number, 0, feature, {}, 0, 0, 0, *it});
       result = ParseResult::kError;
       fasm_skip_to_eol();
     }
     ++it;  // Consume \n and get ready for next line and position there.
   }
+  if constexpr (kWantsStats) {
+    stats->lines += line_number - (chunk.first_line - 1);
+    stats->bytes += content.size();
+  }
+  return result;
+}
+}  // namespace internal
+
+template <typename ParseCallbackT, typename AnnotationCallbackT,
+          typename WideParseCallbackT>
+inline ParseResult parse(const ContentChunk &chunk,
+                         DiagnosticSink *diagnostics,
+                         ParseCallbackT &&parse_callback,
+                         AnnotationCallbackT &&annotation_callback,
+                         WideParseCallbackT &&wide_callback) {
+  return internal::parse_lines<false, false>(
+      chunk, diagnostics, nullptr, nullptr, parse_callback,
+      annotation_callback, wide_callback);
+}
+
+template <typename ParseCallbackT, typename AnnotationCallbackT,
+          typename WideParseCallbackT>
+inline ParseResult parse(const ContentChunk &chunk, FILE *errstream,
+                         ParseCallbackT &&parse_callback,
+                         AnnotationCallbackT &&annotation_callback,
+                         WideParseCallbackT &&wide_callback) {
+  FileDiagnosticSink diagnostics(errstream);
+  return internal::parse_lines<false, false>(
+      chunk, &diagnostics, nullptr, nullptr, parse_callback,
+      annotation_callback, wide_callback);
+}
+
+template <typename ParseCallbackT, typename AnnotationCallbackT,
+          typename WideParseCallbackT>
+inline ParseResult parse(std::string_view content, FILE *errstream,
+                         ParseCallbackT &&parse_callback,
+                         AnnotationCallbackT &&annotation_callback,
+                         WideParseCallbackT &&wide_callback) {
+  return parse(ContentChunk{content, 1}, errstream, parse_callback,
+               annotation_callback, wide_callback);
+}
+
+inline ParseResult parse(std::string_view content, FILE *errstream,
+                         const ParseCallback &parse_callback,
+                         const AnnotationCallback &annotation_callback) {
+  // Explicit template arguments, otherwise overload resolution would pick
+  // this function again.
+  if (annotation_callback) {
+    return parse<const ParseCallback &, const AnnotationCallback &>(
+        content, errstream, parse_callback, annotation_callback);
+  }
+  return parse<const ParseCallback &, std::nullptr_t>(content, errstream,
+                                                      parse_callback, nullptr);
+}
+
+inline void run_threads(int count, const std::function<void(int)> &task) {
+  std::vector<std::thread> threads;
+  threads.reserve(count);
+  for (int i = 1; i < count; ++i) {
+    threads.emplace_back(task, i);
+  }
+  if (count > 0) task(0);  // Current thread can do some work as well.
+  for (std::thread &t : threads) {
+    t.join();
+  }
+}
+
+inline void run_balanced(int task_count, int thread_count,
+                         const std::function<void(int worker, int task)> &task,
+                         const Executor &executor) {
+  thread_count = std::clamp(thread_count, 1, std::max(task_count, 1));
+  std::atomic<int> next_task(0);
+  const auto worker = [&](int w) {
+    for (int i; (i = next_task.fetch_add(1, std::memory_order_relaxed)) <
+                task_count;) {
+      task(w, i);
+    }
+  };
+  if (executor) {
+    executor(thread_count, worker);
+  } else {
+    run_threads(thread_count, worker);
+  }
+}
+
+inline int balanced_chunk_count(size_t content_size, int thread_count) {
+  constexpr size_t kMinChunkSize = 1 << 20;
+  constexpr int kMaxChunksPerThread = 16;
+  thread_count = std::max(thread_count, 1);
+  if (thread_count == 1) return 1;
+  const size_t by_size = content_size / kMinChunkSize;
+  return (int)std::clamp<size_t>(by_size, thread_count,
+                                 (size_t)thread_count * kMaxChunksPerThread);
+}
+
+inline std::vector<ContentChunk> split_lines(std::string_view content,
+                                             int count, int thread_count,
+                                             const Executor &executor) {
+  std::vector<ContentChunk> chunks;
+  if (content.empty() || content.back() != '\n') {
+    return chunks;
+  }
+  count = std::max(count, 1);
+  const size_t chunk_size = (content.size() + count - 1) / count;
+  uint64_t offset = 0;
+  while (!content.empty()) {
+    // find next fasm line boundary
+    const size_t pos = internal::find_newline(
+        content.data() + std::min(content.size(), chunk_size) - 1) -
+      content.data();
+    chunks.push_back({content.substr(0, pos + 1), 0, offset});
+    content.remove_prefix(pos + 1);
+    offset += pos + 1;
+  }
+
+  // Number of lines in each chunk to determine the start line of the next.
+  // The last chunk does not need to be counted.
+  const int count_chunks = chunks.size() - 1;
+  std::vector<uint32_t> line_counts(count_chunks);
+  run_balanced(
+      count_chunks, thread_count,
+      [&](int, int i) {
+        const std::string_view c = chunks[i].content;
+        line_counts[i] =
+            internal::count_newlines(c.data(), c.data() + c.size());
+      },
+      executor);
+  chunks[0].first_line = 1;
+  for (int i = 0; i < count_chunks; ++i) {
+    chunks[i + 1].first_line = chunks[i].first_line + line_counts[i];
+  }
+  return chunks;
+}
+
+namespace internal {
+// Implementation of parse_parallel(); chunk i reports to sink_for_chunk(i).
+template <typename SinkForChunkT, typename ParseCallbackT,
+          typename AnnotationCallbackT>
+inline ParseResult parse_parallel(std::string_view content, int thread_count,
+                                  SinkForChunkT &&sink_for_chunk,
+                                  ParseCallbackT &&parse_callback,
+                                  AnnotationCallbackT &&annotation_callback,
+                                  const Executor &executor) {
+  if (content.empty() || content.back() != '\n') {
+    // Let regular parse deal with reporting empty or non-terminated content.
+    return parse(content, sink_for_chunk(0), parse_callback,
+                 annotation_callback);
+  }
+  const std::vector<ContentChunk> chunks =
+      split_lines(content, balanced_chunk_count(content.size(), thread_count),
+                  thread_count, executor);
+  std::vector<ParseResult> results(chunks.size());
+  run_balanced(
+      chunks.size(), thread_count,
+      [&](int, int i) {
+        results[i] = parse(chunks[i], sink_for_chunk(i), parse_callback,
+                           annotation_callback);
+      },
+      executor);
+  ParseResult result = ParseResult::kSuccess;
+  for (const ParseResult r : results) {
+    result = std::max(result, r);
+  }
+  return result;
+}
+}  // namespace internal
+
+template <typename ParseCallbackT, typename AnnotationCallbackT>
+inline ParseResult parse_parallel(std::string_view content, int thread_count,
+                                  FILE *errstream,
+                                  ParseCallbackT &&parse_callback,
+                                  AnnotationCallbackT &&annotation_callback,
+                                  const Executor &executor) {
+  FileDiagnosticSink diagnostics(errstream);  // stdio is thread-safe.
+  return internal::parse_parallel(
+      content, thread_count, [&](int) { return &diagnostics; },
+      parse_callback, annotation_callback, executor);
+}
+
+inline void ParseStats::add(const ParseStats &other) {
+  bytes += other.bytes;
+  lines += other.lines;
+  blank_lines += other.blank_lines;
+  comment_lines += other.comment_lines;
+  error_lines += other.error_lines;
+  plain_features += other.plain_features;
+  ranged_features += other.ranged_features;
+  for (int i = 0; i < kAssignmentKinds; ++i) {
+    assignments[i] += other.assignments[i];
+  }
+  annotated_lines += other.annotated_lines;
+  annotations += other.annotations;
+  annotation_bytes += other.annotation_bytes;
+  for (int i = 0; i < kHistogramBuckets; ++i) {
+    width_histogram[i] += other.width_histogram[i];
+    name_length_histogram[i] += other.name_length_histogram[i];
+  }
+  duration_us += other.duration_us;
+}
+
+template <typename ParseCallbackT, typename AnnotationCallbackT,
+          typename WideParseCallbackT>
+inline ParseResult parse_with_stats(const ContentChunk &chunk,
+                                    DiagnosticSink *diagnostics,
+                                    ParseStats *stats,
+                                    ParseCallbackT &&parse_callback,
+                                    AnnotationCallbackT &&annotation_callback,
+                                    WideParseCallbackT &&wide_callback) {
+  using Clock = std::chrono::steady_clock;
+  const Clock::time_point start = Clock::now();
+  internal::LineCountingSink counting_sink(diagnostics, &stats->error_lines);
+  const ParseResult result = internal::parse_lines<false, true>(
+      chunk, &counting_sink, nullptr, stats, parse_callback,
+      annotation_callback, wide_callback);
+  stats->duration_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                            Clock::now() - start)
+                            .count();
   return result;
 }
 
+template <typename ParseCallbackT, typename AnnotationCallbackT,
+          typename WideParseCallbackT>
+inline ParseResult parse_with_stats(std::string_view content, FILE *errstream,
+                                    ParseStats *stats,
+                                    ParseCallbackT &&parse_callback,
+                                    AnnotationCallbackT &&annotation_callback,
+                                    WideParseCallbackT &&wide_callback) {
+  FileDiagnosticSink diagnostics(errstream);
+  return parse_with_stats(ContentChunk{content, 1}, &diagnostics, stats,
+                          parse_callback, annotation_callback, wide_callback);
+}
+
+template <typename ParseCallbackT, typename AnnotationCallbackT>
+inline ParseResult parse_parallel_with_stats(
+    std::string_view content, int thread_count, FILE *errstream,
+    std::vector<ParseStats> *worker_stats, ParseCallbackT &&parse_callback,
+    AnnotationCallbackT &&annotation_callback, const Executor &executor) {
+  FileDiagnosticSink diagnostics(errstream);
+  worker_stats->assign(std::max(thread_count, 1), ParseStats());
+  if (content.empty() || content.back() != '\n') {
+    return parse_with_stats(ContentChunk{content, 1}, &diagnostics,
+                            &worker_stats->front(), parse_callback,
+                            annotation_callback);
+  }
+  const std::vector<ContentChunk> chunks =
+      split_lines(content, balanced_chunk_count(content.size(), thread_count),
+                  thread_count, executor);
+  std::vector<ParseResult> results(chunks.size());
+  run_balanced(
+      chunks.size(), thread_count,
+      [&](int worker, int i) {
+        results[i] =
+            parse_with_stats(chunks[i], &diagnostics, &(*worker_stats)[worker],
+                             parse_callback, annotation_callback);
+      },
+      executor);
+  ParseResult result = ParseResult::kSuccess;
+  for (const ParseResult r : results) {
+    result = std::max(result, r);
+  }
+  return result;
+}
+
+template <int kCapacity, typename BatchCallbackT>
+inline ParseResult parse_batched(const ContentChunk &chunk, FILE *errstream,
+                                 RecordBlock<kCapacity> *block,
+                                 BatchCallbackT &&batch_callback) {
+  bool aborted = false;
+  const auto flush_block = [&]() {
+    aborted = !batch_callback(*block);
+    block->size = 0;
+    block->annotations.clear();
+    return !aborted;
+  };
+  block->size = 0;
+  block->annotations.clear();
+  ParseResult result = parse(
+      chunk, errstream,
+      [&](uint32_t line, std::string_view feature, int start_bit, int width,
+          uint64_t bits) {
+        if (block->size == kCapacity && !flush_block()) {
+          return false;
+        }
+        const int i = block->size++;
+        block->line[i] = line;
+        block->feature[i] = feature.data();
+        block->feature_length[i] = feature.size();
+        block->start_bit[i] = start_bit;
+        block->width[i] = width;
+        block->bits[i] = bits;
+        return true;
+      },
+      [&](uint32_t line, std::string_view feature, std::string_view name,
+          std::string_view value) {
+        // Annotations follow the feature of the same line, so if there is
+        // one, it is the last record.
+        const int record = feature.empty() ? -1 : block->size - 1;
+        block->annotations.push_back({record, line, name, value});
+      });
+  if (!aborted && (block->size > 0 || !block->annotations.empty()) &&
+      !flush_block()) {
+    result = std::max(result, ParseResult::kUserAbort);
+  }
+  return result;
+}
+
+template <typename SegmentCallbackT, typename AnnotationCallbackT>
+inline ParseResult parse_segmented(const ContentChunk &chunk, FILE *errstream,
+                                   SegmentCallbackT &&segment_callback,
+                                   AnnotationCallbackT &&annotation_callback) {
+  FeatureSegments segments;
+  FileDiagnosticSink diagnostics(errstream);
+  return internal::parse_lines<true, false>(
+      chunk, &diagnostics, &segments, nullptr,
+      [&](uint32_t line, std::string_view, int start_bit, int width,
+          uint64_t bits) {
+        return segment_callback(line, segments, start_bit, width, bits);
+      },
+      annotation_callback, nullptr);
+}
+
+template <typename ParseCallbackT, typename AnnotationCallbackT,
+          typename WideParseCallbackT>
+StreamParser<ParseCallbackT, AnnotationCallbackT, WideParseCallbackT>::
+    StreamParser(FILE *errstream, ParseCallbackT parse_callback,
+                 AnnotationCallbackT annotation_callback,
+                 WideParseCallbackT wide_callback)
+    : errstream_(errstream),
+      parse_callback_(std::move(parse_callback)),
+      annotation_callback_(std::move(annotation_callback)),
+      wide_callback_(std::move(wide_callback)) {}
+
+template <typename ParseCallbackT, typename AnnotationCallbackT,
+          typename WideParseCallbackT>
+bool StreamParser<ParseCallbackT, AnnotationCallbackT,
+                  WideParseCallbackT>::feed(std::string_view fragment) {
+  if (aborted_) return false;
+  if (!partial_line_.empty()) {
+    // Complete the line we have started in a previous fragment.
+    const size_t eol = fragment.find('\n');
+    if (eol == std::string_view::npos) {
+      partial_line_.append(fragment);
+      return true;
+    }
+    partial_line_.append(fragment.substr(0, eol + 1));
+    fragment.remove_prefix(eol + 1);
+    parse_lines(partial_line_);
+    partial_line_.clear();
+  }
+
+  // All complete lines can be parsed directly from the fragment.
+  const size_t last_eol = fragment.rfind('\n');
+  if (last_eol != std::string_view::npos && !aborted_) {
+    parse_lines(fragment.substr(0, last_eol + 1));
+    fragment.remove_prefix(last_eol + 1);
+  }
+  partial_line_.assign(fragment);
+  return !aborted_;
+}
+
+template <typename ParseCallbackT, typename AnnotationCallbackT,
+          typename WideParseCallbackT>
+ParseResult StreamParser<ParseCallbackT, AnnotationCallbackT,
+                         WideParseCallbackT>::finish() {
+  if (!partial_line_.empty() && !aborted_) {
+    partial_line_.push_back('\n');  // Terminate last line.
+    parse_lines(partial_line_);
+  }
+  partial_line_.clear();
+  return result_;
+}
+
+template <typename ParseCallbackT, typename AnnotationCallbackT,
+          typename WideParseCallbackT>
+void StreamParser<ParseCallbackT, AnnotationCallbackT,
+                  WideParseCallbackT>::parse_lines(std::string_view lines) {
+  // Remember if the callback wants to stop, so that we stop in the next
+  // fragments as well.
+  auto parse_callback = [this](uint32_t line, std::string_view feature,
+                               int start_bit, int width, uint64_t bits) {
+    if (fasm_unlikely(!parse_callback_(line, feature, start_bit, width,
+                                       bits))) {
+      aborted_ = true;
+    }
+    return !aborted_;
+  };
+  const ContentChunk chunk{lines, line_count_ + 1, offset_};
+  ParseResult result;
+  if constexpr (std::is_same_v<WideParseCallbackT, std::nullptr_t>) {
+    result = parse(chunk, errstream_, parse_callback, annotation_callback_);
+  } else {
+    auto wide_callback = [this](uint32_t line, std::string_view feature,
+                                int start_bit, int width,
+                                const uint64_t *bits) {
+      if (fasm_unlikely(!wide_callback_(line, feature, start_bit, width,
+                                        bits))) {
+        aborted_ = true;
+      }
+      return !aborted_;
+    };
+    result = parse(chunk, errstream_, parse_callback, annotation_callback_,
+                   wide_callback);
+  }
+  result_ = std::max(result_, result);
+  offset_ += lines.size();
+  line_count_ += internal::count_newlines(lines.data(),
+                                          lines.data() + lines.size());
+}
+
 #undef fasm_parse_number_with_base
 #undef fasm_skip_to_start_of_next_line
 #undef fasm_skip_to_eol
@@ -12,10 +12,32 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <stdlib.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <string_view>
+#include <vector>
 
+#include "fasm-assembler.h"
+#include "fasm-binary.h"
+#include "fasm-canonical.h"
+#include "fasm-decompress.h"
+#include "fasm-diagnostics.h"
+#include "fasm-diff.h"
+#include "fasm-feature-state.h"
+#include "fasm-feature-table.h"
+#include "fasm-index.h"
+#include "fasm-io.h"
 #include "fasm-parse.h"
+#include "fasm-writer.h"
 
 using fasm::ParseResult;
 
@@ -127,17 +149,8 @@ void ValueParseTest() {
       {"BRACKET_MISSING[4:0xyz", ParseResult::kError, //
        "", 0, 0, 0},                                    // Callback never called
 
-      // Numbers longer than 64 bit can not be dealt with, only best effort
-      // parse
-      {"VERY_LONG_NOT_SUPPORTED[255:0] = 256'h1", ParseResult::kError,
-       "VERY_LONG_NOT_SUPPORTED", 0, 64, 1}, // Short enough to parse complete
-      {"BEST_EFFORT[127:0] = 128'hdeadbeef_deadbeef_c0feface_1337f00d",
-       ParseResult::kError,                       //
-       "BEST_EFFORT", 0, 64, 0xc0feface1337f00d}, // Truncated
-
-      // Examples from README.
+      // Widest range that still fits in one value. Wider: see WideValueTest
       {"FOO[255:192] = 42", ParseResult::kSuccess, "FOO", 192, 64, 42},
-      {"BAR[255:0] = 42", ParseResult::kError, "BAR", 0, 64, 42},
 
       // Attempt to assign too wide number; warn but comes back properly shaved
       {"ASSIGN_HEX[15:0] = 32'hcafebabe", ParseResult::kNonCritical,
@@ -182,6 +195,110 @@ void ValueParseTest() {
   }
 }
 
+struct WideValueTestCase {
+  std::string_view input;
+  // Expected outputs
+  fasm::ParseResult result;
+  int min_bit;
+  int width;
+  std::vector<uint64_t> words;  // Least significant first.
+};
+
+void WideValueParseTest() {
+  std::cout << "\n-- Wide value parse test -- \n";
+  const WideValueTestCase tests[] = {
+      {"WIDE[255:0] = 256'h1", ParseResult::kSuccess, 0, 256, {1, 0, 0, 0}},
+      {"WIDE[127:0] = 128'hdeadbeef_deadbeef_c0feface_1337f00d",
+       ParseResult::kSuccess,
+       0,
+       128,
+       {0xc0feface1337f00d, 0xdeadbeefdeadbeef}},
+      {"WIDE[199:100] = 100'h8_00000000_00000000_00000001",
+       ParseResult::kSuccess,
+       100,
+       100,
+       {0x1, 0x800000000}},
+      // Upper bits not fitting into range are silently dropped
+      {"WIDE[64:0] = 'hff_ffffffff_ffffffff", ParseResult::kSuccess,
+       0, 65, {0xffffffffffffffff, 0x1}},
+      {"WIDE[129:0] = 130'b11_"
+       "0000000000000000000000000000000000000000000000000000000000000001_"
+       "1000000000000000000000000000000000000000000000000000000000000000",
+       ParseResult::kSuccess,
+       0,
+       130,
+       {0x8000000000000000, 0x1, 0x3}},
+      // Octal digits straddling word boundaries: 22 * 3 bits = 66
+      {"WIDE[65:0] = 66'o7777777777777777777777", ParseResult::kSuccess,
+       0, 66, {0xffffffffffffffff, 0x3}},
+      {"WIDE[95:0] = 96'o7_000000000000000000000", ParseResult::kSuccess,
+       0, 96, {0x8000000000000000, 0x3}},
+      // 2^64 = 18446744073709551616; 2^70 + 2 = 1180591620717411303426
+      {"WIDE[127:0] = 18446744073709551616", ParseResult::kSuccess,
+       0, 128, {0, 1}},
+      {"WIDE[127:0] = 128'd1_180_591_620_717_411_303_426",
+       ParseResult::kSuccess, 0, 128, {2, 0x40}},
+      {"WIDE[127:0] = 256'h1", ParseResult::kNonCritical, 0, 128, {1, 0}},
+      {"WIDE[127:0] = 128'y1", ParseResult::kError, 0, 128, {1, 0}},
+      {"WIDE[127:0]", ParseResult::kInfo, 0, 128, {1, 0}},
+      {"WIDE[127:0] = 1 { foo = \"bar\" } # more", ParseResult::kSuccess,
+       0, 128, {1, 0}},
+  };
+
+  for (const WideValueTestCase &expected : tests) {
+    const std::string input = std::string(expected.input) + "\n";
+    // All in one go in the wide callback
+    int wide_calls = 0;
+    auto result = fasm::parse(
+        input, stderr,
+        [&](uint32_t, std::string_view, int, int, uint64_t) {
+          EXPECT_EQ(true, false) << "Unexpected narrow call\n";
+          return true;
+        },
+        nullptr,
+        [&](uint32_t, std::string_view feature, int min_bit, int width,
+            const uint64_t *bits) {
+          ++wide_calls;
+          EXPECT_EQ(feature, "WIDE") << expected.input << "\n";
+          EXPECT_EQ(min_bit, expected.min_bit) << expected.input << "\n";
+          EXPECT_EQ(width, expected.width) << expected.input << "\n";
+          for (size_t i = 0; i < expected.words.size(); ++i) {
+            EXPECT_EQ(bits[i], expected.words[i]) << expected.input << "\n";
+          }
+          return true;
+        });
+    EXPECT_EQ(result, expected.result) << expected.input << "\n";
+    EXPECT_EQ(wide_calls, 1) << expected.input << "\n";
+
+    // Without wide callback, values are reported in slices of up to 64 bits.
+    size_t slice = 0;
+    result = fasm::parse(
+        input, stderr,
+        [&](uint32_t, std::string_view feature, int min_bit, int width,
+            uint64_t bits) {
+          const int slice_start = 64 * int(slice);
+          EXPECT_EQ(feature, "WIDE") << expected.input;
+          EXPECT_EQ(min_bit, expected.min_bit + slice_start)
+              << expected.input << "\n";
+          EXPECT_EQ(width, std::min(64, expected.width - slice_start))
+              << expected.input << "\n";
+          EXPECT_EQ(bits, expected.words[slice]) << expected.input << "\n";
+          ++slice;
+          return true;
+        });
+    EXPECT_EQ(result, expected.result) << expected.input << "\n";
+    EXPECT_EQ(slice, expected.words.size()) << expected.input << "\n";
+  }
+
+  // Abort requested in the middle of the slices.
+  int calls = 0;
+  auto result = fasm::parse("WIDE[255:0] = 0\nNEXT\n", stderr,
+                            [&](uint32_t, std::string_view, int, int,
+                                uint64_t) { return ++calls < 2; });
+  EXPECT_EQ(result, ParseResult::kUserAbort);
+  EXPECT_EQ(calls, 2);
+}
+
 struct AnnotationTestCase {
   std::string_view input;
   fasm::ParseResult result;
@@ -249,11 +366,1828 @@ void AnnotationParseTest() {
 
     EXPECT_EQ(result, expected.result) << expected.input;
   }
+
+  // Empty std::function callbacks are treated as not given.
+  fasm::AnnotationCallback no_annotations;
+  fasm::WideParseCallback no_wide;
+  int features = 0;
+  const auto count = [&](uint32_t, std::string_view, int, int, uint64_t) {
+    ++features;
+    return true;
+  };
+  EXPECT_EQ(fasm::parse("FOO { a = \"b\" }\nW[99:0] = 100'h1\n", stderr,
+                        count, no_annotations, no_wide),
+            ParseResult::kSuccess);
+  EXPECT_EQ(features, 3);  // Wide value in two slices.
+}
+
+void NewlineScanTest() {
+  std::cout << "\n-- Newline scan test -- \n";
+  // Compare vectorized scanning with the trivial implementation at all
+  // possible alignments and lengths around the vector sizes.
+  std::string buffer;
+  for (int i = 0; i < 2000; ++i) {
+    buffer.push_back((i * 7919) % 13 == 0 ? '\n' : 'a' + i % 26);
+  }
+  buffer.push_back('\n');  // Sentinel
+  const char *const end = buffer.data() + buffer.size();
+  for (const char *start = buffer.data(); start < end; ++start) {
+    const char *expected = start;
+    while (*expected != '\n') ++expected;
+    EXPECT_EQ(fasm::internal::find_newline(start) - buffer.data(),
+              expected - buffer.data());
+  }
+  for (size_t start = 0; start < 70; ++start) {
+    for (size_t len = 0; start + len <= buffer.size();
+         len += (len < 70 ? 1 : 37)) {
+      const char *b = buffer.data() + start;
+      EXPECT_EQ(fasm::internal::count_newlines(b, b + len),
+                size_t(std::count(b, b + len, '\n')))
+          << start << " " << len;
+    }
+  }
+
+  // Long lines without newline, e.g. > 255 vector rounds in the counter.
+  std::string long_line(100000, 'x');
+  long_line += "\n";
+  EXPECT_EQ(fasm::internal::find_newline(long_line.data()),
+            long_line.data() + 100000);
+  std::string all_newlines(100000, '\n');
+  EXPECT_EQ(fasm::internal::count_newlines(
+                all_newlines.data(), all_newlines.data() + all_newlines.size()),
+            all_newlines.size());
+}
+
+// Parse with the fast path, finished by the scalar path, as the parser does
+template <int base, typename T>
+T ParseDigitsFast(std::string_view str, size_t *consumed) {
+  T value = 0;
+  const char *it = str.data();
+  fasm::internal::parse_digits_swar<base>(it, str.data() + str.size(), value);
+  fasm::internal::parse_digits_scalar<base>(it, value);
+  *consumed = it - str.data();
+  return value;
+}
+
+template <int base, typename T>
+T ParseDigitsScalar(std::string_view str, size_t *consumed) {
+  T value = 0;
+  const char *it = str.data();
+  fasm::internal::parse_digits_scalar<base>(it, value);
+  *consumed = it - str.data();
+  return value;
+}
+
+template <int base, typename T>
+void CompareDigitParsing(std::string_view str) {
+  size_t fast_consumed;
+  size_t scalar_consumed;
+  const T fast = ParseDigitsFast<base, T>(str, &fast_consumed);
+  const T scalar = ParseDigitsScalar<base, T>(str, &scalar_consumed);
+  EXPECT_EQ(fast, scalar) << "base " << base << ": '" << str << "'\n";
+  EXPECT_EQ(fast_consumed, scalar_consumed) << base << ": " << str << "\n";
+}
+
+void NumberParseDifferentialTest() {
+  std::cout << "\n-- Number parse differential test -- \n";
+  // Numbers with all lengths up to 20 digits, sometimes with separators,
+  // followed by various terminating characters and enough characters to
+  // not limit the fast path.
+  const std::string_view kDigitChars = "0123456789abcdefABCDEF";
+  const std::string_view kTerminators = "]: \n_'gG/@`{";
+  uint32_t rand_state = 42;
+  auto next_rand = [&rand_state]() {
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 16;
+  };
+  for (int round = 0; round < 20000; ++round) {
+    std::string number;
+    const int len = next_rand() % 21;
+    const int digit_range = (round % 3 == 0)   ? 2
+                            : (round % 3 == 1) ? 10
+                                               : kDigitChars.size();
+    for (int i = 0; i < len; ++i) {
+      if (round % 5 == 0 && next_rand() % 6 == 0) {
+        number.push_back('_');
+      } else {
+        number.push_back(kDigitChars[next_rand() % digit_range]);
+      }
+    }
+    number.push_back(kTerminators[next_rand() % kTerminators.size()]);
+    number.append("01234567");
+
+    CompareDigitParsing<16, uint64_t>(number);
+    CompareDigitParsing<10, uint64_t>(number);
+    CompareDigitParsing<2, uint64_t>(number);
+    CompareDigitParsing<8, uint64_t>(number);
+    CompareDigitParsing<10, fasm::internal::bit_range_t>(number);
+
+    // Short buffer, so fast path needs to stop before the end.
+    const std::string_view short_number(number.data(), number.size() % 9);
+    CompareDigitParsing<16, uint64_t>(short_number);
+  }
+
+  // All characters that are not digits terminate the number.
+  for (int c = 0; c < 256; ++c) {
+    std::string number = "1a1a";
+    number.push_back(c);
+    number.append("1a1a1a1a1a");
+    CompareDigitParsing<16, uint64_t>(number);
+    CompareDigitParsing<10, uint64_t>(number);
+    CompareDigitParsing<2, uint64_t>(number);
+  }
+}
+
+void ParallelParseTest() {
+  std::cout << "\n-- Parallel parse test -- \n";
+  // Some content with varying line lengths, comments and an error line so
+  // that we can see that line numbers are reported relative to the whole file.
+  std::string content;
+  constexpr uint32_t kLines = 1000;
+  constexpr uint32_t kErrorLine = 789;
+  for (uint32_t i = 1; i <= kLines; ++i) {
+    if (i == kErrorLine) {
+      content += "ERROR[8:4 = 12\n";
+    } else if (i % 7 == 0) {
+      content += "# Just a comment\n";
+    } else {
+      content += "FEATURE_" + std::to_string(i) + "[" + std::to_string(i % 64) +
+                 "] = 1 { line = \"" + std::to_string(i) + "\" }\n";
+    }
+  }
+
+  for (int threads : {1, 2, 3, 8, 64}) {
+    std::mutex lock;
+    uint32_t callback_count = 0;
+    uint32_t annotation_count = 0;
+    char *error_messages = nullptr;
+    size_t error_message_size = 0;
+    FILE *errstream = open_memstream(&error_messages, &error_message_size);
+    int executor_tasks = 0;
+    auto result = fasm::parse_parallel(
+        content, threads, errstream,
+        [&](uint32_t line, std::string_view feature, int start_bit, int width,
+            uint64_t bits) {
+          EXPECT_EQ(feature, "FEATURE_" + std::to_string(line));
+          EXPECT_EQ(start_bit, int(line % 64));
+          EXPECT_EQ(width, 1);
+          EXPECT_EQ(bits, 1u);
+          const std::lock_guard<std::mutex> l(lock);
+          ++callback_count;
+          return true;
+        },
+        [&](uint32_t line, std::string_view, std::string_view name,
+            std::string_view value) {
+          EXPECT_EQ(name, "line");
+          EXPECT_EQ(value, std::to_string(line));
+          const std::lock_guard<std::mutex> l(lock);
+          ++annotation_count;
+        },
+        // Executor that just runs everything sequentially.
+        [&](int count, const std::function<void(int)> &task) {
+          for (int i = 0; i < count; ++i) {
+            task(i);
+            ++executor_tasks;
+          }
+        });
+    fclose(errstream);
+    EXPECT_EQ(result, ParseResult::kError);
+    const uint32_t expected_features = kLines - kLines / 7 - 1;
+    EXPECT_EQ(callback_count, expected_features) << threads;
+    EXPECT_EQ(annotation_count, expected_features) << threads;
+    EXPECT_EQ(executor_tasks > 0, true);
+    // Error is reported with line number relative to the whole content.
+    EXPECT_EQ(std::string(error_messages, error_message_size).rfind(
+                  std::to_string(kErrorLine) + ": ERR expected ']'", 0),
+              0u)
+        << threads << ": " << error_messages;
+    free(error_messages);
+  }
+
+  // Chunks are line aligned, know their starting line and cover everything.
+  const auto chunks = fasm::split_lines(content, 5);
+  EXPECT_EQ(chunks.size(), 5u);
+  std::string reassembled;
+  uint32_t expected_first_line = 1;
+  for (const fasm::ContentChunk &chunk : chunks) {
+    EXPECT_EQ(chunk.first_line, expected_first_line);
+    EXPECT_EQ(chunk.content.back(), '\n');
+    expected_first_line += std::count(chunk.content.begin(),
+                                      chunk.content.end(), '\n');
+    reassembled.append(chunk.content);
+  }
+  EXPECT_EQ(reassembled, content);
+
+  // Lines are counted with no more workers than the given thread count.
+  int executor_workers = 0;
+  const fasm::Executor executor = [&](int count,
+                                      const std::function<void(int)> &task) {
+    executor_workers = std::max(executor_workers, count);
+    fasm::run_threads(count, task);
+  };
+  const auto counted = fasm::split_lines(content, 5, 2, executor);
+  EXPECT_EQ(executor_workers, 2);
+  EXPECT_EQ(counted.back().first_line, chunks.back().first_line);
+
+  // More chunks requested than there are lines
+  EXPECT_EQ(fasm::split_lines("A\nB\n", 16).size(), 2u);
+  EXPECT_EQ(fasm::split_lines("", 16).size(), 0u);
+
+  // Balanced scheduling runs every task exactly once on a valid worker.
+  for (int threads : {1, 3, 8}) {
+    std::vector<std::atomic<int>> runs(100);
+    std::atomic<int> bad_worker(0);
+    fasm::run_balanced(runs.size(), threads, [&](int worker, int task) {
+      if (worker < 0 || worker >= threads) ++bad_worker;
+      ++runs[task];
+    });
+    EXPECT_EQ(bad_worker.load(), 0);
+    EXPECT_EQ(std::count(runs.begin(), runs.end(), 1), 100) << threads;
+  }
+
+  // Multiple chunks per thread for large content, but not tiny ones.
+  EXPECT_EQ(fasm::balanced_chunk_count(1 << 30, 1), 1);
+  EXPECT_EQ(fasm::balanced_chunk_count(1000, 4), 4);
+  EXPECT_EQ(fasm::balanced_chunk_count(32 << 20, 4), 32);
+  EXPECT_EQ(fasm::balanced_chunk_count(1 << 30, 4), 64);
+}
+
+void StreamParseTest() {
+  std::cout << "\n-- Stream parse test -- \n";
+  const std::string_view content =
+      "# Some comment\n"
+      "FOO[7:0] = 8'hab { a = \"b\" }\n"
+      "\n"
+      "   BAR_BAZ.QUUX[3] = 1\r\n"
+      "WIDE[99:0] = 100'hf_00000000_00000000_00000001\n"
+      "ERROR[3:0 = 4\n"
+      "{ global = \"annotation\" }\n"
+      "LAST_LINE = 0";  // No newline at end.
+
+  // Serialize everything we get in callbacks to compare.
+  std::string expected;
+  auto record = [](std::string *out) {
+    return [out](uint32_t line, std::string_view feature, int start_bit,
+                 int width, uint64_t bits) {
+      *out += std::to_string(line) + ":" + std::string(feature) + "[" +
+              std::to_string(start_bit) + "+" + std::to_string(width) +
+              "]=" + std::to_string(bits) + ";";
+      return true;
+    };
+  };
+  auto record_annotation = [](std::string *out) {
+    return [out](uint32_t line, std::string_view, std::string_view name,
+                 std::string_view value) {
+      *out += std::to_string(line) + ":" + std::string(name) + "=" +
+              std::string(value) + ";";
+    };
+  };
+  const ParseResult expected_result =
+      fasm::parse(std::string(content) + "\n", stderr, record(&expected),
+                  record_annotation(&expected));
+  EXPECT_EQ(expected_result, ParseResult::kError);
+
+  for (size_t fragment_size : {1, 2, 3, 5, 7, 16, 1000}) {
+    std::string got;
+    fasm::StreamParser parser(stderr, record(&got), record_annotation(&got));
+    for (size_t pos = 0; pos < content.size(); pos += fragment_size) {
+      // Make sure fragments are not accidentally backed by the content.
+      const std::string fragment(content.substr(pos, fragment_size));
+      EXPECT_EQ(parser.feed(fragment), true);
+    }
+    EXPECT_EQ(parser.line_count(), 7u) << fragment_size;
+    EXPECT_EQ(parser.finish(), expected_result) << fragment_size;
+    EXPECT_EQ(got, expected) << fragment_size;
+  }
+
+  // Once the callback requests to abort, no more callbacks.
+  int calls = 0;
+  fasm::StreamParser abort_parser(
+      stderr, [&](uint32_t, std::string_view, int, int, uint64_t) {
+        return ++calls < 2;
+      });
+  EXPECT_EQ(abort_parser.feed("A\nB\nC"), false);
+  EXPECT_EQ(abort_parser.feed("\nD\n"), false);
+  EXPECT_EQ(abort_parser.finish(), ParseResult::kUserAbort);
+  EXPECT_EQ(calls, 2);
+}
+
+void BatchedParseTest() {
+  std::cout << "\n-- Batched parse test -- \n";
+  std::string content;
+  for (int i = 0; i < 10; ++i) {
+    content += "FEATURE_" + std::to_string(i) + "[" + std::to_string(i + 3) +
+               ":" + std::to_string(i) + "] = 4'd" + std::to_string(i) + "\n";
+    if (i % 3 == 0) content += "{ global = \"" + std::to_string(i) + "\" }\n";
+    if (i % 4 == 0) content += "ANNOTATED { a = \"1\", b = \"2\" }\n";
+  }
+  content += "WIDE[99:0] = 100'h1_00000000_00000002\n";
+
+  // Collect records from single callback calls for comparison.
+  struct Record {
+    uint32_t line;
+    std::string_view feature;
+    int start_bit;
+    int width;
+    uint64_t bits;
+  };
+  std::vector<Record> expected;
+  fasm::parse(content, stderr,
+              [&](uint32_t line, std::string_view feature, int start_bit,
+                  int width, uint64_t bits) {
+                expected.push_back({line, feature, start_bit, width, bits});
+                return true;
+              });
+  EXPECT_EQ(expected.size(), 15u);
+
+  auto block = std::make_unique<fasm::RecordBlock<4>>();
+  size_t record_count = 0;
+  int block_count = 0;
+  int annotation_count = 0;
+  auto result = fasm::parse_batched(
+      content, stderr, block.get(), [&](const fasm::RecordBlock<4> &b) {
+        ++block_count;
+        EXPECT_EQ(b.size <= 4, true);
+        for (int i = 0; i < b.size; ++i) {
+          const Record &e = expected[record_count + i];
+          EXPECT_EQ(b.line[i], e.line);
+          EXPECT_EQ(b.feature_name(i), e.feature);
+          EXPECT_EQ(b.start_bit[i], e.start_bit);
+          EXPECT_EQ(b.width[i], e.width);
+          EXPECT_EQ(b.bits[i], e.bits);
+        }
+        for (const auto &annotation : b.annotations) {
+          ++annotation_count;
+          if (annotation.name == "global") {
+            EXPECT_EQ(annotation.record, -1);
+          } else {
+            EXPECT_EQ(annotation.record >= 0, true);
+            EXPECT_EQ(b.feature_name(annotation.record), "ANNOTATED");
+            EXPECT_EQ(b.line[annotation.record], annotation.line);
+          }
+        }
+        record_count += b.size;
+        return true;
+      });
+  EXPECT_EQ(result, ParseResult::kSuccess);
+  EXPECT_EQ(record_count, expected.size());
+  EXPECT_EQ(block_count, 4);
+  EXPECT_EQ(annotation_count, 4 + 2 * 3);
+
+  // Abort after first block.
+  block_count = 0;
+  result = fasm::parse_batched(content, stderr, block.get(),
+                               [&](const fasm::RecordBlock<4> &) {
+                                 ++block_count;
+                                 return false;
+                               });
+  EXPECT_EQ(result, ParseResult::kUserAbort);
+  EXPECT_EQ(block_count, 1);
+}
+
+void SegmentedParseTest() {
+  std::cout << "\n-- Segmented parse test -- \n";
+  std::string many_segments = "A";
+  for (int i = 1; i < 20; ++i) many_segments += "." + std::to_string(i);
+  const std::string content = "TILE_X1Y2.SLICEL_X0.ALUT.INIT[3:0] = 4'hA\n"
+                              "  NOHIERARCHY { a = \"1\" }\n"
+                              "EMPTY..SEGMENT.\n"
+                              "WIDE.VALUE[99:0] = 100'h1_00000000_00000002\n" +
+                              many_segments + "\n";
+  std::vector<std::vector<std::string>> segments;
+  std::vector<std::string> prefixes;
+  int annotation_count = 0;
+  auto result = fasm::parse_segmented(
+      content, stderr,
+      [&](uint32_t, const fasm::FeatureSegments &feature, int, int,
+          uint64_t) {
+        std::vector<std::string> parts;
+        for (int i = 0; i < feature.count; ++i) {
+          parts.emplace_back(feature.segment(i));
+        }
+        segments.push_back(parts);
+        prefixes.emplace_back(feature.prefix(0));
+        EXPECT_EQ(feature.prefix(feature.count - 1), feature.name);
+        return true;
+      },
+      [&](uint32_t, std::string_view feature, std::string_view,
+          std::string_view) {
+        EXPECT_EQ(feature, "NOHIERARCHY");
+        ++annotation_count;
+      });
+  EXPECT_EQ(result, ParseResult::kSuccess);
+  EXPECT_EQ(annotation_count, 1);
+  EXPECT_EQ(segments.size(), 6u);  // Wide value reported in two slices.
+  using Parts = std::vector<std::string>;
+  EXPECT_EQ(segments[0] == Parts({"TILE_X1Y2", "SLICEL_X0", "ALUT", "INIT"}),
+            true);
+  EXPECT_EQ(prefixes[0], "TILE_X1Y2");
+  EXPECT_EQ(segments[1] == Parts({"NOHIERARCHY"}), true);
+  EXPECT_EQ(segments[2] == Parts({"EMPTY", "", "SEGMENT", ""}), true);
+  EXPECT_EQ(segments[3] == Parts({"WIDE", "VALUE"}), true);
+  EXPECT_EQ(segments[4] == segments[3], true);
+
+  // Segments beyond the maximum are kept in the last one.
+  const Parts &last = segments[5];
+  EXPECT_EQ(last.size(), size_t(fasm::FeatureSegments::kMaxSegments));
+  EXPECT_EQ(last[1], "1");
+  EXPECT_EQ(last.back(), "15.16.17.18.19");
+}
+
+void FeatureTableTest() {
+  std::cout << "\n-- Feature table test -- \n";
+  fasm::FeatureTable table;
+  EXPECT_EQ(table.intern("FOO"), 0u);
+  EXPECT_EQ(table.intern("BAR"), 1u);
+  EXPECT_EQ(table.intern(std::string("FOO")), 0u);  // Different memory.
+  EXPECT_EQ(table.find("BAR"), 1u);
+  EXPECT_EQ(table.find("BAZ"), fasm::FeatureTable::kNotFound);
+  EXPECT_EQ(table.size(), 2u);
+  EXPECT_EQ(table.name(0), "FOO");
+  EXPECT_EQ(table.name(1), "BAR");
+
+  // Enough names to grow the shards; names must stay valid.
+  for (int i = 0; i < 20000; ++i) {
+    EXPECT_EQ(table.intern("NAME_" + std::to_string(i)), uint32_t(i + 2));
+  }
+  for (int i = 0; i < 20000; i += 7) {
+    EXPECT_EQ(table.find("NAME_" + std::to_string(i)), uint32_t(i + 2));
+    EXPECT_EQ(table.name(i + 2), "NAME_" + std::to_string(i));
+  }
+
+  // Many threads parsing content with repeating names: all threads get the
+  // same ID for the same name, and IDs are dense.
+  std::string content;
+  constexpr int kDistinctNames = 500;
+  for (int i = 0; i < 20000; ++i) {
+    content += "TILE_X" + std::to_string(i * 7 % kDistinctNames) +
+               ".SITE.BIT[" + std::to_string(i % 32) + "]\n";
+  }
+  fasm::FeatureTable parallel_table;
+  std::mutex lock;
+  std::vector<std::string> id_to_name(kDistinctNames);
+  auto result = fasm::parse_parallel(
+      content, 8, stderr,
+      fasm::with_interning(
+          &parallel_table,
+          [&](uint32_t, const fasm::InternedFeature &feature, int, int,
+              uint64_t) {
+            EXPECT_EQ(feature.hash, fasm::FeatureTable::hash(feature.name));
+            EXPECT_EQ(feature.id < kDistinctNames, true) << feature.id;
+            const std::lock_guard<std::mutex> l(lock);
+            std::string &name = id_to_name[feature.id % kDistinctNames];
+            if (name.empty()) name = std::string(feature.name);
+            EXPECT_EQ(name, feature.name);
+            return true;
+          }));
+  EXPECT_EQ(result, ParseResult::kSuccess);
+  EXPECT_EQ(parallel_table.size(), uint32_t(kDistinctNames));
+  for (int i = 0; i < kDistinctNames; ++i) {
+    EXPECT_EQ(parallel_table.name(i), id_to_name[i]);
+  }
+}
+
+void FeatureTrieTest() {
+  std::cout << "\n-- Feature trie test -- \n";
+  fasm::FeatureTrie trie;
+  EXPECT_EQ(trie.size(), 1u);  // Root
+  EXPECT_EQ(trie.parent(fasm::FeatureTrie::kRoot),
+            fasm::FeatureTrie::kNotFound);
+  const uint32_t tile = trie.child(fasm::FeatureTrie::kRoot, "TILE");
+  const uint32_t site = trie.child(tile, "SITE");
+  EXPECT_EQ(trie.child(fasm::FeatureTrie::kRoot, "TILE"), tile);
+  EXPECT_EQ(trie.find_child(tile, "SITE"), site);
+  EXPECT_EQ(trie.find_child(site, "SITE"), fasm::FeatureTrie::kNotFound);
+  EXPECT_EQ(trie.parent(site), tile);
+  EXPECT_EQ(trie.segment(site), "SITE");
+  EXPECT_EQ(trie.path(site), "TILE.SITE");
+  const std::string long_segment(1000, 'x');
+  const uint32_t long_node = trie.child(site, long_segment);
+  EXPECT_EQ(trie.segment(long_node), long_segment);
+  EXPECT_EQ(trie.find_child(site, long_segment), long_node);
+
+  // The prefix cache resolves to the same nodes as walking the trie, also
+  // for names that share only parts of segments with the previous one.
+  const char *const names[] = {
+      "TILE.SITE.A",  "TILE.SITE.B", "TILE.SITE.B",  "TILE.SITE",
+      "TILE.SITE.AB", "TILE.SITEX",  "TILEX.SITE.A", "TILE.SITE.A.B.C",
+      "OTHER",        "TILE.SITE.A",
+  };
+  std::string content;
+  for (const char *name : names) {
+    content.append(name).append("\n");
+  }
+  fasm::PrefixCache cache(&trie);
+  size_t index = 0;
+  fasm::parse_segmented(content, stderr,
+                        [&](uint32_t, const fasm::FeatureSegments &feature,
+                            int, int, uint64_t) {
+                          const uint32_t node = cache.resolve(feature);
+                          EXPECT_EQ(trie.path(node), names[index]);
+                          uint32_t expected = fasm::FeatureTrie::kRoot;
+                          for (int i = 0; i < feature.count; ++i) {
+                            expected = trie.find_child(expected,
+                                                       feature.segment(i));
+                            EXPECT_EQ(cache.node(i), expected) << i;
+                          }
+                          EXPECT_EQ(node, expected);
+                          ++index;
+                          return true;
+                        });
+  EXPECT_EQ(index, std::size(names));
+}
+
+void AssemblerTest() {
+  std::cout << "\n-- Assembler test -- \n";
+  fasm::BitDatabase db(100);
+  std::string segbits = "# Comment\n"
+                        "\n"
+                        "TILE.LUT.INIT[00] 0_0\n"
+                        "TILE.LUT.INIT[01] 0_1\n"
+                        "TILE.LUT.INIT[03] 1_99\n"  // No bit 2
+                        "TILE.MUX.A 2_5 !2_6\n"
+                        "TILE.MUX.B 2_5 2_6\n";
+  for (int i = 0; i < 100; ++i) {
+    segbits += "TILE.WIDE[" + std::to_string(i) + "] 3_" + std::to_string(i) +
+               "\n";
+  }
+  EXPECT_EQ(db.load_segbits(segbits, stderr), ParseResult::kSuccess);
+  EXPECT_EQ(db.load_segbits("X 1 \nY[a] 1_1\nZ 1_100\n", stderr),
+            ParseResult::kError);
+  // Frame bit positions beyond 32 bits are rejected, not wrapped around.
+  fasm::BitDatabase huge_db(100);
+  EXPECT_EQ(huge_db.add("OK", 0, 42949671, 99), true);
+  EXPECT_EQ(huge_db.add("TOO_FAR", 0, 42949672, 0), false);
+  EXPECT_EQ(huge_db.add("BIT_OUTSIDE_FRAME", 0, 0, 100), false);
+  EXPECT_EQ(huge_db.frame_count(), 42949672u);
+  EXPECT_EQ(huge_db.load_segbits("A 42949672_0\nB 99999999999_0\n", stderr),
+            ParseResult::kError);
+  EXPECT_EQ(huge_db.frame_count(), 42949672u);
+  db.compile();
+  EXPECT_EQ(db.frame_count(), 4u);
+
+  fasm::FrameBitmap frames(db.frame_count(), db.frame_bits());
+  auto result = fasm::assemble("TILE.LUT.INIT[3:0] = 4'b1011\n"
+                               "TILE.MUX.B\n"
+                               "TILE.WIDE[99:0] = 100'h8_00000000_"
+                               "00000000_00000001\n",
+                               db, stderr, &frames);
+  EXPECT_EQ(result, ParseResult::kSuccess);
+  EXPECT_EQ(frames.get(0, 0), true);
+  EXPECT_EQ(frames.get(0, 1), true);
+  EXPECT_EQ(frames.get(1, 99), true);
+  EXPECT_EQ(frames.get(2, 5), true);
+  EXPECT_EQ(frames.get(2, 6), true);
+  EXPECT_EQ(frames.get(3, 0), true);
+  EXPECT_EQ(frames.get(3, 1), false);
+  EXPECT_EQ(frames.get(3, 99), true);
+  int set_bits = 0;
+  for (const uint64_t word : frames.words()) {
+    set_bits += __builtin_popcountll(word);
+  }
+  EXPECT_EQ(set_bits, 7);
+
+  // Unknown features are skipped, bits without mapping are noted.
+  fasm::FrameBitmap other(db.frame_count(), db.frame_bits());
+  EXPECT_EQ(fasm::assemble("TILE.LUT.INIT[2]\n", db, stderr, &other),
+            ParseResult::kNonCritical);
+  EXPECT_EQ(fasm::assemble("TILE.UNKNOWN\n", db, stderr, &other),
+            ParseResult::kSkipped);
+
+  // Parallel assembly merges to the same result.
+  std::string content;
+  for (int i = 0; i < 1000; ++i) {
+    content += "TILE.WIDE[" + std::to_string(i % 100) + "]\n";
+    if (i % 7 == 0) content += "TILE.MUX.A\n";
+  }
+  fasm::FrameBitmap sequential(db.frame_count(), db.frame_bits());
+  fasm::FrameBitmap parallel(db.frame_count(), db.frame_bits());
+  EXPECT_EQ(fasm::assemble(content, db, stderr, &sequential),
+            ParseResult::kSuccess);
+  EXPECT_EQ(fasm::assemble_parallel(content, 7, db, stderr, &parallel),
+            ParseResult::kSuccess);
+  EXPECT_EQ(sequential.words() == parallel.words(), true);
+  EXPECT_EQ(parallel.get(3, 42), true);
+  EXPECT_EQ(parallel.get(2, 6), false);
+}
+
+void BinaryFormatTest() {
+  std::cout << "\n-- Binary format test -- \n";
+  const std::string content = "{ leading = \"annotation\" }\n"
+                              "FOO.BAR[7:0] = 8'h2A\n"
+                              "FOO.BAR[15:8] = 8'h11 { a = \"1\", b = \"2\" }\n"
+                              "# comment\n"
+                              "WIDE[99:0] = 100'h1_00000000_00000002\n"
+                              "{ between = \"x\" }\n"
+                              "FOO.BAR[3]\n"
+                              "BAZ { last = \"3\" }\n"
+                              "{ trailing = \"annotation\" }\n";
+
+  // Everything as sequence of strings to compare parse and replay.
+  std::vector<std::string> expected;
+  const auto record = [](std::vector<std::string> *out) {
+    return [out](uint32_t line, std::string_view feature, int start_bit,
+                 int width, uint64_t bits) {
+      out->push_back(std::to_string(line) + ":" + std::string(feature) + "[" +
+                     std::to_string(start_bit) + "+" + std::to_string(width) +
+                     "]=" + std::to_string(bits));
+      return true;
+    };
+  };
+  const auto annotation = [](std::vector<std::string> *out) {
+    return [out](uint32_t line, std::string_view feature,
+                 std::string_view name, std::string_view value) {
+      out->push_back(std::to_string(line) + ":" + std::string(feature) + "{" +
+                     std::string(name) + "=" + std::string(value) + "}");
+    };
+  };
+  EXPECT_EQ(fasm::parse(content, stderr, record(&expected),
+                        annotation(&expected)),
+            ParseResult::kSuccess);
+  EXPECT_EQ(expected.size(), 12u);
+
+  FILE *tmp = tmpfile();
+  fasm::BinaryWriter writer(tmp);
+  const ParseResult result = fasm::parse(
+      content, stderr, writer.parse_callback(), writer.annotation_callback());
+  const fasm::SourceFingerprint source = fasm::fingerprint(content, 42);
+  EXPECT_EQ(writer.finish(result, source), true);
+
+  // Read back into aligned buffer.
+  fseek(tmp, 0, SEEK_END);
+  const size_t size = ftell(tmp);
+  std::vector<uint64_t> buffer((size + 7) / 8);
+  fseek(tmp, 0, SEEK_SET);
+  EXPECT_EQ(fread(buffer.data(), 1, size, tmp), size);
+  fclose(tmp);
+  const std::string_view binary((const char *)buffer.data(), size);
+
+  fasm::BinaryReader reader;
+  EXPECT_EQ(reader.open_buffer(binary.substr(0, size - 1), stderr), false);
+  EXPECT_EQ(reader.open_buffer(binary, stderr), true);
+  EXPECT_EQ(reader.header().source == source, true);
+  EXPECT_EQ(reader.header().source == fasm::fingerprint(content, 43), false);
+  EXPECT_EQ(reader.parse_result(), ParseResult::kSuccess);
+  EXPECT_EQ(reader.record_count(), 6u);
+  EXPECT_EQ(reader.string(reader.record(4).feature), "FOO.BAR");
+
+  // Corrupt string references are rejected when opening.
+  std::vector<uint64_t> corrupt = buffer;
+  const auto &corrupt_header = *(const fasm::BinaryHeader *)corrupt.data();
+  auto *corrupt_string =
+      (fasm::BinaryString *)((char *)corrupt.data() +
+                             corrupt_header.strings_offset);
+  corrupt_string->size = corrupt_header.string_data_size + 1;
+  const std::string_view corrupt_binary((const char *)corrupt.data(), size);
+  EXPECT_EQ(reader.open_buffer(corrupt_binary, stderr), false);
+  corrupt = buffer;
+  auto *corrupt_record =
+      (fasm::BinaryRecord *)((char *)corrupt.data() +
+                             corrupt_header.records_offset);
+  corrupt_record->feature = uint32_t(corrupt_header.string_count);
+  EXPECT_EQ(reader.open_buffer(corrupt_binary, stderr), false);
+  corrupt = buffer;
+  auto *corrupt_annotation =
+      (fasm::BinaryAnnotation *)((char *)corrupt.data() +
+                                 corrupt_header.annotations_offset);
+  corrupt_annotation->value = uint32_t(corrupt_header.string_count);
+  EXPECT_EQ(reader.open_buffer(corrupt_binary, stderr), false);
+
+  // Section sizes that wrap around to the original offsets are rejected.
+  corrupt = buffer;
+  auto *corrupt_counts = (fasm::BinaryHeader *)corrupt.data();
+  static_assert(sizeof(fasm::BinaryRecord) == 24);
+  corrupt_counts->record_count += uint64_t(1) << 61;  // * 24 wraps to zero.
+  EXPECT_EQ(reader.open_buffer(corrupt_binary, stderr), false);
+  corrupt = buffer;
+  corrupt_counts->records_offset = 0;
+  corrupt_counts->record_count += sizeof(fasm::BinaryHeader) /
+                                  sizeof(fasm::BinaryRecord);
+  EXPECT_EQ(reader.open_buffer(corrupt_binary, stderr), false);
+  EXPECT_EQ(reader.open_buffer(binary, stderr), true);
+
+  std::vector<std::string> replayed;
+  EXPECT_EQ(reader.replay(0, reader.record_count(), record(&replayed),
+                          annotation(&replayed)),
+            true);
+  EXPECT_EQ(replayed == expected, true);
+  fasm::AnnotationCallback no_annotations;
+  EXPECT_EQ(reader.replay(0, reader.record_count(), record(&replayed),
+                          no_annotations),
+            true);
+
+  // Annotation-only lines between ranges go to the range that follows.
+  std::vector<std::string> first_range, second_range;
+  reader.replay(0, 4, record(&first_range), annotation(&first_range));
+  reader.replay(4, reader.record_count(), record(&second_range),
+                annotation(&second_range));
+  EXPECT_EQ(first_range.back(), "5:WIDE[64+36]=1");
+  EXPECT_EQ(second_range.front(), "6:{between=x}");
+
+  // Ranges in any split cover everything exactly once and in order.
+  for (uint64_t split = 0; split <= reader.record_count(); ++split) {
+    replayed.clear();
+    reader.replay(0, split, record(&replayed), annotation(&replayed));
+    reader.replay(split, reader.record_count(), record(&replayed),
+                  annotation(&replayed));
+    EXPECT_EQ(replayed == expected, true) << split;
+  }
+
+  for (int threads : {1, 2, 3, 8}) {
+    std::mutex lock;
+    std::vector<std::string> parallel;
+    auto record_locked = [&](uint32_t line, std::string_view feature,
+                             int start_bit, int width, uint64_t bits) {
+      const std::lock_guard<std::mutex> l(lock);
+      return record(&parallel)(line, feature, start_bit, width, bits);
+    };
+    auto annotation_locked = [&](uint32_t line, std::string_view feature,
+                                 std::string_view name,
+                                 std::string_view value) {
+      const std::lock_guard<std::mutex> l(lock);
+      annotation(&parallel)(line, feature, name, value);
+    };
+    EXPECT_EQ(reader.replay_parallel(threads, record_locked,
+                                     annotation_locked),
+              ParseResult::kSuccess);
+    std::sort(parallel.begin(), parallel.end());
+    std::vector<std::string> sorted_expected = expected;
+    std::sort(sorted_expected.begin(), sorted_expected.end());
+    EXPECT_EQ(parallel == sorted_expected, true) << threads;
+  }
+}
+
+// Parse content into a list of strings representing all callbacks, without
+// line numbers.
+std::vector<std::string> ParseToStrings(std::string_view content) {
+  std::vector<std::string> result;
+  auto parse_result = fasm::parse(
+      content, stderr,
+      [&](uint32_t, std::string_view feature, int start_bit, int width,
+          uint64_t bits) {
+        result.push_back(std::string(feature) + "[" +
+                         std::to_string(start_bit) + "+" +
+                         std::to_string(width) +
+                         "]=" + std::to_string(bits));
+        return true;
+      },
+      [&](uint32_t, std::string_view feature, std::string_view name,
+          std::string_view value) {
+        result.push_back(std::string(feature) + "{" + std::string(name) +
+                         "=" + std::string(value) + "}");
+      });
+  EXPECT_EQ(parse_result, ParseResult::kSuccess);
+  return result;
+}
+
+void WriterTest() {
+  std::cout << "\n-- Writer test -- \n";
+  {
+    std::string out;
+    fasm::Writer writer(&out);
+    writer.add_feature("FOO", 0, 1, 1);
+    writer.add_feature("FOO", 3, 1, 1);
+    writer.add_feature("FOO", 3, 1, 0);
+    writer.add_feature("BAR", 8, 16, 0x2a);
+    writer.add_feature("BAR", 0, 64, 0xfedcba9876543210);
+    writer.add_feature("CLAMPED", 0, 4, 0xff);
+    writer.add_annotation("a", "1");
+    writer.add_annotation("b", "with \\\"quote\\\"");
+    writer.add_annotation("only", "annotation");
+    writer.end_line();
+    writer.add_annotation("own", "line");
+    const uint64_t wide[] = {0x1, 0x23};
+    writer.add_wide_feature("WIDE", 0, 72, wide);
+    writer.flush();
+    EXPECT_EQ(out, "FOO\n"
+                   "FOO[3]\n"
+                   "FOO[3] = 1'h0\n"
+                   "BAR[23:8] = 16'h002a\n"
+                   "BAR[63:0] = 64'hfedcba9876543210\n"
+                   "CLAMPED[3:0] = 4'hf { a = \"1\", "
+                   "b = \"with \\\"quote\\\"\", only = \"annotation\" }\n"
+                   "{ own = \"line\" }\n"
+                   "WIDE[71:0] = 72'h230000000000000001\n");
+  }
+  {
+    std::string out;
+    fasm::Writer writer(&out, fasm::WriteStyle::kCanonical);
+    writer.add_feature("BAR", 8, 16, 0x2a);
+    writer.add_feature("ZERO", 0, 8, 0);
+    writer.add_annotation("a", "1");
+    const uint64_t wide[] = {0x1, 0x0};
+    writer.add_wide_feature("WIDE", 0, 100, wide);
+    writer.flush();
+    EXPECT_EQ(out, "BAR[23:8]=16'h2a\n"
+                   "ZERO[7:0]=8'h0{a=\"1\"}\n"
+                   "WIDE[99:0]=100'h1\n");
+  }
+
+  // Round trip through parse() in both styles.
+  const std::string content =
+      "{ leading = \"annotation\" }\n"
+      "FOO.BAR[7:0] = 8'b101010 # Comment\n"
+      "  FOO.BAR[15:8] = 8'd17 { a = \"1\", b = \"\\\"quoted\\\"\" }\n"
+      "WIDE[99:0] = 100'h1_00000000_00000002\n"
+      "{ between = \"x\" }\n"
+      "{ between = \"y\" }\n"
+      "SINGLE\n"
+      "SINGLE[5]\n"
+      "ZERO[63:0] = 0\n"
+      "OCTAL[11:0] = 12'o7777 { last = \"3\" }\n";
+  const std::vector<std::string> expected = ParseToStrings(content);
+  for (auto style : {fasm::WriteStyle::kReadable,
+                     fasm::WriteStyle::kCanonical}) {
+    std::string out;
+    {
+      fasm::Writer writer(&out, style);
+      fasm::parse(content, stderr, writer.parse_callback(),
+                  writer.annotation_callback(), writer.wide_callback());
+    }
+    EXPECT_EQ(ParseToStrings(out) == expected, true) << out;
+
+    // Writing batched records results in the same.
+    std::string batched_out;
+    fasm::Writer batched_writer(&batched_out, style);
+    auto block = std::make_unique<fasm::RecordBlock<3>>();
+    fasm::parse_batched(content, stderr, block.get(),
+                        [&](const fasm::RecordBlock<3> &b) {
+                          fasm::write_block(b, &batched_writer);
+                          return true;
+                        });
+    batched_writer.flush();
+    EXPECT_EQ(ParseToStrings(batched_out) == expected, true) << batched_out;
+  }
+
+  // Parallel formatting, concatenated in order.
+  FILE *tmp = tmpfile();
+  EXPECT_EQ(fasm::write_parallel(
+                10,
+                [](int block, fasm::Writer *writer) {
+                  for (int i = 0; i < 1000; ++i) {
+                    writer->add_feature("BLOCK", block, 1, i & 1);
+                  }
+                },
+                tmp),
+            true);
+  std::string sequential;
+  {
+    fasm::Writer writer(&sequential);
+    for (int block = 0; block < 10; ++block) {
+      for (int i = 0; i < 1000; ++i) {
+        writer.add_feature("BLOCK", block, 1, i & 1);
+      }
+    }
+  }
+  std::string parallel(ftell(tmp), '\0');
+  fseek(tmp, 0, SEEK_SET);
+  EXPECT_EQ(fread(&parallel[0], 1, parallel.size(), tmp), parallel.size());
+  fclose(tmp);
+  EXPECT_EQ(parallel == sequential, true);
+}
+
+// Write "content" to a new temporary file and return its name.
+std::string WriteTempFile(std::string_view content) {
+  char name[] = "/tmp/fasm-test-XXXXXX";
+  const int fd = mkstemp(name);
+  EXPECT_EQ(write(fd, content.data(), content.size()),
+            (ssize_t)content.size());
+  close(fd);
+  return name;
+}
+
+// All callbacks of parsing the file, sorted as they arrive in arbitrary
+// order from the parse workers.
+std::vector<std::string> ParseCompressedToStrings(
+    const char *filename, const fasm::PipelineOptions &options,
+    fasm::PipelineStats *stats, ParseResult expected_result) {
+  std::mutex lock;
+  std::vector<std::string> result;
+  const ParseResult parse_result = fasm::parse_compressed_file(
+      filename, stderr,
+      [&](uint32_t line, std::string_view feature, int start_bit, int width,
+          uint64_t bits) {
+        const std::lock_guard<std::mutex> l(lock);
+        result.push_back(std::to_string(line) + ":" + std::string(feature) +
+                         "[" + std::to_string(start_bit) + "+" +
+                         std::to_string(width) + "]=" + std::to_string(bits));
+        return true;
+      },
+      [&](uint32_t line, std::string_view, std::string_view name,
+          std::string_view value) {
+        const std::lock_guard<std::mutex> l(lock);
+        result.push_back(std::to_string(line) + "{" + std::string(name) +
+                         "=" + std::string(value) + "}");
+      },
+      options, stats);
+  EXPECT_EQ(parse_result, expected_result) << filename;
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+void DecompressParseTest() {
+  std::cout << "\n-- Decompress parse test -- \n";
+  std::string content;
+  for (uint32_t i = 1; i <= 2000; ++i) {
+    if (i % 11 == 0) {
+      content += "# comment\n";
+    } else if (i % 97 == 0) {
+      content += "VERY_LONG" + std::string(300, 'X') + "[99:0] = 100'h1\n";
+    } else {
+      content += "FEATURE_" + std::to_string(i) + "[" +
+                 std::to_string(i % 64) + "] = 1 { line = \"" +
+                 std::to_string(i) + "\" }\n";
+    }
+  }
+  content += "LAST_LINE_WITHOUT_NEWLINE[3:0] = 4'hf";
+
+  // Reference: parse all of it at once.
+  const std::string reference_content = content + "\n";
+  std::vector<std::string> expected;
+  fasm::parse(reference_content, stderr,
+              [&](uint32_t line, std::string_view feature, int start_bit,
+                  int width, uint64_t bits) {
+                expected.push_back(
+                    std::to_string(line) + ":" + std::string(feature) + "[" +
+                    std::to_string(start_bit) + "+" + std::to_string(width) +
+                    "]=" + std::to_string(bits));
+                return true;
+              },
+              [&](uint32_t line, std::string_view, std::string_view name,
+                  std::string_view value) {
+                expected.push_back(std::to_string(line) + "{" +
+                                   std::string(name) + "=" +
+                                   std::string(value) + "}");
+              });
+  std::sort(expected.begin(), expected.end());
+
+  // Files in all the formats we support.
+  fasm::PipelineOptions options;
+  std::vector<std::string> files;
+  files.push_back(WriteTempFile(content));
+  {
+    char gz_name[] = "/tmp/fasm-test-XXXXXX";
+    close(mkstemp(gz_name));
+    gzFile gz = gzopen(gz_name, "wb");
+    gzwrite(gz, content.data(), content.size());
+    gzclose(gz);
+    files.push_back(gz_name);
+  }
+#ifdef FASM_HAVE_ZSTD
+  {
+    std::string compressed(ZSTD_compressBound(content.size()), '\0');
+    compressed.resize(ZSTD_compress(&compressed[0], compressed.size(),
+                                    content.data(), content.size(), 3));
+    files.push_back(WriteTempFile(compressed));
+  }
+#endif
+
+  for (const std::string &file : files) {
+    // Block sizes smaller than lines, in the middle of lines etc.
+    for (size_t block_size : {1, 100, 4096, 1 << 20}) {
+      for (int threads : {1, 3}) {
+        options.parse_threads = threads;
+        options.block_size = block_size;
+        fasm::PipelineStats stats;
+        EXPECT_EQ(ParseCompressedToStrings(file.c_str(), options, &stats,
+                                           ParseResult::kSuccess) == expected,
+                  true)
+            << file << " " << block_size << " " << threads;
+        EXPECT_EQ(stats.lines, 2001u);
+        EXPECT_EQ(stats.content_bytes, reference_content.size());
+        EXPECT_EQ(stats.compressed_bytes > 0, true);
+      }
+    }
+
+    // Aborting stops everything.
+    options.parse_threads = 2;
+    options.block_size = 64;
+    EXPECT_EQ(fasm::parse_compressed_file(
+                  file.c_str(), stderr,
+                  [](uint32_t, std::string_view, int, int, uint64_t) {
+                    return false;
+                  }),
+              ParseResult::kUserAbort);
+
+    // Truncated compressed file is an error.
+    FILE *f = fopen(file.c_str(), "rb");
+    std::string file_content(content.size(), '\0');
+    file_content.resize(fread(&file_content[0], 1, content.size(), f));
+    fclose(f);
+    if (fasm::detect_compression(file_content) != fasm::Compression::kNone) {
+      file_content.resize(file_content.size() / 2);
+      const std::string truncated = WriteTempFile(file_content);
+      ParseCompressedToStrings(truncated.c_str(), options, nullptr,
+                               ParseResult::kError);
+      unlink(truncated.c_str());
+    }
+    unlink(file.c_str());
+  }
+  ParseCompressedToStrings("/non/existent/file", options, nullptr,
+                           ParseResult::kError);
+}
+
+void FileReadBackendTest() {
+  std::cout << "\n-- File read backend test -- \n";
+  std::string content;
+  for (uint32_t i = 1; i <= 3000; ++i) {
+    if (i % 101 == 0) {
+      content += "LONG" + std::string(5000, 'X') + "[7:0] = 8'h42\n";
+    } else {
+      content += "FEATURE_" + std::to_string(i) + "[" +
+                 std::to_string(i % 64) + "] = 1 { line = \"" +
+                 std::to_string(i) + "\" }\n";
+    }
+  }
+  const std::string file = WriteTempFile(content);
+
+  std::mutex lock;
+  std::vector<std::string> got;
+  const auto parse_chunk = [&](int, const fasm::ContentChunk &chunk) {
+    return fasm::parse(
+        chunk, stderr,
+        [&](uint32_t line, std::string_view feature, int start_bit, int width,
+            uint64_t bits) {
+          const std::lock_guard<std::mutex> l(lock);
+          got.push_back(std::to_string(line) + ":" + std::string(feature) +
+                        "[" + std::to_string(start_bit) + "+" +
+                        std::to_string(width) + "]=" + std::to_string(bits));
+          return true;
+        },
+        [&](uint32_t line, std::string_view, std::string_view name,
+            std::string_view value) {
+          const std::lock_guard<std::mutex> l(lock);
+          got.push_back(std::to_string(line) + "{" + std::string(name) + "=" +
+                        std::string(value) + "}");
+        });
+  };
+
+  // Reference: everything read at once.
+  fasm::ReadOptions read_options;
+  fasm::PipelineOptions options;
+  EXPECT_EQ(fasm::parse_file_chunks(file.c_str(), read_options, stderr,
+                                    parse_chunk, options),
+            ParseResult::kSuccess);
+  std::sort(got.begin(), got.end());
+  const std::vector<std::string> expected = got;
+  EXPECT_EQ(expected.size(), 3000u + 2971u);  // Long lines: no annotation
+
+  for (const fasm::ReadBackend backend :
+       {fasm::ReadBackend::kMmap, fasm::ReadBackend::kPread,
+        fasm::ReadBackend::kDirect, fasm::ReadBackend::kIoUring}) {
+    // Read sizes not aligned, smaller and larger than lines and blocks.
+    for (size_t read_size : {1000, 4096, 1 << 20}) {
+      for (int threads : {1, 3}) {
+        read_options.backend = backend;
+        read_options.read_size = read_size;
+        read_options.read_ahead = 3;
+        options.parse_threads = threads;
+        options.block_size = 8192;
+        fasm::PipelineStats stats;
+        got.clear();
+        EXPECT_EQ(fasm::parse_file_chunks(file.c_str(), read_options, stderr,
+                                          parse_chunk, options, &stats),
+                  ParseResult::kSuccess);
+        std::sort(got.begin(), got.end());
+        EXPECT_EQ(got == expected, true)
+            << fasm::read_backend_name(backend) << " " << read_size << " "
+            << threads;
+        EXPECT_EQ(stats.lines, 3000u);
+        EXPECT_EQ(stats.content_bytes, content.size());
+      }
+    }
+  }
+
+  fasm::ReadBackend backend;
+  EXPECT_EQ(fasm::parse_read_backend("io_uring", &backend), true);
+  EXPECT_EQ(backend == fasm::ReadBackend::kIoUring, true);
+  EXPECT_EQ(fasm::parse_read_backend("carrier-pigeon", &backend), false);
+
+  fasm::MappedFile mapped;
+  read_options.populate = true;
+  read_options.advise_willneed = true;
+  EXPECT_EQ(mapped.map(file.c_str(), read_options, stderr), true);
+  EXPECT_EQ(mapped.content() == content, true);
+  EXPECT_EQ(fasm::evict_from_page_cache(file.c_str()), true);
+  unlink(file.c_str());
+  EXPECT_EQ(mapped.map("/non/existent/file", read_options, stderr), false);
+}
+
+// Keeps copies of all diagnostics.
+class RecordingSink : public fasm::DiagnosticSink {
+ public:
+  void report(const fasm::Diagnostic &d) final {
+    diagnostics.push_back(d);
+    features.emplace_back(d.feature);
+  }
+  std::vector<fasm::Diagnostic> diagnostics;
+  std::vector<std::string> features;
+};
+
+void DiagnosticsTest() {
+  std::cout << "\n-- Diagnostics test -- \n";
+  using fasm::DiagnosticCode;
+  const std::string content =
+      "GOOD[3:0] = 4'h5\n"
+      "BAD_RANGE[0:3] = 1\n"
+      "TOO_WIDE[3:0] = 8'hff\n"
+      "NO_BRACKET[3:0 = 1\n"
+      "FOO { bar = baz }\n";
+  RecordingSink sink;
+  EXPECT_EQ(fasm::parse(
+                content, &sink,
+                [](uint32_t, std::string_view, int, int, uint64_t) {
+                  return true;
+                },
+                [](uint32_t, std::string_view, std::string_view,
+                   std::string_view) {}),
+            ParseResult::kError);
+  // Annotation issue is followed by not finding the end of annotations.
+  EXPECT_EQ(sink.diagnostics.size(), 5u);
+  if (sink.diagnostics.size() == 5) {
+    const fasm::Diagnostic &inverted = sink.diagnostics[0];
+    EXPECT_EQ(inverted.code == DiagnosticCode::kInvertedRange, true);
+    EXPECT_EQ(inverted.severity, ParseResult::kSkipped);
+    EXPECT_EQ(inverted.line, 2u);
+    EXPECT_EQ(inverted.offset, content.find("BAD_RANGE"));
+    EXPECT_EQ(sink.features[0], "BAD_RANGE");
+    EXPECT_EQ(inverted.max_bit, 0);
+    EXPECT_EQ(inverted.min_bit, 3);
+
+    const fasm::Diagnostic &too_wide = sink.diagnostics[1];
+    EXPECT_EQ(too_wide.code == DiagnosticCode::kValueTooWide, true);
+    EXPECT_EQ(too_wide.severity, ParseResult::kNonCritical);
+    EXPECT_EQ(too_wide.line, 3u);
+    EXPECT_EQ(too_wide.value, 8u);
+
+    const fasm::Diagnostic &bracket = sink.diagnostics[2];
+    EXPECT_EQ(bracket.code == DiagnosticCode::kExpectedCloseBracket, true);
+    EXPECT_EQ(bracket.severity, ParseResult::kError);
+    EXPECT_EQ(sink.features[2], "NO_BRACKET[3:0 =");
+    EXPECT_EQ(bracket.offset, content.find("= 1\nFOO"));
+
+    const fasm::Diagnostic &quote = sink.diagnostics[3];
+    EXPECT_EQ(quote.code == DiagnosticCode::kAnnotationNotQuoted, true);
+    EXPECT_EQ(quote.line, 5u);
+    EXPECT_EQ(quote.found, 'b');
+    EXPECT_EQ(sink.diagnostics[4].code ==
+                  DiagnosticCode::kAnnotationExpectedSeparator,
+              true);
+
+    // Formatted the same way as printed with the FILE* functions.
+    char *formatted = nullptr;
+    size_t formatted_size = 0;
+    FILE *out = open_memstream(&formatted, &formatted_size);
+    for (const fasm::Diagnostic &d : sink.diagnostics) {
+      fasm::print_diagnostic(out, d);
+    }
+    fclose(out);
+    char *printed = nullptr;
+    size_t printed_size = 0;
+    out = open_memstream(&printed, &printed_size);
+    fasm::parse(
+        content, out,
+        [](uint32_t, std::string_view, int, int, uint64_t) { return true; },
+        [](uint32_t, std::string_view, std::string_view, std::string_view) {
+        });
+    fclose(out);
+    EXPECT_EQ(std::string(formatted, formatted_size),
+              std::string(printed, printed_size));
+    EXPECT_EQ(std::string(formatted, formatted_size).rfind(
+                  "2: SKIP inverted range BAD_RANGE[0:3]\n", 0),
+              0u);
+    free(formatted);
+    free(printed);
+  }
+
+  // Many errors reported from parallel parsing, collected per thread and
+  // merged in line order with only the first of each kind kept.
+  std::string broken;
+  constexpr int kLines = 1000;
+  for (int i = 1; i <= kLines; ++i) {
+    broken += (i % 2) ? "A[1:2] = 1\n" : "B[1 = 1\n";
+  }
+  fasm::DiagnosticLimits limits;
+  limits.max_per_code = 3;
+  fasm::DiagnosticCollector collector(limits);
+  EXPECT_EQ(fasm::parse_parallel(
+                broken, 4, &collector,
+                [](uint32_t, std::string_view, int, int, uint64_t) {
+                  return true;
+                }),
+            ParseResult::kError);
+  EXPECT_EQ(collector.count(DiagnosticCode::kInvertedRange), 500u);
+  EXPECT_EQ(collector.count(DiagnosticCode::kExpectedCloseBracket), 500u);
+  EXPECT_EQ(collector.count(DiagnosticCode::kExpectedNewline), 0u);
+  const std::vector<fasm::Diagnostic> merged = collector.merge();
+  EXPECT_EQ(merged.size(), 6u);
+  size_t line_start = 0;
+  for (size_t i = 0; i < merged.size(); ++i) {
+    EXPECT_EQ(merged[i].line, i + 1);
+    // Inverted range reported at the feature, missing ']' where expected.
+    EXPECT_EQ(merged[i].offset, line_start + (i % 2 ? 4 : 0)) << i;
+    line_start = broken.find('\n', line_start) + 1;
+  }
+  char *printed = nullptr;
+  size_t printed_size = 0;
+  FILE *out = open_memstream(&printed, &printed_size);
+  collector.print(out);
+  fclose(out);
+  EXPECT_EQ(std::string(printed, printed_size),
+            "1: SKIP inverted range A[1:2]\n"
+            "2: ERR expected ']' : 'B[1 ='\n"
+            "3: SKIP inverted range A[1:2]\n"
+            "4: ERR expected ']' : 'B[1 ='\n"
+            "5: SKIP inverted range A[1:2]\n"
+            "6: ERR expected ']' : 'B[1 ='\n"
+            "... and 497 more expected-close-bracket\n"
+            "... and 497 more inverted-range\n");
+  free(printed);
+
+  // The total is limited as well.
+  limits.max_per_code = 1000;
+  limits.max_total = 10;
+  fasm::DiagnosticCollector total_limited(limits);
+  fasm::parse_parallel(broken, 3, &total_limited,
+                       [](uint32_t, std::string_view, int, int, uint64_t) {
+                         return true;
+                       });
+  EXPECT_EQ(total_limited.merge().size(), 10u);
+  EXPECT_EQ(total_limited.merge().back().line, 10u);
+}
+
+void ParseStatsTest() {
+  std::cout << "\n-- Parse statistics test -- \n";
+  using fasm::ParseStats;
+  const std::string content =
+      "# comment\n"
+      "\n"
+      "  \n"
+      "A\n"
+      "B[3:0] = 4'h5\n"
+      "C[7:0] = 8'b101\n"
+      "D[2] = 1\n"
+      "E[5:0] = 6'o7\n"
+      "F[9:0] = 10'd3 { a = \"x\", b = \"y\" }\n"
+      "WIDE[99:0] = 100'h1\n"
+      "G[0:3] = 1\n"
+      "{ c = \"z\" }\n";
+  const auto ignore_feature = [](uint32_t, std::string_view, int, int,
+                                 uint64_t) { return true; };
+  const auto ignore_annotation = [](uint32_t, std::string_view,
+                                    std::string_view, std::string_view) {};
+  FILE *const devnull = fopen("/dev/null", "w");
+  ParseStats stats;
+  EXPECT_EQ(fasm::parse_with_stats(content, devnull, &stats, ignore_feature,
+                                   ignore_annotation),
+            ParseResult::kSkipped);
+  EXPECT_EQ(stats.bytes, content.size());
+  EXPECT_EQ(stats.lines, 12u);
+  EXPECT_EQ(stats.blank_lines, 2u);
+  EXPECT_EQ(stats.comment_lines, 1u);
+  EXPECT_EQ(stats.error_lines, 1u);
+  EXPECT_EQ(stats.plain_features, 1u);
+  EXPECT_EQ(stats.ranged_features, 7u);
+  EXPECT_EQ(stats.assignments[ParseStats::kNoAssignment], 1u);
+  EXPECT_EQ(stats.assignments[ParseStats::kPlainNumber], 1u);
+  EXPECT_EQ(stats.assignments[ParseStats::kBinary], 1u);
+  EXPECT_EQ(stats.assignments[ParseStats::kOctal], 1u);
+  EXPECT_EQ(stats.assignments[ParseStats::kDecimal], 1u);
+  EXPECT_EQ(stats.assignments[ParseStats::kHex], 2u);  // Including wide.
+  EXPECT_EQ(stats.annotated_lines, 2u);
+  EXPECT_EQ(stats.annotations, 3u);
+  EXPECT_EQ(stats.annotation_bytes,
+            strlen("{ a = \"x\", b = \"y\" }") + strlen("{ c = \"z\" }"));
+
+  // Widths 1 (A and D[2]), 4, 6, 8, 10 and 100 in buckets by bits needed.
+  EXPECT_EQ(stats.width_histogram[1], 2u);
+  EXPECT_EQ(stats.width_histogram[3], 2u);  // 4 and 6
+  EXPECT_EQ(stats.width_histogram[4], 2u);  // 8 and 10
+  EXPECT_EQ(stats.width_histogram[7], 1u);  // 100
+  EXPECT_EQ(stats.name_length_histogram[1], 7u);  // Single letter names.
+  EXPECT_EQ(stats.name_length_histogram[3], 1u);  // WIDE
+  EXPECT_EQ(ParseStats::histogram_bucket(0), 0);
+  EXPECT_EQ(ParseStats::histogram_bucket(uint64_t(1) << 40),
+            ParseStats::kHistogramBuckets - 1);
+
+  // Chunks of the parallel parse add up to the same.
+  std::string repeated;
+  for (int i = 0; i < 100; ++i) repeated += content;
+  std::vector<ParseStats> chunk_stats;
+  fasm::parse_parallel_with_stats(repeated, 4, devnull, &chunk_stats,
+                                  ignore_feature, ignore_annotation);
+  EXPECT_EQ(chunk_stats.size(), 4u);
+  ParseStats total;
+  for (const ParseStats &s : chunk_stats) total.add(s);
+  EXPECT_EQ(total.bytes, repeated.size());
+  EXPECT_EQ(total.lines, 1200u);
+  EXPECT_EQ(total.error_lines, 100u);
+  EXPECT_EQ(total.ranged_features, 700u);
+  EXPECT_EQ(total.annotations, 300u);
+  EXPECT_EQ(total.width_histogram[7], 100u);
+  fclose(devnull);
+}
+
+void LineIndexTest() {
+  std::cout << "\n-- Line index test -- \n";
+  // Tiles of 25 lines, with some comments in between and at the end.
+  std::string content;
+  std::vector<size_t> offsets = {0, 0};  // Offset of each line from line 1
+  for (uint32_t i = 1; i <= 2003; ++i) {
+    if (i % 10 == 0 || i > 2000) {
+      content += "# comment " + std::to_string(i) + "\n";
+    } else {
+      content += "TILE_" + std::to_string(i / 25) + ".FEAT_" +
+                 std::to_string(i) + "[" + std::to_string(i % 8) + "] = 1\n";
+    }
+    offsets.push_back(content.size());
+  }
+  const auto ignore_feature = [](uint32_t, std::string_view, int, int,
+                                 uint64_t) { return true; };
+  const fasm::SourceFingerprint source = fasm::fingerprint(content, 42);
+  fasm::LineIndexBuilder builder(content, 16);
+  EXPECT_EQ(fasm::parse(content, stderr, builder.wrap(ignore_feature)),
+            ParseResult::kSuccess);
+  const fasm::LineIndex index = builder.finish(source);
+  EXPECT_EQ(index.line_count(), 2003u);
+  EXPECT_EQ(index.entries().size(), 2000u / 16);  // Line 2000 is a comment.
+  for (uint32_t line = 1; line <= 2003; ++line) {
+    EXPECT_EQ(index.line_offset(content, line), offsets[line]) << line;
+  }
+  EXPECT_EQ(index.line_offset(content, 2004), content.size());
+
+  // Lines 75 up to 99 are TILE_3, with 80 and 90 being comments.
+  EXPECT_EQ(index.tiles().size(), 80u);
+  EXPECT_EQ(index.find_tile("TILE"), nullptr);
+  const fasm::LineIndex::TileRange *tile = index.find_tile("TILE_3");
+  EXPECT_EQ(tile != nullptr, true);
+  EXPECT_EQ(tile->first_line, 75u);
+  EXPECT_EQ(tile->last_line, 99u);
+  EXPECT_EQ(tile->begin, offsets[75]);
+  EXPECT_EQ(tile->end, offsets[100]);
+  uint32_t feature_count = 0;
+  const fasm::ContentChunk tile_lines =
+      index.lines(content, tile->first_line, tile->last_line);
+  EXPECT_EQ(tile_lines.offset, tile->begin);
+  fasm::parse(tile_lines, stderr,
+              [&](uint32_t line, std::string_view feature, int, int,
+                  uint64_t) {
+                EXPECT_EQ(feature.substr(0, 7), "TILE_3.");
+                EXPECT_EQ(feature.substr(12), std::to_string(line));
+                ++feature_count;
+                return true;
+              });
+  EXPECT_EQ(feature_count, 23u);
+
+  // Split by number of lines.
+  const std::vector<fasm::ContentChunk> chunks = index.split(content, 7);
+  EXPECT_EQ(chunks.size(), 7u);
+  std::string reassembled;
+  uint32_t expected_first_line = 1;
+  for (const fasm::ContentChunk &chunk : chunks) {
+    EXPECT_EQ(chunk.first_line, expected_first_line);
+    EXPECT_EQ(chunk.offset, reassembled.size());
+    const uint32_t lines = std::count(chunk.content.begin(),
+                                      chunk.content.end(), '\n');
+    EXPECT_EQ(lines == 2003 / 7 || lines == 2003 / 7 + 1, true) << lines;
+    expected_first_line += lines;
+    reassembled.append(chunk.content);
+  }
+  EXPECT_EQ(reassembled, content);
+
+  // Built by several builders parsing chunks in arbitrary order: same.
+  std::vector<fasm::LineIndexBuilder> builders;
+  builders.emplace_back(content, 16);
+  builders.emplace_back(content, 16);
+  const auto parallel_chunks = fasm::split_lines(content, 6);
+  for (int i = parallel_chunks.size() - 1; i >= 0; --i) {
+    fasm::parse(parallel_chunks[i], stderr,
+                builders[i % 2].wrap(ignore_feature));
+  }
+  builders[0].merge(builders[1]);
+  const fasm::LineIndex merged = builders[0].finish(source);
+  EXPECT_EQ(merged.line_count(), index.line_count());
+  EXPECT_EQ(merged.entries().size(), index.entries().size());
+  for (size_t i = 0; i < merged.entries().size(); ++i) {
+    EXPECT_EQ(merged.entries()[i].line, index.entries()[i].line);
+    EXPECT_EQ(merged.entries()[i].offset, index.entries()[i].offset);
+  }
+  EXPECT_EQ(merged.tiles().size(), index.tiles().size());
+  for (size_t i = 0; i < merged.tiles().size(); ++i) {
+    EXPECT_EQ(merged.tiles()[i].prefix, index.tiles()[i].prefix);
+    EXPECT_EQ(merged.tiles()[i].first_line, index.tiles()[i].first_line);
+    EXPECT_EQ(merged.tiles()[i].end, index.tiles()[i].end);
+  }
+
+  // Sidecar file only accepted for the same source.
+  const std::string file = WriteTempFile("");
+  EXPECT_EQ(index.write(file.c_str()), true);
+  FILE *const devnull = fopen("/dev/null", "w");
+  fasm::LineIndex loaded;
+  EXPECT_EQ(loaded.read(file.c_str(), fasm::fingerprint(content, 43),
+                        devnull),
+            false);
+  EXPECT_EQ(loaded.read(file.c_str(), source, devnull), true);
+  EXPECT_EQ(loaded.stride(), 16u);
+  EXPECT_EQ(loaded.line_count(), 2003u);
+  EXPECT_EQ(loaded.entries().size(), index.entries().size());
+  EXPECT_EQ(loaded.line_offset(content, 1234), offsets[1234]);
+  EXPECT_EQ(loaded.find_tile("TILE_3") != nullptr, true);
+  EXPECT_EQ(loaded.find_tile("TILE_3")->end, offsets[100]);
+
+  // Corrupt sidecars with a matching fingerprint are rejected.
+  const auto patch_file = [&](size_t offset, uint64_t value) {
+    EXPECT_EQ(index.write(file.c_str()), true);
+    FILE *const f = fopen(file.c_str(), "r+b");
+    fseek(f, offset, SEEK_SET);
+    fwrite(&value, sizeof(value), 1, f);
+    fclose(f);
+  };
+  patch_file(offsetof(fasm::LineIndexHeader, entry_count), uint64_t(1) << 60);
+  EXPECT_EQ(loaded.read(file.c_str(), source, devnull), false);
+  patch_file(sizeof(fasm::LineIndexHeader) +
+                 index.entries().size() * sizeof(fasm::LineIndex::Entry) +
+                 offsetof(fasm::LineIndexTile, end),
+             content.size() + 1);
+  EXPECT_EQ(loaded.read(file.c_str(), source, devnull), false);
+  patch_file(sizeof(fasm::LineIndexHeader) +
+                 offsetof(fasm::LineIndex::Entry, offset),
+             content.size() + 1);
+  EXPECT_EQ(loaded.read(file.c_str(), source, devnull), false);
+  fclose(devnull);
+  unlink(file.c_str());
+}
+
+void FeatureLookupTest() {
+  std::cout << "\n-- Feature lookup test -- \n";
+  std::string content;
+  for (uint32_t i = 1; i <= 3000; ++i) {
+    if (i % 100 == 0) {
+      // Same feature on several lines.
+      content += "TILE.REPEATED[" + std::to_string(i / 100) + "] = 1\n";
+    } else if (i == 1234) {
+      content += "TILE.WIDE[99:0] = 100'h3_00000000_00000007 { a = \"b\" }\n";
+    } else if (i % 7 == 0) {
+      content += "# comment\n";
+    } else {
+      content += "TILE_" + std::to_string(i) + ".FEAT[3:0] = 4'd" +
+                 std::to_string(i % 16) + "\n";
+    }
+  }
+  const fasm::SourceFingerprint source = fasm::fingerprint(content, 42);
+  const auto ignore_feature = [](uint32_t, std::string_view, int, int,
+                                 uint64_t) { return true; };
+
+  // Built in parallel from chunks in arbitrary order.
+  std::vector<fasm::FeatureIndexBuilder> builders;
+  builders.emplace_back(content);
+  builders.emplace_back(content);
+  const auto chunks = fasm::split_lines(content, 5);
+  for (int i = chunks.size() - 1; i >= 0; --i) {
+    fasm::parse(chunks[i], stderr, builders[i % 2].wrap(ignore_feature));
+  }
+  builders[0].merge(builders[1]);
+  fasm::FeatureIndex index = builders[0].finish(source);
+  EXPECT_EQ(index.size(), 3000u - (3000 / 7 - 3000 / 700));
+
+  std::vector<std::string> got;
+  const auto record = [&](uint32_t line, std::string_view feature,
+                          int start_bit, int width, uint64_t bits) {
+    got.push_back(std::to_string(line) + ":" + std::string(feature) + "[" +
+                  std::to_string(start_bit) + "+" + std::to_string(width) +
+                  "]=" + std::to_string(bits));
+    return true;
+  };
+  EXPECT_EQ(fasm::lookup(index, content,
+                         {"TILE_1002.FEAT", "NOT_THERE", "TILE.REPEATED"},
+                         stderr, record),
+            ParseResult::kSuccess);
+  EXPECT_EQ(got.size(), 31u);
+  EXPECT_EQ(got[0], "1002:TILE_1002.FEAT[0+4]=10");
+  EXPECT_EQ(got[1], "100:TILE.REPEATED[1+1]=1");
+  EXPECT_EQ(got[30], "3000:TILE.REPEATED[30+1]=1");
+
+  // Wide values in slices or in one piece, with annotations.
+  got.clear();
+  std::vector<std::string> annotations;
+  const auto record_annotation = [&](uint32_t line, std::string_view feature,
+                                     std::string_view name,
+                                     std::string_view value) {
+    annotations.push_back(std::to_string(line) + ":" + std::string(feature) +
+                          "{" + std::string(name) + "=" + std::string(value) +
+                          "}");
+  };
+  fasm::lookup(index, content, {"TILE.WIDE"}, stderr, record,
+               record_annotation);
+  EXPECT_EQ(got.size(), 2u);
+  EXPECT_EQ(got[0], "1234:TILE.WIDE[0+64]=7");
+  EXPECT_EQ(got[1], "1234:TILE.WIDE[64+36]=3");
+  EXPECT_EQ(annotations.size(), 1u);
+  EXPECT_EQ(annotations[0], "1234:TILE.WIDE{a=b}");
+  int wide_calls = 0;
+  fasm::lookup(index, content, {"TILE.WIDE"}, stderr, ignore_feature,
+               nullptr,
+               [&](uint32_t line, std::string_view, int, int width,
+                   const uint64_t *bits) {
+                 EXPECT_EQ(line, 1234u);
+                 EXPECT_EQ(width, 100);
+                 EXPECT_EQ(bits[1], 3u);
+                 ++wide_calls;
+                 return true;
+               });
+  EXPECT_EQ(wide_calls, 1);
+
+  // Sidecar file is memory mapped and only accepted for the same source.
+  const std::string file = WriteTempFile("");
+  EXPECT_EQ(index.write(file.c_str()), true);
+  FILE *const devnull = fopen("/dev/null", "w");
+  fasm::FeatureIndex loaded;
+  EXPECT_EQ(loaded.read(file.c_str(), fasm::fingerprint(content, 43),
+                        devnull),
+            false);
+  EXPECT_EQ(loaded.read(file.c_str(), source, devnull), true);
+  EXPECT_EQ(loaded.size(), index.size());
+  got.clear();
+  fasm::lookup(loaded, content, {"TILE_2999.FEAT"}, stderr, record);
+  EXPECT_EQ(got.size(), 1u);
+  EXPECT_EQ(got[0], "2999:TILE_2999.FEAT[0+4]=7");
+  got.clear();
+  fasm::AnnotationCallback no_annotations;
+  fasm::WideParseCallback no_wide;
+  fasm::lookup(loaded, content, {"TILE.WIDE"}, stderr, record, no_annotations,
+               no_wide);
+  EXPECT_EQ(got.size(), 2u);
+  fasm::FeatureIndex moved = std::move(loaded);
+  EXPECT_EQ(moved.size(), index.size());
+  EXPECT_EQ(moved.candidates("TILE.REPEATED").second -
+                moved.candidates("TILE.REPEATED").first,
+            30);
+
+  // An entry count that only matches the file size when overflowing.
+  static_assert(sizeof(fasm::FeatureIndex::Entry) == 16);
+  uint64_t entry_count = index.size() + (uint64_t(1) << 60);
+  FILE *const f = fopen(file.c_str(), "r+b");
+  fseek(f, offsetof(fasm::FeatureIndexHeader, entry_count), SEEK_SET);
+  fwrite(&entry_count, sizeof(entry_count), 1, f);
+  fclose(f);
+  EXPECT_EQ(loaded.read(file.c_str(), source, devnull), false);
+  fclose(devnull);
+  unlink(file.c_str());
+}
+
+void DiffTest() {
+  std::cout << "\n-- Diff test -- \n";
+  const std::string old_content =
+      "A.B[7:0] = 8'hA5\n"
+      "PLAIN\n"
+      "# comment\n"
+      "WIDE[99:0] = 100'h1_00000000_00000003\n"
+      "ZERO[3:0] = 4'h0\n"
+      "LAST[1:0] = 2'b11\n"
+      "LAST[0] = 0\n"  // Last assignment counts.
+      "SPARSE[5]\n"
+      "SPARSE[65000]\n"
+      "GONE[2]\n";
+  // Same bits, but in different order, bases and ranges.
+  const std::string same_content =
+      "SPARSE[65000] = 1\n"
+      "WIDE[99:64] = 36'd1\n"
+      "A.B[3:0]=4'b0101\n"
+      "  A.B[7:4] = 4'o12  \n"
+      "WIDE[63:0] = 3\n"
+      "LAST[1]\n"
+      "PLAIN[0] = 1\n"
+      "SPARSE[5]\n"
+      "GONE[2]\n";
+  for (int threads : {1, 3}) {
+    std::vector<fasm::FeatureDiff> diffs;
+    EXPECT_EQ(fasm::diff(old_content, same_content, threads, stderr, &diffs),
+              ParseResult::kSuccess);
+    EXPECT_EQ(diffs.size(), 0u) << threads;
+  }
+
+  const std::string new_content = same_content +
+                                  "A.B[0] = 0\n"
+                                  "A.B[9:8] = 2'b10\n"
+                                  "GONE[2] = 0\n"
+                                  "NEW[64]\n"
+                                  "SPARSE[65000] = 0\n";
+  std::vector<fasm::FeatureDiff> diffs;
+  EXPECT_EQ(fasm::diff(old_content, new_content, 2, stderr, &diffs),
+            ParseResult::kSuccess);
+  EXPECT_EQ(diffs.size(), 4u);
+  if (diffs.size() != 4) return;
+  EXPECT_EQ(diffs[0].feature, "A.B");  // Sorted by name.
+  EXPECT_EQ(diffs[0].min_bit, 0);
+  EXPECT_EQ(diffs[0].width, 10);
+  EXPECT_EQ(diffs[0].old_bits[0], 0xA5u);
+  EXPECT_EQ(diffs[0].new_bits[0], 0x2A4u);
+  EXPECT_EQ(diffs[0].added_bits(), 1u);
+  EXPECT_EQ(diffs[0].removed_bits(), 1u);
+  EXPECT_EQ(diffs[1].feature, "GONE");
+  EXPECT_EQ(diffs[1].min_bit, 2);
+  EXPECT_EQ(diffs[1].new_bits[0], 0u);
+  EXPECT_EQ(diffs[2].feature, "NEW");
+  EXPECT_EQ(diffs[2].min_bit, 64);
+  EXPECT_EQ(diffs[2].old_bits[0], 0u);
+  EXPECT_EQ(diffs[2].added_bits(), 1u);
+  EXPECT_EQ(diffs[3].feature, "SPARSE");
+  EXPECT_EQ(diffs[3].min_bit, 5);
+  EXPECT_EQ(diffs[3].width, 65000 - 5 + 1);
+  EXPECT_EQ(diffs[3].removed_bits(), 1u);
+
+  // New values appended to the old content make it the same as the new.
+  std::string patched = old_content;
+  {
+    fasm::Writer writer(&patched, fasm::WriteStyle::kCanonical);
+    for (const fasm::FeatureDiff &d : diffs) {
+      writer.add_wide_feature(d.feature, d.min_bit, d.width,
+                              d.new_bits.data());
+    }
+  }
+  std::vector<fasm::FeatureDiff> remaining;
+  fasm::diff(patched, new_content, 2, stderr, &remaining);
+  EXPECT_EQ(remaining.size(), 0u);
+}
+
+static std::string Canonicalize(std::string_view content,
+                                const fasm::CanonicalizeOptions &options) {
+  char *buffer = nullptr;
+  size_t size = 0;
+  FILE *out = open_memstream(&buffer, &size);
+  EXPECT_EQ(fasm::canonicalize(content, stderr, out, options),
+            ParseResult::kSuccess);
+  fclose(out);
+  std::string result(buffer, size);
+  free(buffer);
+  return result;
+}
+
+void CanonicalizeTest() {
+  std::cout << "\n-- Canonicalize test -- \n";
+  fasm::CanonicalizeOptions options;
+  EXPECT_EQ(Canonicalize("", options), "");
+  const std::string content =
+      "B[3:0] = 4'b1010 { a = \"b\" }\n"
+      "# comment\n"
+      "A.X[65]\n"
+      "A.X\n"
+      "B[1] = 0\n"  // Last assignment counts.
+      "ZERO[7:0] = 8'h0\n"
+      "B[0] = 1\n"
+      "W[69:0] = 70'h20_00000000_00000004\n"
+      "A.X[10]\n";
+  const std::string expected =
+      "A.X\n"
+      "A.X[10]\n"
+      "A.X[65]\n"
+      "B\n"
+      "B[3]\n"
+      "W[2]\n"
+      "W[69]\n";
+  for (int threads : {1, 3}) {
+    options.thread_count = threads;
+    EXPECT_EQ(Canonicalize(content, options), expected) << threads;
+  }
+
+  // Large enough to be sorted in runs with a small budget. Later lines
+  // change bits set in earlier runs.
+  std::string large;
+  for (int i = 0; i < 50000; ++i) {
+    large += "TILE_" + std::to_string(i % 5000) + ".BITS[31:0] = 32'h" +
+             (i < 45000 ? "f0f0f0f" : "1") + std::to_string(i % 10) + "\n";
+  }
+  EXPECT_EQ(large.size() > (1 << 20), true);
+  options.thread_count = 2;
+  const std::string in_memory = Canonicalize(large, options);
+  options.memory_budget = 1;
+  EXPECT_EQ(Canonicalize(large, options), in_memory);
+  std::vector<fasm::FeatureDiff> diffs;
+  fasm::diff(large, in_memory, 2, stderr, &diffs);
+  EXPECT_EQ(diffs.size(), 0u);
+}
+
+void FeatureStateTest() {
+  std::cout << "\n-- Feature state test -- \n";
+  const std::string content =
+      "FOO[3:0] = 4'h5\n"
+      "BAR\n"
+      "FOO[7:4] = 4'hA\n"       // Merged with line 1.
+      "FOO[5:2] = 4'b1101\n"    // Bits 3:2 duplicate, 5:4 conflict.
+      "BAR\n"                   // Duplicate.
+      "WIDE[99:60] = 40'hF_0000_000F\n"  // Crossing a word boundary.
+      "WIDE[64:63] = 2'b00\n";  // Conflict, last line counts.
+  // Lines added in any order give the same result.
+  for (bool reverse : {false, true}) {
+    fasm::FeatureStateStore store;
+    std::vector<std::function<void()>> adds;
+    fasm::parse(content, stderr,
+                [&](uint32_t line, std::string_view feature, int start_bit,
+                    int width, uint64_t bits) {
+                  adds.push_back([=, &store]() {
+                    store.add(line, feature, start_bit, width, bits);
+                  });
+                  return true;
+                });
+    if (reverse) std::reverse(adds.begin(), adds.end());
+    for (const auto &add : adds) add();
+
+    EXPECT_EQ(store.size(), 3u);
+    uint64_t bits = 0, assigned = 0;
+    EXPECT_EQ(store.value("FOO", 0, 8, &bits, &assigned), true);
+    EXPECT_EQ(bits, 0xB5u) << reverse;
+    EXPECT_EQ(assigned, 0xFFu);
+    EXPECT_EQ(store.value("FOO", 4, 8, &bits, &assigned), true);
+    EXPECT_EQ(bits, 0xBu);
+    EXPECT_EQ(assigned, 0xFu);
+    EXPECT_EQ(store.value("WIDE", 60, 40, &bits, &assigned), true);
+    EXPECT_EQ(bits, 0xF00000007u) << reverse;
+    EXPECT_EQ(assigned, 0xFFFFFFFFFFu);
+    EXPECT_EQ(store.value("BAR", 0, 1, &bits), true);
+    EXPECT_EQ(bits, 1u);
+    EXPECT_EQ(store.value("BAZ", 0, 1, &bits), false);
+
+    const std::vector<fasm::FeatureConflict> conflicts = store.conflicts();
+    EXPECT_EQ(conflicts.size(), 4u);
+    if (conflicts.size() != 4) continue;
+    EXPECT_EQ(conflicts[0].first_line, 1u);  // Sorted by line.
+    EXPECT_EQ(conflicts[0].second_line, 4u);
+    EXPECT_EQ(conflicts[0].start_bit, 2);
+    EXPECT_EQ(conflicts[0].width, 2);
+    EXPECT_EQ(conflicts[0].conflicting(), false);
+    EXPECT_EQ(conflicts[1].first_line, 3u);
+    EXPECT_EQ(conflicts[1].start_bit, 4);
+    EXPECT_EQ(conflicts[1].first_bits, 0x2u);
+    EXPECT_EQ(conflicts[1].second_bits, 0x3u);
+    EXPECT_EQ(conflicts[1].conflicting(), true);
+    EXPECT_EQ(conflicts[2].feature, "BAR");
+    EXPECT_EQ(conflicts[2].conflicting(), false);
+    EXPECT_EQ(conflicts[3].feature, "WIDE");
+    EXPECT_EQ(conflicts[3].start_bit, 63);
+    EXPECT_EQ(conflicts[3].second_line, 7u);
+    EXPECT_EQ(conflicts[3].conflicting(), true);
+
+    char *printed = nullptr;
+    size_t printed_size = 0;
+    FILE *out = open_memstream(&printed, &printed_size);
+    fasm::print_conflict(out, conflicts[1]);
+    fasm::print_conflict(out, conflicts[2]);
+    fclose(out);
+    EXPECT_EQ(std::string(printed, printed_size),
+              "4: WARN FOO[5:4] = 2'h3 conflicts with line 3: 2'h2\n"
+              "5: INFO BAR[0] already assigned in line 2\n");
+    free(printed);
+  }
+
+  // Filled concurrently by a parallel parse.
+  std::string large;
+  for (int i = 0; i < 100000; ++i) {
+    large += "TILE_" + std::to_string(i % 50000) + ".BITS[" +
+             std::to_string(i < 50000 ? 7 : 15) + ":" +
+             std::to_string(i < 50000 ? 0 : 8) + "] = 8'h" +
+             (i == 75000 ? "11" : "ff") + "\n";
+  }
+  large += "TILE_3.BITS[0] = 0\n";
+  fasm::FeatureStateStore store;
+  fasm::Executor executor = [](int count, const std::function<void(int)> &f) {
+    fasm::run_threads(count, f);
+  };
+  EXPECT_EQ(fasm::parse_parallel(large, 3, stderr, store.parse_callback(),
+                                 nullptr, executor),
+            ParseResult::kSuccess);
+  EXPECT_EQ(store.size(), 50000u);
+  uint64_t bits = 0;
+  store.value("TILE_25000.BITS", 0, 16, &bits);
+  EXPECT_EQ(bits, 0x11ffu);
+  store.value("TILE_3.BITS", 0, 16, &bits);
+  EXPECT_EQ(bits, 0xfffeu);
+  EXPECT_EQ(store.conflicts().size(), 1u);
 }
 
 int main() {
   ValueParseTest();
+  WideValueParseTest();
   AnnotationParseTest();
+  NumberParseDifferentialTest();
+  NewlineScanTest();
+  ParallelParseTest();
+  StreamParseTest();
+  BatchedParseTest();
+  SegmentedParseTest();
+  FeatureTableTest();
+  FeatureTrieTest();
+  AssemblerTest();
+  BinaryFormatTest();
+  WriterTest();
+  DecompressParseTest();
+  FileReadBackendTest();
+  DiagnosticsTest();
+  ParseStatsTest();
+  LineIndexTest();
+  FeatureLookupTest();
+  DiffTest();
+  CanonicalizeTest();
+  FeatureStateTest();
 
   if (expect_mismatch_count == 0) {
     printf("\nPASS, all expectations met.\n");
@@ -14,19 +14,29 @@
 
 // See if a file can be parsed successfully with fasm-parse and simple benchmark
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 
 #include <algorithm>
-#include <cassert>
 #include <cstdlib>
+#include <memory>
+#include <string>
 #include <string_view>
 #include <thread>
+#include <vector>
 
+#include "fasm-binary.h"
+#include "fasm-decompress.h"
+#include "fasm-diagnostics.h"
+#include "fasm-feature-state.h"
+#include "fasm-index.h"
+#include "fasm-io.h"
 #include "fasm-parse.h"
 
 int64_t getTimeInMicros() {
@@ -39,26 +49,308 @@ struct ParseStatistics {
   uint64_t accumulate = 0;
   uint32_t last_line = 0;
   fasm::ParseResult result = fasm::ParseResult::kSuccess;
+  int64_t parse_us = 0;    // Only measured when parsing multiple files.
+  fasm::ParseStats parse;  // Only collected with PARSE_STATS
 };
 
 void Accumulate(const ParseStatistics &stats, ParseStatistics *accumulator) {
   accumulator->accumulate ^= stats.accumulate;
-  accumulator->last_line += stats.last_line;
+  accumulator->last_line = std::max(accumulator->last_line, stats.last_line);
   accumulator->result = std::max(accumulator->result, stats.result);
+  accumulator->parse_us += stats.parse_us;
+  accumulator->parse.add(stats.parse);
 }
 
-ParseStatistics ParseContent(std::string_view content) {
+// For comparison: call the parser through the std::function based API
+// instead of the templated one that can inline the callback.
+static const bool kUseStdFunction = getenv("USE_STD_FUNCTION") != nullptr;
+
+// PARSE_STATS=text or PARSE_STATS=json: collect and print parse statistics.
+enum class StatsFormat { kNone, kText, kJson };
+static const StatsFormat kStatsFormat = []() {
+  const char *const env = getenv("PARSE_STATS");
+  if (!env) return StatsFormat::kNone;
+  return std::string_view(env) == "json" ? StatsFormat::kJson
+                                          : StatsFormat::kText;
+}();
+
+// Upper bound of values in histogram bucket, e.g. "15" for 4 bits.
+std::string BucketLimit(int bucket) {
+  if (bucket == fasm::ParseStats::kHistogramBuckets - 1) return "inf";
+  return std::to_string((uint64_t(1) << bucket) - 1);
+}
+
+void PrintStatsJson(const fasm::ParseStats &total,
+                    const std::vector<fasm::ParseStats> &per_thread,
+                    double imbalance) {
+  const auto print_array = [](const uint64_t *values, int count) {
+    for (int i = 0; i < count; ++i) {
+      fprintf(stdout, "%s%" PRIu64, i ? ", " : "", values[i]);
+    }
+  };
+  fprintf(stdout,
+          "{\"bytes\": %" PRIu64 ", \"lines\": %" PRIu64
+          ", \"blank_lines\": %" PRIu64 ", \"comment_lines\": %" PRIu64
+          ", \"error_lines\": %" PRIu64 ",\n"
+          " \"plain_features\": %" PRIu64 ", \"ranged_features\": %" PRIu64
+          ",\n \"assignments\": {\"none\": %" PRIu64
+          ", \"number\": %" PRIu64 ", \"binary\": %" PRIu64
+          ", \"octal\": %" PRIu64 ", \"decimal\": %" PRIu64
+          ", \"hex\": %" PRIu64 "},\n"
+          " \"annotated_lines\": %" PRIu64 ", \"annotations\": %" PRIu64
+          ", \"annotation_bytes\": %" PRIu64 ",\n",
+          total.bytes, total.lines, total.blank_lines, total.comment_lines,
+          total.error_lines, total.plain_features, total.ranged_features,
+          total.assignments[fasm::ParseStats::kNoAssignment],
+          total.assignments[fasm::ParseStats::kPlainNumber],
+          total.assignments[fasm::ParseStats::kBinary],
+          total.assignments[fasm::ParseStats::kOctal],
+          total.assignments[fasm::ParseStats::kDecimal],
+          total.assignments[fasm::ParseStats::kHex], total.annotated_lines,
+          total.annotations, total.annotation_bytes);
+  fprintf(stdout, " \"width_histogram\": [");
+  print_array(total.width_histogram, fasm::ParseStats::kHistogramBuckets);
+  fprintf(stdout, "],\n \"name_length_histogram\": [");
+  print_array(total.name_length_histogram,
+              fasm::ParseStats::kHistogramBuckets);
+  fprintf(stdout, "],\n \"threads\": [");
+  for (size_t i = 0; i < per_thread.size(); ++i) {
+    const fasm::ParseStats &t = per_thread[i];
+    fprintf(stdout,
+            "%s\n  {\"bytes\": %" PRIu64 ", \"lines\": %" PRIu64
+            ", \"duration_us\": %" PRId64 "}",
+            i ? "," : "", t.bytes, t.lines, t.duration_us);
+  }
+  fprintf(stdout, "],\n \"imbalance\": %.3f}\n", imbalance);
+}
+
+void PrintStatsText(const fasm::ParseStats &total,
+                    const std::vector<fasm::ParseStats> &per_thread,
+                    double imbalance) {
+  fprintf(stdout,
+          "Lines: %" PRIu64 " total; %" PRIu64 " blank; %" PRIu64
+          " comment; %" PRIu64 " with errors\n"
+          "Features: %" PRIu64 " plain; %" PRIu64 " ranged\n"
+          "Assignments: %" PRIu64 " none; %" PRIu64 " number; %" PRIu64
+          " binary; %" PRIu64 " octal; %" PRIu64 " decimal; %" PRIu64
+          " hex\n"
+          "Annotations: %" PRIu64 " lines; %" PRIu64 " name/values; %" PRIu64
+          " bytes\n",
+          total.lines, total.blank_lines, total.comment_lines,
+          total.error_lines, total.plain_features, total.ranged_features,
+          total.assignments[fasm::ParseStats::kNoAssignment],
+          total.assignments[fasm::ParseStats::kPlainNumber],
+          total.assignments[fasm::ParseStats::kBinary],
+          total.assignments[fasm::ParseStats::kOctal],
+          total.assignments[fasm::ParseStats::kDecimal],
+          total.assignments[fasm::ParseStats::kHex], total.annotated_lines,
+          total.annotations, total.annotation_bytes);
+  fprintf(stdout, "%10s %14s %14s\n", "up to", "width", "name length");
+  for (int i = 0; i < fasm::ParseStats::kHistogramBuckets; ++i) {
+    if (!total.width_histogram[i] && !total.name_length_histogram[i]) {
+      continue;
+    }
+    fprintf(stdout, "%10s %14" PRIu64 " %14" PRIu64 "\n",
+            BucketLimit(i).c_str(), total.width_histogram[i],
+            total.name_length_histogram[i]);
+  }
+  constexpr float MiBFactor = 1e6 / (1 << 20);
+  for (size_t i = 0; i < per_thread.size(); ++i) {
+    const fasm::ParseStats &t = per_thread[i];
+    fprintf(stdout,
+            "Thread %2zu: %12" PRIu64 " bytes %10" PRIu64
+            " lines %.3fs %.1f MiB/s\n",
+            i, t.bytes, t.lines, t.duration_us / 1e6,
+            1.0f * t.bytes / std::max<int64_t>(t.duration_us, 1) * MiBFactor);
+  }
+  fprintf(stdout, "Imbalance (slowest/mean thread time): %.2f\n", imbalance);
+}
+
+// Print statistics in the format chosen with PARSE_STATS.
+void PrintParseStats(const std::vector<ParseStatistics> &results) {
+  if (kStatsFormat == StatsFormat::kNone || results.empty()) return;
+  fasm::ParseStats total;
+  std::vector<fasm::ParseStats> per_thread;
+  int64_t max_duration = 0;
+  for (const ParseStatistics &r : results) {
+    total.add(r.parse);
+    per_thread.push_back(r.parse);
+    max_duration = std::max(max_duration, r.parse.duration_us);
+  }
+  const double mean_duration = 1.0 * total.duration_us / results.size();
+  const double imbalance =
+      mean_duration > 0 ? max_duration / mean_duration : 1.0;
+  if (kStatsFormat == StatsFormat::kJson) {
+    PrintStatsJson(total, per_thread, imbalance);
+  } else {
+    PrintStatsText(total, per_thread, imbalance);
+  }
+}
+
+// Issues are reported to the per-thread "diagnostics" sink, so that threads
+// don't contend on stderr with broken files. Features are recorded in
+// "index" if given.
+ParseStatistics ParseContent(const fasm::ContentChunk &content,
+                             fasm::DiagnosticSink *diagnostics,
+                             fasm::LineIndexBuilder *index = nullptr,
+                             fasm::FeatureStateStore *state = nullptr) {
   ParseStatistics stats;
-  stats.result = fasm::parse(
-      content, stderr,
-      [&stats](uint32_t line, std::string_view, int, int, uint64_t bits) {
-        stats.accumulate ^= bits;
-        stats.last_line = line;
-        return true;
-      });
+  auto accumulate = [&stats](uint32_t line, std::string_view, int, int,
+                             uint64_t bits) {
+    stats.accumulate ^= bits;
+    stats.last_line = line;
+    return true;
+  };
+  // Parse with "callback"; with statistics if requested.
+  const auto parse = [&](auto &&callback) {
+    if (kStatsFormat != StatsFormat::kNone) {
+      // Annotations are only looked at with an annotation callback.
+      return fasm::parse_with_stats(
+          content, diagnostics, &stats.parse, callback,
+          [](uint32_t, std::string_view, std::string_view, std::string_view) {
+          });
+    }
+    return fasm::parse(content, diagnostics, callback);
+  };
+  if (index && state) {
+    stats.result = parse(index->wrap(state->wrap(accumulate)));
+  } else if (index) {
+    stats.result = parse(index->wrap(accumulate));
+  } else if (state) {
+    stats.result = parse(state->wrap(accumulate));
+  } else if (kUseStdFunction && kStatsFormat == StatsFormat::kNone) {
+    stats.result =
+        fasm::parse(content, diagnostics, fasm::ParseCallback(accumulate));
+  } else {
+    stats.result = parse(accumulate);
+  }
   return stats;
 }
 
+// IO_BACKEND=mmap|pread|direct|io_uring chooses how the file is read;
+// MMAP_HINTS a comma-separated subset of sequential,willneed,populate,hugepage
+// instead of the default sequential.
+static const fasm::ReadOptions kReadOptions = []() {
+  fasm::ReadOptions options;
+  const char *const backend = getenv("IO_BACKEND");
+  if (backend && !fasm::parse_read_backend(backend, &options.backend)) {
+    fprintf(stderr, "Unknown IO_BACKEND '%s'; using mmap\n", backend);
+  }
+  if (const char *const hints = getenv("MMAP_HINTS")) {
+    const std::string_view h(hints);
+    options.advise_sequential = h.find("sequential") != h.npos;
+    options.advise_willneed = h.find("willneed") != h.npos;
+    options.populate = h.find("populate") != h.npos;
+    options.huge_pages = h.find("hugepage") != h.npos;
+  }
+  return options;
+}();
+
+// COLD_CACHE=1: evict the file from the page cache first, to measure
+// reading from disk.
+static const bool kColdCache = getenv("COLD_CACHE") != nullptr;
+
+std::string DescribeReadOptions() {
+  std::string result = fasm::read_backend_name(kReadOptions.backend);
+  if (kReadOptions.backend == fasm::ReadBackend::kMmap) {
+    if (kReadOptions.advise_sequential) result += ",sequential";
+    if (kReadOptions.advise_willneed) result += ",willneed";
+    if (kReadOptions.populate) result += ",populate";
+    if (kReadOptions.huge_pages) result += ",hugepage";
+  }
+  if (kColdCache) result += "; cold cache";
+  return result;
+}
+
+// Binary cache of the parsed file: "foo.fasm" -> "foo.fasmb".
+static const bool kUseBinaryCache = getenv("USE_FASMB_CACHE") != nullptr;
+
+// Line index of the file: "foo.fasm" -> "foo.fasmi".
+static const bool kUseLineIndex = getenv("LINE_INDEX") != nullptr;
+
+// PARSE_LINES=<first>-<last>: only parse these lines.
+static const char *const kParseLines = getenv("PARSE_LINES");
+
+// CHECK_CONFLICTS=1: report bits assigned more than once.
+static const bool kCheckConflicts = getenv("CHECK_CONFLICTS") != nullptr;
+
+// Name of file next to "fasm_file", with "kind" appended to the suffix.
+std::string SidecarName(std::string_view fasm_file, const char *kind) {
+  std::string result(fasm_file);
+  constexpr std::string_view kSuffix = ".fasm";
+  if (result.size() < kSuffix.size() ||
+      result.compare(result.size() - kSuffix.size(), kSuffix.size(),
+                     kSuffix) != 0) {
+    result.append(kSuffix);
+  }
+  return result.append(kind);
+}
+
+// Parse again sequentially and write binary cache. Written to a temporary
+// file first, so that concurrent readers never see a partial file.
+void WriteBinaryCache(const char *fasm_file, std::string_view content,
+                      const fasm::SourceFingerprint &source) {
+  const std::string cache_name = SidecarName(fasm_file, "b");
+  const std::string tmp_name = cache_name + ".tmp";
+  FILE *out = fopen(tmp_name.c_str(), "wb");
+  if (!out) {
+    perror("Can't write binary cache");
+    return;
+  }
+  const int64_t start_us = getTimeInMicros();
+  fasm::BinaryWriter writer(out);
+  const fasm::ParseResult result =
+      fasm::parse(content, stderr, writer.parse_callback(),
+                  writer.annotation_callback());
+  const bool success = writer.finish(result, source);
+  fclose(out);
+  if (!success) {
+    fprintf(stderr, "Writing binary cache %s failed\n", tmp_name.c_str());
+    unlink(tmp_name.c_str());
+    return;
+  }
+  if (rename(tmp_name.c_str(), cache_name.c_str()) != 0) {
+    perror("Renaming binary cache failed");
+    unlink(tmp_name.c_str());
+    return;
+  }
+  fprintf(stdout, "Wrote %s in %.3fs\n", cache_name.c_str(),
+          (getTimeInMicros() - start_us) / 1e6);
+}
+
+// If there is a binary cache for the file matching "source", replay it
+// into the same statistics as parsing would produce.
+bool ReplayBinaryCache(const char *fasm_file,
+                       const fasm::SourceFingerprint &source, int thread_count,
+                       ParseStatistics *combined) {
+  fasm::BinaryReader reader;
+  const std::string cache_name = SidecarName(fasm_file, "b");
+  if (access(cache_name.c_str(), R_OK) != 0 ||
+      !reader.open(cache_name.c_str(), stderr) ||
+      !(reader.header().source == source)) {
+    return false;
+  }
+  // Each thread works through its own range of records.
+  const uint64_t count = reader.record_count();
+  std::vector<ParseStatistics> results(thread_count);
+  fasm::run_threads(thread_count, [&](int i) {
+    ParseStatistics &stats = results[i];
+    reader.replay(count * i / thread_count, count * (i + 1) / thread_count,
+                  [&stats](uint32_t line, std::string_view, int, int,
+                           uint64_t bits) {
+                    stats.accumulate ^= bits;
+                    stats.last_line = line;
+                    return true;
+                  });
+  });
+  for (const ParseStatistics &thread_result : results) {
+    Accumulate(thread_result, combined);
+  }
+  combined->result = reader.parse_result();
+  fprintf(stdout, "Replayed %s\n", cache_name.c_str());
+  return true;
+}
+
 // Useful upper bound.
 static const int kMaxThreads = 2 * std::thread::hardware_concurrency();
 int GetThreadNumberToUse() {
@@ -66,70 +358,155 @@ int GetThreadNumberToUse() {
   return std::clamp(parallel_env ? atoi(parallel_env) : 1, 1, kMaxThreads);
 }
 
+// Read line index of "fasm_file" if there is one matching "source".
+bool ReadLineIndex(const char *fasm_file, const fasm::SourceFingerprint &source,
+                   fasm::LineIndex *index) {
+  const std::string index_name = SidecarName(fasm_file, "i");
+  return access(index_name.c_str(), R_OK) == 0 &&
+         index->read(index_name.c_str(), source, stderr);
+}
+
+// Combine the index collected by each thread and write it.
+void WriteLineIndex(const char *fasm_file,
+                    std::vector<fasm::LineIndexBuilder> *builders,
+                    const fasm::SourceFingerprint &source) {
+  const int64_t start_us = getTimeInMicros();
+  for (size_t i = 1; i < builders->size(); ++i) {
+    (*builders)[0].merge((*builders)[i]);
+  }
+  const fasm::LineIndex index = (*builders)[0].finish(source);
+  const std::string index_name = SidecarName(fasm_file, "i");
+  if (!index.write(index_name.c_str())) {
+    perror("Writing line index failed");
+    return;
+  }
+  fprintf(stdout, "Wrote %s with %zu entries and %zu tiles in %.3fs\n",
+          index_name.c_str(), index.entries().size(), index.tiles().size(),
+          (getTimeInMicros() - start_us) / 1e6);
+}
+
+// Only parse the lines given in PARSE_LINES, found with the "index" or by
+// scanning from the start if the file is not "indexed".
+fasm::ParseResult ParseLineRange(std::string_view content,
+                                 const fasm::LineIndex &index, bool indexed) {
+  unsigned first = 0, last = 0;
+  const int got = sscanf(kParseLines, "%u-%u", &first, &last);
+  if (got < 1) {
+    fprintf(stderr, "PARSE_LINES: expected <first>-<last>\n");
+    return fasm::ParseResult::kError;
+  }
+  if (got == 1) last = first;
+  const int64_t start_us = getTimeInMicros();
+  const fasm::ContentChunk chunk = index.lines(content, first, last);
+  fasm::DiagnosticCollector diagnostics;
+  const ParseStatistics stats = ParseContent(chunk, diagnostics.sink(0));
+  const int64_t duration_us = getTimeInMicros() - start_us;
+  diagnostics.print(stderr);
+  fprintf(stdout, "Lines %u-%u at offset %" PRIu64 " (%s): %zu Bytes.\n",
+          first, last, chunk.offset, indexed ? "from index" : "scanned",
+          chunk.content.size());
+  fprintf(stdout, "XOR of values: %" PRIX64 ". %.6fs wall time.\n",
+          stats.accumulate, duration_us / 1e6);
+  return stats.result;
+}
+
+// Print conflicting and duplicate assignments found in "state"; conflicts
+// make the result at least kNonCritical.
+void ReportConflicts(const fasm::FeatureStateStore &state,
+                     ParseStatistics *combined) {
+  const std::vector<fasm::FeatureConflict> conflicts = state.conflicts();
+  size_t conflicting = 0;
+  for (const fasm::FeatureConflict &c : conflicts) {
+    fasm::print_conflict(stderr, c);
+    conflicting += c.conflicting();
+  }
+  fprintf(stdout, "%zu features. %zu conflicting, %zu duplicate assignments\n",
+          state.size(), conflicting, conflicts.size() - conflicting);
+  if (conflicting) {
+    combined->result =
+        std::max(combined->result, fasm::ParseResult::kNonCritical);
+  }
+}
+
 // Parse file and print number of lines and performance report.
 fasm::ParseResult ParseFileFast(const char *fasm_file, int thread_count) {
-  const int fd = open(fasm_file, O_RDONLY);
-  if (fd < 0) {
-    perror("Can't open file");
+  if (kColdCache) fasm::evict_from_page_cache(fasm_file);
+  const int64_t start_us = getTimeInMicros();
+
+  // Memory map everything into a convenient contiguous buffer
+  fasm::MappedFile file;
+  if (!file.map(fasm_file, kReadOptions, stderr)) {
     return fasm::ParseResult::kError;
   }
-
-  struct stat s;
-  fstat(fd, &s);
+  const struct stat &s = file.file_stat();
   const size_t file_size = s.st_size;
 
-  fprintf(stdout, "Parsing %s with %zu Bytes.\n", fasm_file, file_size);
+  fprintf(stdout, "Parsing %s with %zu Bytes (%s).\n", fasm_file, file_size,
+          DescribeReadOptions().c_str());
   if (file_size == 0) {
     fprintf(stdout, "Empty file.\n");
-    close(fd);
     return fasm::ParseResult::kSuccess;
   }
 
-  // Memory map everything into a convenient contiguous buffer
-  void *const buffer = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
-  close(fd);
-  if (buffer == MAP_FAILED) {
-    perror("Couldn't map file");
-    return fasm::ParseResult::kError;
-  }
-
-  std::string_view content((const char *)buffer, file_size);
+  std::string_view content = file.content();
   if (content[content.size() - 1] != '\n') {
     fprintf(stdout, "File does not end in a newline\n");
     return fasm::ParseResult::kError;
   }
 
-  // Split this into chunks at newline boundaries to be processed in parallel.
-  std::vector<std::string_view> chunks(thread_count);
-  for (std::string_view &chunk : chunks) {
-    size_t pos = std::min(content.size(), file_size / thread_count) - 1;
-    while (content[pos] != '\n') { // find next fasm line boundary
-      ++pos;
-    }
-    chunk = content.substr(0, pos + 1);
-    content = content.substr(pos + 1);
-  }
-  assert(content.size() == 0);  // Everything divided into chunks now.
+  const fasm::SourceFingerprint source = fasm::fingerprint(
+      content, int64_t(s.st_mtim.tv_sec) * 1000000000 + s.st_mtim.tv_nsec);
+  fasm::LineIndex index;
+  const bool indexed = (kUseLineIndex || kParseLines) &&
+                       ReadLineIndex(fasm_file, source, &index);
+  if (kParseLines) return ParseLineRange(content, index, indexed);
 
-  std::vector<std::thread *> threads(thread_count);
-  std::vector<ParseStatistics> results(thread_count);
+  ParseStatistics combined;
+  std::vector<fasm::LineIndexBuilder> index_builders;
+  const bool from_cache =
+      kUseBinaryCache &&
+      ReplayBinaryCache(fasm_file, source, thread_count, &combined);
+  if (!from_cache) {
+    // Split this into chunks at newline boundaries to be processed in
+    // parallel. Each chunk knows its starting line, so line numbers are
+    // globally correct. More chunks than threads, so that threads done
+    // early take over work from others. With a line index, chunks have
+    // the same number of lines and don't need to be counted.
+    const char *const chunks_env = getenv("PARSE_CHUNKS");
+    const int chunk_count =
+        chunks_env ? atoi(chunks_env)
+                   : fasm::balanced_chunk_count(content.size(), thread_count);
+    const std::vector<fasm::ContentChunk> chunks =
+        indexed ? index.split(content, chunk_count)
+                : fasm::split_lines(content, chunk_count, thread_count);
+    if (kUseLineIndex && !indexed) {
+      index_builders.reserve(thread_count);
+      for (int i = 0; i < thread_count; ++i) {
+        index_builders.emplace_back(content);
+      }
+    }
 
-  const int64_t start_us = getTimeInMicros();
-  for (int i = 0; i < thread_count; ++i) {
-    threads[i] = new std::thread([&results, &chunks, i]() { //
-      results[i] = ParseContent(chunks[i]);
+    // Not using fasm::parse_parallel() as we want separate statistics per
+    // thread, not sharing anything between them.
+    std::vector<ParseStatistics> results(thread_count);
+    fasm::DiagnosticCollector diagnostics;
+    std::unique_ptr<fasm::FeatureStateStore> state;
+    if (kCheckConflicts) state.reset(new fasm::FeatureStateStore());
+    fasm::run_balanced(chunks.size(), thread_count, [&](int worker, int i) {
+      Accumulate(ParseContent(chunks[i], diagnostics.sink(worker),
+                              index_builders.empty() ? nullptr
+                                                     : &index_builders[worker],
+                              state.get()),
+                 &results[worker]);
     });
-  }
-  for (std::thread *thread : threads) {
-    thread->join();
-    delete thread;
+    for (const ParseStatistics &thread_result : results) {
+      Accumulate(thread_result, &combined);
+    }
+    diagnostics.print(stderr);
+    if (state) ReportConflicts(*state, &combined);
+    PrintParseStats(results);
   }
   const int64_t duration_us = getTimeInMicros() - start_us;
-
-  ParseStatistics combined;
-  for (const ParseStatistics &thread_result : results) {
-    Accumulate(thread_result, &combined);
-  }
   fprintf(stdout, "%d lines. XOR of all values: %" PRIX64 "\n",
           combined.last_line, combined.accumulate);
   constexpr float MiBFactor = 1e6 / (1 << 20);
@@ -137,44 +514,319 @@ fasm::ParseResult ParseFileFast(const char *fasm_file, int thread_count) {
   fprintf(stdout, "%d thread%s. %.3fs wall time. %.1f MiB/s; %.1f MLines/s\n",
           thread_count, thread_count > 1 ? "s" : "", duration_us / 1e6,
           bytes_per_microsecond * MiBFactor, 1.0*combined.last_line / duration_us);
-  munmap(buffer, file_size);
+  if (kUseBinaryCache && !from_cache) {
+    WriteBinaryCache(fasm_file, content, source);
+  }
+  if (!index_builders.empty()) {
+    WriteLineIndex(fasm_file, &index_builders, source);
+  }
+
+  return combined.result;
+}
+
+// A file parsed by ParseFilesShared(). Large files are mapped and split
+// into chunks up front; small ones are mapped by the worker parsing them.
+struct FileJob {
+  enum class Status { kOk, kEmpty, kNoNewline, kError };
+  const char *name = nullptr;
+  size_t size = 0;
+  Status status = Status::kOk;
+  std::string errors;      // Issues opening the file, reported before stats.
+  fasm::MappedFile file;   // Only for split files.
+  int chunk_count = 1;
+  std::vector<ParseStatistics> results;  // Per worker.
+  fasm::DiagnosticCollector diagnostics;
+};
+
+// A whole file if "chunk" is empty, otherwise a chunk of a split file.
+struct FileTask {
+  int file;
+  size_t size;
+  fasm::ContentChunk chunk;
+};
+
+FileJob::Status CheckContent(std::string_view content) {
+  if (content.empty()) return FileJob::Status::kEmpty;
+  return content.back() == '\n' ? FileJob::Status::kOk
+                                 : FileJob::Status::kNoNewline;
+}
+
+void ParseFileTask(FileJob *job, int worker, const fasm::ContentChunk &chunk) {
+  const int64_t start_us = getTimeInMicros();
+  ParseStatistics stats = ParseContent(chunk, job->diagnostics.sink(worker));
+  stats.parse_us = getTimeInMicros() - start_us;
+  Accumulate(stats, &job->results[worker]);
+}
+
+void ParseWholeFileTask(FileJob *job, int worker) {
+  fasm::MappedFile file;
+  char *errors = nullptr;
+  size_t errors_size = 0;
+  FILE *const errstream = open_memstream(&errors, &errors_size);
+  const bool mapped = file.map(job->name, kReadOptions, errstream);
+  fclose(errstream);
+  job->errors.assign(errors, errors_size);
+  free(errors);
+  job->status = mapped ? CheckContent(file.content()) : FileJob::Status::kError;
+  if (job->status == FileJob::Status::kOk) {
+    ParseFileTask(job, worker, {file.content(), 1});
+  }
+}
 
+// Print the same report for "job" as ParseFileFast() does, with the time
+// spent parsing instead of wall time, which overlaps with other files.
+fasm::ParseResult ReportFile(const FileJob &job) {
+  fprintf(stdout, "Parsing %s with %zu Bytes (%s).\n", job.name, job.size,
+          DescribeReadOptions().c_str());
+  fputs(job.errors.c_str(), stderr);
+  switch (job.status) {
+  case FileJob::Status::kOk: break;
+  case FileJob::Status::kEmpty:
+    fprintf(stdout, "Empty file.\n");
+    return fasm::ParseResult::kSuccess;
+  case FileJob::Status::kNoNewline:
+    fprintf(stdout, "File does not end in a newline\n");
+    return fasm::ParseResult::kError;
+  case FileJob::Status::kError: return fasm::ParseResult::kError;
+  }
+  ParseStatistics combined;
+  std::vector<ParseStatistics> worked;  // Only workers that got a share.
+  for (const ParseStatistics &worker_result : job.results) {
+    Accumulate(worker_result, &combined);
+    if (worker_result.parse_us > 0) worked.push_back(worker_result);
+  }
+  job.diagnostics.print(stderr);
+  PrintParseStats(worked);
+  fprintf(stdout, "%d lines. XOR of all values: %" PRIX64 "\n",
+          combined.last_line, combined.accumulate);
+  fprintf(stdout, "%.3fs parse time in %d chunk%s.\n",
+          combined.parse_us / 1e6, job.chunk_count,
+          job.chunk_count > 1 ? "s" : "");
   return combined.result;
 }
 
-// No threads, just stdio reading, line by line.
+// Parse all "files" with one set of "thread_count" workers instead of
+// starting threads per file, as most time would go to thread start-up and
+// waiting for the last chunk of each file with many small files. Small
+// files are parsed whole by one worker, large ones are split into chunks.
+// Results are reported in the order of "files" once all are parsed,
+// followed by the aggregate throughput.
+fasm::ParseResult ParseFilesShared(const std::vector<const char *> &files,
+                                   int thread_count) {
+  constexpr size_t kMinChunkSize = 1 << 20;
+  const int64_t start_us = getTimeInMicros();
+  std::vector<FileJob> jobs(files.size());
+  std::vector<FileTask> tasks;
+  size_t total_bytes = 0;
+  for (size_t i = 0; i < files.size(); ++i) {
+    FileJob &job = jobs[i];
+    job.name = files[i];
+    job.results.resize(thread_count);
+    if (kColdCache) fasm::evict_from_page_cache(job.name);
+    struct stat s;
+    if (stat(job.name, &s) != 0) {
+      job.errors = std::string(job.name) + ": can't open: " + strerror(errno) +
+                   "\n";
+      job.status = FileJob::Status::kError;
+      continue;
+    }
+    job.size = s.st_size;
+    total_bytes += job.size;
+    job.chunk_count = std::clamp<size_t>(
+        job.size / kMinChunkSize, 1,
+        fasm::balanced_chunk_count(job.size, thread_count));
+    if (job.chunk_count == 1) {
+      tasks.push_back({int(i), job.size, {}});
+      continue;
+    }
+    if (!job.file.map(job.name, kReadOptions, stderr)) {
+      job.status = FileJob::Status::kError;
+      continue;
+    }
+    job.status = CheckContent(job.file.content());
+    if (job.status != FileJob::Status::kOk) continue;
+    for (const fasm::ContentChunk &chunk :
+         fasm::split_lines(job.file.content(), job.chunk_count, thread_count)) {
+      tasks.push_back({int(i), chunk.content.size(), chunk});
+    }
+  }
+
+  // Largest first, so that small files fill the gaps at the end.
+  std::stable_sort(tasks.begin(), tasks.end(),
+                   [](const FileTask &a, const FileTask &b) {
+                     return a.size > b.size;
+                   });
+  fasm::run_balanced(tasks.size(), thread_count, [&](int worker, int i) {
+    const FileTask &task = tasks[i];
+    if (task.chunk.content.empty()) {
+      ParseWholeFileTask(&jobs[task.file], worker);
+    } else {
+      ParseFileTask(&jobs[task.file], worker, task.chunk);
+    }
+  });
+  const int64_t duration_us = getTimeInMicros() - start_us;
+
+  fasm::ParseResult combined_result = fasm::ParseResult::kSuccess;
+  uint64_t total_lines = 0;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    if (i != 0) fprintf(stdout, "\n");
+    combined_result = std::max(combined_result, ReportFile(jobs[i]));
+    uint32_t file_lines = 0;
+    for (const ParseStatistics &worker_result : jobs[i].results) {
+      file_lines = std::max(file_lines, worker_result.last_line);
+    }
+    total_lines += file_lines;
+  }
+  constexpr float MiBFactor = 1e6 / (1 << 20);
+  fprintf(stdout,
+          "\nTotal: %zu files with %zu Bytes, %" PRIu64 " lines. "
+          "%d thread%s. %.3fs wall time. %.1f MiB/s; %.1f MLines/s\n",
+          files.size(), total_bytes, total_lines, thread_count,
+          thread_count > 1 ? "s" : "", duration_us / 1e6,
+          1.0f * total_bytes / duration_us * MiBFactor,
+          1.0 * total_lines / duration_us);
+  return combined_result;
+}
+
+// No threads, just stdio reading block by block, fed to the stream parser.
 fasm::ParseResult ParseFileSimple(const char *fasm_file, int) {
   FILE *f = fopen(fasm_file, "r");
   if (!f) {
     perror("Can't open file");
     return fasm::ParseResult::kError;
   }
-  size_t buf_size = 8192;
-  char *buffer = (char*)malloc(buf_size);  // will be realloc()'ed if needed.
+  constexpr size_t kBufferSize = 1 << 20;
+  char *buffer = (char *)malloc(kBufferSize);
 
   const int64_t start_us = getTimeInMicros();
-  ParseStatistics combined;
-  ssize_t line_length;
-  while ((line_length = getline(&buffer, &buf_size, f)) > 0) {
-    const std::string_view content(buffer, line_length);
-    Accumulate(ParseContent(content), &combined);
+  ParseStatistics stats;
+  fasm::StreamParser parser(
+      stderr, [&stats](uint32_t line, std::string_view, int, int,
+                       uint64_t bits) {
+        stats.accumulate ^= bits;
+        stats.last_line = line;
+        return true;
+      });
+  size_t got;
+  while ((got = fread(buffer, 1, kBufferSize, f)) > 0) {
+    parser.feed(std::string_view(buffer, got));
   }
+  stats.result = parser.finish();
   const int64_t duration_us = getTimeInMicros() - start_us;
   free(buffer);
   fclose(f);
   fprintf(stdout, "%d lines. XOR of all values: %" PRIX64 "\n",
-          combined.last_line, combined.accumulate);
+          stats.last_line, stats.accumulate);
   fprintf(stdout, "%.3fs wall time. %.1f MLines/s\n", duration_us / 1e6,
-          1.0 * combined.last_line / duration_us);
+          1.0 * stats.last_line / duration_us);
 
-  return combined.result;
+  return stats.result;
 }
 
+// Check magic bytes if this is a compressed file.
+bool IsCompressed(const char *fasm_file) {
+  FILE *f = fopen(fasm_file, "rb");
+  if (!f) return false;
+  char magic[4];
+  const size_t got = fread(magic, 1, sizeof(magic), f);
+  fclose(f);
+  return fasm::detect_compression(std::string_view(magic, got)) !=
+         fasm::Compression::kNone;
+}
+
+// Decompress or read in one thread while parsing blocks in "thread_count"
+// others.
+fasm::ParseResult ParseFilePipelined(const char *fasm_file, int thread_count,
+                                     bool compressed) {
+  if (kColdCache) fasm::evict_from_page_cache(fasm_file);
+  if (compressed) {
+    fprintf(stdout, "Parsing compressed %s%s\n", fasm_file,
+            kColdCache ? " (cold cache)" : "");
+  } else {
+    fprintf(stdout, "Parsing %s (%s)\n", fasm_file,
+            DescribeReadOptions().c_str());
+  }
+  std::vector<ParseStatistics> results(thread_count);
+  fasm::PipelineOptions options;
+  options.parse_threads = thread_count;
+  fasm::PipelineStats pipeline;
+  fasm::DiagnosticCollector diagnostics;
+  ParseStatistics combined;
+  const fasm::ChunkParser parse_chunk = [&](int worker,
+                                            const fasm::ContentChunk &chunk) {
+    Accumulate(ParseContent(chunk, diagnostics.sink(worker)),
+               &results[worker]);
+    return results[worker].result;
+  };
+  if (compressed) {
+    combined.result = fasm::parse_compressed_chunks(
+        fasm_file, stderr, parse_chunk, options, &pipeline);
+  } else {
+    combined.result = fasm::parse_file_chunks(
+        fasm_file, kReadOptions, stderr, parse_chunk, options, &pipeline);
+  }
+  diagnostics.print(stderr);
+  for (const ParseStatistics &thread_result : results) {
+    Accumulate(thread_result, &combined);
+  }
+  PrintParseStats(results);
+  fprintf(stdout, "%d lines. XOR of all values: %" PRIX64 "\n",
+          combined.last_line, combined.accumulate);
+  if (pipeline.content_bytes == 0) return combined.result;
+
+  // Throughput of each stage when running by itself, to see which one
+  // limits the wall time.
+  constexpr float MiBFactor = 1e6 / (1 << 20);
+  const double content_mib = pipeline.content_bytes / double(1 << 20);
+  if (compressed) {
+    fprintf(stdout, "%.1f MiB from %.1f MiB compressed in %u blocks. ",
+            content_mib, pipeline.compressed_bytes / double(1 << 20),
+            pipeline.blocks);
+  } else {
+    fprintf(stdout, "%.1f MiB in %u blocks. ", content_mib, pipeline.blocks);
+  }
+  fprintf(stdout, "%.3fs wall time. %.1f MiB/s\n", pipeline.wall_us / 1e6,
+          1.0f * pipeline.content_bytes / pipeline.wall_us * MiBFactor);
+  fprintf(stdout, "%s: 1 thread  %.3fs busy; %.1f MiB/s. "
+          "%.3fs waiting for parse.\n",
+          compressed ? "Decompress" : "Read",
+          pipeline.decompress_us / 1e6,
+          content_mib / std::max<int64_t>(pipeline.decompress_us, 1) * 1e6,
+          pipeline.decompress_wait_us / 1e6);
+  fprintf(stdout, "Parse: %d thread%s %.3fs busy; %.1f MiB/s. "
+          "%.3fs waiting for decompress.\n",
+          thread_count, thread_count > 1 ? "s" : " ", pipeline.parse_us / 1e6,
+          content_mib * thread_count / std::max<int64_t>(pipeline.parse_us, 1) * 1e6,
+          pipeline.parse_wait_us / 1e6);
+  return combined.result;
+}
 
 int main(int argc, char *argv[]) {
   if (argc < 2) {
     printf("usage: %s <fasm-file> [<fasm-file>...]\n\tReads PARALLEL_FASM "
-           "environment variable for #threads to use [1..%d].\n",
+           "environment variable for #threads to use [1..%d].\n"
+           "\tUSE_STD_FUNCTION=1 benchmarks the std::function API instead "
+           "of the template one.\n"
+           "\tUSE_FASMB_CACHE=1 replays <file>b binary cache if it matches "
+           "the file, otherwise writes it.\n"
+           "\tgzip or zstd compressed files are decompressed in a separate "
+           "thread.\n"
+           "\tIO_BACKEND=mmap|pread|direct|io_uring chooses how to read; all "
+           "but mmap read\n\t  blocks in a separate thread. MMAP_HINTS="
+           "sequential,willneed,populate,hugepage\n"
+           "\tCOLD_CACHE=1 evicts the file from the page cache first.\n"
+           "\tPARSE_CHUNKS=<n> splits the file in n chunks instead of "
+           "several per thread.\n"
+           "\tLINE_INDEX=1 writes <file>i line index or uses it to split "
+           "the file.\n"
+           "\tPARSE_LINES=<first>-<last> only parses these lines, found "
+           "with the line index.\n"
+           "\tCHECK_CONFLICTS=1 reports bits assigned on more than one "
+           "line.\n"
+           "\tMultiple uncompressed files share the threads; small ones are "
+           "not split.\n"
+           "\tPARSE_STATS=text or PARSE_STATS=json prints statistics of "
+           "line classes and time per thread.\n",
            argv[0], kMaxThreads);
     return 1;
   }
@@ -185,10 +837,27 @@ int main(int argc, char *argv[]) {
 
   const int thread_count = GetThreadNumberToUse();
 
+  // Several files share one set of threads, unless some need a different
+  // way of reading.
+  std::vector<const char *> files(argv + 1, argv + argc);
+  const bool share_threads =
+      files.size() > 1 && ParseFunctionToUse == ParseFileFast &&
+      !kUseBinaryCache && !kUseLineIndex && !kParseLines && !kCheckConflicts &&
+      kReadOptions.backend == fasm::ReadBackend::kMmap &&
+      std::none_of(files.begin(), files.end(), IsCompressed);
+  if (share_threads) {
+    const fasm::ParseResult result = ParseFilesShared(files, thread_count);
+    return result <= fasm::ParseResult::kNonCritical ? 0 : 1;
+  }
+
   fasm::ParseResult combined_result = fasm::ParseResult::kSuccess;
   for (int i = 1; i < argc; ++i) {
     if (i != 1) fprintf(stdout, "\n");
-    auto result = ParseFunctionToUse(argv[i], thread_count);
+    const bool compressed = IsCompressed(argv[i]);
+    auto result =
+        (compressed || kReadOptions.backend != fasm::ReadBackend::kMmap)
+            ? ParseFilePipelined(argv[i], thread_count, compressed)
+            : ParseFunctionToUse(argv[i], thread_count);
     combined_result = std::max(combined_result, result);
   }
 
@@ -0,0 +1,340 @@
+// Copyright 2022 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Fast writer for FPGA assembly files.
+
+#ifndef SIMPLE_FASM_WRITER_H
+#define SIMPLE_FASM_WRITER_H
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "fasm-parse.h"
+
+namespace fasm {
+enum class WriteStyle {
+  // Spaces around '=' and values padded with zeros to the full width:
+  //   FEATURE[15:0] = 16'h002a
+  kReadable,
+
+  // No spaces and no leading zeros, for stable diffs:
+  //   FEATURE[15:0]=16'h2a
+  kCanonical,
+};
+
+// Formats FASM lines into large buffers. Numbers are formatted without
+// printf() and independent of locale. Values are always written in hex;
+// single bits that are set are written as just the feature name, e.g.
+// "FEATURE" or "FEATURE[3]".
+//
+// Each feature is written on its own line. Annotations are added to the
+// line of the last feature, or on a line of their own if there is none.
+class Writer {
+ public:
+  // Write to "out", flushed whenever the internal buffer is full and in
+  // flush() or the destructor.
+  explicit Writer(FILE *out, WriteStyle style = WriteStyle::kReadable);
+
+  // Append to "out".
+  explicit Writer(std::string *out, WriteStyle style = WriteStyle::kReadable);
+
+  ~Writer();
+  Writer(const Writer &) = delete;
+  Writer &operator=(const Writer &) = delete;
+
+  // Write feature with "width" bits starting at "start_bit", i.e. the
+  // values the ParseCallback receives. Starts a new line.
+  void add_feature(std::string_view feature, int start_bit, int width,
+                   uint64_t bits);
+
+  // Same for features wider than 64 bits, "bits" having (width + 63) / 64
+  // words, least significant first, as the WideParseCallback receives.
+  void add_wide_feature(std::string_view feature, int start_bit, int width,
+                        const uint64_t *bits);
+
+  // Add annotation to the current line. The value is written in quotes as
+  // is, so needs to have quotes escaped already, as from the parser.
+  void add_annotation(std::string_view name, std::string_view value);
+
+  // Finish current line, if any.
+  void end_line();
+
+  // Callbacks writing everything passed to them, e.g. to round-trip
+  // parsed content. Features are written in the same line as annotations
+  // with the same line number.
+  auto parse_callback() {
+    return [this](uint32_t, std::string_view feature, int start_bit,
+                  int width, uint64_t bits) {
+      add_feature(feature, start_bit, width, bits);
+      return true;
+    };
+  }
+  auto wide_callback() {
+    return [this](uint32_t, std::string_view feature, int start_bit,
+                  int width, const uint64_t *bits) {
+      add_wide_feature(feature, start_bit, width, bits);
+      return true;
+    };
+  }
+  auto annotation_callback() {
+    return [this](uint32_t line, std::string_view feature,
+                  std::string_view name, std::string_view value) {
+      // Annotations on lines without feature need a separate line.
+      if (feature.empty() && line != annotation_line_) end_line();
+      annotation_line_ = line;
+      add_annotation(name, value);
+    };
+  }
+
+  // End current line and write buffer to the FILE, if any. Returns false
+  // on write errors.
+  bool flush();
+
+ private:
+  static constexpr size_t kFlushSize = 1 << 20;
+
+  void append(std::string_view s) { buffer_->append(s); }
+  void append_decimal(uint32_t value);
+  void append_hex(uint64_t value, int digits);
+  void append_range(int start_bit, int width);
+  void maybe_flush() {
+    if (out_ && buffer_->size() >= kFlushSize) flush_buffer();
+  }
+  void flush_buffer();
+
+  FILE *const out_;
+  const WriteStyle style_;
+  std::string own_buffer_;
+  std::string *const buffer_;
+  bool line_open_ = false;
+  bool in_annotation_ = false;
+  bool write_ok_ = true;
+  uint32_t annotation_line_ = 0;
+};
+
+// Format "block_count" blocks of lines in parallel and write them to "out"
+// in block order. The "format_block" function is called for each block
+// with a Writer writing to the buffer of that block. Without "executor",
+// blocks are formatted on at most one thread per core.
+inline bool write_parallel(
+    int block_count,
+    const std::function<void(int block, Writer *writer)> &format_block,
+    FILE *out, WriteStyle style = WriteStyle::kReadable,
+    const Executor &executor = {});
+
+// Write all records and annotations of "block", e.g. from parse_batched().
+template <int kCapacity>
+inline void write_block(const RecordBlock<kCapacity> &block, Writer *writer);
+
+// -- End of API interface; rest is implementation details
+
+inline Writer::Writer(FILE *out, WriteStyle style)
+    : out_(out), style_(style), buffer_(&own_buffer_) {
+  own_buffer_.reserve(kFlushSize + 4096);
+}
+
+inline Writer::Writer(std::string *out, WriteStyle style)
+    : out_(nullptr), style_(style), buffer_(out) {}
+
+inline Writer::~Writer() { flush(); }
+
+inline void Writer::append_decimal(uint32_t value) {
+  char digits[10];
+  char *const end = digits + sizeof(digits);
+  char *pos = end;
+  do {
+    *--pos = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  buffer_->append(pos, end - pos);
+}
+
+inline void Writer::append_hex(uint64_t value, int digits) {
+  static constexpr char kHex[] = "0123456789abcdef";
+  const size_t pos = buffer_->size();
+  buffer_->resize(pos + digits);
+  char *const end = &(*buffer_)[pos] + digits;
+  for (char *it = end - 1; it >= end - digits; --it) {
+    *it = kHex[value & 0xf];
+    value >>= 4;
+  }
+}
+
+inline void Writer::append_range(int start_bit, int width) {
+  buffer_->push_back('[');
+  if (width > 1) {
+    append_decimal(start_bit + width - 1);
+    buffer_->push_back(':');
+  }
+  append_decimal(start_bit);
+  buffer_->push_back(']');
+}
+
+inline void Writer::end_line() {
+  if (!line_open_) return;
+  if (in_annotation_) {
+    append(style_ == WriteStyle::kReadable ? " }" : "}");
+  }
+  buffer_->push_back('\n');
+  line_open_ = false;
+  in_annotation_ = false;
+  maybe_flush();
+}
+
+inline void Writer::add_feature(std::string_view feature, int start_bit,
+                                int width, uint64_t bits) {
+  end_line();
+  line_open_ = true;
+  append(feature);
+  bits &= uint64_t(-1) >> (64 - width);  // What the parser would do.
+  if (width == 1 && bits == 1) {
+    if (start_bit != 0) append_range(start_bit, width);
+    return;
+  }
+  append_range(start_bit, width);
+  append(style_ == WriteStyle::kReadable ? " = " : "=");
+  append_decimal(width);
+  append("'h");
+  int digits;
+  if (style_ == WriteStyle::kReadable) {
+    digits = (width + 3) / 4;
+  } else {
+    digits = bits ? (64 - __builtin_clzll(bits) + 3) / 4 : 1;
+  }
+  append_hex(bits, digits);
+}
+
+inline void Writer::add_wide_feature(std::string_view feature, int start_bit,
+                                     int width, const uint64_t *bits) {
+  if (width <= 64) {
+    add_feature(feature, start_bit, width, bits[0]);
+    return;
+  }
+  end_line();
+  line_open_ = true;
+  append(feature);
+  append_range(start_bit, width);
+  append(style_ == WriteStyle::kReadable ? " = " : "=");
+  append_decimal(width);
+  append("'h");
+  int word = (width + 63) / 64 - 1;
+  int top_digits;
+  if (style_ == WriteStyle::kReadable) {
+    top_digits = ((width - 64 * word) + 3) / 4;
+  } else {
+    while (word > 0 && bits[word] == 0) --word;
+    top_digits = bits[word] ? (64 - __builtin_clzll(bits[word]) + 3) / 4 : 1;
+  }
+  append_hex(bits[word], top_digits);
+  for (--word; word >= 0; --word) {
+    append_hex(bits[word], 16);
+  }
+}
+
+inline void Writer::add_annotation(std::string_view name,
+                                   std::string_view value) {
+  const bool readable = (style_ == WriteStyle::kReadable);
+  if (!in_annotation_) {
+    if (line_open_) {
+      append(readable ? " { " : "{");
+    } else {
+      append(readable ? "{ " : "{");
+    }
+    line_open_ = true;
+    in_annotation_ = true;
+  } else {
+    append(readable ? ", " : ",");
+  }
+  append(name);
+  append(readable ? " = \"" : "=\"");
+  append(value);
+  buffer_->push_back('"');
+}
+
+inline void Writer::flush_buffer() {
+  if (!out_) return;
+  write_ok_ &= fwrite(buffer_->data(), 1, buffer_->size(), out_) ==
+               buffer_->size();
+  buffer_->clear();
+}
+
+inline bool Writer::flush() {
+  end_line();
+  flush_buffer();
+  return write_ok_;
+}
+
+inline bool write_parallel(
+    int block_count,
+    const std::function<void(int block, Writer *writer)> &format_block,
+    FILE *out, WriteStyle style, const Executor &executor) {
+  std::vector<std::string> buffers(block_count);
+  const auto format = [&](int i) {
+    Writer writer(&buffers[i], style);
+    format_block(i, &writer);
+  };
+  if (executor) {
+    executor(block_count, format);
+  } else {
+    // Possibly many blocks; no more threads than cores.
+    run_balanced(block_count, std::max(1u, std::thread::hardware_concurrency()),
+                 [&](int, int i) { format(i); });
+  }
+  bool success = true;
+  for (const std::string &buffer : buffers) {
+    success &= fwrite(buffer.data(), 1, buffer.size(), out) == buffer.size();
+  }
+  return success;
+}
+
+template <int kCapacity>
+inline void write_block(const RecordBlock<kCapacity> &block, Writer *writer) {
+  // Annotations are sorted by line, so can be merged with the records.
+  auto annotation = block.annotations.begin();
+  const auto annotation_end = block.annotations.end();
+  const auto write_annotation_lines_before = [&](uint32_t line) {
+    uint32_t current_line = 0;
+    for (/**/; annotation != annotation_end && annotation->record < 0 &&
+               annotation->line < line;
+         ++annotation) {
+      if (annotation->line != current_line) {
+        writer->end_line();
+        current_line = annotation->line;
+      }
+      writer->add_annotation(annotation->name, annotation->value);
+    }
+  };
+  for (int i = 0; i < block.size; ++i) {
+    write_annotation_lines_before(block.line[i]);
+    writer->add_feature(block.feature_name(i), block.start_bit[i],
+                        block.width[i], block.bits[i]);
+    for (/**/; annotation != annotation_end && annotation->record == i;
+         ++annotation) {
+      writer->add_annotation(annotation->name, annotation->value);
+    }
+  }
+  write_annotation_lines_before(UINT32_MAX);
+  writer->end_line();
+}
+}  // namespace fasm
+#endif  // SIMPLE_FASM_WRITER_H